@@ -35,6 +35,9 @@ static const char *input_range_weight_filename = NULL;
 static const char *output_depth_filename = NULL;
 static const char *output_plot_filename = NULL;
 static const char *true_depth_filename = NULL;
+static const char *input_pose_filename = NULL;
+static const char *batch_filename = NULL;
+static const char *sweep_filename = NULL;
 static double minimum_depth = 0.05;
 static double maximum_depth = 20;
 static double png_depth_scale = 4000;
@@ -48,6 +51,14 @@ static int normalize_tangent_vectors = 0;
 static int xres = 0;
 static int yres = 0;
 static int solver = RN_CSPARSE_SOLVER;
+static double solver_tolerance = 1E-3;
+static double pcg_tolerance = 1E-7;
+static int solver_max_iterations = 0;
+static int multigrid_levels = 0;
+static int max_threads = 1;
+static int nested_dissection = 0;
+static int mixed_precision = 0;
+static int warm_start = 0;
 static R3Matrix camera_intrinsics(0, 0, 0, 0, 0, 0, 0, 0, 1); 
 static double gravity_vector_in_camera_coordinates[3] = { 0, 0, -1 };
 static double plot_max_value = 1;
@@ -82,6 +93,19 @@ static R2Grid *output_depth_image = NULL;
 
 
 
+////////////////////////////////////////////////////////////////////////
+// Streaming state
+////////////////////////////////////////////////////////////////////////
+
+static R2Grid *previous_depth_image = NULL;
+static RNBoolean warm_started = FALSE;
+static int solver_iterations = 0;
+static RNBoolean solver_iterative = FALSE;
+static RNScalar solver_time = 0;
+static RNCSparseCholesky cholesky_cache;
+
+
+
 ////////////////////////////////////////////////////////////////////////
 // Utility functions
 ////////////////////////////////////////////////////////////////////////
@@ -591,7 +615,9 @@ WriteOutputs(void)
   if (!WriteImage(output_depth_image, output_depth_filename, png_depth_scale, 0, print_verbose)) return 0;
 
   // Write error plot
-  if (!WriteErrorPlot(output_depth_image, true_depth_image, output_plot_filename, plot_max_value, print_verbose)) return 0;
+  if (output_plot_filename && true_depth_image) {
+    if (!WriteErrorPlot(output_depth_image, true_depth_image, output_plot_filename, plot_max_value, print_verbose)) return 0;
+  }
 
   // Return success
   return 1;
@@ -599,74 +625,186 @@ WriteOutputs(void)
 
 
 
+////////////////////////////////////////////////////////////////////////
+// Parallel equation construction
+////////////////////////////////////////////////////////////////////////
+
+typedef void (*EquationRowsFunction)(RNArray<RNEquation *>& equations, int iy0, int iy1);
+
+struct EquationThreadData {
+  EquationRowsFunction function;
+  RNArray<RNEquation *> *buffers;
+  RNArena **arenas;
+};
+
+
+
+static void
+CreateEquationsThread(int thread_index, int nthreads, void *data)
+{
+  // Create equations for this thread's block of image rows
+  EquationThreadData *thread_data = (EquationThreadData *) data;
+  int iy0, iy1;
+  RNThreadRange(yres, thread_index, nthreads, iy0, iy1);
+  RNArena *previous_arena = RNSetCurrentArena(thread_data->arenas[thread_index]);
+  (*thread_data->function)(thread_data->buffers[thread_index], iy0, iy1);
+  RNSetCurrentArena(previous_arena);
+}
+
+
+
+static void
+CreateEquationsInParallel(RNSystemOfEquations& equations, EquationRowsFunction function)
+{
+  // Determine number of threads
+  int nthreads = (max_threads > 0) ? max_threads : RNNumProcessors();
+  if (nthreads > yres) nthreads = yres;
+  if (nthreads < 1) nthreads = 1;
+
+  // Create one arena per thread (owned by the system, so equations are released in bulk)
+  RNArena **arenas = new RNArena * [ nthreads ];
+  for (int t = 0; t < nthreads; t++) arenas[t] = equations.CreateArena();
+
+  // Create equations for blocks of rows in separate buffers
+  EquationThreadData thread_data;
+  thread_data.function = function;
+  thread_data.buffers = new RNArray<RNEquation *> [ nthreads ];
+  thread_data.arenas = arenas;
+  RNRunThreads(nthreads, CreateEquationsThread, &thread_data);
+
+  // Merge buffers in row order (so equation order does not depend on nthreads)
+  for (int t = 0; t < nthreads; t++) {
+    RNArray<RNEquation *>& buffer = thread_data.buffers[t];
+    for (int i = 0; i < buffer.NEntries(); i++) {
+      equations.InsertEquation(buffer.Kth(i));
+    }
+  }
+
+  // Delete buffers
+  delete [] thread_data.buffers;
+  delete [] arenas;
+}
+
+
+
+typedef void (*LinearEquationRowsFunction)(RNSystemOfEquations& equations, int k, int iy0, int iy1, void *data);
+
+struct LinearEquationThreadData {
+  LinearEquationRowsFunction function;
+  RNSystemOfEquations *equations;
+  int first;
+  int rows_per_pixel;
+  void *data;
+};
+
+
+
+static void
+CreateLinearEquationsThread(int thread_index, int nthreads, void *data)
+{
+  // Fill rows for this thread's block of image rows (starting at the block's first slot)
+  LinearEquationThreadData *thread_data = (LinearEquationThreadData *) data;
+  int iy0, iy1;
+  RNThreadRange(yres, thread_index, nthreads, iy0, iy1);
+  int k = thread_data->first + iy0 * xres * thread_data->rows_per_pixel;
+  (*thread_data->function)(*(thread_data->equations), k, iy0, iy1, thread_data->data);
+}
+
+
+
+static void
+CreateLinearEquationsInParallel(RNSystemOfEquations& equations, LinearEquationRowsFunction function,
+  int rows_per_pixel, int nterms, void *data = NULL)
+{
+  // Determine number of threads
+  int nthreads = (max_threads > 0) ? max_threads : RNNumProcessors();
+  if (nthreads > yres) nthreads = yres;
+  if (nthreads < 1) nthreads = 1;
+
+  // Insert empty rows (up to rows_per_pixel per pixel, in row-major order)
+  LinearEquationThreadData thread_data;
+  thread_data.function = function;
+  thread_data.equations = &equations;
+  thread_data.first = equations.InsertLinearEquations(xres*yres*rows_per_pixel, nterms);
+  thread_data.rows_per_pixel = rows_per_pixel;
+  thread_data.data = data;
+
+  // Fill rows for blocks of image rows in separate threads
+  RNRunThreads(nthreads, CreateLinearEquationsThread, &thread_data);
+
+  // Remove rows left empty (so equation order does not depend on nthreads)
+  equations.CompactLinearEquations();
+}
+
+
+
 ////////////////////////////////////////////////////////////////////////
 // Equation definition functions
 ////////////////////////////////////////////////////////////////////////
 
-static int
-CreateSmoothnessEquations(RNSystemOfEquations& equations)
+static void
+CreateSmoothnessEquationRows(RNSystemOfEquations& equations, int k, int iy0, int iy1, void *data)
 {
-  // Check smoothness weight
-  if ((smoothness_weight == 0) && !input_smoothness_weight_images[0] && !input_smoothness_weight_images[1]) return 1;
-  
-  // Create smoothness equations
-  int count = 0;
-  for (int iy = 0; iy < yres; iy++) {
+  // Create smoothness equations (stencil rows written into slots starting at k)
+  int variables[2];
+  RNScalar coefficients[2];
+  for (int iy = iy0; iy < iy1; iy++) {
     for (int ix = 0; ix < xres; ix++) {
       // Check if pixel is in a hole
       if (FALSE) continue;
 
       // Add smoothness equations
+      variables[0] = (iy)*xres+(ix);
       if (ix > 0) {
         RNScalar w = smoothness_weight;
         if (input_smoothness_weight_images[0]) w *= input_smoothness_weight_images[0]->GridValue(ix-1, iy);
         if (w > 0) {
-          RNPolynomial *e = new RNPolynomial();
-          e->AddTerm(-1.0, (iy)*xres+(ix),   1.0);
-          e->AddTerm( 1.0, (iy)*xres+(ix-1), 1.0);
-          e->Multiply(w);
-          equations.InsertEquation(e);
-          count++;
+          variables[1] = (iy)*xres+(ix-1);
+          coefficients[0] = -w; coefficients[1] = w;
+          equations.SetLinearEquation(k++, 2, variables, coefficients);
         }
       }
       if (ix < xres-1) {
         RNScalar w = smoothness_weight;
         if (input_smoothness_weight_images[0]) w *= input_smoothness_weight_images[0]->GridValue(ix, iy);
         if (w > 0) {
-          RNPolynomial *e = new RNPolynomial();
-          e->AddTerm(-1.0, (iy)*xres+(ix),   1.0);
-          e->AddTerm( 1.0, (iy)*xres+(ix+1), 1.0);
-          e->Multiply(w);
-          equations.InsertEquation(e);
-          count++;
+          variables[1] = (iy)*xres+(ix+1);
+          coefficients[0] = -w; coefficients[1] = w;
+          equations.SetLinearEquation(k++, 2, variables, coefficients);
         }
       }
       if (iy > 0) {
         RNScalar w = smoothness_weight;
         if (input_smoothness_weight_images[1]) w *= input_smoothness_weight_images[1]->GridValue(ix, iy-1);
         if (w > 0) {
-          RNPolynomial *e = new RNPolynomial();
-          e->AddTerm(-1.0, (iy)  *xres+(ix),   1.0);
-          e->AddTerm( 1.0, (iy-1)*xres+(ix), 1.0);
-          e->Multiply(w);
-          equations.InsertEquation(e);
-          count++;
+          variables[1] = (iy-1)*xres+(ix);
+          coefficients[0] = -w; coefficients[1] = w;
+          equations.SetLinearEquation(k++, 2, variables, coefficients);
         }
       }
       if (iy < yres-1) {
         RNScalar w = smoothness_weight;
         if (input_smoothness_weight_images[1]) w *= input_smoothness_weight_images[1]->GridValue(ix, iy);
         if (w > 0) {
-          RNPolynomial *e = new RNPolynomial();
-          e->AddTerm(-1.0, (iy)  *xres+(ix),   1.0);
-          e->AddTerm( 1.0, (iy+1)*xres+(ix), 1.0);
-          e->Multiply(w);
-          equations.InsertEquation(e);
-          count++;
+          variables[1] = (iy+1)*xres+(ix);
+          coefficients[0] = -w; coefficients[1] = w;
+          equations.SetLinearEquation(k++, 2, variables, coefficients);
         }
       }
     }
   }
+}
+
+
+
+static int
+CreateSmoothnessEquations(RNSystemOfEquations& equations)
+{
+  // Check smoothness weight
+  if ((smoothness_weight == 0) && !input_smoothness_weight_images[0] && !input_smoothness_weight_images[1]) return 1;
+  
+  // Create (at most) four two-term rows per pixel, one per neighbor
+  CreateLinearEquationsInParallel(equations, CreateSmoothnessEquationRows, 4, 2);
 
   // Return success
   return 1;
@@ -674,43 +812,54 @@ CreateSmoothnessEquations(RNSystemOfEquations& equations)
 
 
 
+static void
+CreateInertiaEquationRows(RNSystemOfEquations& equations, int k, int iy0, int iy1, void *data)
+{
+  // Preserve depth in given depth image (one row per pixel written into slots starting at k)
+  R2Grid *depth_image = (R2Grid *) data;
+  for (int i = iy0*xres; i < iy1*xres; i++) {
+    RNScalar w = 1;
+    if (input_inertia_weight_image) w = input_inertia_weight_image->GridValue(i);
+    if ((w <= 0) || (w == R2_GRID_UNKNOWN_VALUE)) continue;
+    RNScalar d = depth_image->GridValue(i);
+    if ((d == 0) || (d == R2_GRID_UNKNOWN_VALUE)) continue;
+    RNScalar c = w * inertia_weight;
+    equations.SetLinearEquation(k++, 1, &i, &c, -d * c);
+  }
+}
+
+
+
 static int
 CreateInertiaEquations(RNSystemOfEquations& equations)
 {
-  RNBoolean found = FALSE;
-
   // Get target depth image
   R2Grid *depth_image = input_inertia_depth_image;
   if (!depth_image) depth_image = input_depth_image;
 
   // Create equations to preserve depths
-  if (depth_image && (inertia_weight > 0) && input_inertia_weight_image) {
-    // Preserve depth in given depth image
-    for (int i = 0; i < xres*yres; i++) {
-      RNScalar w = input_inertia_weight_image->GridValue(i);
-      if ((w <= 0) || (w == R2_GRID_UNKNOWN_VALUE)) continue;
-      RNScalar d = depth_image->GridValue(i);
-      if ((d == 0) || (d == R2_GRID_UNKNOWN_VALUE)) continue;
-      RNPolynomial *e = new RNPolynomial(1.0, i, 1.0);
-      e->Subtract(d);
-      e->Multiply(w * inertia_weight);
-      equations.InsertEquation(e);
-      found = TRUE;
-    }
-  }
-  else if (depth_image && (inertia_weight > 0)) {
+  if (depth_image && (inertia_weight > 0)) {
     // Preserve depth in given depth image
-    for (int i = 0; i < xres*yres; i++) {
-      RNScalar d = depth_image->GridValue(i);
-      if ((d == 0) || (d == R2_GRID_UNKNOWN_VALUE)) continue;
-      RNPolynomial *e = new RNPolynomial(1.0, i, 1.0);
-      e->Subtract(d);
-      e->Multiply(inertia_weight);
-      equations.InsertEquation(e);
-      found = TRUE;
-    }
+    CreateLinearEquationsInParallel(equations, CreateInertiaEquationRows, 1, 1, depth_image);
   }
-  else if (depth_image) {
+
+  // Return success
+  return 1;
+}
+
+
+
+static int
+CreateAnchorEquations(RNSystemOfEquations& equations)
+{
+  RNBoolean found = FALSE;
+
+  // Get target depth image
+  R2Grid *depth_image = input_inertia_depth_image;
+  if (!depth_image) depth_image = input_depth_image;
+
+  // Create equation to fix depth of one pixel (used when no depths are preserved)
+  if (depth_image) {
     // Set depth of one pixel
     int ix, iy, n = xres*yres;
     for (int i = 0; i < n; i++) {
@@ -720,10 +869,8 @@ CreateInertiaEquations(RNSystemOfEquations& equations)
       if ((iy < yres/4) || (iy > 3*yres/4)) continue;
       RNScalar d = depth_image->GridValue(index);
       if ((d != 0) && (d != R2_GRID_UNKNOWN_VALUE)) {
-        RNPolynomial *e = new RNPolynomial(1.0, index, 1.0);
-        e->Subtract(d);
-        e->Multiply(1000);
-        equations.InsertEquation(e);
+        RNScalar c = 1000;
+        equations.InsertLinearEquation(1, &index, &c, -d * c);
         found = TRUE;
         break;
       }
@@ -733,9 +880,9 @@ CreateInertiaEquations(RNSystemOfEquations& equations)
   // Last resort
   if (!found) {
     // Set depth of middle pixel to zero
-    RNPolynomial *e = new RNPolynomial(1.0, (yres/2)*xres+(xres/2), 1.0);
-    e->Multiply(1000);
-    equations.InsertEquation(e);
+    int index = (yres/2)*xres+(xres/2);
+    RNScalar c = 1000;
+    equations.InsertLinearEquation(1, &index, &c);
   }
 
   // Return success
@@ -744,43 +891,55 @@ CreateInertiaEquations(RNSystemOfEquations& equations)
 
 
   
+static void
+CreateDUVEquationRows(RNSystemOfEquations& equations, int k, int iy0, int iy1, void *data)
+{
+  // Get derivative image and offset to neighbor
+  int i = *((int *) data);
+  int sx = 0, sy = 0;
+  if (i == 0)      { sx = -1; sy =  1; }
+  else if (i == 1) { sx =  0; sy =  1; }
+  else if (i == 2) { sx =  1; sy =  1; }
+  else if (i == 3) { sx = -1; sy =  0; }
+  else if (i == 4) { sx =  1; sy =  0; }
+  else if (i == 5) { sx = -1; sy = -1; }
+  else if (i == 6) { sx =  0; sy = -1; }
+  else if (i == 7) { sx =  1; sy = -1; }
+
+  // Create derivative equations (one row per pixel written into slots starting at k)
+  int variables[2];
+  RNScalar coefficients[2];
+  for (int iy = iy0; iy < iy1; iy++) {
+    int ny = iy+sy;
+    if ((ny < 0) || (ny >= input_duv_images[i]->YResolution())) continue;
+    for (int ix = 0; ix < xres-1; ix++) {
+      int nx = ix+sx;
+      if ((nx < 0) || (nx >= input_duv_images[i]->XResolution())) continue;
+      RNScalar d = input_duv_images[i]->GridValue(ix, iy);
+      if (d == R2_GRID_UNKNOWN_VALUE) continue;
+      RNScalar w = derivative_weight;
+      if (input_derivative_weight_image) w *= input_derivative_weight_image->GridValue(ix, iy);
+      if (w == 0) continue;
+      variables[0] = (iy)*xres+(ix);
+      variables[1] = (ny)*xres+(nx);
+      coefficients[0] = w; coefficients[1] = -w;
+      equations.SetLinearEquation(k++, 2, variables, coefficients, -d * w);
+    }
+  }
+}
+
+
+
 static int
 CreateDUVEquations(RNSystemOfEquations& equations)
 {
   // Check images/weight
   if (!input_duv_images[0] || (derivative_weight == 0)) return 1;
   
-  // Create derivative equations
+  // Create derivative equations (one image at a time, so rows stay in the same order)
   for (int i = 0; i < 8; i++) {
     if (!input_duv_images[i]) continue;
-    int sx = 0, sy = 0;
-    if (i == 0)      { sx = -1; sy =  1; }
-    else if (i == 1) { sx =  0; sy =  1; }
-    else if (i == 2) { sx =  1; sy =  1; }
-    else if (i == 3) { sx = -1; sy =  0; }
-    else if (i == 4) { sx =  1; sy =  0; }
-    else if (i == 5) { sx = -1; sy = -1; }
-    else if (i == 6) { sx =  0; sy = -1; }
-    else if (i == 7) { sx =  1; sy = -1; }
-    for (int iy = 0; iy < yres; iy++) {
-      int ny = iy+sy;
-      if ((ny < 0) || (ny >= input_duv_images[i]->YResolution())) continue;
-      for (int ix = 0; ix < xres-1; ix++) {
-        int nx = ix+sx;
-        if ((nx < 0) || (nx >= input_duv_images[i]->XResolution())) continue;
-        RNScalar d = input_duv_images[i]->GridValue(ix, iy);
-        if (d == R2_GRID_UNKNOWN_VALUE) continue;
-        RNScalar w = derivative_weight;
-        if (input_derivative_weight_image) w *= input_derivative_weight_image->GridValue(ix, iy);
-        if (w == 0) continue;
-        RNPolynomial *e = new RNPolynomial();
-        e->AddTerm(1.0, (iy)*xres+(ix), 1.0);
-        e->AddTerm(-1.0,(ny)*xres+(nx), 1.0);
-        e->Subtract(d);
-        e->Multiply(w);
-        equations.InsertEquation(e);
-      }
-    }
+    CreateLinearEquationsInParallel(equations, CreateDUVEquationRows, 1, 2, &i);
   }
 
   // Return success
@@ -945,6 +1104,103 @@ CreateDXYEquations(RNSystemOfEquations& equations)
 
 
 
+static void
+CreateNormalEquationRows(RNArray<RNEquation *>& equations, int iy0, int iy1)
+{
+  // Create normal equations
+  for (int iy = iy0; iy < iy1; iy++) {
+    for (int ix = 0; ix < xres; ix++) {
+      RNScalar input_nx = input_normals_images[0]->GridValue(ix, iy);
+      if (input_nx == R2_GRID_UNKNOWN_VALUE) continue;
+      RNScalar input_ny = input_normals_images[1]->GridValue(ix, iy);
+      if (input_ny == R2_GRID_UNKNOWN_VALUE) continue;
+      RNScalar input_nz = input_normals_images[2]->GridValue(ix, iy);
+      if (input_nz == R2_GRID_UNKNOWN_VALUE) continue;
+      RNScalar w = normal_weight;
+      if (!normalize_tangent_vectors) w *= camera_intrinsics[0][0];
+      if (input_normal_weight_image) w *= input_normal_weight_image->GridValue(ix, iy);
+      if (w == 0) continue;
+
+      // Check normal direction
+      if (RNIsNegativeOrZero(input_nz)) continue;
+
+      // Consider 4 directions
+      for (int dir = 0; dir < 4; dir++) {
+        // Get image coordinates of adjacent point
+        int ixA , iyA, ixB, iyB;
+        if (dir == 0) { ixA = ix+1; iyA = iy; ixB = ix; iyB = iy+1; }
+        else if (dir == 1) { ixA = ix; iyA = iy+1; ixB = ix-1; iyB = iy; }
+        else if (dir == 2) { ixA = ix-1; iyA = iy; ixB = ix; iyB = iy-1; }
+        else { ixA = ix; iyA = iy-1; ixB = ix+1; iyB = iy; }
+        if ((ixA < 0) || (ixA >= xres)) continue;
+        if ((iyA < 0) || (iyA >= yres)) continue;
+        if ((ixB < 0) || (ixB >= xres)) continue;
+        if ((iyB < 0) || (iyB >= yres)) continue;
+
+        // Compute depths
+        RNPolynomial d(1.0, (iy)*xres+(ix), 1.0);
+        RNPolynomial dA(1.0, (iyA)*xres+(ixA), 1.0);
+        RNPolynomial dB(1.0, (iyB)*xres+(ixB), 1.0);
+
+        // Compute camera coordinates
+        RNPolynomial x = d * ((ix - camera_intrinsics[0][2]) / camera_intrinsics[0][0]);
+        RNPolynomial y = d * ((iy - camera_intrinsics[1][2]) / camera_intrinsics[1][1]);
+        RNPolynomial xA = dA * ((ixA - camera_intrinsics[0][2]) / camera_intrinsics[0][0]);
+        RNPolynomial yA = dA * ((iyA - camera_intrinsics[1][2]) / camera_intrinsics[1][1]);
+        RNPolynomial xB = dB * ((ixB - camera_intrinsics[0][2]) / camera_intrinsics[0][0]);
+        RNPolynomial yB = dB * ((iyB - camera_intrinsics[1][2]) / camera_intrinsics[1][1]);
+
+        // Compute tangent vector
+        RNAlgebraic *dxA = new RNAlgebraic(xA - x, 0);
+        RNAlgebraic *dyA = new RNAlgebraic(yA - y, 0);
+        RNAlgebraic *dzA = new RNAlgebraic(d - dA, 0);
+        RNAlgebraic *dxB = new RNAlgebraic(xB - x, 0);
+        RNAlgebraic *dyB = new RNAlgebraic(yB - y, 0);
+        RNAlgebraic *dzB = new RNAlgebraic(d - dB, 0);
+
+        // Compute cross product of vA and vB
+        RNAlgebraic *cx1 = new RNAlgebraic(RN_MULTIPLY_OPERATION, new RNAlgebraic(*dyA), new RNAlgebraic(*dzB));
+        RNAlgebraic *cx2 = new RNAlgebraic(RN_MULTIPLY_OPERATION, new RNAlgebraic(*dzA), new RNAlgebraic(*dyB));
+        RNAlgebraic *cx = new RNAlgebraic(RN_SUBTRACT_OPERATION, cx1, cx2);
+        RNAlgebraic *cy1 = new RNAlgebraic(RN_MULTIPLY_OPERATION, dzA, new RNAlgebraic(*dxB));
+        RNAlgebraic *cy2 = new RNAlgebraic(RN_MULTIPLY_OPERATION, new RNAlgebraic(*dxA), dzB);
+        RNAlgebraic *cy = new RNAlgebraic(RN_SUBTRACT_OPERATION, cy1, cy2);
+        RNAlgebraic *cz1 = new RNAlgebraic(RN_MULTIPLY_OPERATION, dxA, dyB);
+        RNAlgebraic *cz2 = new RNAlgebraic(RN_MULTIPLY_OPERATION, dyA, dxB);
+        RNAlgebraic *cz = new RNAlgebraic(RN_SUBTRACT_OPERATION, cz1, cz2);
+
+        // Compute normal
+        RNAlgebraic *scx = new RNAlgebraic(RN_POW_OPERATION, new RNAlgebraic(*cx), 2);
+        RNAlgebraic *scy = new RNAlgebraic(RN_POW_OPERATION, new RNAlgebraic(*cy), 2);
+        RNAlgebraic *scz = new RNAlgebraic(RN_POW_OPERATION, new RNAlgebraic(*cz), 2);
+        RNAlgebraic *slen = new RNAlgebraic(RN_ADD_OPERATION, scx, scy);
+        slen = new RNAlgebraic(RN_ADD_OPERATION, slen, scz);
+        RNAlgebraic *len = new RNAlgebraic(RN_POW_OPERATION, slen, 0.5);
+        RNAlgebraic *nx = new RNAlgebraic(RN_DIVIDE_OPERATION, cx, new RNAlgebraic(*len));
+        RNAlgebraic *ny = new RNAlgebraic(RN_DIVIDE_OPERATION, cy, new RNAlgebraic(*len));
+        RNAlgebraic *nz = new RNAlgebraic(RN_DIVIDE_OPERATION, cz, len);
+
+        // Compute errors
+        RNAlgebraic *ex = new RNAlgebraic(RN_SUBTRACT_OPERATION, nx, input_nx);
+        RNAlgebraic *ey = new RNAlgebraic(RN_SUBTRACT_OPERATION, ny, input_ny);
+        RNAlgebraic *ez = new RNAlgebraic(RN_SUBTRACT_OPERATION, nz, input_nz);
+
+        // Multiply by weight
+        ex = new RNAlgebraic(RN_MULTIPLY_OPERATION, ex, w);
+        ey = new RNAlgebraic(RN_MULTIPLY_OPERATION, ey, w);
+        ez = new RNAlgebraic(RN_MULTIPLY_OPERATION, ez, w);
+
+        // Insert equations
+        equations.Insert(new RNEquation(ex));
+        equations.Insert(new RNEquation(ey));
+        equations.Insert(new RNEquation(ez));
+      }
+    }
+  }
+}
+
+
+
 static int
 CreateNormalEquations(RNSystemOfEquations& equations)
 {
@@ -957,95 +1213,7 @@ CreateNormalEquations(RNSystemOfEquations& equations)
     }
 
     // Create normal equations
-    for (int iy = 0; iy < yres; iy++) {
-      for (int ix = 0; ix < xres; ix++) {
-        RNScalar input_nx = input_normals_images[0]->GridValue(ix, iy);
-        if (input_nx == R2_GRID_UNKNOWN_VALUE) continue;
-        RNScalar input_ny = input_normals_images[1]->GridValue(ix, iy);
-        if (input_ny == R2_GRID_UNKNOWN_VALUE) continue;
-        RNScalar input_nz = input_normals_images[2]->GridValue(ix, iy);
-        if (input_nz == R2_GRID_UNKNOWN_VALUE) continue;
-        RNScalar w = normal_weight;
-        if (!normalize_tangent_vectors) w *= camera_intrinsics[0][0];
-        if (input_normal_weight_image) w *= input_normal_weight_image->GridValue(ix, iy);
-        if (w == 0) continue;
-
-        // Check normal direction
-        if (RNIsNegativeOrZero(input_nz)) continue;
-
-        // Consider 4 directions
-        for (int dir = 0; dir < 4; dir++) {
-          // Get image coordinates of adjacent point
-          int ixA , iyA, ixB, iyB;
-          if (dir == 0) { ixA = ix+1; iyA = iy; ixB = ix; iyB = iy+1; }
-          else if (dir == 1) { ixA = ix; iyA = iy+1; ixB = ix-1; iyB = iy; }
-          else if (dir == 2) { ixA = ix-1; iyA = iy; ixB = ix; iyB = iy-1; }
-          else { ixA = ix; iyA = iy-1; ixB = ix+1; iyB = iy; }
-          if ((ixA < 0) || (ixA >= xres)) continue;
-          if ((iyA < 0) || (iyA >= yres)) continue;
-          if ((ixB < 0) || (ixB >= xres)) continue;
-          if ((iyB < 0) || (iyB >= yres)) continue;
-
-          // Compute depths
-          RNPolynomial d(1.0, (iy)*xres+(ix), 1.0);
-          RNPolynomial dA(1.0, (iyA)*xres+(ixA), 1.0);
-          RNPolynomial dB(1.0, (iyB)*xres+(ixB), 1.0);
-
-          // Compute camera coordinates
-          RNPolynomial x = d * ((ix - camera_intrinsics[0][2]) / camera_intrinsics[0][0]);
-          RNPolynomial y = d * ((iy - camera_intrinsics[1][2]) / camera_intrinsics[1][1]);
-          RNPolynomial xA = dA * ((ixA - camera_intrinsics[0][2]) / camera_intrinsics[0][0]);
-          RNPolynomial yA = dA * ((iyA - camera_intrinsics[1][2]) / camera_intrinsics[1][1]);
-          RNPolynomial xB = dB * ((ixB - camera_intrinsics[0][2]) / camera_intrinsics[0][0]);
-          RNPolynomial yB = dB * ((iyB - camera_intrinsics[1][2]) / camera_intrinsics[1][1]);
-
-          // Compute tangent vector
-          RNAlgebraic *dxA = new RNAlgebraic(xA - x, 0);
-          RNAlgebraic *dyA = new RNAlgebraic(yA - y, 0);
-          RNAlgebraic *dzA = new RNAlgebraic(d - dA, 0);
-          RNAlgebraic *dxB = new RNAlgebraic(xB - x, 0);
-          RNAlgebraic *dyB = new RNAlgebraic(yB - y, 0);
-          RNAlgebraic *dzB = new RNAlgebraic(d - dB, 0);
-
-          // Compute cross product of vA and vB
-          RNAlgebraic *cx1 = new RNAlgebraic(RN_MULTIPLY_OPERATION, new RNAlgebraic(*dyA), new RNAlgebraic(*dzB));
-          RNAlgebraic *cx2 = new RNAlgebraic(RN_MULTIPLY_OPERATION, new RNAlgebraic(*dzA), new RNAlgebraic(*dyB));
-          RNAlgebraic *cx = new RNAlgebraic(RN_SUBTRACT_OPERATION, cx1, cx2);
-          RNAlgebraic *cy1 = new RNAlgebraic(RN_MULTIPLY_OPERATION, dzA, new RNAlgebraic(*dxB));
-          RNAlgebraic *cy2 = new RNAlgebraic(RN_MULTIPLY_OPERATION, new RNAlgebraic(*dxA), dzB);
-          RNAlgebraic *cy = new RNAlgebraic(RN_SUBTRACT_OPERATION, cy1, cy2);
-          RNAlgebraic *cz1 = new RNAlgebraic(RN_MULTIPLY_OPERATION, dxA, dyB);
-          RNAlgebraic *cz2 = new RNAlgebraic(RN_MULTIPLY_OPERATION, dyA, dxB);
-          RNAlgebraic *cz = new RNAlgebraic(RN_SUBTRACT_OPERATION, cz1, cz2);
-
-          // Compute normal
-          RNAlgebraic *scx = new RNAlgebraic(RN_POW_OPERATION, new RNAlgebraic(*cx), 2);
-          RNAlgebraic *scy = new RNAlgebraic(RN_POW_OPERATION, new RNAlgebraic(*cy), 2);
-          RNAlgebraic *scz = new RNAlgebraic(RN_POW_OPERATION, new RNAlgebraic(*cz), 2);
-          RNAlgebraic *slen = new RNAlgebraic(RN_ADD_OPERATION, scx, scy);
-          slen = new RNAlgebraic(RN_ADD_OPERATION, slen, scz);
-          RNAlgebraic *len = new RNAlgebraic(RN_POW_OPERATION, slen, 0.5);
-          RNAlgebraic *nx = new RNAlgebraic(RN_DIVIDE_OPERATION, cx, new RNAlgebraic(*len));
-          RNAlgebraic *ny = new RNAlgebraic(RN_DIVIDE_OPERATION, cy, new RNAlgebraic(*len));
-          RNAlgebraic *nz = new RNAlgebraic(RN_DIVIDE_OPERATION, cz, len);
-
-          // Compute errors
-          RNAlgebraic *ex = new RNAlgebraic(RN_SUBTRACT_OPERATION, nx, input_nx);
-          RNAlgebraic *ey = new RNAlgebraic(RN_SUBTRACT_OPERATION, ny, input_ny);
-          RNAlgebraic *ez = new RNAlgebraic(RN_SUBTRACT_OPERATION, nz, input_nz);
-
-          // Multiply by weight
-          ex = new RNAlgebraic(RN_MULTIPLY_OPERATION, ex, w);
-          ey = new RNAlgebraic(RN_MULTIPLY_OPERATION, ey, w);
-          ez = new RNAlgebraic(RN_MULTIPLY_OPERATION, ez, w);
-
-          // Insert equations
-          equations.InsertEquation(ex);
-          equations.InsertEquation(ey);
-          equations.InsertEquation(ez);
-        }
-      }
-    }
+    CreateEquationsInParallel(equations, CreateNormalEquationRows);
   }
 
   // Return success
@@ -1054,6 +1222,182 @@ CreateNormalEquations(RNSystemOfEquations& equations)
 
 
 
+static RNScalar
+TangentEquationWeight(int ix, int iy, RNScalar normal[3])
+{
+  // Get normal at pixel
+  normal[0] = input_normals_images[0]->GridValue(ix, iy);
+  if (normal[0] == R2_GRID_UNKNOWN_VALUE) return 0;
+  normal[1] = input_normals_images[1]->GridValue(ix, iy);
+  if (normal[1] == R2_GRID_UNKNOWN_VALUE) return 0;
+  normal[2] = input_normals_images[2]->GridValue(ix, iy);
+  if (normal[2] == R2_GRID_UNKNOWN_VALUE) return 0;
+
+  // Check normal direction
+  if (RNIsNegativeOrZero(normal[2])) return 0;
+
+  // Return weight of tangent equations at pixel
+  RNScalar w = tangent_weight;
+  if (!normalize_tangent_vectors) w *= camera_intrinsics[0][0];
+  if (input_tangent_weight_image) w *= input_tangent_weight_image->GridValue(ix, iy);
+  return w;
+}
+
+
+
+static RNBoolean
+TangentEquationVectors(int ix, int iy, int dir, int variables[2], RNScalar P[3], RNScalar Q[3])
+{
+  // Get image coordinates of adjacent point
+  int ixA , iyA;
+  if (dir == 0) { ixA = ix+1; iyA = iy; }
+  else if (dir == 1) { ixA = ix; iyA = iy+1; }
+  else if (dir == 2) { ixA = ix-1; iyA = iy;  }
+  else { ixA = ix; iyA = iy-1; }
+  if ((ixA < 0) || (ixA >= xres)) return FALSE;
+  if ((iyA < 0) || (iyA >= yres)) return FALSE;
+
+  // Get depth variables
+  variables[0] = (iy)*xres+(ix);
+  variables[1] = (iyA)*xres+(ixA);
+
+  // Compute tangent vector (xA - x, yA - y, d - dA) = d*P + dA*Q
+  P[0] = -(ix - camera_intrinsics[0][2]) / camera_intrinsics[0][0];
+  P[1] = -(iy - camera_intrinsics[1][2]) / camera_intrinsics[1][1];
+  P[2] = 1;
+  Q[0] = (ixA - camera_intrinsics[0][2]) / camera_intrinsics[0][0];
+  Q[1] = (iyA - camera_intrinsics[1][2]) / camera_intrinsics[1][1];
+  Q[2] = -1;
+
+  // Return success
+  return TRUE;
+}
+
+
+
+// Instances of the normalized tangent family computed for a block of image rows
+struct TangentInstanceBuffer {
+  int ninstances;
+  int *variables;
+  RNScalar *parameters;
+  RNScalar *weights;
+};
+
+
+
+static void
+CreateNormalizedTangentInstancesThread(int thread_index, int nthreads, void *data)
+{
+  // Get buffer and block of image rows for this thread
+  TangentInstanceBuffer *buffer = &((TangentInstanceBuffer *) data)[thread_index];
+  int iy0, iy1;
+  RNThreadRange(yres, thread_index, nthreads, iy0, iy1);
+
+  // Allocate buffer for (at most) four instances per pixel
+  int n = 4 * xres * (iy1 - iy0);
+  buffer->ninstances = 0;
+  buffer->variables = new int [ 2*n + 1 ];
+  buffer->parameters = new RNScalar [ 5*n + 1 ];
+  buffer->weights = new RNScalar [ n + 1 ];
+
+  // Compute one instance per pixel and tangent direction, weighted by w
+  RNScalar normal[3], P[3], Q[3];
+  for (int iy = iy0; iy < iy1; iy++) {
+    for (int ix = 0; ix < xres; ix++) {
+      RNScalar w = TangentEquationWeight(ix, iy, normal);
+      if (w == 0) continue;
+
+      // Consider 4 tangent directions
+      for (int dir = 0; dir < 4; dir++) {
+        int *variables = &buffer->variables[2*buffer->ninstances];
+        RNScalar *parameters = &buffer->parameters[5*buffer->ninstances];
+        if (!TangentEquationVectors(ix, iy, dir, variables, P, Q)) continue;
+        parameters[0] = normal[0]*P[0] + normal[1]*P[1] + normal[2]*P[2];
+        parameters[1] = normal[0]*Q[0] + normal[1]*Q[1] + normal[2]*Q[2];
+        parameters[2] = P[0]*P[0] + P[1]*P[1] + P[2]*P[2];
+        parameters[3] = Q[0]*Q[0] + Q[1]*Q[1] + Q[2]*Q[2];
+        parameters[4] = 2 * (P[0]*Q[0] + P[1]*Q[1] + P[2]*Q[2]);
+        buffer->weights[buffer->ninstances++] = w;
+      }
+    }
+  }
+}
+
+
+
+static void
+CreateNormalizedTangentEquations(RNSystemOfEquations& equations)
+{
+  // Create family of equations dot(n, t) / |t|, with tangent t = d*P + dA*Q, 
+  // as (a*d + b*dA) / sqrt(p*d^2 + q*dA^2 + r*d*dA), where template variables 
+  // are d (0) and dA (1), and parameters are a (2), b (3), p (4), q (5), and r (6)
+  int dot_variables[2][2] = { { 2, 0 }, { 3, 1 } };
+  int dd_variables[3][3] = { { 4, 0 }, { 5, 1 }, { 6, 0, 1 } };
+  RNScalar dot_exponents[2] = { 1.0, 1.0 };
+  RNScalar dd_exponents[3][3] = { { 1.0, 2.0 }, { 1.0, 2.0 }, { 1.0, 1.0, 1.0 } };
+  RNPolynomial *dot = new RNPolynomial(1.0, 2, dot_variables[0], dot_exponents);
+  dot->Add(RNPolynomial(1.0, 2, dot_variables[1], dot_exponents));
+  RNPolynomial *dd = new RNPolynomial(1.0, 2, dd_variables[0], dd_exponents[0]);
+  dd->Add(RNPolynomial(1.0, 2, dd_variables[1], dd_exponents[1]));
+  dd->Add(RNPolynomial(1.0, 3, dd_variables[2], dd_exponents[2]));
+  RNAlgebraic *length = new RNAlgebraic(RN_POW_OPERATION, dd, 0.5);
+  RNAlgebraic *e = new RNAlgebraic(RN_DIVIDE_OPERATION, dot, length);
+  int family = equations.InsertEquationFamily(e, 2, 5);
+  if (family < 0) return;
+
+  // Determine number of threads
+  int nthreads = (max_threads > 0) ? max_threads : RNNumProcessors();
+  if (nthreads > yres) nthreads = yres;
+  if (nthreads < 1) nthreads = 1;
+
+  // Compute instances for blocks of rows in separate buffers
+  TangentInstanceBuffer *buffers = new TangentInstanceBuffer [ nthreads ];
+  RNRunThreads(nthreads, CreateNormalizedTangentInstancesThread, buffers);
+
+  // Insert instances in row order (so equation order does not depend on nthreads)
+  int ninstances = 0;
+  for (int t = 0; t < nthreads; t++) ninstances += buffers[t].ninstances;
+  equations.ReserveEquationFamilyInstances(family, ninstances);
+  for (int t = 0; t < nthreads; t++) {
+    TangentInstanceBuffer *buffer = &buffers[t];
+    for (int i = 0; i < buffer->ninstances; i++) {
+      equations.InsertEquationFamilyInstance(family, &buffer->variables[2*i], &buffer->parameters[5*i], buffer->weights[i]);
+    }
+  }
+
+  // Delete buffers
+  for (int t = 0; t < nthreads; t++) {
+    delete [] buffers[t].variables;
+    delete [] buffers[t].parameters;
+    delete [] buffers[t].weights;
+  }
+  delete [] buffers;
+}
+
+
+
+static void
+CreateTangentEquationRows(RNSystemOfEquations& equations, int k, int iy0, int iy1, void *data)
+{
+  // Create unnormalized tangent equations (rows written into slots starting at k)
+  int variables[2];
+  RNScalar coefficients[2], normal[3], P[3], Q[3];
+  for (int iy = iy0; iy < iy1; iy++) {
+    for (int ix = 0; ix < xres; ix++) {
+      RNScalar w = TangentEquationWeight(ix, iy, normal);
+      if (w == 0) continue;
+      for (int dir = 0; dir < 4; dir++) {
+        if (!TangentEquationVectors(ix, iy, dir, variables, P, Q)) continue;
+        coefficients[0] = w * (normal[0]*P[0] + normal[1]*P[1] + normal[2]*P[2]);
+        coefficients[1] = w * (normal[0]*Q[0] + normal[1]*Q[1] + normal[2]*Q[2]);
+        equations.SetLinearEquation(k++, 2, variables, coefficients);
+      }
+    }
+  }
+}
+
+
+
 static int
 CreateTangentEquations(RNSystemOfEquations& equations)
 {
@@ -1066,73 +1410,13 @@ CreateTangentEquations(RNSystemOfEquations& equations)
     }
 
     // Create tangent equations
-    for (int iy = 0; iy < yres; iy++) {
-      for (int ix = 0; ix < xres; ix++) {
-        RNScalar input_nx = input_normals_images[0]->GridValue(ix, iy);
-        if (input_nx == R2_GRID_UNKNOWN_VALUE) continue;
-        RNScalar input_ny = input_normals_images[1]->GridValue(ix, iy);
-        if (input_ny == R2_GRID_UNKNOWN_VALUE) continue;
-        RNScalar input_nz = input_normals_images[2]->GridValue(ix, iy);
-        if (input_nz == R2_GRID_UNKNOWN_VALUE) continue;
-        RNScalar w = tangent_weight;
-        if (!normalize_tangent_vectors) w *= camera_intrinsics[0][0];
-        if (input_tangent_weight_image) w *= input_tangent_weight_image->GridValue(ix, iy);
-        if (w == 0) continue;
-
-        // Check normal direction
-        if (RNIsNegativeOrZero(input_nz)) continue;
-
-        // Consider 4 tangent directions
-        for (int dir = 0; dir < 4; dir++) {
-          // Get image coordinates of adjacent point
-          int ixA , iyA;
-          if (dir == 0) { ixA = ix+1; iyA = iy; }
-          else if (dir == 1) { ixA = ix; iyA = iy+1; }
-          else if (dir == 2) { ixA = ix-1; iyA = iy;  }
-          else { ixA = ix; iyA = iy-1; }
-          if ((ixA < 0) || (ixA >= xres)) continue;
-          if ((iyA < 0) || (iyA >= yres)) continue;
-
-          // Compute depths
-          RNPolynomial d(1.0, (iy)*xres+(ix), 1.0);
-          RNPolynomial dA(1.0, (iyA)*xres+(ixA), 1.0);
-
-          // Compute camera coordinates
-          RNPolynomial x = d * ((ix - camera_intrinsics[0][2]) / camera_intrinsics[0][0]);
-          RNPolynomial y = d * ((iy - camera_intrinsics[1][2]) / camera_intrinsics[1][1]);
-          RNPolynomial xA = dA * ((ixA - camera_intrinsics[0][2]) / camera_intrinsics[0][0]);
-          RNPolynomial yA = dA * ((iyA - camera_intrinsics[1][2]) / camera_intrinsics[1][1]);
-
-          // Compute tangent vector
-          RNAlgebraic *dx = new RNAlgebraic(xA - x, 0);
-          RNAlgebraic *dy = new RNAlgebraic(yA - y, 0);
-          RNAlgebraic *dz = new RNAlgebraic(d - dA, 0);
-
-          // Normalize tangent vector
-          if (normalize_tangent_vectors) {
-            RNAlgebraic *ddx = new RNAlgebraic(RN_POW_OPERATION, new RNAlgebraic(*dx), 2);
-            RNAlgebraic *ddy = new RNAlgebraic(RN_POW_OPERATION, new RNAlgebraic(*dy), 2);
-            RNAlgebraic *ddz = new RNAlgebraic(RN_POW_OPERATION, new RNAlgebraic(*dz), 2);
-            RNAlgebraic *dd = new RNAlgebraic(RN_ADD_OPERATION, ddx, ddy);
-            dd = new RNAlgebraic(RN_ADD_OPERATION, dd, ddz);
-            RNAlgebraic *d = new RNAlgebraic(RN_POW_OPERATION, dd, 0.5);
-            dx = new RNAlgebraic(RN_DIVIDE_OPERATION, dx, new RNAlgebraic(*d));
-            dy = new RNAlgebraic(RN_DIVIDE_OPERATION, dy, new RNAlgebraic(*d));
-            dz = new RNAlgebraic(RN_DIVIDE_OPERATION, dz, d);
-          }
-
-          // Compute dot product between tangent and normal
-          RNAlgebraic *dotx = new RNAlgebraic(RN_MULTIPLY_OPERATION, dx, input_nx);
-          RNAlgebraic *doty = new RNAlgebraic(RN_MULTIPLY_OPERATION, dy, input_ny);
-          RNAlgebraic *dotz = new RNAlgebraic(RN_MULTIPLY_OPERATION, dz, input_nz);
-          RNAlgebraic *dot = new RNAlgebraic(RN_ADD_OPERATION, dotx, doty);
-          dot = new RNAlgebraic(RN_ADD_OPERATION, dot, dotz);
-
-          // Add equation for error
-          RNAlgebraic *e = new RNAlgebraic(RN_MULTIPLY_OPERATION, dot, w);
-          equations.InsertEquation(e);
-        }
-      }
+    if (normalize_tangent_vectors) {
+      // Normalized tangents are nonlinear, but share one expression, so create an equation family
+      CreateNormalizedTangentEquations(equations);
+    }
+    else {
+      // Unnormalized tangents are linear in depths, so create (at most) four two-term rows per pixel
+      CreateLinearEquationsInParallel(equations, CreateTangentEquationRows, 4, 2);
     }
   }
 
@@ -1142,18 +1426,15 @@ CreateTangentEquations(RNSystemOfEquations& equations)
 
 
 
-static int
-CreateRangeEquations(RNSystemOfEquations& equations)
+static void
+CreateRangeEquationRows(RNArray<RNEquation *>& equations, int iy0, int iy1)
 {
-  // Check parameters
-  if (range_weight == 0) return 1;
-  
   // For now
   RNScalar minimum = 0.1;
   RNScalar maximum = 20.0;
   
   // Create equations that penalize values outside range
-  for (int i = 0; i < xres*yres; i++) {
+  for (int i = iy0*xres; i < iy1*xres; i++) {
     // Compute weight
     RNScalar w = range_weight;
     if (input_range_weight_image) w *= input_range_weight_image->GridValue(i);
@@ -1164,15 +1445,27 @@ CreateRangeEquations(RNSystemOfEquations& equations)
     RNAlgebraic *e0 = new RNAlgebraic(RN_ADD_OPERATION, d0, 1.0 - minimum);
     e0 = new RNAlgebraic(RN_POW_OPERATION, e0, -2);
     e0 = new RNAlgebraic(RN_MULTIPLY_OPERATION, e0, w);
-    equations.InsertEquation(e0);
+    equations.Insert(new RNEquation(e0));
 
     // Add penalty function on high side of range
     RNPolynomial *d1 = new RNPolynomial(1.0, i, 1.0);
     RNAlgebraic *e1 = new RNAlgebraic(RN_SUBTRACT_OPERATION, maximum - 1.0, d1);
     e1 = new RNAlgebraic(RN_POW_OPERATION, e1, -2);
     e1 = new RNAlgebraic(RN_MULTIPLY_OPERATION, e1, w);
-    equations.InsertEquation(e1);
+    equations.Insert(new RNEquation(e1));
   }
+}
+
+
+
+static int
+CreateRangeEquations(RNSystemOfEquations& equations)
+{
+  // Check parameters
+  if (range_weight == 0) return 1;
+  
+  // Create equations that penalize values outside range
+  CreateEquationsInParallel(equations, CreateRangeEquationRows);
 
   // Return success
   return 1;
@@ -1185,7 +1478,7 @@ CreateRangeEquations(RNSystemOfEquations& equations)
 ////////////////////////////////////////////////////////////////////////
 
 static int
-CreateDepthImage(void)
+SolveDepthImage(double *x, RNBoolean initialized)
 {
   // Start statistics
   RNTime start_time;
@@ -1193,12 +1486,10 @@ CreateDepthImage(void)
   int n = xres*yres;
   if (n == 0) return 0;
 
-  // Allocate variables
-  double *x = new double [ n ];
-  for (int i = 0; i < n; i++) x[i] = 1;
-
   // Create system of equations
   RNSystemOfEquations equations(n);
+  equations.SetMaxThreads(max_threads);
+  if (nested_dissection) equations.SetGridResolution(xres, yres);
 
   // Add bounds
   for (int i = 0; i < n; i++) equations.SetLowerBound(i, minimum_depth);
@@ -1209,12 +1500,15 @@ CreateDepthImage(void)
   CreateInertiaEquations(equations);
   int inertia_equations_count = equations.NEquations() - equations_count;
   equations_count = equations.NEquations();
+  if (inertia_equations_count == 0) CreateAnchorEquations(equations);
+  int anchor_equations_count = equations.NEquations() - equations_count;
+  equations_count = equations.NEquations();
   CreateSmoothnessEquations(equations);
   int smoothness_equations_count = equations.NEquations() - equations_count;
   equations_count = equations.NEquations();
 
-  // Solve for initial guess 
-  equations.Minimize(x, RN_CSPARSE_SOLVER, 1E-3);
+  // Solve for initial guess (unless prolonged from coarser level)
+  if (!initialized) equations.Minimize(x, (solver == RN_CSPARSE_SUPERNODAL_SOLVER) ? solver : RN_CSPARSE_SOLVER, 1E-3, &cholesky_cache);
 
   // Print initial guess
   if (print_debug) {
@@ -1237,21 +1531,360 @@ CreateDepthImage(void)
   int range_equations_count = equations.NEquations() - equations_count;
   equations_count = equations.NEquations();
 
+  // Lower expression equations into a flat tape for faster evaluation
+  equations.Freeze();
+
   // Log initial ssd
   RNScalar initial_ssd = equations.SumOfSquaredResiduals(x);
   if (print_debug) printf("A %d %d %g\n", equations.NVariables(), equations.NEquations(), initial_ssd);
 
-  // Solve for depth
-  if (!equations.Minimize(x, solver, 1E-3)) {
+  // Solve for depth (iteratively from prolonged or previous solution, if there is one)
+  int level_solver = (initialized) ? RN_PCG_SOLVER : solver;
+  if (mixed_precision && (level_solver == RN_PCG_SOLVER)) level_solver = RN_MIXED_PCG_SOLVER;
+  RNBoolean pcg = (level_solver == RN_PCG_SOLVER) || (level_solver == RN_MIXED_PCG_SOLVER);
+  equations.SetMaxIterations(solver_max_iterations);
+  if (!equations.Minimize(x, level_solver, (pcg) ? pcg_tolerance : solver_tolerance, &cholesky_cache)) {
     fprintf(stderr, "Unable to minimize system of equations\n");
-    delete [] x;
     return 0;
   }
+
+  // Update statistics
+  solver_iterations += equations.NIterations();
+  if (!pcg) solver_iterative = FALSE;
   
   // Log final ssd
   RNScalar final_ssd = equations.SumOfSquaredResiduals(x);
   if (print_debug) printf("B %d %d %g\n", equations.NVariables(), equations.NEquations(), final_ssd);
 
+  // Print message
+  if (print_verbose) {
+    printf("Solved for depth image\n");
+    printf("  Time = %.2f seconds\n", start_time.Elapsed());
+    printf("  Resolution = %d %d\n", xres, yres);
+    printf("  # Variables = %d\n", equations.NVariables());
+    printf("  # Equations = %d\n", equations.NEquations());
+    printf("    Inertia Equations = %d\n", inertia_equations_count);
+    printf("    Anchor Equations = %d\n", anchor_equations_count);
+    printf("    Smoothness Equations = %d\n", smoothness_equations_count);
+    printf("    Derivative Equations = %d\n", derivative_equations_count);
+    printf("    Normal Equations = %d\n", normal_equations_count);
+    printf("    Tangent Equations = %d\n", tangent_equations_count);
+    printf("    Range Equations = %d\n", range_equations_count);
+    printf("  Initial SSD = %g\n", initial_ssd);
+    printf("  Final SSD = %g\n", final_ssd);
+    printf("  Iterations = %d\n", equations.NIterations());
+    fflush(stdout);
+  }
+
+  // Return success
+  return 1;
+}
+
+
+
+////////////////////////////////////////////////////////////////////////
+// Multigrid (coarse-to-fine) solver functions
+////////////////////////////////////////////////////////////////////////
+
+static R2Grid *
+DownsampleImage(R2Grid *image, int coarse_xres, int coarse_yres, RNScalar scale = 1.0)
+{
+  // Check image
+  if (!image) return NULL;
+
+  // Average known values in each 2x2 block
+  R2Grid *coarse_image = new R2Grid(coarse_xres, coarse_yres);
+  for (int iy = 0; iy < coarse_yres; iy++) {
+    for (int ix = 0; ix < coarse_xres; ix++) {
+      int count = 0;
+      RNScalar sum = 0;
+      for (int j = 2*iy; (j <= 2*iy+1) && (j < image->YResolution()); j++) {
+        for (int i = 2*ix; (i <= 2*ix+1) && (i < image->XResolution()); i++) {
+          RNScalar value = image->GridValue(i, j);
+          if (value == R2_GRID_UNKNOWN_VALUE) continue;
+          sum += value;
+          count++;
+        }
+      }
+      if (count == 0) coarse_image->SetGridValue(ix, iy, R2_GRID_UNKNOWN_VALUE);
+      else coarse_image->SetGridValue(ix, iy, scale * sum / count);
+    }
+  }
+
+  // Return coarse image
+  return coarse_image;
+}
+
+
+
+static void
+ProlongSolution(const double *coarse_x, int coarse_xres, int coarse_yres, double *x)
+{
+  // Bilinearly interpolate coarse solution at centers of fine pixels
+  R2Grid coarse_grid(coarse_xres, coarse_yres);
+  for (int i = 0; i < coarse_xres*coarse_yres; i++) coarse_grid.SetGridValue(i, coarse_x[i]);
+  for (int iy = 0; iy < yres; iy++) {
+    RNScalar cy = 0.5*(iy + 0.5) - 0.5;
+    if (cy < 0) cy = 0;
+    if (cy > coarse_yres-1) cy = coarse_yres-1;
+    for (int ix = 0; ix < xres; ix++) {
+      RNScalar cx = 0.5*(ix + 0.5) - 0.5;
+      if (cx < 0) cx = 0;
+      if (cx > coarse_xres-1) cx = coarse_xres-1;
+      x[iy*xres+ix] = coarse_grid.GridValue(cx, cy);
+    }
+  }
+}
+
+
+
+static int
+SolveDepthImageMultigrid(double *x, int level)
+{
+  // Check if should solve at coarser level first
+  int coarse_xres = (xres+1)/2;
+  int coarse_yres = (yres+1)/2;
+  RNBoolean initialized = FALSE;
+  if ((level < multigrid_levels-1) && (coarse_xres >= 16) && (coarse_yres >= 16)) {
+    // Save inputs at this level
+    int fine_xres = xres, fine_yres = yres;
+    R3Matrix fine_camera_intrinsics = camera_intrinsics;
+    R2Grid *fine_depth_image = input_depth_image;
+    R2Grid *fine_normals_images[3], *fine_duv_images[8];
+    for (int i = 0; i < 3; i++) fine_normals_images[i] = input_normals_images[i];
+    for (int i = 0; i < 8; i++) fine_duv_images[i] = input_duv_images[i];
+    R2Grid *fine_inertia_depth_image = input_inertia_depth_image;
+    R2Grid *fine_inertia_weight_image = input_inertia_weight_image;
+    R2Grid *fine_smoothness_weight_images[2] = { input_smoothness_weight_images[0], input_smoothness_weight_images[1] };
+    R2Grid *fine_normal_weight_image = input_normal_weight_image;
+    R2Grid *fine_tangent_weight_image = input_tangent_weight_image;
+    R2Grid *fine_derivative_weight_image = input_derivative_weight_image;
+    R2Grid *fine_range_weight_image = input_range_weight_image;
+
+    // Replace inputs with downsampled versions (depth differences double with pixel spacing)
+    xres = coarse_xres;
+    yres = coarse_yres;
+    camera_intrinsics[0][0] = 0.5 * fine_camera_intrinsics[0][0];
+    camera_intrinsics[1][1] = 0.5 * fine_camera_intrinsics[1][1];
+    camera_intrinsics[0][2] = 0.5 * (fine_camera_intrinsics[0][2] + 0.5) - 0.5;
+    camera_intrinsics[1][2] = 0.5 * (fine_camera_intrinsics[1][2] + 0.5) - 0.5;
+    input_depth_image = DownsampleImage(fine_depth_image, xres, yres);
+    for (int i = 0; i < 3; i++) input_normals_images[i] = DownsampleImage(fine_normals_images[i], xres, yres);
+    for (int i = 0; i < 8; i++) input_duv_images[i] = DownsampleImage(fine_duv_images[i], xres, yres, 2.0);
+    input_inertia_depth_image = DownsampleImage(fine_inertia_depth_image, xres, yres);
+    input_inertia_weight_image = DownsampleImage(fine_inertia_weight_image, xres, yres);
+    for (int i = 0; i < 2; i++) input_smoothness_weight_images[i] = DownsampleImage(fine_smoothness_weight_images[i], xres, yres);
+    input_normal_weight_image = DownsampleImage(fine_normal_weight_image, xres, yres);
+    input_tangent_weight_image = DownsampleImage(fine_tangent_weight_image, xres, yres);
+    input_derivative_weight_image = DownsampleImage(fine_derivative_weight_image, xres, yres);
+    input_range_weight_image = DownsampleImage(fine_range_weight_image, xres, yres);
+
+    // Renormalize averaged normals
+    if (input_normals_images[0] && input_normals_images[1] && input_normals_images[2]) {
+      for (int i = 0; i < xres*yres; i++) {
+        RNScalar nx = input_normals_images[0]->GridValue(i);
+        RNScalar ny = input_normals_images[1]->GridValue(i);
+        RNScalar nz = input_normals_images[2]->GridValue(i);
+        if ((nx == R2_GRID_UNKNOWN_VALUE) || (ny == R2_GRID_UNKNOWN_VALUE) || (nz == R2_GRID_UNKNOWN_VALUE)) continue;
+        RNScalar length = sqrt(nx*nx + ny*ny + nz*nz);
+        if (RNIsZero(length)) continue;
+        input_normals_images[0]->SetGridValue(i, nx / length);
+        input_normals_images[1]->SetGridValue(i, ny / length);
+        input_normals_images[2]->SetGridValue(i, nz / length);
+      }
+    }
+
+    // Solve at coarser level
+    double *coarse_x = new double [ xres*yres ];
+    for (int i = 0; i < xres*yres; i++) coarse_x[i] = 1;
+    int status = SolveDepthImageMultigrid(coarse_x, level+1);
+
+    // Delete downsampled inputs
+    delete input_depth_image;
+    for (int i = 0; i < 3; i++) delete input_normals_images[i];
+    for (int i = 0; i < 8; i++) delete input_duv_images[i];
+    delete input_inertia_depth_image;
+    delete input_inertia_weight_image;
+    for (int i = 0; i < 2; i++) delete input_smoothness_weight_images[i];
+    delete input_normal_weight_image;
+    delete input_tangent_weight_image;
+    delete input_derivative_weight_image;
+    delete input_range_weight_image;
+
+    // Restore inputs at this level
+    xres = fine_xres;
+    yres = fine_yres;
+    camera_intrinsics = fine_camera_intrinsics;
+    input_depth_image = fine_depth_image;
+    for (int i = 0; i < 3; i++) input_normals_images[i] = fine_normals_images[i];
+    for (int i = 0; i < 8; i++) input_duv_images[i] = fine_duv_images[i];
+    input_inertia_depth_image = fine_inertia_depth_image;
+    input_inertia_weight_image = fine_inertia_weight_image;
+    for (int i = 0; i < 2; i++) input_smoothness_weight_images[i] = fine_smoothness_weight_images[i];
+    input_normal_weight_image = fine_normal_weight_image;
+    input_tangent_weight_image = fine_tangent_weight_image;
+    input_derivative_weight_image = fine_derivative_weight_image;
+    input_range_weight_image = fine_range_weight_image;
+
+    // Prolong coarse solution to initialize this level
+    if (status) {
+      ProlongSolution(coarse_x, coarse_xres, coarse_yres, x);
+      initialized = TRUE;
+    }
+
+    // Delete coarse solution
+    delete [] coarse_x;
+  }
+
+  // Solve at this level
+  return SolveDepthImage(x, initialized);
+}
+
+
+
+////////////////////////////////////////////////////////////////////////
+// Warm start (streaming) functions
+////////////////////////////////////////////////////////////////////////
+
+static int
+ReadPose(const char *filename, RNScalar pose[4][4])
+{
+  // Open file
+  FILE *fp = fopen(filename, "r");
+  if (!fp) {
+    fprintf(stderr, "Unable to open pose file %s\n", filename);
+    return 0;
+  }
+
+  // Read 4x4 matrix (row major)
+  for (int i = 0; i < 4; i++) {
+    for (int j = 0; j < 4; j++) {
+      if (fscanf(fp, "%lf", &pose[i][j]) != 1) {
+        fprintf(stderr, "Unable to read 4x4 matrix from pose file %s\n", filename);
+        fclose(fp);
+        return 0;
+      }
+    }
+  }
+
+  // Close file
+  fclose(fp);
+
+  // Return success
+  return 1;
+}
+
+
+
+static R2Grid *
+WarpDepthImage(const R2Grid *depth_image, RNScalar pose[4][4])
+{
+  // Get convenient variables
+  RNScalar fx = camera_intrinsics[0][0];
+  RNScalar fy = camera_intrinsics[1][1];
+  RNScalar cx = camera_intrinsics[0][2];
+  RNScalar cy = camera_intrinsics[1][2];
+
+  // Allocate warped depth image (zero where nothing projects)
+  R2Grid *warped_image = new R2Grid(xres, yres);
+
+  // Forward project depths into new camera (nearest depth wins)
+  for (int iy = 0; iy < yres; iy++) {
+    for (int ix = 0; ix < xres; ix++) {
+      RNScalar d = depth_image->GridValue(ix, iy);
+      if ((d <= 0) || (d == R2_GRID_UNKNOWN_VALUE)) continue;
+
+      // Compute position in previous camera coordinates
+      RNScalar p[3] = { d * (ix - cx) / fx, d * (iy - cy) / fy, d };
+
+      // Transform into current camera coordinates
+      RNScalar q[3];
+      for (int j = 0; j < 3; j++) {
+        q[j] = pose[j][0]*p[0] + pose[j][1]*p[1] + pose[j][2]*p[2] + pose[j][3];
+      }
+      if (q[2] <= 0) continue;
+
+      // Project into current image
+      int jx = (int) (fx * q[0] / q[2] + cx + 0.5);
+      int jy = (int) (fy * q[1] / q[2] + cy + 0.5);
+      if ((jx < 0) || (jx >= xres) || (jy < 0) || (jy >= yres)) continue;
+
+      // Keep nearest depth
+      RNScalar old_d = warped_image->GridValue(jx, jy);
+      if ((old_d > 0) && (old_d <= q[2])) continue;
+      warped_image->SetGridValue(jx, jy, q[2]);
+    }
+  }
+
+  // Return warped depth image
+  return warped_image;
+}
+
+
+
+static RNBoolean
+InitializeFromPreviousFrame(double *x)
+{
+  // Check previous frame
+  if (!warm_start || !previous_depth_image) return FALSE;
+  if ((previous_depth_image->XResolution() != xres) || (previous_depth_image->YResolution() != yres)) return FALSE;
+
+  // Motion compensate previous depth image
+  R2Grid *warped_image = NULL;
+  if (input_pose_filename) {
+    RNScalar pose[4][4];
+    if (!ReadPose(input_pose_filename, pose)) return FALSE;
+    warped_image = WarpDepthImage(previous_depth_image, pose);
+  }
+
+  // Initialize variables from previous output (holes get input depth, or else unwarped previous depth)
+  for (int i = 0; i < xres*yres; i++) {
+    RNScalar d = (warped_image) ? warped_image->GridValue(i) : previous_depth_image->GridValue(i);
+    if (((d <= 0) || (d == R2_GRID_UNKNOWN_VALUE)) && input_depth_image) d = input_depth_image->GridValue(i);
+    if ((d <= 0) || (d == R2_GRID_UNKNOWN_VALUE)) d = previous_depth_image->GridValue(i);
+    x[i] = d;
+  }
+
+  // Delete warped image
+  if (warped_image) delete warped_image;
+
+  // Return success
+  return TRUE;
+}
+
+
+
+static int
+CreateDepthImage(void)
+{
+  // Start statistics
+  RNTime start_time;
+  start_time.Read();
+  int n = xres*yres;
+  if (n == 0) return 0;
+
+  // Allocate variables
+  double *x = new double [ n ];
+  for (int i = 0; i < n; i++) x[i] = 1;
+
+  // Initialize from previous frame when streaming
+  solver_iterations = 0;
+  solver_iterative = TRUE;
+  warm_started = InitializeFromPreviousFrame(x);
+
+  // Solve for depth
+  int status = 0;
+  RNTime solver_start_time;
+  solver_start_time.Read();
+  if (warm_started) status = SolveDepthImage(x, TRUE);
+  else if (multigrid_levels > 1) status = SolveDepthImageMultigrid(x, 0);
+  else status = SolveDepthImage(x, FALSE);
+  solver_time = solver_start_time.Elapsed();
+  if (!status) {
+    delete [] x;
+    return 0;
+  }
+
   // Allocate output depth image
   output_depth_image = new R2Grid(xres, yres);
   if (!output_depth_image) {
@@ -1267,18 +1900,8 @@ CreateDepthImage(void)
 
   // Print message
   if (print_verbose) {
-    printf("Solved for depth image\n");
+    printf("Created depth image\n");
     printf("  Time = %.2f seconds\n", start_time.Elapsed());
-    printf("  # Variables = %d\n", equations.NVariables());
-    printf("  # Equations = %d\n", equations.NEquations());
-    printf("    Inertia Equations = %d\n", inertia_equations_count);
-    printf("    Smoothness Equations = %d\n", smoothness_equations_count);
-    printf("    Derivative Equations = %d\n", derivative_equations_count);
-    printf("    Normal Equations = %d\n", normal_equations_count);
-    printf("    Tangent Equations = %d\n", tangent_equations_count);
-    printf("    Range Equations = %d\n", range_equations_count);
-    printf("  Initial SSD = %g\n", initial_ssd);
-    printf("  Final SSD = %g\n", final_ssd);
     fflush(stdout);
   }
 
@@ -1291,6 +1914,542 @@ CreateDepthImage(void)
 
 
 
+////////////////////////////////////////////////////////////////////////
+// Batch processing
+////////////////////////////////////////////////////////////////////////
+
+// Options that can be set per job in a batch manifest line 
+// (all other options are shared by all jobs and set on the command line)
+static struct BatchJobOption {
+  const char *name;
+  const char **filename;
+  double *value;
+  int *resolution;
+} batch_job_options[] = {
+  { "-input_normals", &input_normals_filename, NULL, NULL },
+  { "-input_derivatives", &input_duv_filename, NULL, NULL },
+  { "-input_duv", &input_duv_filename, NULL, NULL },
+  { "-input_nx", &input_nx_filename, NULL, NULL },
+  { "-input_ny", &input_ny_filename, NULL, NULL },
+  { "-input_nz", &input_nz_filename, NULL, NULL },
+  { "-input_du", &input_du_filename, NULL, NULL },
+  { "-input_dv", &input_dv_filename, NULL, NULL },
+  { "-input_inertia_depth", &input_inertia_depth_filename, NULL, NULL },
+  { "-input_inertia_weight", &input_inertia_weight_filename, NULL, NULL },
+  { "-input_xsmoothness_weight", &input_xsmoothness_weight_filename, NULL, NULL },
+  { "-input_ysmoothness_weight", &input_ysmoothness_weight_filename, NULL, NULL },
+  { "-input_normal_weight", &input_normal_weight_filename, NULL, NULL },
+  { "-input_tangent_weight", &input_tangent_weight_filename, NULL, NULL },
+  { "-input_derivative_weight", &input_derivative_weight_filename, NULL, NULL },
+  { "-input_range_weight", &input_range_weight_filename, NULL, NULL },
+  { "-output_plot", &output_plot_filename, NULL, NULL },
+  { "-true_depth", &true_depth_filename, NULL, NULL },
+  { "-pose", &input_pose_filename, NULL, NULL },
+  { "-inertia_weight", NULL, &inertia_weight, NULL },
+  { "-duv_weight", NULL, &derivative_weight, NULL },
+  { "-normal_weight", NULL, &normal_weight, NULL },
+  { "-tangent_weight", NULL, &tangent_weight, NULL },
+  { "-smoothness_weight", NULL, &smoothness_weight, NULL },
+  { "-range_weight", NULL, &range_weight, NULL },
+  { "-fx", NULL, &camera_intrinsics[0][0], NULL },
+  { "-fy", NULL, &camera_intrinsics[1][1], NULL },
+  { "-cx", NULL, &camera_intrinsics[0][2], NULL },
+  { "-cy", NULL, &camera_intrinsics[1][2], NULL },
+  { "-xres", NULL, NULL, &xres },
+  { "-yres", NULL, NULL, &yres },
+  { NULL, NULL, NULL, NULL }
+};
+
+
+
+static void
+SaveBatchJobOptions(const char **filenames, double *values, int *resolutions)
+{
+  // Save current values of per-job options
+  for (int i = 0; batch_job_options[i].name; i++) {
+    BatchJobOption& option = batch_job_options[i];
+    if (option.filename) filenames[i] = *option.filename;
+    else if (option.value) values[i] = *option.value;
+    else if (option.resolution) resolutions[i] = *option.resolution;
+  }
+}
+
+
+
+static void
+RestoreBatchJobOptions(const char **filenames, const double *values, const int *resolutions)
+{
+  // Restore saved values of per-job options
+  for (int i = 0; batch_job_options[i].name; i++) {
+    BatchJobOption& option = batch_job_options[i];
+    if (option.filename) *option.filename = filenames[i];
+    else if (option.value) *option.value = values[i];
+    else if (option.resolution) *option.resolution = resolutions[i];
+  }
+}
+
+
+
+static int
+ParseBatchJob(char *line)
+{
+  // Parse "inputdepth outputdepth [per-job options]" (whitespace separated, no quoting)
+  input_depth_filename = NULL;
+  output_depth_filename = NULL;
+  char *token = strtok(line, " \t\r\n");
+  while (token) {
+    if (token[0] == '-') {
+      // Find option
+      BatchJobOption *option = NULL;
+      for (int i = 0; batch_job_options[i].name; i++) {
+        if (!strcmp(token, batch_job_options[i].name)) { option = &batch_job_options[i]; break; }
+      }
+
+      // Check option
+      if (!option) {
+        fprintf(stderr, "Invalid option in batch manifest: %s\n", token);
+        return 0;
+      }
+
+      // Read option value
+      char *value = strtok(NULL, " \t\r\n");
+      if (!value) {
+        fprintf(stderr, "Missing value for %s in batch manifest\n", token);
+        return 0;
+      }
+
+      // Set option
+      if (option->filename) *option->filename = value;
+      else if (option->value) *option->value = atof(value);
+      else if (option->resolution) *option->resolution = atoi(value);
+    }
+    else {
+      if (!input_depth_filename) input_depth_filename = token;
+      else if (!output_depth_filename) output_depth_filename = token;
+      else { fprintf(stderr, "Invalid argument in batch manifest: %s\n", token); return 0; }
+    }
+    token = strtok(NULL, " \t\r\n");
+  }
+
+  // Check filenames
+  if (!input_depth_filename || !output_depth_filename) {
+    fprintf(stderr, "Batch manifest line must start with inputdepth outputdepth\n");
+    return 0;
+  }
+
+  // Return success
+  return 1;
+}
+
+
+
+static void
+DeleteImages(void)
+{
+  // Delete input and output images (so that next job reads its own)
+  R2Grid **images[] = { 
+    &input_depth_image, &input_inertia_depth_image, &input_inertia_weight_image, 
+    &input_smoothness_weight_images[0], &input_smoothness_weight_images[1], 
+    &input_normal_weight_image, &input_tangent_weight_image, &input_derivative_weight_image, 
+    &input_range_weight_image, &true_depth_image, &output_depth_image,
+    &input_normals_images[0], &input_normals_images[1], &input_normals_images[2],
+    &input_duv_images[0], &input_duv_images[1], &input_duv_images[2], &input_duv_images[3],
+    &input_duv_images[4], &input_duv_images[5], &input_duv_images[6], &input_duv_images[7]
+  };
+  for (unsigned int i = 0; i < sizeof(images) / sizeof(images[0]); i++) {
+    if (*images[i]) delete *images[i];
+    *images[i] = NULL;
+  }
+}
+
+
+
+static int
+ProcessBatch(const char *filename)
+{
+  // Start statistics
+  RNTime start_time;
+  start_time.Read();
+
+  // Open manifest file
+  FILE *fp = fopen(filename, "r");
+  if (!fp) {
+    fprintf(stderr, "Unable to open batch manifest %s\n", filename);
+    return 0;
+  }
+
+  // Save options from command line (they are the defaults for every job)
+  int noptions = 0;
+  while (batch_job_options[noptions].name) noptions++;
+  const char **filenames = new const char * [ noptions ];
+  double *values = new double [ noptions ];
+  int *resolutions = new int [ noptions ];
+  SaveBatchJobOptions(filenames, values, resolutions);
+
+  // Process jobs
+  char buffer[16384];
+  int njobs = 0, nfailures = 0;
+  int ncold_jobs = 0, ncold_iterations = 0;
+  int nwarm_jobs = 0, nwarm_iterations = 0;
+  RNScalar cold_time = 0, warm_time = 0;
+  RNBoolean cold_iterative = TRUE;
+  while (fgets(buffer, sizeof(buffer), fp)) {
+    // Skip blank lines and comments
+    char *line = buffer;
+    while (isspace(*line)) line++;
+    if ((*line == '\0') || (*line == '#')) continue;
+    njobs++;
+
+    // Setup options for job
+    RestoreBatchJobOptions(filenames, values, resolutions);
+    if (!ParseBatchJob(line)) { nfailures++; continue; }
+    if (print_verbose) {
+      printf("Job %d: %s -> %s\n", njobs, input_depth_filename, output_depth_filename);
+      fflush(stdout);
+    }
+
+    // Run job (symbolic factorizations are cached between jobs)
+    int status = ReadInputs() && CreateDepthImage() && WriteOutputs();
+    if (!status) {
+      fprintf(stderr, "Unable to process job %d: %s\n", njobs, input_depth_filename);
+      nfailures++;
+    }
+
+    // Update solver statistics (warm starts always use PCG, cold starts may use a direct solver)
+    if (status && warm_started) { 
+      nwarm_jobs++; 
+      nwarm_iterations += solver_iterations; 
+      warm_time += solver_time; 
+    }
+    else if (status) { 
+      ncold_jobs++; 
+      ncold_iterations += solver_iterations; 
+      cold_time += solver_time; 
+      if (!solver_iterative) cold_iterative = FALSE;
+    }
+
+    // Keep output depth image to warm start next job
+    if (warm_start) {
+      if (previous_depth_image) delete previous_depth_image;
+      previous_depth_image = (status) ? output_depth_image : NULL;
+      if (!status && output_depth_image) delete output_depth_image;
+      output_depth_image = NULL;
+    }
+
+    // Delete images
+    DeleteImages();
+  }
+
+  // Close manifest file
+  fclose(fp);
+
+  // Delete previous frame
+  if (previous_depth_image) delete previous_depth_image;
+  previous_depth_image = NULL;
+
+  // Delete saved options
+  RestoreBatchJobOptions(filenames, values, resolutions);
+  delete [] filenames;
+  delete [] values;
+  delete [] resolutions;
+
+  // Print statistics
+  if (print_verbose) {
+    printf("Processed batch ...\n");
+    printf("  Time = %.2f seconds\n", start_time.Elapsed());
+    printf("  # Jobs = %d\n", njobs);
+    printf("  # Failures = %d\n", nfailures);
+    if (warm_start) {
+      // Compare solve times, and also iterations if cold starts used the same (PCG) solver
+      RNScalar cold_average = (ncold_jobs > 0) ? cold_time / ncold_jobs : 0;
+      RNScalar warm_average = (nwarm_jobs > 0) ? warm_time / nwarm_jobs : 0;
+      printf("  # Cold Started Jobs = %d (%.2f seconds per solve)\n", ncold_jobs, cold_average);
+      printf("  # Warm Started Jobs = %d (%.2f seconds per solve)\n", nwarm_jobs, warm_average);
+      if ((ncold_jobs > 0) && (nwarm_jobs > 0)) {
+        printf("  Solve Time Saved = %.2f seconds per warm started job\n", cold_average - warm_average);
+        if (cold_iterative) {
+          RNScalar cold_iterations = (RNScalar) ncold_iterations / ncold_jobs;
+          RNScalar warm_iterations = (RNScalar) nwarm_iterations / nwarm_jobs;
+          printf("  PCG Iterations Saved = %.1f per warm started job (%.1f cold, %.1f warm)\n", 
+            cold_iterations - warm_iterations, cold_iterations, warm_iterations);
+        }
+      }
+    }
+    fflush(stdout);
+  }
+
+  // Return whether all jobs succeeded
+  return (nfailures == 0) ? 1 : 0;
+}
+
+
+
+////////////////////////////////////////////////////////////////////////
+// Parameter sweep
+////////////////////////////////////////////////////////////////////////
+
+// Equation terms whose normal equations are assembled separately
+enum {
+  SWEEP_INERTIA_TERM,
+  SWEEP_ANCHOR_TERM,
+  SWEEP_SMOOTHNESS_TERM,
+  SWEEP_TANGENT_TERM,
+  SWEEP_FIXED_TERM,
+  SWEEP_NUM_TERMS
+};
+
+struct SweepJob {
+  RNScalar weights[SWEEP_NUM_TERMS];
+  char output_filename[1024];
+  int status;
+};
+
+struct SweepData {
+  const RNSystemOfEquations *equations;
+  RNScalar *JTJ[SWEEP_NUM_TERMS];
+  RNScalar *JTr[SWEEP_NUM_TERMS];
+  SweepJob *jobs;
+  int njobs;
+  int first_job;
+  RNCSparseCholesky *choleskies;
+  RNScalar **thread_JTJ;
+  RNScalar **thread_x;
+};
+
+
+
+static void
+SolveSweepJob(int thread_index, int nthreads, void *data)
+{
+  // Get convenient variables
+  SweepData *sweep_data = (SweepData *) data;
+  const RNSystemOfEquations *equations = sweep_data->equations;
+  int n = equations->NVariables();
+  int nnz = equations->NormalMatrixNNonzeros();
+  RNScalar *JTJ = sweep_data->thread_JTJ[thread_index];
+  RNScalar *x = sweep_data->thread_x[thread_index];
+
+  // Get job assigned to this thread in this round
+  int j = sweep_data->first_job + thread_index;
+  if (j >= sweep_data->njobs) return;
+  SweepJob *job = &sweep_data->jobs[j];
+
+  // Sum normal equations of terms (rows scale by weight, so blocks scale by weight squared)
+  for (int i = 0; i < nnz; i++) JTJ[i] = 0;
+  for (int i = 0; i < n; i++) x[i] = 0;
+  for (int k = 0; k < SWEEP_NUM_TERMS; k++) {
+    RNScalar scale = job->weights[k] * job->weights[k];
+    if (scale == 0) continue;
+    const RNScalar *term_JTJ = sweep_data->JTJ[k];
+    const RNScalar *term_JTr = sweep_data->JTr[k];
+    for (int i = 0; i < nnz; i++) JTJ[i] += scale * term_JTJ[i];
+    for (int i = 0; i < n; i++) x[i] -= scale * term_JTr[i];
+  }
+
+  // Solve J^T*J * x = -J^T*r (with this thread's factorization cache)
+  if (!SolveNormalEquationsCSPARSE(equations, JTJ, x, &sweep_data->choleskies[thread_index])) return;
+
+  // Clamp to depth range (bounds of single runs)
+  for (int i = 0; i < n; i++) {
+    if (x[i] < minimum_depth) x[i] = minimum_depth;
+    else if (x[i] > maximum_depth) x[i] = maximum_depth;
+  }
+
+  // Remember that job was solved (the main thread writes the depth image)
+  job->status = 1;
+}
+
+
+
+static int
+ReadSweepJobs(const char *filename, SweepJob **jobs)
+{
+  // Open file
+  FILE *fp = fopen(filename, "r");
+  if (!fp) {
+    fprintf(stderr, "Unable to open sweep file %s\n", filename);
+    return -1;
+  }
+
+  // Read lines of "inertia_weight smoothness_weight tangent_weight outputdepth"
+  int njobs = 0, nallocated = 16;
+  *jobs = new SweepJob [ nallocated ];
+  char buffer[4096];
+  while (fgets(buffer, sizeof(buffer), fp)) {
+    // Skip blank lines and comments
+    char *line = buffer;
+    while (isspace(*line)) line++;
+    if ((*line == '\0') || (*line == '#')) continue;
+
+    // Make room for job
+    if (njobs == nallocated) {
+      SweepJob *tmp = new SweepJob [ 2 * nallocated ];
+      for (int i = 0; i < njobs; i++) tmp[i] = (*jobs)[i];
+      delete [] *jobs;
+      *jobs = tmp;
+      nallocated *= 2;
+    }
+
+    // Parse job
+    SweepJob *job = &(*jobs)[njobs];
+    if (sscanf(line, "%lf%lf%lf%1023s", &job->weights[SWEEP_INERTIA_TERM], 
+      &job->weights[SWEEP_SMOOTHNESS_TERM], &job->weights[SWEEP_TANGENT_TERM], job->output_filename) != 4) {
+      fprintf(stderr, "Invalid line in sweep file %s: %s", filename, line);
+      fclose(fp);
+      return -1;
+    }
+
+    // Anchor one pixel instead of preserving depths if inertia weight is not positive (as in single runs)
+    if (job->weights[SWEEP_INERTIA_TERM] <= 0) {
+      job->weights[SWEEP_INERTIA_TERM] = 0;
+      job->weights[SWEEP_ANCHOR_TERM] = 1;
+    }
+    else {
+      job->weights[SWEEP_ANCHOR_TERM] = 0;
+    }
+
+    // Insert job
+    job->weights[SWEEP_FIXED_TERM] = 1;
+    job->status = 0;
+    njobs++;
+  }
+
+  // Close file
+  fclose(fp);
+
+  // Return number of jobs
+  return njobs;
+}
+
+
+
+static int
+SweepDepthImages(const char *filename)
+{
+  // Start statistics
+  RNTime start_time;
+  start_time.Read();
+  int n = xres*yres;
+  if (n == 0) return 0;
+
+  // Check equations (only linear terms can be assembled once and reweighted)
+  if (normalize_tangent_vectors || (normal_weight > 0) || (range_weight > 0)) {
+    fprintf(stderr, "Parameter sweep supports only linear equations (no normal, range, or normalized tangent terms)\n");
+    return 0;
+  }
+
+  // Read jobs
+  SweepJob *jobs = NULL;
+  int njobs = ReadSweepJobs(filename, &jobs);
+  if (njobs < 0) { delete [] jobs; return 0; }
+
+  // Create equations for each term with unit weight (terms are contiguous ranges of rows)
+  RNSystemOfEquations equations(n);
+  if (nested_dissection) equations.SetGridResolution(xres, yres);
+  RNScalar saved_weights[3] = { inertia_weight, smoothness_weight, tangent_weight };
+  int term_starts[SWEEP_NUM_TERMS+1];
+  inertia_weight = smoothness_weight = tangent_weight = 1;
+  term_starts[SWEEP_INERTIA_TERM] = equations.NEquations();
+  CreateInertiaEquations(equations);
+  term_starts[SWEEP_ANCHOR_TERM] = equations.NEquations();
+  CreateAnchorEquations(equations);
+  term_starts[SWEEP_SMOOTHNESS_TERM] = equations.NEquations();
+  CreateSmoothnessEquations(equations);
+  term_starts[SWEEP_TANGENT_TERM] = equations.NEquations();
+  CreateTangentEquations(equations);
+  term_starts[SWEEP_FIXED_TERM] = equations.NEquations();
+  CreateDUVEquations(equations);
+  term_starts[SWEEP_NUM_TERMS] = equations.NEquations();
+  inertia_weight = saved_weights[0];
+  smoothness_weight = saved_weights[1];
+  tangent_weight = saved_weights[2];
+
+  // Anchor one pixel in every job if there are no depths to preserve (as in single runs)
+  if (term_starts[SWEEP_ANCHOR_TERM] == term_starts[SWEEP_INERTIA_TERM]) {
+    for (int j = 0; j < njobs; j++) jobs[j].weights[SWEEP_ANCHOR_TERM] = 1;
+  }
+
+  // Assemble normal equations of each term once
+  SweepData sweep_data;
+  int nnz = equations.NormalMatrixNNonzeros();
+  double *zero = new double [ n ];
+  for (int i = 0; i < n; i++) zero[i] = 0;
+  for (int k = 0; k < SWEEP_NUM_TERMS; k++) {
+    sweep_data.JTJ[k] = new RNScalar [ nnz ];
+    sweep_data.JTr[k] = new RNScalar [ n ];
+    equations.EvaluateNormalEquations(zero, sweep_data.JTJ[k], sweep_data.JTr[k], term_starts[k], term_starts[k+1]);
+  }
+
+  // Allocate temporary data for each thread (including one factorization cache)
+  int nthreads = (max_threads > 0) ? max_threads : RNNumProcessors();
+  if (nthreads > njobs) nthreads = njobs;
+  if (nthreads < 1) nthreads = 1;
+  sweep_data.choleskies = new RNCSparseCholesky [ nthreads ];
+  sweep_data.thread_JTJ = new RNScalar * [ nthreads ];
+  sweep_data.thread_x = new RNScalar * [ nthreads ];
+  for (int t = 0; t < nthreads; t++) {
+    if (solver == RN_CSPARSE_SUPERNODAL_SOLVER) sweep_data.choleskies[t].SetSupernodal(TRUE);
+    sweep_data.thread_JTJ[t] = new RNScalar [ nnz ];
+    sweep_data.thread_x[t] = new RNScalar [ n ];
+  }
+
+  // Solve rounds of one job per thread, and then write their depth images from this thread
+  sweep_data.equations = &equations;
+  sweep_data.jobs = jobs;
+  sweep_data.njobs = njobs;
+  int nfailures = 0;
+  for (int first_job = 0; first_job < njobs; first_job += nthreads) {
+    // Solve jobs in this round
+    sweep_data.first_job = first_job;
+    RNRunThreads(nthreads, SolveSweepJob, &sweep_data);
+
+    // Write depth images in job order
+    for (int t = 0; (t < nthreads) && (first_job + t < njobs); t++) {
+      SweepJob *job = &jobs[first_job + t];
+      if (job->status) {
+        R2Grid image(xres, yres);
+        for (int i = 0; i < n; i++) image.SetGridValue(i, sweep_data.thread_x[t][i]);
+        job->status = WriteImage(&image, job->output_filename, png_depth_scale, 0, print_verbose);
+      }
+      else {
+        fprintf(stderr, "Unable to solve for %s\n", job->output_filename);
+      }
+      if (!job->status) nfailures++;
+    }
+  }
+
+  // Print statistics
+  if (print_verbose) {
+    printf("Solved parameter sweep ...\n");
+    printf("  Time = %.2f seconds\n", start_time.Elapsed());
+    printf("  # Variables = %d\n", equations.NVariables());
+    printf("  # Equations = %d\n", equations.NEquations());
+    printf("  # Jobs = %d\n", njobs);
+    printf("  # Failures = %d\n", nfailures);
+    fflush(stdout);
+  }
+
+  // Delete stuff
+  for (int k = 0; k < SWEEP_NUM_TERMS; k++) {
+    delete [] sweep_data.JTJ[k];
+    delete [] sweep_data.JTr[k];
+  }
+  for (int t = 0; t < nthreads; t++) {
+    delete [] sweep_data.thread_JTJ[t];
+    delete [] sweep_data.thread_x[t];
+  }
+  delete [] sweep_data.thread_JTJ;
+  delete [] sweep_data.thread_x;
+  delete [] sweep_data.choleskies;
+  delete [] zero;
+  delete [] jobs;
+
+  // Return whether all jobs succeeded
+  return (nfailures == 0) ? 1 : 0;
+}
+
+
+
 ////////////////////////////////////////////////////////////////////////
 // Program argument parsing
 ////////////////////////////////////////////////////////////////////////
@@ -1307,6 +2466,19 @@ ParseArgs(int argc, char **argv)
       else if (!strcmp(*argv, "-ceres")) solver = RN_CERES_SOLVER;
       else if (!strcmp(*argv, "-splm")) solver = RN_SPLM_SOLVER;
       else if (!strcmp(*argv, "-csparse")) solver = RN_CSPARSE_SOLVER;
+      else if (!strcmp(*argv, "-pcg")) solver = RN_PCG_SOLVER;
+      else if (!strcmp(*argv, "-supernodal")) solver = RN_CSPARSE_SUPERNODAL_SOLVER;
+      else if (!strcmp(*argv, "-nested_dissection")) nested_dissection = 1;
+      else if (!strcmp(*argv, "-mixed_precision")) mixed_precision = 1;
+      else if (!strcmp(*argv, "-tolerance")) { argc--; argv++; solver_tolerance = atof(*argv); }
+      else if (!strcmp(*argv, "-pcg_tolerance")) { argc--; argv++; pcg_tolerance = atof(*argv); }
+      else if (!strcmp(*argv, "-max_iterations")) { argc--; argv++; solver_max_iterations = atoi(*argv); }
+      else if (!strcmp(*argv, "-multigrid")) multigrid_levels = 4;
+      else if (!strcmp(*argv, "-threads")) { argc--; argv++; max_threads = atoi(*argv); }
+      else if (!strcmp(*argv, "-batch")) { argc--; argv++; batch_filename = *argv; }
+      else if (!strcmp(*argv, "-warm_start")) warm_start = 1;
+      else if (!strcmp(*argv, "-sweep")) { argc--; argv++; sweep_filename = *argv; }
+      else if (!strcmp(*argv, "-multigrid_levels")) { argc--; argv++; multigrid_levels = atoi(*argv); }
       else if (!strcmp(*argv, "-input_normals")) { argc--; argv++; input_normals_filename = *argv; }
       else if (!strcmp(*argv, "-input_derivatives")) { argc--; argv++; input_duv_filename = *argv; }
       else if (!strcmp(*argv, "-input_duv")) { argc--; argv++; input_duv_filename = *argv; }
@@ -1325,6 +2497,7 @@ ParseArgs(int argc, char **argv)
       else if (!strcmp(*argv, "-input_range_weight")) { argc--; argv++; input_range_weight_filename = *argv; }
       else if (!strcmp(*argv, "-output_plot")) { argc--; argv++; output_plot_filename = *argv; }
       else if (!strcmp(*argv, "-true_depth")) { argc--; argv++; true_depth_filename = *argv; }
+      else if (!strcmp(*argv, "-pose")) { argc--; argv++; input_pose_filename = *argv; }
       else if (!strcmp(*argv, "-fx")) { argc--; argv++; camera_intrinsics[0][0] = atof(*argv); }
       else if (!strcmp(*argv, "-fy")) { argc--; argv++; camera_intrinsics[1][1] = atof(*argv); }
       else if (!strcmp(*argv, "-cx")) { argc--; argv++; camera_intrinsics[0][2] = atof(*argv); }
@@ -1360,10 +2533,17 @@ ParseArgs(int argc, char **argv)
   }
 
   // Check program arguments
-  if (!input_depth_filename || !output_depth_filename) {
+  if (!batch_filename && (!input_depth_filename || (!output_depth_filename && !sweep_filename))) {
     printf("Usage: depth2depth inputdepth outputdepth [options]\n");
+    printf("       depth2depth inputdepth -sweep weightsfile [options]\n");
+    printf("       depth2depth -batch manifest [options]\n");
     return 0;
   }
+
+  // Check that mixed precision applies to some solve (it only replaces the PCG solver)
+  if (mixed_precision && (solver != RN_PCG_SOLVER) && (multigrid_levels <= 1) && !(warm_start && batch_filename)) {
+    fprintf(stderr, "Warning: -mixed_precision has no effect without -pcg, -multigrid, or -batch with -warm_start\n");
+  }
   
   // Return OK status 
   return 1;
@@ -1381,9 +2561,24 @@ main(int argc, char **argv)
   // Parse program arguments
   if (!ParseArgs(argc, argv)) exit(-1);
 
+  // Use the same number of threads for grid operations as for equations
+  R2SetGridMaxThreads(max_threads);
+
+  // Process batch of jobs listed in manifest
+  if (batch_filename) {
+    if (!ProcessBatch(batch_filename)) exit(-1);
+    return 0;
+  }
+
   // Read inputs
   if (!ReadInputs()) exit(-1);
 
+  // Solve for depth images with weights listed in sweep file
+  if (sweep_filename) {
+    if (!SweepDepthImages(sweep_filename)) exit(-1);
+    return 0;
+  }
+
   // Create images
   if (!CreateDepthImage()) exit(-1);
 
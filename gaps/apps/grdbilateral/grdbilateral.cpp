@@ -0,0 +1,182 @@
+// Source file for the program that checks the fast bilateral filter against the exact one
+
+
+
+////////////////////////////////////////////////////////////////////////
+// Include files 
+////////////////////////////////////////////////////////////////////////
+
+#include "R2Shapes/R2Shapes.h"
+
+
+
+////////////////////////////////////////////////////////////////////////
+// Program arguments
+////////////////////////////////////////////////////////////////////////
+
+static const char *input_grid_filename = NULL;
+static RNScalar grid_sigmas[64];
+static int ngrid_sigmas = 0;
+static RNScalar value_sigma = -1;
+static RNBoolean value_sigma_is_fraction = FALSE;
+static RNScalar max_error = -1;
+static int max_threads = 1;
+static int print_verbose = 0;
+
+
+
+////////////////////////////////////////////////////////////////////////
+// Comparison functions
+////////////////////////////////////////////////////////////////////////
+
+static int
+CompareFilters(const R2Grid& input, RNLength grid_sigma)
+{
+  // Filter with exact bilateral filter
+  R2Grid exact(input);
+  RNTime exact_time;
+  exact_time.Read();
+  exact.BilateralFilter(grid_sigma, value_sigma, value_sigma_is_fraction, FALSE);
+  RNScalar exact_seconds = exact_time.Elapsed();
+
+  // Filter with fast bilateral filter
+  R2Grid fast(input);
+  RNTime fast_time;
+  fast_time.Read();
+  fast.BilateralFilter(grid_sigma, value_sigma, value_sigma_is_fraction, TRUE);
+  RNScalar fast_seconds = fast_time.Elapsed();
+
+  // Compute errors where the exact result is known
+  RNScalar sum_of_errors = 0;
+  RNScalar maximum_error = 0;
+  int count = 0;
+  for (int i = 0; i < input.NEntries(); i++) {
+    RNScalar value = exact.GridValue(i);
+    if (value == R2_GRID_UNKNOWN_VALUE) continue;
+    RNScalar fast_value = fast.GridValue(i);
+    RNScalar error = (fast_value == R2_GRID_UNKNOWN_VALUE) ? RN_INFINITY : fabs(fast_value - value);
+    if (error > maximum_error) maximum_error = error;
+    sum_of_errors += error;
+    count++;
+  }
+
+  // Compute mean error
+  RNScalar mean_error = (count > 0) ? sum_of_errors / count : 0;
+
+  // Print results
+  printf("%8.2f %10.3f %10.3f %8.1f %12.6g %12.6g\n", grid_sigma, exact_seconds, fast_seconds,
+    (fast_seconds > 0) ? exact_seconds / fast_seconds : 0.0, mean_error, maximum_error);
+
+  // Check mean error
+  if ((max_error >= 0) && (mean_error > max_error)) {
+    fprintf(stderr, "Mean error %g of fast bilateral filter for grid sigma %g exceeds %g\n", mean_error, grid_sigma, max_error);
+    return 0;
+  }
+
+  // Return success
+  return 1;
+}
+
+
+
+static int
+CompareFilters(const char *filename)
+{
+  // Read grid
+  R2Grid input;
+  if (!input.ReadFile(filename)) {
+    fprintf(stderr, "Unable to read grid from %s\n", filename);
+    return 0;
+  }
+
+  // Print header
+  if (print_verbose) {
+    printf("Read grid from %s ...\n", filename);
+    printf("  Resolution = %d %d\n", input.XResolution(), input.YResolution());
+    printf("  Range = %g %g\n", input.Minimum(), input.Maximum());
+  }
+  printf("%8s %10s %10s %8s %12s %12s\n", "sigma", "exact(s)", "fast(s)", "speedup", "mean_error", "max_error");
+
+  // Compare filters for every grid sigma
+  int nfailures = 0;
+  for (int i = 0; i < ngrid_sigmas; i++) {
+    if (!CompareFilters(input, grid_sigmas[i])) nfailures++;
+  }
+
+  // Return whether all comparisons passed
+  return (nfailures == 0) ? 1 : 0;
+}
+
+
+
+////////////////////////////////////////////////////////////////////////
+// Program argument parsing
+////////////////////////////////////////////////////////////////////////
+
+static int 
+ParseArgs(int argc, char **argv)
+{
+  // Parse arguments
+  argc--; argv++;
+  while (argc > 0) {
+    if ((*argv)[0] == '-') {
+      if (!strcmp(*argv, "-v")) print_verbose = 1; 
+      else if (!strcmp(*argv, "-grid_sigma")) { 
+        argc--; argv++; 
+        if (ngrid_sigmas < 64) grid_sigmas[ngrid_sigmas++] = atof(*argv); 
+      }
+      else if (!strcmp(*argv, "-value_sigma")) { argc--; argv++; value_sigma = atof(*argv); }
+      else if (!strcmp(*argv, "-value_sigma_fraction")) { argc--; argv++; value_sigma = atof(*argv); value_sigma_is_fraction = TRUE; }
+      else if (!strcmp(*argv, "-max_error")) { argc--; argv++; max_error = atof(*argv); }
+      else if (!strcmp(*argv, "-threads")) { argc--; argv++; max_threads = atoi(*argv); }
+      else {
+        fprintf(stderr, "Invalid program argument: %s", *argv);
+        exit(1);
+      }
+    }
+    else {
+      if (!input_grid_filename) input_grid_filename = *argv;
+      else { fprintf(stderr, "Invalid program argument: %s", *argv); exit(1); }
+    }
+    argv++; argc--;
+  }
+
+  // Check program arguments
+  if (!input_grid_filename) {
+    printf("Usage: grdbilateral inputgrid [-grid_sigma s]* [-value_sigma s] [-max_error e] [options]\n");
+    return 0;
+  }
+
+  // Use default grid sigmas
+  if (ngrid_sigmas == 0) {
+    grid_sigmas[ngrid_sigmas++] = 1;
+    grid_sigmas[ngrid_sigmas++] = 2;
+    grid_sigmas[ngrid_sigmas++] = 4;
+    grid_sigmas[ngrid_sigmas++] = 8;
+  }
+  
+  // Return OK status 
+  return 1;
+}
+
+
+
+////////////////////////////////////////////////////////////////////////
+// Main program
+////////////////////////////////////////////////////////////////////////
+
+int 
+main(int argc, char **argv)
+{
+  // Parse program arguments
+  if (!ParseArgs(argc, argv)) exit(-1);
+
+  // Set number of threads for grid operations
+  R2SetGridMaxThreads(max_threads);
+
+  // Compare fast and exact bilateral filters
+  if (!CompareFilters(input_grid_filename)) exit(-1);
+
+  // Return success
+  return 0;
+}
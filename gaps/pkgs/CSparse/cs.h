@@ -80,7 +80,9 @@ typedef struct cs_dmperm_results    /* cs_dmperm or cs_scc output */
 } csd ;
 
 int *cs_amd (int order, const cs *A) ;
+int *cs_ndgrid (int xres, int yres, int w) ;
 csn *cs_chol (const cs *A, const css *S) ;
+csn *cs_chol_super (const cs *A, const css *S, int nthreads) ;
 csd *cs_dmperm (const cs *A, int seed) ;
 int cs_droptol (cs *A, double tol) ;
 int cs_dropzeros (cs *A) ;
@@ -94,6 +96,7 @@ int *cs_pinv (const int *p, int n) ;
 int cs_pvec (const int *p, const double *b, double *x, int n) ;
 csn *cs_qr (const cs *A, const css *S) ;
 css *cs_schol (int order, const cs *A) ;
+css *cs_schol_perm (const int *P, const cs *A) ;
 css *cs_sqr (int order, const cs *A, int qr) ;
 cs *cs_symperm (const cs *A, const int *pinv, int values) ;
 int cs_updown (cs *L, int sigma, const cs *C, const int *parent) ;
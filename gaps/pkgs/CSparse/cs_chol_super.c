@@ -0,0 +1,339 @@
+#include "cs.h"
+#ifndef _WIN32
+#include <pthread.h>
+#endif
+/* Supernodal L = chol (A, [pinv parent cp]).  Columns with nested patterns are
+ * grouped into supernodes and factored together with dense kernels (left-looking:
+ * each supernode gathers block updates from its descendants, then is factored
+ * in place).  Independent subtrees of the supernodal elimination tree can be
+ * factored by separate threads.  L has the same pattern and layout as for
+ * cs_chol, so cs_lsolve and cs_ltsolve can be used with it. */
+
+typedef struct cs_super_factor   /* state shared by all threads */
+{
+    const cs *L ;       /* pattern (Lp, Li) and values (Lx) of result */
+    const cs *CT ;      /* lower triangle of permuted A, column-wise */
+    int nsuper ;        /* number of supernodes */
+    int *super ;        /* supernode s has columns super [s] to super [s+1]-1 */
+    int *snode ;        /* snode [j] is supernode containing column j */
+    int *owner ;        /* owner [s] is thread that factors s (-1: serial) */
+    int *head ;         /* head [s] is first descendant with updates for s */
+    int *next ;         /* next [k] is next descendant in same list as k */
+    int *pos ;          /* pos [k] is offset of next row of k to be used */
+} cs_super_factor ;
+
+typedef struct cs_super_thread  /* state of one thread */
+{
+    cs_super_factor *F ;
+    int id ;            /* thread index (-1: serial) */
+    int *map ;          /* map [i] is offset of row i in current supernode */
+    double *W ;         /* workspace for block updates */
+    int nW ;            /* size of W */
+    int *pending ;      /* supernodes to link into lists of other threads */
+    int npending ;
+    int ok ;
+} cs_super_thread ;
+
+/* link supernode k into list of supernode s (or defer if s has another owner) */
+static void cs_super_link (cs_super_thread *T, int k, int s)
+{
+    cs_super_factor *F = T->F ;
+    if (T->id >= 0 && F->owner [s] != T->id)
+    {
+        T->pending [T->npending++] = k ;
+        return ;
+    }
+    F->next [k] = F->head [s] ;
+    F->head [s] = k ;
+}
+
+/* factor supernode s, after all of its descendants have been factored */
+static int cs_super_node (cs_super_thread *T, int s)
+{
+    cs_super_factor *F = T->F ;
+    int f, l, ncols, nrows, *rows, *Lp, *Li, *Cp, *Ci, *map, c, i, j, k, p, pk,
+        fk, ncolsk, nrowsk, *rowsk, ndrow1, ndrow2 ;
+    double *Lx, *Cx, *Xc, *Xk, *W, *Wj, d, b ;
+    Lp = F->L->p ; Li = F->L->i ; Lx = F->L->x ;
+    Cp = F->CT->p ; Ci = F->CT->i ; Cx = F->CT->x ;
+    map = T->map ;
+    f = F->super [s] ; l = F->super [s+1] ;
+    ncols = l - f ;
+    rows = Li + Lp [f] ;            /* pattern of supernode is that of column f */
+    nrows = Lp [f+1] - Lp [f] ;
+    /* --- Assemble A into supernode ---------------------------------------- */
+    for (i = 0 ; i < nrows ; i++) map [rows [i]] = i ;
+    for (c = 0 ; c < ncols ; c++)
+    {
+        Xc = Lx + Lp [f+c] - c ;    /* Xc [i] is L(rows [i], f+c), i >= c */
+        for (i = c ; i < nrows ; i++) Xc [i] = 0 ;
+        for (p = Cp [f+c] ; p < Cp [f+c+1] ; p++) Xc [map [Ci [p]]] += Cx [p] ;
+    }
+    /* --- Apply updates from descendants ----------------------------------- */
+    while ((k = F->head [s]) >= 0)
+    {
+        F->head [s] = F->next [k] ;
+        fk = F->super [k] ;
+        ncolsk = F->super [k+1] - fk ;
+        rowsk = Li + Lp [fk] ;
+        nrowsk = Lp [fk+1] - Lp [fk] ;
+        pk = F->pos [k] ;
+        for (ndrow1 = 0 ; pk + ndrow1 < nrowsk && rowsk [pk+ndrow1] < l ; ndrow1++) ;
+        ndrow2 = nrowsk - pk ;
+        /* W = L (rowsk [pk:], k) * L (rowsk [pk:pk+ndrow1], k)' (lower part) */
+        if (ndrow1 * ndrow2 > T->nW)
+        {
+            T->W = cs_realloc (T->W, ndrow1 * ndrow2, sizeof (double), &(T->ok)) ;
+            if (!T->ok) return (0) ;
+            T->nW = ndrow1 * ndrow2 ;
+        }
+        W = T->W ;
+        for (j = 0 ; j < ndrow1 ; j++)
+        {
+            Wj = W + j * ndrow2 ;
+            for (i = j ; i < ndrow2 ; i++) Wj [i] = 0 ;
+        }
+        for (c = 0 ; c < ncolsk ; c++)
+        {
+            Xk = Lx + Lp [fk+c] - c + pk ;
+            for (j = 0 ; j < ndrow1 ; j++)
+            {
+                b = Xk [j] ;
+                if (b == 0) continue ;
+                Wj = W + j * ndrow2 ;
+                for (i = j ; i < ndrow2 ; i++) Wj [i] += Xk [i] * b ;
+            }
+        }
+        /* subtract W from supernode s */
+        for (j = 0 ; j < ndrow1 ; j++)
+        {
+            c = rowsk [pk+j] - f ;
+            Xc = Lx + Lp [f+c] - c ;
+            Wj = W + j * ndrow2 ;
+            for (i = j ; i < ndrow2 ; i++) Xc [map [rowsk [pk+i]]] -= Wj [i] ;
+        }
+        /* move k to list of supernode containing its next row */
+        F->pos [k] = pk + ndrow1 ;
+        if (F->pos [k] < nrowsk) cs_super_link (T, k, F->snode [rowsk [F->pos [k]]]) ;
+    }
+    /* --- Dense factorization of supernode --------------------------------- */
+    for (c = 0 ; c < ncols ; c++)
+    {
+        Xc = Lx + Lp [f+c] - c ;
+        d = Xc [c] ;
+        if (d <= 0) return (0) ;    /* not positive definite */
+        d = sqrt (d) ;
+        Xc [c] = d ;
+        for (i = c+1 ; i < nrows ; i++) Xc [i] /= d ;
+        for (j = c+1 ; j < ncols ; j++)     /* update rest of supernode */
+        {
+            b = Xc [j] ;
+            if (b == 0) continue ;
+            Xk = Lx + Lp [f+j] - j ;
+            for (i = j ; i < nrows ; i++) Xk [i] -= Xc [i] * b ;
+        }
+    }
+    /* link s to list of supernode containing its first off-diagonal row */
+    F->pos [s] = ncols ;
+    if (ncols < nrows) cs_super_link (T, s, F->snode [rows [ncols]]) ;
+    return (1) ;
+}
+
+/* factor all supernodes owned by one thread, in column order */
+static void *cs_super_run (void *data)
+{
+    cs_super_thread *T = (cs_super_thread *) data ;
+    int s ;
+    for (s = 0 ; s < T->F->nsuper && T->ok ; s++)
+    {
+        if (T->F->owner [s] != T->id) continue ;
+        if (!cs_super_node (T, s)) T->ok = 0 ;
+    }
+    return (NULL) ;
+}
+
+/* assign independent subtrees of the supernodal etree to nthreads threads */
+static int cs_super_partition (cs_super_factor *F, const int *parent, int nthreads)
+{
+    int s, k, t, nsuper, ncand, best, *sparent, *child, *sibling, *cand ;
+    double *work, *load, total, rows ;
+    nsuper = F->nsuper ;
+    for (s = 0 ; s < nsuper ; s++) F->owner [s] = -1 ;
+    if (nthreads <= 1) return (1) ;
+    sparent = cs_malloc (4*nsuper, sizeof (int)) ;
+    work = cs_malloc (nsuper + nthreads, sizeof (double)) ;
+    if (!sparent || !work) { cs_free (sparent) ; cs_free (work) ; return (0) ; }
+    child = sparent + nsuper ; sibling = child + nsuper ; cand = sibling + nsuper ;
+    load = work + nsuper ;
+    /* supernodal etree and work in each subtree (children precede parents) */
+    for (s = 0 ; s < nsuper ; s++) child [s] = -1 ;
+    for (s = 0 ; s < nsuper ; s++)
+    {
+        k = parent [F->super [s+1] - 1] ;
+        sparent [s] = (k >= 0) ? F->snode [k] : -1 ;
+        rows = F->L->p [F->super [s]+1] - F->L->p [F->super [s]] ;
+        work [s] = rows * rows * (F->super [s+1] - F->super [s]) ;
+    }
+    for (s = nsuper-1 ; s >= 0 ; s--)
+    {
+        if (sparent [s] < 0) continue ;
+        sibling [s] = child [sparent [s]] ;
+        child [sparent [s]] = s ;
+    }
+    total = 0 ;
+    for (s = 0 ; s < nsuper ; s++)
+    {
+        if (sparent [s] >= 0) work [sparent [s]] += work [s] ;
+        else total += work [s] ;
+    }
+    /* split largest subtree into its children until there are enough */
+    ncand = 0 ;
+    for (s = 0 ; s < nsuper ; s++) if (sparent [s] < 0) cand [ncand++] = s ;
+    while (ncand > 0 && ncand < 4*nthreads)
+    {
+        for (best = 0, k = 1 ; k < ncand ; k++) if (work [cand [k]] > work [cand [best]]) best = k ;
+        if (work [cand [best]] < total / (4*nthreads)) break ;
+        s = cand [best] ;
+        if (child [s] < 0) break ;
+        cand [best] = cand [--ncand] ;
+        for (k = child [s] ; k >= 0 ; k = sibling [k]) cand [ncand++] = k ;
+    }
+    /* assign subtrees to least loaded thread, largest first */
+    for (t = 0 ; t < nthreads ; t++) load [t] = 0 ;
+    while (ncand > 0)
+    {
+        for (best = 0, k = 1 ; k < ncand ; k++) if (work [cand [k]] > work [cand [best]]) best = k ;
+        s = cand [best] ;
+        cand [best] = cand [--ncand] ;
+        for (t = 0, k = 1 ; k < nthreads ; k++) if (load [k] < load [t]) t = k ;
+        F->owner [s] = t ;
+        load [t] += work [s] ;
+    }
+    /* descendants of assigned subtrees belong to same thread */
+    for (s = nsuper-1 ; s >= 0 ; s--)
+    {
+        if (F->owner [s] < 0 && sparent [s] >= 0 && F->owner [sparent [s]] >= 0)
+        {
+            F->owner [s] = F->owner [sparent [s]] ;
+        }
+    }
+    cs_free (sparent) ;
+    cs_free (work) ;
+    return (1) ;
+}
+
+csn *cs_chol_super (const cs *A, const css *S, int nthreads)
+{
+    int top, i, p, k, n, t, *Li, *Lp, *cp, *pinv, *s, *c, *parent, *iwork ;
+    cs *L, *C, *E, *CT ;
+    csn *N ;
+    cs_super_factor F ;
+    cs_super_thread *T ;
+    if (!CS_CSC (A) || !S || !S->cp || !S->parent) return (NULL) ;
+    n = A->n ;
+    if (nthreads < 1) nthreads = 1 ;
+    N = cs_calloc (1, sizeof (csn)) ;       /* allocate result */
+    c = cs_malloc (2*n, sizeof (int)) ;     /* get int workspace */
+    cp = S->cp ; pinv = S->pinv ; parent = S->parent ;
+    C = pinv ? cs_symperm (A, pinv, 1) : ((cs *) A) ;
+    E = pinv ? C : NULL ;           /* E is alias for A, or a copy E=A(p,p) */
+    if (!N || !c || !C) return (cs_ndone (N, E, c, NULL, 0)) ;
+    s = c + n ;
+    N->L = L = cs_spalloc (n, n, cp [n], 1, 0) ;    /* allocate result */
+    if (!L) return (cs_ndone (N, E, c, NULL, 0)) ;
+    Lp = L->p ; Li = L->i ;
+    /* --- Pattern of L (as in cs_chol) ------------------------------------- */
+    for (k = 0 ; k < n ; k++) Lp [k] = c [k] = cp [k] ;
+    for (k = 0 ; k < n ; k++)
+    {
+        top = cs_ereach (C, k, parent, s, c) ;      /* find pattern of L(k,:) */
+        for ( ; top < n ; top++) Li [c [s [top]]++] = k ;
+        Li [c [k]++] = k ;
+    }
+    Lp [n] = cp [n] ;
+    /* --- Supernodes (consecutive columns with nested patterns) ------------ */
+    iwork = cs_malloc (6*n + 1, sizeof (int)) ;
+    CT = cs_transpose (C, 1) ;      /* CT = lower triangle of C */
+    if (!iwork || !CT)
+    {
+        cs_free (iwork) ; cs_spfree (CT) ;
+        return (cs_ndone (N, E, c, NULL, 0)) ;
+    }
+    F.L = L ; F.CT = CT ;
+    F.super = iwork ; F.snode = iwork + n + 1 ; F.owner = F.snode + n ;
+    F.head = F.owner + n ; F.next = F.head + n ; F.pos = F.next + n ;
+    F.nsuper = 0 ;
+    for (k = 0 ; k < n ; k++)
+    {
+        if (k == 0 || parent [k-1] != k ||
+            Lp [k] - Lp [k-1] != Lp [k+1] - Lp [k] + 1)
+        {
+            F.super [F.nsuper++] = k ;
+        }
+        F.snode [k] = F.nsuper - 1 ;
+    }
+    F.super [F.nsuper] = n ;
+    for (k = 0 ; k < F.nsuper ; k++) F.head [k] = -1 ;
+    /* --- Numeric factorization ------------------------------------------- */
+#ifdef _WIN32
+    nthreads = 1 ;
+#endif
+    T = cs_calloc (nthreads + 1, sizeof (cs_super_thread)) ;
+    if (!T || !cs_super_partition (&F, parent, nthreads))
+    {
+        cs_free (T) ; cs_free (iwork) ; cs_spfree (CT) ;
+        return (cs_ndone (N, E, c, NULL, 0)) ;
+    }
+    for (t = 0 ; t <= nthreads ; t++)
+    {
+        T [t].F = &F ;
+        T [t].id = (t < nthreads && nthreads > 1) ? t : -1 ;
+        T [t].map = cs_malloc (n, sizeof (int)) ;
+        T [t].pending = cs_malloc (F.nsuper, sizeof (int)) ;
+        T [t].ok = (T [t].map && T [t].pending) ;
+    }
+#ifndef _WIN32
+    if (nthreads > 1)               /* factor independent subtrees */
+    {
+        pthread_t *threads = cs_malloc (nthreads, sizeof (pthread_t)) ;
+        int *started = cs_calloc (nthreads, sizeof (int)) ;
+        if (threads && started)
+        {
+            for (t = 1 ; t < nthreads ; t++)
+            {
+                started [t] = !pthread_create (&threads [t], NULL, cs_super_run, &T [t]) ;
+                if (!started [t]) cs_super_run (&T [t]) ;
+            }
+            cs_super_run (&T [0]) ;
+            for (t = 1 ; t < nthreads ; t++) if (started [t]) pthread_join (threads [t], NULL) ;
+        }
+        else
+        {
+            for (t = 0 ; t < nthreads ; t++) T [t].ok = 0 ;
+        }
+        cs_free (threads) ;
+        cs_free (started) ;
+        for (t = 0 ; t < nthreads ; t++)    /* link deferred updates */
+        {
+            for (i = 0 ; i < T [t].npending ; i++)
+            {
+                k = T [t].pending [i] ;
+                cs_super_link (&T [nthreads], k, F.snode [Li [Lp [F.super [k]] + F.pos [k]]]) ;
+            }
+        }
+    }
+#endif
+    for (t = 0 ; t < nthreads && nthreads > 1 ; t++) if (!T [t].ok) T [nthreads].ok = 0 ;
+    if (T [nthreads].ok) cs_super_run (&T [nthreads]) ;    /* factor the rest */
+    p = T [nthreads].ok ;
+    for (t = 0 ; t <= nthreads ; t++)
+    {
+        cs_free (T [t].map) ;
+        cs_free (T [t].W) ;
+        cs_free (T [t].pending) ;
+    }
+    cs_free (T) ;
+    cs_free (iwork) ;
+    cs_spfree (CT) ;
+    return (cs_ndone (N, E, c, NULL, p)) ; /* free E,c; return N (or NULL) */
+}
@@ -0,0 +1,49 @@
+#include "cs.h"
+/* order the nx-by-ny block of the grid at (x0,y0): both halves, then separator */
+static void cs_ndgrid_block (int xres, int x0, int y0, int nx, int ny, int w,
+    int *P, int *k)
+{
+    int x, y, m ;
+    if (nx <= 0 || ny <= 0) return ;
+    if (nx < 2*w+2 && ny < 2*w+2)
+    {
+        for (y = y0 ; y < y0 + ny ; y++)    /* small block: natural order */
+        {
+            for (x = x0 ; x < x0 + nx ; x++) P [(*k)++] = y * xres + x ;
+        }
+    }
+    else if (nx >= ny)                      /* split with vertical lines */
+    {
+        m = (nx - w) / 2 ;
+        cs_ndgrid_block (xres, x0, y0, m, ny, w, P, k) ;
+        cs_ndgrid_block (xres, x0 + m + w, y0, nx - m - w, ny, w, P, k) ;
+        for (y = y0 ; y < y0 + ny ; y++)
+        {
+            for (x = x0 + m ; x < x0 + m + w ; x++) P [(*k)++] = y * xres + x ;
+        }
+    }
+    else                                    /* split with horizontal lines */
+    {
+        m = (ny - w) / 2 ;
+        cs_ndgrid_block (xres, x0, y0, nx, m, w, P, k) ;
+        cs_ndgrid_block (xres, x0, y0 + m + w, nx, ny - m - w, w, P, k) ;
+        for (y = y0 + m ; y < y0 + m + w ; y++)
+        {
+            for (x = x0 ; x < x0 + nx ; x++) P [(*k)++] = y * xres + x ;
+        }
+    }
+}
+
+/* P = nested dissection ordering of an xres-by-yres grid, whose node (x,y) is
+ * y*xres+x.  Each block is split along its longer side by a band of w lines,
+ * which separates the halves if no entry of the matrix couples nodes more than
+ * w rows or columns apart.  Blocks too small to split are ordered naturally. */
+int *cs_ndgrid (int xres, int yres, int w)
+{
+    int *P, k = 0 ;
+    if (xres <= 0 || yres <= 0) return (NULL) ;     /* check inputs */
+    P = cs_malloc (xres * yres, sizeof (int)) ;     /* allocate result */
+    if (!P) return (NULL) ;                         /* out of memory */
+    cs_ndgrid_block (xres, 0, 0, xres, yres, CS_MAX (w, 1), P, &k) ;
+    return (P) ;
+}
@@ -2,17 +2,28 @@
 /* ordering and symbolic analysis for a Cholesky factorization */
 css *cs_schol (int order, const cs *A)
 {
-    int n, *c, *post, *P ;
+    int *P ;
+    css *S ;
+    if (!CS_CSC (A)) return (NULL) ;        /* check inputs */
+    P = cs_amd (order, A) ;                 /* P = amd(A+A'), or natural */
+    if (order && !P) return (NULL) ;        /* out of memory */
+    S = cs_schol_perm (P, A) ;              /* symbolic analysis of A(P,P) */
+    cs_free (P) ;
+    return (S) ;
+}
+
+/* symbolic analysis for a Cholesky factorization with a given ordering P */
+css *cs_schol_perm (const int *P, const cs *A)
+{
+    int n, *c, *post ;
     cs *C ;
     css *S ;
     if (!CS_CSC (A)) return (NULL) ;        /* check inputs */
     n = A->n ;
     S = cs_calloc (1, sizeof (css)) ;       /* allocate result S */
     if (!S) return (NULL) ;                 /* out of memory */
-    P = cs_amd (order, A) ;                 /* P = amd(A+A'), or natural */
     S->pinv = cs_pinv (P, n) ;              /* find inverse permutation */
-    cs_free (P) ;
-    if (order && !S->pinv) return (cs_sfree (S)) ;
+    if (P && !S->pinv) return (cs_sfree (S)) ;
     C = cs_symperm (A, S->pinv, 0) ;        /* C = spones(triu(A(P,P))) */
     S->parent = cs_etree (C, 0) ;           /* find etree of C */
     post = cs_post (S->parent, n) ;         /* postorder the etree */
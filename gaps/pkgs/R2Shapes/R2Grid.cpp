@@ -13,6 +13,472 @@
 // Include files
 
 #include "R2Shapes/R2Shapes.h"
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#  define R2_GRID_AVX2
+#  include <immintrin.h>
+#endif
+
+
+
+////////////////////////////////////////////////////////////////////////
+// Row kernels
+////////////////////////////////////////////////////////////////////////
+
+// These kernels apply pointwise operations and reductions to n consecutive
+// grid values.  AVX2 versions handle four values per instruction, selecting
+// results for unknown values with masks instead of branches, on processors
+// that support them (checked at run time).  They return how many values they
+// processed, and scalar loops handle the rest (or all values on other processors).
+
+static const int R2_GRID_MULTIPLY_OPERATION = 3;
+static const int R2_GRID_DIVIDE_OPERATION = 4;
+
+static const int R2_GRID_SUM_REDUCTION = 0;
+static const int R2_GRID_SUM_OF_SQUARES_REDUCTION = 1;
+static const int R2_GRID_MEAN_REDUCTION = 2;
+static const int R2_GRID_DOT_REDUCTION = 0;
+static const int R2_GRID_L1_DISTANCE_REDUCTION = 1;
+static const int R2_GRID_L2_DISTANCE_SQUARED_REDUCTION = 2;
+
+#ifdef R2_GRID_AVX2
+
+#define R2_GRID_AVX2_FUNCTION __attribute__((target("avx2")))
+
+static int
+UseAVX2(void)
+{
+  // Check processor once
+  static int avx2 = -1;
+  if (avx2 < 0) avx2 = (__builtin_cpu_supports("avx2")) ? 1 : 0;
+  return avx2;
+}
+
+
+
+R2_GRID_AVX2_FUNCTION static RNScalar
+HorizontalSumAVX2(__m256d x)
+{
+  // Return sum of four values (in fixed order)
+  double v[4];
+  _mm256_storeu_pd(v, x);
+  return (v[0] + v[1]) + (v[2] + v[3]);
+}
+
+
+
+R2_GRID_AVX2_FUNCTION static int
+ApplyAVX2(RNScalar *values, int n, RNScalar value, int operation)
+{
+  // Add value to (or multiply by value) known values
+  const __m256d unknown = _mm256_set1_pd(R2_GRID_UNKNOWN_VALUE);
+  const __m256d v = _mm256_set1_pd(value);
+  int i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m256d x = _mm256_loadu_pd(&values[i]);
+    __m256d known = _mm256_cmp_pd(x, unknown, _CMP_NEQ_UQ);
+    __m256d y = (operation == R2_GRID_ADD_OPERATION) ? _mm256_add_pd(x, v) : _mm256_mul_pd(x, v);
+    _mm256_storeu_pd(&values[i], _mm256_blendv_pd(x, y, known));
+  }
+  return i;
+}
+
+
+
+R2_GRID_AVX2_FUNCTION static int
+SubstituteAVX2(RNScalar *values, int n, RNScalar old_value, RNScalar new_value)
+{
+  // Replace old_value with new_value
+  const __m256d o = _mm256_set1_pd(old_value);
+  const __m256d v = _mm256_set1_pd(new_value);
+  int i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m256d x = _mm256_loadu_pd(&values[i]);
+    __m256d match = _mm256_cmp_pd(x, o, _CMP_EQ_OQ);
+    _mm256_storeu_pd(&values[i], _mm256_blendv_pd(x, v, match));
+  }
+  return i;
+}
+
+
+
+R2_GRID_AVX2_FUNCTION static int
+ThresholdAVX2(RNScalar *values, int n, RNScalar threshold, RNScalar low, RNScalar high)
+{
+  // Replace known values with low (high) if less/equal (greater) than threshold
+  const __m256d unknown = _mm256_set1_pd(R2_GRID_UNKNOWN_VALUE);
+  const __m256d t = _mm256_set1_pd(threshold);
+  const __m256d l = _mm256_set1_pd(low);
+  const __m256d h = _mm256_set1_pd(high);
+  const RNBoolean keep_low = (low == R2_GRID_KEEP_VALUE);
+  const RNBoolean keep_high = (high == R2_GRID_KEEP_VALUE);
+  int i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m256d x = _mm256_loadu_pd(&values[i]);
+    __m256d known = _mm256_cmp_pd(x, unknown, _CMP_NEQ_UQ);
+    __m256d below = _mm256_cmp_pd(x, t, _CMP_LE_OQ);
+    __m256d y = _mm256_blendv_pd((keep_high) ? x : h, (keep_low) ? x : l, below);
+    _mm256_storeu_pd(&values[i], _mm256_blendv_pd(x, y, known));
+  }
+  return i;
+}
+
+
+
+R2_GRID_AVX2_FUNCTION static int
+CombineAVX2(RNScalar *values, const RNScalar *values2, int n, int operation)
+{
+  // Combine values where both are known, and set others to unknown
+  const __m256d unknown = _mm256_set1_pd(R2_GRID_UNKNOWN_VALUE);
+  const __m256d zero = _mm256_setzero_pd();
+  const __m256d infinity = _mm256_set1_pd(RN_INFINITY);
+  int i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m256d x = _mm256_loadu_pd(&values[i]);
+    __m256d x2 = _mm256_loadu_pd(&values2[i]);
+    __m256d known = _mm256_and_pd(_mm256_cmp_pd(x, unknown, _CMP_NEQ_UQ), _mm256_cmp_pd(x2, unknown, _CMP_NEQ_UQ));
+    __m256d y;
+    if (operation == R2_GRID_ADD_OPERATION) y = _mm256_add_pd(x, x2);
+    else if (operation == R2_GRID_SUBTRACT_OPERATION) y = _mm256_sub_pd(x, x2);
+    else if (operation == R2_GRID_MULTIPLY_OPERATION) y = _mm256_mul_pd(x, x2);
+    else {
+      // Divide (division by zero gives signed infinity, or zero for zero)
+      __m256d divzero = _mm256_cmp_pd(x2, zero, _CMP_EQ_OQ);
+      __m256d inf = _mm256_blendv_pd(x, infinity, _mm256_cmp_pd(x, zero, _CMP_GT_OQ));
+      inf = _mm256_blendv_pd(inf, _mm256_sub_pd(zero, infinity), _mm256_cmp_pd(x, zero, _CMP_LT_OQ));
+      y = _mm256_blendv_pd(_mm256_div_pd(x, x2), inf, divzero);
+    }
+    _mm256_storeu_pd(&values[i], _mm256_blendv_pd(unknown, y, known));
+  }
+  return i;
+}
+
+
+
+R2_GRID_AVX2_FUNCTION static int
+MaskAVX2(RNScalar *values, const RNScalar *mask, int n)
+{
+  // Set values to zero (unknown) where mask is zero (unknown)
+  const __m256d unknown = _mm256_set1_pd(R2_GRID_UNKNOWN_VALUE);
+  const __m256d zero = _mm256_setzero_pd();
+  int i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m256d x = _mm256_loadu_pd(&values[i]);
+    __m256d m = _mm256_loadu_pd(&mask[i]);
+    x = _mm256_blendv_pd(x, unknown, _mm256_cmp_pd(m, unknown, _CMP_EQ_OQ));
+    x = _mm256_blendv_pd(x, zero, _mm256_cmp_pd(m, zero, _CMP_EQ_OQ));
+    _mm256_storeu_pd(&values[i], x);
+  }
+  return i;
+}
+
+
+
+R2_GRID_AVX2_FUNCTION static int
+RangeAVX2(const RNScalar *values, int n, RNScalar& minimum, RNScalar& maximum)
+{
+  // Find smallest and largest known values
+  const __m256d unknown = _mm256_set1_pd(R2_GRID_UNKNOWN_VALUE);
+  __m256d lo = _mm256_set1_pd(minimum);
+  __m256d hi = _mm256_set1_pd(maximum);
+  int i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m256d x = _mm256_loadu_pd(&values[i]);
+    __m256d known = _mm256_cmp_pd(x, unknown, _CMP_NEQ_UQ);
+    lo = _mm256_blendv_pd(lo, _mm256_min_pd(x, lo), known);
+    hi = _mm256_blendv_pd(hi, _mm256_max_pd(x, hi), known);
+  }
+  double l[4], h[4];
+  _mm256_storeu_pd(l, lo);
+  _mm256_storeu_pd(h, hi);
+  for (int k = 0; k < 4; k++) {
+    if (l[k] < minimum) minimum = l[k];
+    if (h[k] > maximum) maximum = h[k];
+  }
+  return i;
+}
+
+
+
+R2_GRID_AVX2_FUNCTION static int
+SumAVX2(const RNScalar *values, int n, int reduction, RNScalar& sum, int& count)
+{
+  // Sum known values (or their squares), and count them for the mean
+  const __m256d unknown = _mm256_set1_pd(R2_GRID_UNKNOWN_VALUE);
+  const __m256d zero = _mm256_setzero_pd();
+  const __m256d one = _mm256_set1_pd(1.0);
+  __m256d s = zero, c = zero;
+  int i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m256d x = _mm256_loadu_pd(&values[i]);
+    __m256d known = _mm256_cmp_pd(x, unknown, _CMP_NEQ_UQ);
+    __m256d y = _mm256_and_pd(x, known);
+    if (reduction == R2_GRID_SUM_OF_SQUARES_REDUCTION) y = _mm256_mul_pd(y, y);
+    s = _mm256_add_pd(s, y);
+    if (reduction == R2_GRID_MEAN_REDUCTION) c = _mm256_add_pd(c, _mm256_and_pd(one, known));
+  }
+  sum += HorizontalSumAVX2(s);
+  count += (int) HorizontalSumAVX2(c);
+  return i;
+}
+
+
+
+R2_GRID_AVX2_FUNCTION static int
+CompareAVX2(const RNScalar *values, const RNScalar *values2, int n, int reduction, RNScalar& sum)
+{
+  // Sum products, absolute differences, or squared differences where both values are known
+  const __m256d unknown = _mm256_set1_pd(R2_GRID_UNKNOWN_VALUE);
+  const __m256d sign = _mm256_set1_pd(-0.0);
+  __m256d s = _mm256_setzero_pd();
+  int i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m256d x = _mm256_loadu_pd(&values[i]);
+    __m256d x2 = _mm256_loadu_pd(&values2[i]);
+    __m256d known = _mm256_and_pd(_mm256_cmp_pd(x, unknown, _CMP_NEQ_UQ), _mm256_cmp_pd(x2, unknown, _CMP_NEQ_UQ));
+    __m256d y;
+    if (reduction == R2_GRID_DOT_REDUCTION) y = _mm256_and_pd(_mm256_mul_pd(x, x2), known);
+    else {
+      __m256d delta = _mm256_and_pd(_mm256_sub_pd(x, x2), known);
+      if (reduction == R2_GRID_L1_DISTANCE_REDUCTION) y = _mm256_andnot_pd(sign, delta);
+      else y = _mm256_mul_pd(delta, delta);
+    }
+    s = _mm256_add_pd(s, y);
+  }
+  sum += HorizontalSumAVX2(s);
+  return i;
+}
+
+#endif
+
+
+
+static void
+ApplyKernel(RNScalar *values, int n, RNScalar value, int operation)
+{
+  // Add value to (or multiply by value) known values
+  int i = 0;
+#ifdef R2_GRID_AVX2
+  if (UseAVX2()) i = ApplyAVX2(values, n, value, operation);
+#endif
+  for (; i < n; i++) {
+    if (values[i] == R2_GRID_UNKNOWN_VALUE) continue;
+    if (operation == R2_GRID_ADD_OPERATION) values[i] += value;
+    else values[i] *= value;
+  }
+}
+
+
+
+static void
+SubstituteKernel(RNScalar *values, int n, RNScalar old_value, RNScalar new_value)
+{
+  // Replace old_value with new_value
+  int i = 0;
+#ifdef R2_GRID_AVX2
+  if (UseAVX2()) i = SubstituteAVX2(values, n, old_value, new_value);
+#endif
+  for (; i < n; i++) {
+    if (values[i] == old_value) {
+      values[i] = new_value;
+    }
+  }
+}
+
+
+
+static void
+ThresholdKernel(RNScalar *values, int n, RNScalar threshold, RNScalar low, RNScalar high)
+{
+  // Replace known values with low (high) if less/equal (greater) than threshold
+  int i = 0;
+#ifdef R2_GRID_AVX2
+  if (UseAVX2()) i = ThresholdAVX2(values, n, threshold, low, high);
+#endif
+  for (; i < n; i++) {
+    if (values[i] != R2_GRID_UNKNOWN_VALUE) {
+      if (values[i] <= threshold) {
+        if (low != R2_GRID_KEEP_VALUE) values[i] = low;
+      }
+      else {
+        if (high != R2_GRID_KEEP_VALUE) values[i] = high;
+      }
+    }
+  }
+}
+
+
+
+static void
+CombineKernel(RNScalar *values, const RNScalar *values2, int n, int operation)
+{
+  // Combine values where both are known, and set others to unknown
+  int i = 0;
+#ifdef R2_GRID_AVX2
+  if (UseAVX2()) i = CombineAVX2(values, values2, n, operation);
+#endif
+  for (; i < n; i++) {
+    if (values[i] == R2_GRID_UNKNOWN_VALUE) continue;
+    if (values2[i] == R2_GRID_UNKNOWN_VALUE) values[i] = R2_GRID_UNKNOWN_VALUE;
+    else if (operation == R2_GRID_ADD_OPERATION) values[i] += values2[i];
+    else if (operation == R2_GRID_SUBTRACT_OPERATION) values[i] -= values2[i];
+    else if (operation == R2_GRID_MULTIPLY_OPERATION) values[i] *= values2[i];
+    else if (values2[i] != 0) values[i] /= values2[i];
+    else if (values[i] > 0) values[i] = RN_INFINITY;
+    else if (values[i] < 0) values[i] = -RN_INFINITY;
+  }
+}
+
+
+
+static void
+MaskKernel(RNScalar *values, const RNScalar *mask, int n)
+{
+  // Set values to zero (unknown) where mask is zero (unknown)
+  int i = 0;
+#ifdef R2_GRID_AVX2
+  if (UseAVX2()) i = MaskAVX2(values, mask, n);
+#endif
+  for (; i < n; i++) {
+    if (mask[i] == 0) values[i] = 0;
+    else if (mask[i] == R2_GRID_UNKNOWN_VALUE) values[i] = R2_GRID_UNKNOWN_VALUE;
+  }
+}
+
+
+
+static void
+RangeKernel(const RNScalar *values, int n, RNScalar& minimum, RNScalar& maximum)
+{
+  // Find smallest and largest known values
+  int i = 0;
+#ifdef R2_GRID_AVX2
+  if (UseAVX2()) i = RangeAVX2(values, n, minimum, maximum);
+#endif
+  for (; i < n; i++) {
+    if (values[i] == R2_GRID_UNKNOWN_VALUE) continue;
+    if (values[i] < minimum) minimum = values[i];
+    if (values[i] > maximum) maximum = values[i];
+  }
+}
+
+
+
+static RNScalar
+SumKernel(const RNScalar *values, int n, int reduction)
+{
+  // Return sum of known values, sum of their squares, or their mean
+  RNScalar sum = 0;
+  int count = 0;
+  int i = 0;
+#ifdef R2_GRID_AVX2
+  if (UseAVX2()) i = SumAVX2(values, n, reduction, sum, count);
+#endif
+  for (; i < n; i++) {
+    if (values[i] == R2_GRID_UNKNOWN_VALUE) continue;
+    if (reduction == R2_GRID_SUM_OF_SQUARES_REDUCTION) sum += values[i] * values[i];
+    else sum += values[i];
+    count++;
+  }
+  if (reduction != R2_GRID_MEAN_REDUCTION) return sum;
+  else if (count == 0) return 0.0;
+  else return sum / count;
+}
+
+
+
+static RNScalar
+CompareKernel(const RNScalar *values, const RNScalar *values2, int n, int reduction)
+{
+  // Return sum of products, absolute differences, or squared differences where both values are known
+  RNScalar sum = 0;
+  int i = 0;
+#ifdef R2_GRID_AVX2
+  if (UseAVX2()) i = CompareAVX2(values, values2, n, reduction, sum);
+#endif
+  for (; i < n; i++) {
+    if (values[i] == R2_GRID_UNKNOWN_VALUE) continue;
+    if (values2[i] == R2_GRID_UNKNOWN_VALUE) continue;
+    RNScalar delta = values[i] - values2[i];
+    if (reduction == R2_GRID_DOT_REDUCTION) sum += values[i] * values2[i];
+    else if (reduction == R2_GRID_L1_DISTANCE_REDUCTION) sum += fabs(delta);
+    else sum += delta * delta;
+  }
+  return sum;
+}
+
+
+
+////////////////////////////////////////////////////////////////////////
+// Parallel execution
+////////////////////////////////////////////////////////////////////////
+
+// Neighborhood operations are run on bands of rows (or columns) by up to
+// R2GridMaxThreads() threads.  Each band reads neighboring values (its halo)
+// from a copy of the input grid, or only from its own rows or columns, and
+// writes only values in its rows or columns.  So, results do not depend on
+// the number of threads.
+
+static int r2_grid_max_threads = 1;
+static const RNScalar R2_GRID_MIN_THREAD_WORK = 65536;
+
+struct R2GridBands {
+  void (*function)(int start, int end, void *data);
+  int count;
+  void *data;
+};
+
+
+
+int
+R2GridMaxThreads(void)
+{
+  // Return maximum number of threads used by grid operations
+  return r2_grid_max_threads;
+}
+
+
+
+void
+R2SetGridMaxThreads(int max_threads)
+{
+  // Set maximum number of threads used by grid operations (0 for all processors)
+  r2_grid_max_threads = max_threads;
+}
+
+
+
+static void
+RunBandsThread(int thread_index, int nthreads, void *data)
+{
+  // Call function for band of this thread
+  R2GridBands *bands = (R2GridBands *) data;
+  int start, end;
+  RNThreadRange(bands->count, thread_index, nthreads, start, end);
+  if (start < end) (*bands->function)(start, end, bands->data);
+}
+
+
+
+static void
+RunBands(int count, RNScalar work_per_item, void (*function)(int start, int end, void *data), void *data)
+{
+  // Call function(start, end, data) for bands [start, end) covering [0, count), 
+  // using at most one thread per R2_GRID_MIN_THREAD_WORK units of work (roughly
+  // one per grid value visited), so that small grids are not split 
+  if (count <= 0) return;
+  int nthreads = (r2_grid_max_threads > 0) ? r2_grid_max_threads : RNNumProcessors();
+  RNScalar work = count * work_per_item;
+  if (nthreads > work / R2_GRID_MIN_THREAD_WORK) nthreads = (int) (work / R2_GRID_MIN_THREAD_WORK);
+  if (nthreads > count) nthreads = count;
+  if (nthreads <= 1) { (*function)(0, count, data); return; }
+
+  // Run bands on threads
+  R2GridBands bands;
+  bands.function = function;
+  bands.count = count;
+  bands.data = data;
+  RNRunThreads(nthreads, RunBandsThread, &bands);
+}
 
 
 
@@ -224,14 +690,7 @@ Range(void) const
   // Find smallest and largest values
   RNScalar minimum = FLT_MAX;
   RNScalar maximum = -FLT_MAX;
-  RNScalar *grid_valuep = grid_values;
-  for (int i = 0; i < grid_size; i++) {
-    if (*grid_valuep != R2_GRID_UNKNOWN_VALUE) {
-      if (*grid_valuep < minimum) minimum = *grid_valuep;
-      if (*grid_valuep > maximum) maximum = *grid_valuep;
-    }
-    grid_valuep++;
-  }
+  RangeKernel(grid_values, grid_size, minimum, maximum);
   return RNInterval(minimum, maximum);
 }
 
@@ -263,13 +722,7 @@ RNScalar R2Grid::
 L1Norm(void) const
 {
   // Return L1 norm of grid
-  RNScalar sum = 0.0;
-  for (int i = 0; i < grid_size; i++) {
-    if (grid_values[i] != R2_GRID_UNKNOWN_VALUE) {
-      sum += grid_values[i];
-    }
-  }
-  return sum;
+  return SumKernel(grid_values, grid_size, R2_GRID_SUM_REDUCTION);
 }
 
 
@@ -278,14 +731,7 @@ RNScalar R2Grid::
 L2Norm(void) const
 {
   // Return L2 norm of grid
-  RNScalar sum = 0.0;
-  for (int i = 0; i < grid_size; i++) {
-    if (grid_values[i] != R2_GRID_UNKNOWN_VALUE) {
-      RNScalar value = grid_values[i];
-      sum += value * value;
-    }
-  }
-  return sqrt(sum);
+  return sqrt(SumKernel(grid_values, grid_size, R2_GRID_SUM_OF_SQUARES_REDUCTION));
 }
 
 
@@ -308,19 +754,8 @@ Cardinality(void) const
 RNScalar R2Grid::
 Mean(void) const
 {
-  // Sum values
-  int count = 0;
-  RNScalar sum = 0;
-  for (int i = 0; i < grid_size; i++) {
-    if (grid_values[i] != R2_GRID_UNKNOWN_VALUE) {
-      sum += grid_values[i];
-      count++;
-    }
-  }
-
-  // Return mean
-  if (count == 0) return 0.0;
-  else return sum / count;
+  // Return mean of known values
+  return SumKernel(grid_values, grid_size, R2_GRID_MEAN_REDUCTION);
 }
 
 
@@ -777,34 +1212,35 @@ Erode(RNLength grid_distance)
 
 
 
-void R2Grid::
-Blur(RNDimension dim, RNLength grid_sigma) 
+struct R2GridBlurData {
+  R2Grid *grid;
+  RNDimension dim;
+  const RNScalar *filter;
+  int filter_radius;
+};
+
+
+
+static void
+BlurBand(int start, int end, void *data)
 {
-  // Build filter
-  RNScalar sigma = grid_sigma;
-  int filter_radius = (int) (3 * sigma + 0.5);
-  RNScalar *filter = new RNScalar [ filter_radius + 1 ];
-  assert(filter);
+  // Get convenient variables
+  R2GridBlurData *blur_data = (R2GridBlurData *) data;
+  R2Grid *grid = blur_data->grid;
+  RNDimension dim = blur_data->dim;
+  const RNScalar *filter = blur_data->filter;
+  int filter_radius = blur_data->filter_radius;
 
   // Make buffer for temporary copy of row
-  int res = Resolution(dim);
+  int res = grid->Resolution(dim);
   RNScalar *buffer = new RNScalar [ res ];
   assert(buffer);
 
-  // Fill filter with Gaussian 
-  const RNScalar sqrt_two_pi = sqrt(RN_TWO_PI);
-  double a = sqrt_two_pi * sigma;
-  double fac = 1.0 / (a * a * a);
-  double denom = 2.0 * sigma * sigma;
-  for (int i = 0; i <= filter_radius; i++) {
-    filter[i] = fac * exp(-i * i / denom);
-  }
-
-  // Convolve grid with filter 
-  for (int j = 0; j < Resolution(1-dim); j++) { 
-    for (int i = 0; i < Resolution(dim); i++) 
-      buffer[i] = (dim == RN_X) ? GridValue(i, j) : GridValue(j, i); 
-    for (int i = 0; i < Resolution(dim); i++) { 
+  // Convolve rows (or columns) [start, end) of grid with filter 
+  for (int j = start; j < end; j++) { 
+    for (int i = 0; i < res; i++) 
+      buffer[i] = (dim == RN_X) ? grid->GridValue(i, j) : grid->GridValue(j, i); 
+    for (int i = 0; i < res; i++) { 
       if (buffer[i] == R2_GRID_UNKNOWN_VALUE) continue;
       RNScalar sum = 0;
       RNScalar weight = 0;
@@ -822,7 +1258,7 @@ Blur(RNDimension dim, RNLength grid_sigma)
           weight += filter[m];
         }
       }
-      nsamples = XResolution() - 1 - i;
+      nsamples = res - 1 - i;
       if (nsamples > filter_radius) nsamples = filter_radius;
       for (int m = 1; m <= nsamples; m++) {
         RNScalar value = buffer[i + m];
@@ -833,21 +1269,20 @@ Blur(RNDimension dim, RNLength grid_sigma)
       }
       if (weight > 0) {
         RNScalar value = sum / weight;
-        if (dim == RN_X) SetGridValue(i, j, value);
-        else SetGridValue(j, i, value);
+        if (dim == RN_X) grid->SetGridValue(i, j, value);
+        else grid->SetGridValue(j, i, value);
       }
     }
   }
 
   // Deallocate memory
-  delete [] filter;
   delete [] buffer;
 }
 
 
 
 void R2Grid::
-Blur(RNLength grid_sigma) 
+Blur(RNDimension dim, RNLength grid_sigma) 
 {
   // Build filter
   RNScalar sigma = grid_sigma;
@@ -855,12 +1290,6 @@ Blur(RNLength grid_sigma)
   RNScalar *filter = new RNScalar [ filter_radius + 1 ];
   assert(filter);
 
-  // Make buffer for temporary copy of row
-  int res = XResolution();
-  if (res < YResolution()) res = YResolution();
-  RNScalar *buffer = new RNScalar [ res ];
-  assert(buffer);
-
   // Fill filter with Gaussian 
   const RNScalar sqrt_two_pi = sqrt(RN_TWO_PI);
   double a = sqrt_two_pi * sigma;
@@ -870,79 +1299,170 @@ Blur(RNLength grid_sigma)
     filter[i] = fac * exp(-i * i / denom);
   }
 
-  // Convolve grid with filter in X direction
-  for (int j = 0; j < YResolution(); j++) { 
-    for (int i = 0; i < XResolution(); i++) 
-      buffer[i] = GridValue(i, j); 
-    for (int i = 0; i < XResolution(); i++) { 
-      if (buffer[i] == R2_GRID_UNKNOWN_VALUE) continue;
-      RNScalar sum = 0;
-      RNScalar weight = 0;
-      RNScalar value = buffer[i];
-      if (value != R2_GRID_UNKNOWN_VALUE) {
-        sum += filter[0] * value;
-        weight += filter[0];
-      }
-      int nsamples = i;
-      if (nsamples > filter_radius) nsamples = filter_radius;
-      for (int m = 1; m <= nsamples; m++) {
-        RNScalar value = buffer[i - m];;
-        if (value != R2_GRID_UNKNOWN_VALUE) {
-          sum += filter[m] * value;
-          weight += filter[m];
-        }
-      }
-      nsamples = XResolution() - 1 - i;
-      if (nsamples > filter_radius) nsamples = filter_radius;
-      for (int m = 1; m <= nsamples; m++) {
-        RNScalar value = buffer[i + m];
-        if (value != R2_GRID_UNKNOWN_VALUE) {
-          sum += filter[m] * value;
-          weight += filter[m];
-        }
-      }
-      if (weight > 0) SetGridValue(i, j, sum / weight);
+  // Convolve grid with filter (in bands of rows or columns on multiple threads)
+  R2GridBlurData blur_data;
+  blur_data.grid = this;
+  blur_data.dim = dim;
+  blur_data.filter = filter;
+  blur_data.filter_radius = filter_radius;
+  RunBands(Resolution(1-dim), Resolution(dim) * (2 * filter_radius + 1), BlurBand, &blur_data);
+
+  // Deallocate memory
+  delete [] filter;
+}
+
+
+
+void R2Grid::
+Blur(RNLength grid_sigma) 
+{
+  // Blur in X and Y directions
+  Blur(RN_X, grid_sigma);
+  Blur(RN_Y, grid_sigma);
+}
+
+
+
+struct R2GridRecursiveBlurData {
+  RNScalar *grid_values;
+  int grid_row_size;
+  RNDimension dim;
+  int res;
+  RNScalar B, b1, b2, b3;
+  RNScalar M[3][3];
+};
+
+
+
+static void
+RecursiveBlurBand(int start, int end, void *data)
+{
+  // Get convenient variables
+  R2GridRecursiveBlurData *blur_data = (R2GridRecursiveBlurData *) data;
+  RNScalar *grid_values = blur_data->grid_values;
+  int grid_row_size = blur_data->grid_row_size;
+  RNDimension dim = blur_data->dim;
+  int res = blur_data->res;
+  RNScalar B = blur_data->B;
+  RNScalar b1 = blur_data->b1;
+  RNScalar b2 = blur_data->b2;
+  RNScalar b3 = blur_data->b3;
+  const RNScalar (*M)[3] = blur_data->M;
+
+  // Make buffers for weighted values and weights of one row (with three entries padded on each side)
+  int stride = (dim == RN_X) ? 1 : grid_row_size;
+  RNScalar *values = new RNScalar [ res + 6 ];
+  RNScalar *weights = new RNScalar [ res + 6 ];
+  assert(values && weights);
+  for (int i = 0; i < 3; i++) {
+    values[i] = 0;
+    weights[i] = 0;
+  }
+
+  // Filter rows [start, end) (unknown values have zero weight, and the result is the ratio
+  // of filtered values and filtered weights, i.e., normalized convolution)
+  for (int j = start; j < end; j++) { 
+    RNScalar *row = (dim == RN_X) ? &grid_values[j * grid_row_size] : &grid_values[j];
+
+    // Gather values and weights
+    for (int i = 0; i < res; i++) {
+      RNScalar value = row[i * stride];
+      if (value == R2_GRID_UNKNOWN_VALUE) { values[i+3] = 0; weights[i+3] = 0; }
+      else { values[i+3] = value; weights[i+3] = 1; }
     }
-  }
 
-  // Convolve grid with filter in Y direction
-  for (int j = 0; j < XResolution(); j++) { 
-    for (int i = 0; i < YResolution(); i++) 
-      buffer[i] = GridValue(j, i); 
-    for (int i = 0; i < YResolution(); i++) { 
-      if (buffer[i] == R2_GRID_UNKNOWN_VALUE) continue;
-      RNScalar sum = 0;
-      RNScalar weight = 0;
-      RNScalar value = buffer[i];
-      if (value != R2_GRID_UNKNOWN_VALUE) {
-        sum += filter[0] * value;
-        weight += filter[0];
-      }
-      int nsamples = i;
-      if (nsamples > filter_radius) nsamples = filter_radius;
-      for (int m = 1; m <= nsamples; m++) {
-        RNScalar value = buffer[i - m];
-        if (value != R2_GRID_UNKNOWN_VALUE) {
-          sum += filter[m] * value;
-          weight += filter[m];
-        }
-      }
-      nsamples = YResolution() - 1 - i;
-      if (nsamples > filter_radius) nsamples = filter_radius;
-      for (int m = 1; m <= nsamples; m++) {
-        RNScalar value = buffer[i + m];
-        if (value != R2_GRID_UNKNOWN_VALUE) {
-          sum += filter[m] * value;
-          weight += filter[m];
-        }
-      }
-      if (weight > 0) SetGridValue(j, i, sum / weight);
+    // Filter forward
+    for (int i = 3; i < res + 3; i++) {
+      values[i] = B * values[i] + b1 * values[i-1] + b2 * values[i-2] + b3 * values[i-3];
+      weights[i] = B * weights[i] + b1 * weights[i-1] + b2 * weights[i-2] + b3 * weights[i-3];
+    }
+
+    // Initialize backward filter from end of forward filter
+    for (int i = 0; i < 3; i++) {
+      values[res+3+i] = M[i][0] * values[res+2] + M[i][1] * values[res+1] + M[i][2] * values[res];
+      weights[res+3+i] = M[i][0] * weights[res+2] + M[i][1] * weights[res+1] + M[i][2] * weights[res];
+    }
+
+    // Filter backward
+    for (int i = res + 2; i >= 3; i--) {
+      values[i] = B * values[i] + b1 * values[i+1] + b2 * values[i+2] + b3 * values[i+3];
+      weights[i] = B * weights[i] + b1 * weights[i+1] + b2 * weights[i+2] + b3 * weights[i+3];
+    }
+
+    // Normalize (unknown values stay unknown)
+    for (int i = 0; i < res; i++) {
+      if (row[i * stride] == R2_GRID_UNKNOWN_VALUE) continue;
+      if (weights[i+3] > 0) row[i * stride] = values[i+3] / weights[i+3];
     }
   }
 
   // Deallocate memory
-  delete [] filter;
-  delete [] buffer;
+  delete [] values;
+  delete [] weights;
+}
+
+
+
+void R2Grid::
+RecursiveBlur(RNDimension dim, RNLength grid_sigma) 
+{
+  // Use direct convolution for small sigmas (where it is as fast and more accurate)
+  if (grid_sigma < 2) { Blur(dim, grid_sigma); return; }
+
+  // Compute coefficients of third-order recursive Gaussian filter (Young and van Vliet, 1995)
+  RNScalar sigma = grid_sigma;
+  RNScalar q = (sigma >= 2.5) ? 0.98711 * sigma - 0.96330 : 3.97156 - 4.14554 * sqrt(1.0 - 0.26891 * sigma);
+  RNScalar q2 = q * q;
+  RNScalar q3 = q2 * q;
+  RNScalar b0 = 1.57825 + 2.44413 * q + 1.4281 * q2 + 0.422205 * q3;
+  RNScalar b1 = (2.44413 * q + 2.85619 * q2 + 1.26661 * q3) / b0;
+  RNScalar b2 = -(1.4281 * q2 + 1.26661 * q3) / b0;
+  RNScalar b3 = 0.422205 * q3 / b0;
+  RNScalar B = 1.0 - (b1 + b2 + b3);
+
+  // Compute matrix M mapping last three outputs of forward filter to first three
+  // states of backward filter beyond the end of a row (by running both filters over
+  // the decaying forward response past the end, where all weights are zero)
+  RNScalar M[3][3];
+  int ntail = (int) (10 * sigma) + 32;
+  RNScalar *tail = new RNScalar [ ntail + 6 ];
+  assert(tail);
+  for (int k = 0; k < 3; k++) {
+    for (int i = 0; i < ntail + 6; i++) tail[i] = 0;
+    tail[2-k] = 1;
+    for (int i = 3; i < ntail + 3; i++) tail[i] = b1 * tail[i-1] + b2 * tail[i-2] + b3 * tail[i-3];
+    for (int i = 0; i < 3; i++) tail[ntail + 3 + i] = 0;
+    for (int i = ntail + 2; i >= 3; i--) tail[i] = B * tail[i] + b1 * tail[i+1] + b2 * tail[i+2] + b3 * tail[i+3];
+    for (int i = 0; i < 3; i++) M[i][k] = tail[3+i];
+  }
+  delete [] tail;
+
+  // Filter rows (in bands on multiple threads)
+  R2GridRecursiveBlurData blur_data;
+  blur_data.grid_values = grid_values;
+  blur_data.grid_row_size = grid_row_size;
+  blur_data.dim = dim;
+  blur_data.res = Resolution(dim);
+  blur_data.B = B;
+  blur_data.b1 = b1;
+  blur_data.b2 = b2;
+  blur_data.b3 = b3;
+  for (int i = 0; i < 3; i++) {
+    for (int k = 0; k < 3; k++) {
+      blur_data.M[i][k] = M[i][k];
+    }
+  }
+  RunBands(Resolution(1-dim), 16 * Resolution(dim), RecursiveBlurBand, &blur_data);
+}
+
+
+
+void R2Grid::
+RecursiveBlur(RNLength grid_sigma) 
+{
+  // Blur with recursive filter in X and Y directions (cost is independent of sigma)
+  RecursiveBlur(RN_X, grid_sigma);
+  RecursiveBlur(RN_Y, grid_sigma);
 }
 
 
@@ -964,85 +1484,681 @@ AddNoise(RNScalar sigma_fraction)
 
 
 
-void R2Grid::
-BilateralFilter(RNLength grid_sigma, RNLength value_sigma, RNBoolean value_sigma_is_fraction)
+static void
+BlurBilateralGrid(RNScalar32 *cells, int nlines, int line_stride, int n, int stride)
 {
-  // Make copy of grid
-  R2Grid copy(*this);
+  // Convolve every line of bilateral grid with [1 2 1]/4 (cells have two channels, and boundary cells are zero)
+  for (int k = 0; k < nlines; k++) {
+    RNScalar32 *line = &cells[2 * k * line_stride];
+    RNScalar32 previous[2] = { 0, 0 };
+    for (int i = 0; i < n; i++) {
+      RNScalar32 *cell = &line[2 * i * stride];
+      RNScalar32 *next = (i < n - 1) ? &line[2 * (i + 1) * stride] : NULL;
+      for (int c = 0; c < 2; c++) {
+        RNScalar32 current = cell[c];
+        cell[c] = 0.25F * previous[c] + 0.5F * current + ((next) ? 0.25F * next[c] : 0.0F);
+        previous[c] = current;
+      }
+    }
+  }
+}
 
-  // Determine reasonable value sigma
-  if (value_sigma == -1) {
-    RNInterval range = Range();
-    value_sigma = 0.01 * (range.Max() - range.Min());
+
+
+struct R2GridBilateralGridData {
+  R2Grid *grid;
+  RNScalar32 *cells;
+  int nx, ny, nz;
+  int axis;
+  RNLength grid_sigma;
+  RNScalar value_sigma;
+  RNBoolean value_sigma_is_fraction;
+  RNScalar rmin, vmin;
+};
+
+
+
+static void
+BlurBilateralGridBand(int start, int end, void *data)
+{
+  // Blur lines [start, end) of bilateral grid along axis
+  // (value lines are indexed by cell, x lines by y, and y lines by x)
+  R2GridBilateralGridData *bilateral_data = (R2GridBilateralGridData *) data;
+  RNScalar32 *cells = bilateral_data->cells;
+  int nx = bilateral_data->nx;
+  int ny = bilateral_data->ny;
+  int nz = bilateral_data->nz;
+  if (bilateral_data->axis == 2) {
+    BlurBilateralGrid(&cells[2 * start * nz], end - start, nz, nz, 1);
+  }
+  else if (bilateral_data->axis == 0) {
+    for (int j = start; j < end; j++) BlurBilateralGrid(&cells[2 * j * nx * nz], nz, 1, nx, nz);
   }
+  else {
+    for (int i = start; i < end; i++) BlurBilateralGrid(&cells[2 * i * nz], nz, 1, ny, nx * nz);
+  }
+}
+
+
+
+static void
+SliceBilateralGridBand(int start, int end, void *data)
+{
+  // Get convenient variables
+  R2GridBilateralGridData *bilateral_data = (R2GridBilateralGridData *) data;
+  R2Grid *grid = bilateral_data->grid;
+  const RNScalar *values = grid->GridValues();
+  const RNScalar32 *cells = bilateral_data->cells;
+  int xres = grid->XResolution();
+  int nx = bilateral_data->nx;
+  int nz = bilateral_data->nz;
+  RNLength grid_sigma = bilateral_data->grid_sigma;
+  RNScalar value_sigma = bilateral_data->value_sigma;
+  RNBoolean value_sigma_is_fraction = bilateral_data->value_sigma_is_fraction;
+  RNScalar rmin = bilateral_data->rmin;
+  RNScalar vmin = bilateral_data->vmin;
+
+  // Slice grid at every known value in rows [start, end)
+  for (int j = start; j < end; j++) {
+    RNScalar gy = j / grid_sigma + 1;
+    int iy = (int) gy;
+    RNScalar ty = gy - iy;
+    for (int i = 0; i < xres; i++) {
+      RNScalar value = values[j * xres + i];
+      if (value == R2_GRID_UNKNOWN_VALUE) continue;
+      RNScalar r = (value_sigma_is_fraction) ? log(value) : value;
+      RNScalar gx = i / grid_sigma + 1;
+      RNScalar gz = (r - rmin) / value_sigma + 1;
+      int ix = (int) gx;
+      int iz = (int) gz;
+      RNScalar tx = gx - ix;
+      RNScalar tz = gz - iz;
+      RNScalar sum = 0;
+      RNScalar weight = 0;
+      for (int c = 0; c < 8; c++) {
+        int dx = c & 1, dy = (c >> 1) & 1, dz = (c >> 2) & 1;
+        RNScalar w = ((dx) ? tx : 1 - tx) * ((dy) ? ty : 1 - ty) * ((dz) ? tz : 1 - tz);
+        const RNScalar32 *cell = &cells[2 * (((iy + dy) * nx + (ix + dx)) * nz + (iz + dz))];
+        sum += w * cell[0];
+        weight += w * cell[1];
+      }
+      if (weight > 0) grid->SetGridValue(j * xres + i, vmin + sum / weight);
+      else grid->SetGridValue(j * xres + i, R2_GRID_UNKNOWN_VALUE);
+    }
+  }
+}
+
+
+
+static int
+BilateralGridFilter(R2Grid *grid, RNLength grid_sigma, RNScalar value_sigma, RNBoolean value_sigma_is_fraction)
+{
+  // Approximate bilateral filter by splatting values into a 3D grid sampled at
+  // intervals of the spatial and value sigmas, blurring it, and slicing it with
+  // trilinear interpolation (Paris and Durand, 2006; Chen et al., 2007).  When
+  // value_sigma is a fraction of the value, the value axis is log(value), so that
+  // value_sigma is (approximately) a constant sigma along it.  Returns 0 if the
+  // grid is not worthwhile (small grid_sigma) or cannot be used, in which case
+  // the caller should use the exact filter.
+  if ((grid_sigma < 2) || (value_sigma <= 0)) return 0;
+  int xres = grid->XResolution();
+  int yres = grid->YResolution();
+  const RNScalar *values = grid->GridValues();
+
+  // Compute range of (log) values
+  RNScalar rmin = RN_INFINITY;
+  RNScalar rmax = -RN_INFINITY;
+  RNScalar vmin = RN_INFINITY;
+  for (int i = 0; i < grid->NEntries(); i++) {
+    RNScalar value = values[i];
+    if (value == R2_GRID_UNKNOWN_VALUE) continue;
+    if (value_sigma_is_fraction && (value <= 0)) return 0;
+    RNScalar r = (value_sigma_is_fraction) ? log(value) : value;
+    if (r < rmin) rmin = r;
+    if (r > rmax) rmax = r;
+    if (value < vmin) vmin = value;
+  }
+  if (rmin > rmax) return 1;
+
+  // Compute bilateral grid dimensions (with one empty cell of padding on each side),
+  // checking its size before converting to int (the value extent can be huge)
+  RNScalar xextent = floor((xres - 1) / grid_sigma) + 3;
+  RNScalar yextent = floor((yres - 1) / grid_sigma) + 3;
+  RNScalar zextent = floor((rmax - rmin) / value_sigma) + 3;
+  if (!(xextent * yextent * zextent <= 32 * 1024 * 1024)) return 0;
+  int nx = (int) xextent;
+  int ny = (int) yextent;
+  int nz = (int) zextent;
+
+  // Allocate bilateral grid
+  int ncells = nx * ny * nz;
+  RNScalar32 *cells = new RNScalar32 [ 2 * ncells ];
+  assert(cells);
+  for (int i = 0; i < 2 * ncells; i++) cells[i] = 0;
+
+  // Splat values (relative to minimum, for float precision) and weights into grid
+  for (int j = 0; j < yres; j++) {
+    RNScalar gy = j / grid_sigma + 1;
+    int iy = (int) gy;
+    RNScalar ty = gy - iy;
+    for (int i = 0; i < xres; i++) {
+      RNScalar value = values[j * xres + i];
+      if (value == R2_GRID_UNKNOWN_VALUE) continue;
+      RNScalar r = (value_sigma_is_fraction) ? log(value) : value;
+      RNScalar gx = i / grid_sigma + 1;
+      RNScalar gz = (r - rmin) / value_sigma + 1;
+      int ix = (int) gx;
+      int iz = (int) gz;
+      RNScalar tx = gx - ix;
+      RNScalar tz = gz - iz;
+      for (int c = 0; c < 8; c++) {
+        int dx = c & 1, dy = (c >> 1) & 1, dz = (c >> 2) & 1;
+        RNScalar w = ((dx) ? tx : 1 - tx) * ((dy) ? ty : 1 - ty) * ((dz) ? tz : 1 - tz);
+        RNScalar32 *cell = &cells[2 * (((iy + dy) * nx + (ix + dx)) * nz + (iz + dz))];
+        cell[0] += w * (value - vmin);
+        cell[1] += w;
+      }
+    }
+  }
+
+  // Blur grid along value, x, and y axes (in bands of lines on multiple threads)
+  R2GridBilateralGridData bilateral_data;
+  bilateral_data.grid = grid;
+  bilateral_data.cells = cells;
+  bilateral_data.nx = nx;
+  bilateral_data.ny = ny;
+  bilateral_data.nz = nz;
+  bilateral_data.grid_sigma = grid_sigma;
+  bilateral_data.value_sigma = value_sigma;
+  bilateral_data.value_sigma_is_fraction = value_sigma_is_fraction;
+  bilateral_data.rmin = rmin;
+  bilateral_data.vmin = vmin;
+  for (int k = 0; k < 3; k++) {
+    int axis = (k + 2) % 3;
+    int nlines = (axis == 2) ? nx * ny : ((axis == 0) ? ny : nx);
+    bilateral_data.axis = axis;
+    RunBands(nlines, 2 * nx * ny * nz / nlines, BlurBilateralGridBand, &bilateral_data);
+  }
+
+  // Slice grid at every known value (in bands of rows on multiple threads)
+  RunBands(yres, 16 * xres, SliceBilateralGridBand, &bilateral_data);
+
+  // Deallocate memory
+  delete [] cells;
 
+  // Return success
+  return 1;
+}
+
+
+
+struct R2GridBilateralData {
+  R2Grid *grid;
+  const R2Grid *copy;
+  RNLength grid_sigma;
+  RNScalar value_sigma;
+  RNBoolean value_sigma_is_fraction;
+};
+
+
+
+static void
+BilateralFilterBand(int start, int end, void *data)
+{
   // Get convenient variables
+  R2GridBilateralData *bilateral_data = (R2GridBilateralData *) data;
+  R2Grid *grid = bilateral_data->grid;
+  const R2Grid *copy = bilateral_data->copy;
+  RNLength grid_sigma = bilateral_data->grid_sigma;
+  RNScalar value_sigma = bilateral_data->value_sigma;
+  RNBoolean value_sigma_is_fraction = bilateral_data->value_sigma_is_fraction;
   double grid_denom = -2.0 * grid_sigma * grid_sigma;
   double value_denom = -2.0 * value_sigma * value_sigma;
   RNScalar grid_radius = 3 * grid_sigma;
   int r = (int) (grid_radius + 1);
   int r_squared = r * r;
 
-  // Set every sample to be filter of surrounding region in input grid
-  for (int cy = 0; cy < YResolution(); cy++) {
-    for (int cx = 0; cx < XResolution(); cx++) {
-      // Check if current value is unknown - if so, don't update
-      RNScalar value = copy.GridValue(cx, cy);
-      if (value != R2_GRID_UNKNOWN_VALUE) {
-        if (value_sigma_is_fraction && (value > 0)) {
-          value_denom = -2.0 * value_sigma * value_sigma * value * value;
+  // Set every sample in rows [start, end) to be filter of surrounding region in input grid
+  for (int cy = start; cy < end; cy++) {
+    for (int cx = 0; cx < grid->XResolution(); cx++) {
+      // Check if current value is unknown - if so, don't update
+      RNScalar value = copy->GridValue(cx, cy);
+      if (value != R2_GRID_UNKNOWN_VALUE) {
+        double denom = value_denom;
+        if (value_sigma_is_fraction && (value > 0)) {
+          denom = -2.0 * value_sigma * value_sigma * value * value;
+        }
+        RNScalar sum = 0;
+        RNScalar weight = 0;
+        int ymin = cy - r;
+        int ymax = cy + r;
+        if (ymin < 0) ymin = 0;
+        if (ymax >= grid->YResolution()) ymax = grid->YResolution() - 1;
+        for (int y = ymin; y <= ymax; y++) {
+          int xmin = cx - r;
+          int xmax = cx + r;
+          if (xmin < 0) xmin = 0;
+          if (xmax >= grid->XResolution()) xmax = grid->XResolution() - 1;
+          int dy = y - cy;
+          for (int x = xmin; x <= xmax; x++) {
+            int dx = x - cx;
+            int grid_distance_squared = dx*dx + dy*dy;
+            if (grid_distance_squared > r_squared) continue;
+            RNScalar sample = copy->GridValue(x, y);
+            if (sample == R2_GRID_UNKNOWN_VALUE) continue;
+            RNScalar value_distance_squared = value - sample;
+            value_distance_squared *= value_distance_squared;
+            RNScalar w = exp(grid_distance_squared/grid_denom) * exp(value_distance_squared/denom);
+            sum += w * sample;
+            weight += w;
+          }
+        }
+
+        // Set grid value
+        if (weight == 0) grid->SetGridValue(cx, cy, R2_GRID_UNKNOWN_VALUE);
+        else grid->SetGridValue(cx, cy, sum / weight);
+      }
+    }
+  }
+}
+
+
+
+void R2Grid::
+BilateralFilter(RNLength grid_sigma, RNLength value_sigma, RNBoolean value_sigma_is_fraction, RNBoolean fast)
+{
+  // Determine reasonable value sigma
+  if (value_sigma == -1) {
+    RNInterval range = Range();
+    value_sigma = 0.01 * (range.Max() - range.Min());
+  }
+
+  // Use bilateral grid approximation if requested (cost is independent of grid_sigma)
+  if (fast && BilateralGridFilter(this, grid_sigma, value_sigma, value_sigma_is_fraction)) return;
+
+  // Make copy of grid
+  R2Grid copy(*this);
+
+  // Filter every sample (in bands of rows on multiple threads)
+  R2GridBilateralData bilateral_data;
+  bilateral_data.grid = this;
+  bilateral_data.copy = &copy;
+  bilateral_data.grid_sigma = grid_sigma;
+  bilateral_data.value_sigma = value_sigma;
+  bilateral_data.value_sigma_is_fraction = value_sigma_is_fraction;
+  int r = (int) (3 * grid_sigma + 1);
+  RunBands(YResolution(), XResolution() * (2*r+1) * (2*r+1), BilateralFilterBand, &bilateral_data);
+}
+
+
+
+void R2Grid::
+AnisotropicDiffusion(RNLength grid_sigma, RNLength gradient_sigma)
+{
+  RNAbort("Not implemented");
+}
+
+
+
+static int *
+DiskHalfWidths(RNLength grid_radius)
+{
+  // Compute half width of disk of grid_radius in row dy (for dy = 0 ... r)
+  RNScalar grid_radius_squared = grid_radius * grid_radius;
+  int r = (int) grid_radius;
+  assert(r >= 0);
+  int *half_widths = new int [ r + 1 ];
+  assert(half_widths);
+  for (int dy = 0; dy <= r; dy++) {
+    int w = r;
+    while ((w > 0) && (w*w + dy*dy > grid_radius_squared)) w--;
+    half_widths[dy] = w;
+  }
+  return half_widths;
+}
+
+
+
+struct R2GridMinimumData {
+  int xres, yres;
+  const RNScalar *values;
+  RNScalar *row_minima;
+  RNScalar *minima;
+  int w, dy0, dy1;
+};
+
+
+
+static void
+MinimumRowsBand(int start, int end, void *data)
+{
+  // Get convenient variables
+  R2GridMinimumData *minimum_data = (R2GridMinimumData *) data;
+  int xres = minimum_data->xres;
+  const RNScalar *values = minimum_data->values;
+  RNScalar *row_minima = minimum_data->row_minima;
+  int w = minimum_data->w;
+
+  // Allocate buffers
+  RNScalar *prefix = new RNScalar [ xres + 4*w + 2 ];
+  RNScalar *suffix = new RNScalar [ xres + 4*w + 2 ];
+  assert(prefix && suffix);
+
+  // Compute min over [x-w, x+w] for rows [start, end), using prefix and suffix mins
+  // within blocks of 2w+1 values of the row (padded by w infinite values on each side)
+  int n = 2*w + 1;
+  int npadded = ((xres + 2*w + n - 1) / n) * n;
+  for (int j = start; j < end; j++) {
+    const RNScalar *row = &values[j * xres];
+    for (int i = 0; i < npadded; i++) {
+      int x = i - w;
+      RNScalar value = ((x >= 0) && (x < xres)) ? row[x] : RN_INFINITY;
+      prefix[i] = ((i % n == 0) || (value < prefix[i-1])) ? value : prefix[i-1];
+    }
+    for (int i = npadded-1; i >= 0; i--) {
+      int x = i - w;
+      RNScalar value = ((x >= 0) && (x < xres)) ? row[x] : RN_INFINITY;
+      suffix[i] = ((i % n == n-1) || (value < suffix[i+1])) ? value : suffix[i+1];
+    }
+    RNScalar *row_minimum = &row_minima[j * xres];
+    for (int x = 0; x < xres; x++) {
+      RNScalar a = suffix[x];
+      RNScalar b = prefix[x + 2*w];
+      row_minimum[x] = (a < b) ? a : b;
+    }
+  }
+
+  // Delete temporary memory
+  delete [] prefix;
+  delete [] suffix;
+}
+
+
+
+static void
+MinimumCombineBand(int start, int end, void *data)
+{
+  // Get convenient variables
+  R2GridMinimumData *minimum_data = (R2GridMinimumData *) data;
+  int xres = minimum_data->xres;
+  int yres = minimum_data->yres;
+  const RNScalar *row_minima = minimum_data->row_minima;
+  RNScalar *minima = minimum_data->minima;
+  int dy0 = minimum_data->dy0;
+  int dy1 = minimum_data->dy1;
+
+  // Combine row mins into mins over disk for rows [start, end)
+  for (int j = start; j < end; j++) {
+    RNScalar *minimum = &minima[j * xres];
+    for (int dy = dy0; dy <= dy1; dy++) {
+      for (int k = 0; k < 2; k++) {
+        if ((k == 1) && (dy == 0)) break;
+        int y = (k == 0) ? j + dy : j - dy;
+        if ((y < 0) || (y >= yres)) continue;
+        const RNScalar *row_minimum = &row_minima[y * xres];
+        for (int x = 0; x < xres; x++) {
+          if (row_minimum[x] < minimum[x]) minimum[x] = row_minimum[x];
+        }
+      }
+    }
+  }
+}
+
+
+
+static void
+MinimumFilter(R2Grid *grid, RNLength grid_radius, RNBoolean maximum)
+{
+  // Set every known value to the min (or max) of known values in a disk.  The disk is
+  // decomposed into rows, the min over each row width is computed for all rows with
+  // the van Herk/Gil-Werman algorithm (three comparisons per value, independent of
+  // width), and then the mins over the 2r+1 rows of the disk are combined.
+  int xres = grid->XResolution();
+  int yres = grid->YResolution();
+  int r = (int) grid_radius;
+  assert(r >= 0);
+  int *half_widths = DiskHalfWidths(grid_radius);
+  RNScalar sign = (maximum) ? -1 : 1;
+
+  // Allocate buffers
+  RNScalar *values = new RNScalar [ grid->NEntries() ];
+  RNScalar *row_minima = new RNScalar [ grid->NEntries() ];
+  RNScalar *minima = new RNScalar [ grid->NEntries() ];
+  assert(values && row_minima && minima);
+
+  // Fill buffer with (negated) values, where unknown values are infinite
+  for (int i = 0; i < grid->NEntries(); i++) {
+    RNScalar value = grid->GridValue(i);
+    values[i] = (value == R2_GRID_UNKNOWN_VALUE) ? RN_INFINITY : sign * value;
+    minima[i] = RN_INFINITY;
+  }
+
+  // Process rows of disk in groups with the same half width
+  R2GridMinimumData minimum_data;
+  minimum_data.xres = xres;
+  minimum_data.yres = yres;
+  minimum_data.values = values;
+  minimum_data.row_minima = row_minima;
+  minimum_data.minima = minima;
+  for (int dy0 = 0; dy0 <= r; ) {
+    int w = half_widths[dy0];
+    int dy1 = dy0;
+    while ((dy1 < r) && (half_widths[dy1+1] == w)) dy1++;
+
+    // Compute mins over rows, and then combine them into mins over disk
+    // (in bands of rows on multiple threads)
+    minimum_data.w = w;
+    minimum_data.dy0 = dy0;
+    minimum_data.dy1 = dy1;
+    RunBands(yres, 4 * xres, MinimumRowsBand, &minimum_data);
+    RunBands(yres, 2 * xres * (dy1 - dy0 + 1), MinimumCombineBand, &minimum_data);
+
+    // Advance to next group of rows
+    dy0 = dy1 + 1;
+  }
+
+  // Set every known value (unknown values stay unknown)
+  for (int i = 0; i < grid->NEntries(); i++) {
+    if (grid->GridValue(i) == R2_GRID_UNKNOWN_VALUE) continue;
+    grid->SetGridValue(i, sign * minima[i]);
+  }
+
+  // Delete temporary memory
+  delete [] half_widths;
+  delete [] values;
+  delete [] row_minima;
+  delete [] minima;
+}
+
+
+
+struct R2GridPercentileData {
+  R2Grid *grid;
+  const int *ranks;
+  const RNScalar *sorted_values;
+  const int *half_widths;
+  int nranks;
+  RNLength grid_radius;
+  RNScalar percentile;
+};
+
+
+
+static void
+HistogramPercentileBand(int start, int end, void *data)
+{
+  // Get convenient variables
+  R2GridPercentileData *percentile_data = (R2GridPercentileData *) data;
+  R2Grid *grid = percentile_data->grid;
+  const int *ranks = percentile_data->ranks;
+  const RNScalar *sorted_values = percentile_data->sorted_values;
+  const int *half_widths = percentile_data->half_widths;
+  int nranks = percentile_data->nranks;
+  RNScalar percentile = percentile_data->percentile;
+  int r = (int) percentile_data->grid_radius;
+  int xres = grid->XResolution();
+  int yres = grid->YResolution();
+
+  // Allocate histogram of ranks, with counts for blocks of ranks to speed up search
+  int block_size = (int) sqrt((double) nranks) + 1;
+  int nblocks = nranks / block_size + 1;
+  int *histogram = new int [ nranks ];
+  int *block_histogram = new int [ nblocks ];
+  assert(histogram && block_histogram);
+  for (int i = 0; i < nranks; i++) histogram[i] = 0;
+  for (int i = 0; i < nblocks; i++) block_histogram[i] = 0;
+
+  // Set every sample in rows [start, end) to be Kth percentile of surrounding region in input grid,
+  // sliding the disk along every row and updating the histogram with samples
+  // that enter and leave it (Huang et al., 1979)
+  for (int cy = start; cy < end; cy++) {
+    int ymin = (cy - r < 0) ? 0 : cy - r;
+    int ymax = (cy + r >= yres) ? yres - 1 : cy + r;
+    int nsamples = 0;
+    int block = 0;
+    int nbelow = 0;
+    for (int cx = -1; cx < xres; cx++) {
+      // Update histogram with samples entering (and leaving) disk
+      for (int y = ymin; y <= ymax; y++) {
+        int w = half_widths[(y > cy) ? y - cy : cy - y];
+        const int *row = &ranks[y * xres];
+        int xmin = (cx == -1) ? 0 : cx + w;
+        int xmax = (cx == -1) ? w - 1 : cx + w;
+        if (xmax >= xres) xmax = xres - 1;
+        for (int x = xmin; x <= xmax; x++) {
+          int rank = row[x];
+          if (rank < 0) continue;
+          histogram[rank]++;
+          block_histogram[rank / block_size]++;
+          if (rank / block_size < block) nbelow++;
+          nsamples++;
         }
-        RNScalar sum = 0;
-        RNScalar weight = 0;
-        int ymin = cy - r;
-        int ymax = cy + r;
-        if (ymin < 0) ymin = 0;
-        if (ymax >= YResolution()) ymax = YResolution() - 1;
-        for (int y = ymin; y <= ymax; y++) {
-          int xmin = cx - r;
-          int xmax = cx + r;
-          if (xmin < 0) xmin = 0;
-          if (xmax >= XResolution()) xmax = XResolution() - 1;
-          int dy = y - cy;
-          for (int x = xmin; x <= xmax; x++) {
-            int dx = x - cx;
-            int grid_distance_squared = dx*dx + dy*dy;
-            if (grid_distance_squared > r_squared) continue;
-            RNScalar sample = copy.GridValue(x, y);
-            if (sample == R2_GRID_UNKNOWN_VALUE) continue;
-            RNScalar value_distance_squared = value - sample;
-            value_distance_squared *= value_distance_squared;
-            RNScalar w = exp(grid_distance_squared/grid_denom) * exp(value_distance_squared/value_denom);
-            sum += w * sample;
-            weight += w;
-          }
+        int x = cx - w - 1;
+        if ((x >= 0) && (row[x] >= 0)) {
+          int rank = row[x];
+          histogram[rank]--;
+          block_histogram[rank / block_size]--;
+          if (rank / block_size < block) nbelow--;
+          nsamples--;
         }
+      }
 
-        // Set grid value
-        if (weight == 0) SetGridValue(cx, cy, R2_GRID_UNKNOWN_VALUE);
-        else SetGridValue(cx, cy, sum / weight);
+      // Check if current value is unknown - if so, don't update
+      if (cx < 0) continue;
+      int index = cy * xres + cx;
+      if (ranks[index] < 0) continue;
+
+      // Find sample of percentile rank in histogram (moving from previous block)
+      int k = (int) (percentile * nsamples);
+      if (k < 0) k = 0;
+      else if (k >= nsamples) k = nsamples-1;
+      while (nbelow > k) nbelow -= block_histogram[--block];
+      while (nbelow + block_histogram[block] <= k) nbelow += block_histogram[block++];
+      int rank = block * block_size;
+      int count = nbelow + histogram[rank];
+      while (count <= k) count += histogram[++rank];
+      grid->SetGridValue(index, sorted_values[rank]);
+    }
+
+    // Remove remaining samples from histogram
+    for (int y = ymin; y <= ymax; y++) {
+      int w = half_widths[(y > cy) ? y - cy : cy - y];
+      const int *row = &ranks[y * xres];
+      int xmin = (xres - 1 - w < 0) ? 0 : xres - 1 - w;
+      for (int x = xmin; x < xres; x++) {
+        int rank = row[x];
+        if (rank < 0) continue;
+        histogram[rank]--;
+        block_histogram[rank / block_size]--;
       }
     }
   }
+
+  // Delete temporary memory
+  delete [] histogram;
+  delete [] block_histogram;
 }
 
 
 
-void R2Grid::
-AnisotropicDiffusion(RNLength grid_sigma, RNLength gradient_sigma)
+static void
+HistogramPercentileFilter(R2Grid *grid, RNLength grid_radius, RNScalar percentile)
 {
-  RNAbort("Not implemented");
+  // Get convenient variables
+  const RNScalar *grid_values = grid->GridValues();
+  int grid_size = grid->NEntries();
+  int xres = grid->XResolution();
+  int yres = grid->YResolution();
+  int r = (int) grid_radius;
+  assert(r >= 0);
+  int *half_widths = DiskHalfWidths(grid_radius);
+
+  // Sort distinct known values
+  int nvalues = 0;
+  RNScalar *sorted_values = new RNScalar [ grid_size ];
+  assert(sorted_values);
+  for (int i = 0; i < grid_size; i++) {
+    if (grid_values[i] == R2_GRID_UNKNOWN_VALUE) continue;
+    sorted_values[nvalues++] = grid_values[i];
+  }
+  if (nvalues == 0) { delete [] sorted_values; delete [] half_widths; return; }
+  qsort(sorted_values, nvalues, sizeof(RNScalar), RNCompareScalars);
+  int nranks = 1;
+  for (int i = 1; i < nvalues; i++) {
+    if (sorted_values[i] != sorted_values[nranks-1]) sorted_values[nranks++] = sorted_values[i];
+  }
+
+  // Replace values by their ranks (or -1 for unknown values)
+  int *ranks = new int [ grid_size ];
+  assert(ranks);
+  for (int i = 0; i < grid_size; i++) {
+    if (grid_values[i] == R2_GRID_UNKNOWN_VALUE) { ranks[i] = -1; continue; }
+    int lo = 0, hi = nranks - 1;
+    while (lo < hi) {
+      int mid = (lo + hi) / 2;
+      if (sorted_values[mid] < grid_values[i]) lo = mid + 1;
+      else hi = mid;
+    }
+    ranks[i] = lo;
+  }
+
+  // Filter rows (in bands on multiple threads, each with its own histogram)
+  R2GridPercentileData percentile_data;
+  percentile_data.grid = grid;
+  percentile_data.ranks = ranks;
+  percentile_data.sorted_values = sorted_values;
+  percentile_data.half_widths = half_widths;
+  percentile_data.nranks = nranks;
+  percentile_data.grid_radius = grid_radius;
+  percentile_data.percentile = percentile;
+  RunBands(yres, xres * (4*r + 16), HistogramPercentileBand, &percentile_data);
+
+  // Delete temporary memory
+  delete [] half_widths;
+  delete [] sorted_values;
+  delete [] ranks;
 }
 
 
 
-void R2Grid::
-PercentileFilter(RNLength grid_radius, RNScalar percentile)
-{
-  // Make copy of grid
-  R2Grid copy(*this);
+struct R2GridSortPercentileData {
+  R2Grid *grid;
+  const R2Grid *copy;
+  RNLength grid_radius;
+  RNScalar percentile;
+};
 
+
+
+static void
+SortPercentileBand(int start, int end, void *data)
+{
   // Get convenient variables
+  R2GridSortPercentileData *percentile_data = (R2GridSortPercentileData *) data;
+  R2Grid *grid = percentile_data->grid;
+  const R2Grid *copy = percentile_data->copy;
+  RNLength grid_radius = percentile_data->grid_radius;
+  RNScalar percentile = percentile_data->percentile;
   RNScalar grid_radius_squared = grid_radius * grid_radius;
   int r = (int) grid_radius;
   assert(r >= 0);
@@ -1050,28 +2166,28 @@ PercentileFilter(RNLength grid_radius, RNScalar percentile)
   RNScalar *samples = new RNScalar [ max_samples ];
   assert(samples);
 
-  // Set every sample to be Kth percentile of surrounding region in input grid
-  for (int cy = 0; cy < YResolution(); cy++) {
-    for (int cx = 0; cx < XResolution(); cx++) {
+  // Set every sample in rows [start, end) to be Kth percentile of surrounding region in input grid
+  for (int cy = start; cy < end; cy++) {
+    for (int cx = 0; cx < grid->XResolution(); cx++) {
       // Check if current value is unknown - if so, don't update
-      if (GridValue(cx, cy) != R2_GRID_UNKNOWN_VALUE) {
+      if (grid->GridValue(cx, cy) != R2_GRID_UNKNOWN_VALUE) {
         // Build list of grid values in neighborhood
         int nsamples = 0;
         int ymin = cy - r;
         int ymax = cy + r;
         if (ymin < 0) ymin = 0;
-        if (ymax >= YResolution()) ymax = YResolution() - 1;
+        if (ymax >= grid->YResolution()) ymax = grid->YResolution() - 1;
         for (int y = ymin; y <= ymax; y++) {
           int xmin = cx - r;
           int xmax = cx + r;
           if (xmin < 0) xmin = 0;
-          if (xmax >= XResolution()) xmax = XResolution() - 1;
+          if (xmax >= grid->XResolution()) xmax = grid->XResolution() - 1;
           int dy = y - cy;
           for (int x = xmin; x <= xmax; x++) {
             int dx = x - cx;
             int d_squared = dx*dx + dy*dy;
             if (d_squared > grid_radius_squared) continue;
-            RNScalar sample = copy.GridValue(x, y);
+            RNScalar sample = copy->GridValue(x, y);
             if (sample == R2_GRID_UNKNOWN_VALUE) continue;
             samples[nsamples++] = sample;
           }
@@ -1079,7 +2195,7 @@ PercentileFilter(RNLength grid_radius, RNScalar percentile)
 
         // Check number of grid values in neighborhood
         if (nsamples == 0) {
-          SetGridValue(cx, cy, R2_GRID_UNKNOWN_VALUE);
+          grid->SetGridValue(cx, cy, R2_GRID_UNKNOWN_VALUE);
         }
         else {
           // Sort samples found in neighborhood
@@ -1089,7 +2205,7 @@ PercentileFilter(RNLength grid_radius, RNScalar percentile)
           int index = (int) (percentile * nsamples);
           if (index < 0) index = 0;
           else if (index >= nsamples) index = nsamples-1;
-          SetGridValue(cx, cy, samples[index]);
+          grid->SetGridValue(cx, cy, samples[index]);
         }
       }
     }
@@ -1101,6 +2217,31 @@ PercentileFilter(RNLength grid_radius, RNScalar percentile)
 
 
 
+void R2Grid::
+PercentileFilter(RNLength grid_radius, RNScalar percentile)
+{
+  // Use van Herk/Gil-Werman filter for min and max
+  if (percentile <= 0) { MinimumFilter(this, grid_radius, FALSE); return; }
+  if (percentile >= 1) { MinimumFilter(this, grid_radius, TRUE); return; }
+
+  // Use sliding histogram filter for larger radii (where sorting samples is slower)
+  if (grid_radius >= 3) { HistogramPercentileFilter(this, grid_radius, percentile); return; }
+
+  // Make copy of grid
+  R2Grid copy(*this);
+
+  // Filter rows (in bands on multiple threads)
+  R2GridSortPercentileData percentile_data;
+  percentile_data.grid = this;
+  percentile_data.copy = &copy;
+  percentile_data.grid_radius = grid_radius;
+  percentile_data.percentile = percentile;
+  int r = (int) grid_radius;
+  RunBands(YResolution(), XResolution() * (2*r+1) * (2*r+1) * 4, SortPercentileBand, &percentile_data);
+}
+
+
+
 static int 
 RNCompareScalarPtrs(const void *value1, const void *value2)
 {
@@ -1256,6 +2397,50 @@ MaskNonMaxima(RNLength grid_radius)
 
 
 
+struct R2GridConvolveData {
+  R2Grid *grid;
+  const R2Grid *copy;
+  const RNScalar (*filter)[3];
+  RNDimension dim;
+};
+
+
+
+static void
+ConvolveBand(int start, int end, void *data)
+{
+  // Get convenient variables
+  R2GridConvolveData *convolve_data = (R2GridConvolveData *) data;
+  R2Grid *grid = convolve_data->grid;
+  const R2Grid *copy = convolve_data->copy;
+  const RNScalar (*filter)[3] = convolve_data->filter;
+
+  // Convolve rows [start, end) of grid with 3x3 filter (except boundary rows)
+  if (start < 1) start = 1;
+  if (end > grid->YResolution()-1) end = grid->YResolution()-1;
+  for (int j = start; j < end; j++) { 
+    for (int i = 1; i < grid->XResolution()-1; i++) { 
+      RNScalar value = copy->GridValue(i, j);
+      if (value != R2_GRID_UNKNOWN_VALUE) {
+        RNScalar sum = 0;
+        RNBoolean unknown = FALSE;
+        for (int dj = -1; dj <= 1; dj++) {
+          for (int di = -1; di <= 1; di++) {
+            value = copy->GridValue(i + di, j + dj);
+            if (value == R2_GRID_UNKNOWN_VALUE) { unknown = TRUE; break; }
+            else sum += filter[dj+1][di+1] * value;
+          }
+          if (unknown) break; 
+        }
+        if (unknown) grid->SetGridValue(i, j, R2_GRID_UNKNOWN_VALUE);
+        else grid->SetGridValue(i, j, sum);
+      }
+    }
+  }
+}
+
+
+
 void R2Grid::
 Convolve(const RNScalar filter[3][3]) 
 {
@@ -1272,26 +2457,13 @@ Convolve(const RNScalar filter[3][3])
     SetGridValue(XResolution()-1, j, R2_GRID_UNKNOWN_VALUE);
   }
 
-  // Convolve grid with 3x3 filter
-  for (int j = 1; j < YResolution()-1; j++) { 
-    for (int i = 1; i < XResolution()-1; i++) { 
-      RNScalar value = copy.GridValue(i, j);
-      if (value != R2_GRID_UNKNOWN_VALUE) {
-        RNScalar sum = 0;
-        RNBoolean unknown = FALSE;
-        for (int dj = -1; dj <= 1; dj++) {
-          for (int di = -1; di <= 1; di++) {
-            value = copy.GridValue(i + di, j + dj);
-            if (value == R2_GRID_UNKNOWN_VALUE) { unknown = TRUE; break; }
-            else sum += filter[dj+1][di+1] * value;
-          }
-          if (unknown) break; 
-        }
-        if (unknown) SetGridValue(i, j, R2_GRID_UNKNOWN_VALUE);
-        else SetGridValue(i, j, sum);
-      }
-    }
-  }
+  // Convolve grid with 3x3 filter (in bands of rows on multiple threads)
+  R2GridConvolveData convolve_data;
+  convolve_data.grid = this;
+  convolve_data.copy = &copy;
+  convolve_data.filter = filter;
+  convolve_data.dim = RN_X;
+  RunBands(YResolution(), 10 * XResolution(), ConvolveBand, &convolve_data);
 }
 
 
@@ -1401,12 +2573,45 @@ Laplacian(void)
 
 
 
-void R2Grid::
-Laplacian(RNDimension dim)
+static void
+LaplacianBand(int start, int end, void *data)
 {
+  // Get convenient variables
+  R2GridConvolveData *convolve_data = (R2GridConvolveData *) data;
+  R2Grid *grid = convolve_data->grid;
+  const R2Grid *copy = convolve_data->copy;
+  RNDimension dim = convolve_data->dim;
+
   // Set up 1D Laplacian filter
   const RNScalar filter[3] = { -1, 2, -1 };
 
+  // Convolve rows [start, end) of grid with 3x1 filter (except boundary rows)
+  if (start < 1) start = 1;
+  if (end > grid->YResolution()-1) end = grid->YResolution()-1;
+  for (int j = start; j < end; j++) { 
+    for (int i = 1; i < grid->XResolution()-1; i++) { 
+      RNScalar value = copy->GridValue(i, j);
+      if (value != R2_GRID_UNKNOWN_VALUE) {
+        RNScalar sum = 0;
+        RNBoolean unknown = FALSE;
+        for (int k = -1; k <= 1; k++) {
+          if (dim == 0) value = copy->GridValue(i + k, j);
+          else value = copy->GridValue(i, j + k);
+          if (value == R2_GRID_UNKNOWN_VALUE) { unknown = TRUE; break; }
+          else sum += filter[k+1] * value;
+        }
+        if (unknown) grid->SetGridValue(i, j, R2_GRID_UNKNOWN_VALUE);
+        else grid->SetGridValue(i, j, sum);
+      }
+    }
+  }
+}
+
+
+
+void R2Grid::
+Laplacian(RNDimension dim)
+{
   // Make temporary copy of grid
   R2Grid copy(*this);
 
@@ -1420,24 +2625,13 @@ Laplacian(RNDimension dim)
     SetGridValue(XResolution()-1, j, R2_GRID_UNKNOWN_VALUE);
   }
 
-  // Convolve grid with 3x1 filter
-  for (int j = 1; j < YResolution()-1; j++) { 
-    for (int i = 1; i < XResolution()-1; i++) { 
-      RNScalar value = copy.GridValue(i, j);
-      if (value != R2_GRID_UNKNOWN_VALUE) {
-        RNScalar sum = 0;
-        RNBoolean unknown = FALSE;
-        for (int k = -1; k <= 1; k++) {
-          if (dim == 0) value = copy.GridValue(i + k, j);
-          else value = copy.GridValue(i, j + k);
-          if (value == R2_GRID_UNKNOWN_VALUE) { unknown = TRUE; break; }
-          else sum += filter[k+1] * value;
-        }
-        if (unknown) SetGridValue(i, j, R2_GRID_UNKNOWN_VALUE);
-        else SetGridValue(i, j, sum);
-      }
-    }
-  }
+  // Convolve grid with 3x1 filter (in bands of rows on multiple threads)
+  R2GridConvolveData convolve_data;
+  convolve_data.grid = this;
+  convolve_data.copy = &copy;
+  convolve_data.filter = NULL;
+  convolve_data.dim = dim;
+  RunBands(YResolution(), 4 * XResolution(), LaplacianBand, &convolve_data);
 }
 
 
@@ -1512,11 +2706,7 @@ void R2Grid::
 Substitute(RNScalar old_value, RNScalar new_value) 
 {
   // Replace all instances of old_value with new_value
-  for (int i = 0; i < grid_size; i++) {
-    if (grid_values[i] == old_value) {
-      grid_values[i] = new_value;
-    }
-  }
+  SubstituteKernel(grid_values, grid_size, old_value, new_value);
 }
 
 
@@ -1525,11 +2715,7 @@ void R2Grid::
 Add(RNScalar value) 
 {
   // Add value to all grid values 
-  for (int i = 0; i < grid_size; i++) {
-    if (grid_values[i] != R2_GRID_UNKNOWN_VALUE) {
-      grid_values[i] += value;
-    }
-  }
+  ApplyKernel(grid_values, grid_size, value, R2_GRID_ADD_OPERATION);
 }
 
 
@@ -1542,12 +2728,7 @@ Add(const R2Grid& grid)
   assert(grid_resolution[1] == grid.grid_resolution[1]);
 
   // Add passed grid values to corresponding entries of this grid
-  for (int i = 0; i < grid_size; i++) {
-    if (grid_values[i] != R2_GRID_UNKNOWN_VALUE) {
-      if (grid.grid_values[i] == R2_GRID_UNKNOWN_VALUE) grid_values[i] = R2_GRID_UNKNOWN_VALUE;
-      else grid_values[i] += grid.grid_values[i];
-    }
-  }
+  CombineKernel(grid_values, grid.grid_values, grid_size, R2_GRID_ADD_OPERATION);
 }
 
 
@@ -1569,12 +2750,7 @@ Subtract(const R2Grid& grid)
   assert(grid_resolution[1] == grid.grid_resolution[1]);
 
   // Subtract passed grid values from corresponding entries of this grid
-  for (int i = 0; i < grid_size; i++) {
-    if (grid_values[i] != R2_GRID_UNKNOWN_VALUE) {
-      if (grid.grid_values[i] == R2_GRID_UNKNOWN_VALUE) grid_values[i] = R2_GRID_UNKNOWN_VALUE;
-      else grid_values[i] -= grid.grid_values[i];
-    }
-  }
+  CombineKernel(grid_values, grid.grid_values, grid_size, R2_GRID_SUBTRACT_OPERATION);
 }
 
 
@@ -1583,11 +2759,7 @@ void R2Grid::
 Multiply(RNScalar value) 
 {
   // Multiply grid values by value
-  for (int i = 0; i < grid_size; i++) {
-    if (grid_values[i] != R2_GRID_UNKNOWN_VALUE) {
-      grid_values[i] *= value;
-    }
-  }
+  ApplyKernel(grid_values, grid_size, value, R2_GRID_MULTIPLY_OPERATION);
 }
 
 
@@ -1600,12 +2772,7 @@ Multiply(const R2Grid& grid)
   assert(grid_resolution[1] == grid.grid_resolution[1]);
 
   // Multiply passed grid values by corresponding entries of this grid
-  for (int i = 0; i < grid_size; i++) {
-    if (grid_values[i] != R2_GRID_UNKNOWN_VALUE) {
-      if (grid.grid_values[i] == R2_GRID_UNKNOWN_VALUE) grid_values[i] = R2_GRID_UNKNOWN_VALUE;
-      else grid_values[i] *= grid.grid_values[i];
-    }
-  }
+  CombineKernel(grid_values, grid.grid_values, grid_size, R2_GRID_MULTIPLY_OPERATION);
 }
 
 
@@ -1630,20 +2797,7 @@ Divide(const R2Grid& grid)
   assert(grid_resolution[1] == grid.grid_resolution[1]);
 
   // Divide entries of this grid by by corresponding entries of passed grid 
-  for (int i = 0; i < grid_size; i++) {
-    if (grid_values[i] != R2_GRID_UNKNOWN_VALUE) {
-      if (grid.grid_values[i] == R2_GRID_UNKNOWN_VALUE) {
-       grid_values[i] = R2_GRID_UNKNOWN_VALUE;
-      }
-      else if (grid.grid_values[i] == 0) {
-        if (grid_values[i] > 0) grid_values[i] = RN_INFINITY;
-        else if (grid_values[i] < 0) grid_values[i] = -RN_INFINITY;
-      }
-      else {
-        grid_values[i] /= grid.grid_values[i];
-      }
-    }
-  }
+  CombineKernel(grid_values, grid.grid_values, grid_size, R2_GRID_DIVIDE_OPERATION);
 }
 
 
@@ -1670,10 +2824,7 @@ Mask(const R2Grid& grid)
   assert(grid_resolution[1] == grid.grid_resolution[1]);
 
   // Mask entries of grid
-  for (int i = 0; i < grid_size; i++) {
-    if (grid.grid_values[i] == 0) grid_values[i] = 0;
-    else if (grid.grid_values[i] == R2_GRID_UNKNOWN_VALUE) grid_values[i] = R2_GRID_UNKNOWN_VALUE;
-  }
+  MaskKernel(grid_values, grid.grid_values, grid_size);
 }
 
 
@@ -1699,16 +2850,7 @@ void R2Grid::
 Threshold(RNScalar threshold, RNScalar low, RNScalar high) 
 {
   // Set grid value to low (high) if less/equal (greater) than threshold
-  for (int i = 0; i < grid_size; i++) {
-    if (grid_values[i] != R2_GRID_UNKNOWN_VALUE) {
-      if (grid_values[i] <= threshold) {
-        if (low != R2_GRID_KEEP_VALUE) grid_values[i] = low;
-      }
-      else {
-        if (high != R2_GRID_KEEP_VALUE) grid_values[i] = high;
-      }
-    }
-  }
+  ThresholdKernel(grid_values, grid_size, threshold, low, high);
 }
 
 
@@ -1749,82 +2891,79 @@ SignedDistanceTransform(void)
 
 
 
-void R2Grid::
-SquaredDistanceTransform(void)
+static void
+SquaredDistanceRowsBand(int start, int end, void *data)
 {
-  int x,y,s,t;
-  int dist,square,new_dist;
-  int* oldBuffer;
-  int* newBuffer;
+  int dist,square;
   int first;
-  int i;
-
-  // Allocate temporary buffers
-  int res = XResolution();
-  if (res < YResolution()) res = YResolution();
-  oldBuffer = new int[res];
-  assert(oldBuffer);
-  newBuffer = new int[res];
-  assert(newBuffer);
-
-  // Initalize values (0 if was set, max_value if not)
-  RNScalar max_value = 2 * (res+1) * (res+1);
-  RNScalar *grid_valuesp = grid_values;
-  for (i = 0; i < grid_size; i++) {
-    if (*grid_valuesp == 0.0) *grid_valuesp = max_value;
-    else if (*grid_valuesp == R2_GRID_UNKNOWN_VALUE) *grid_valuesp = max_value;
-    else *grid_valuesp = 0.0;
-    grid_valuesp++;
-  }
+  R2Grid *grid = (R2Grid *) data;
 
-  // Scan along x axis
-  for (y = 0; y < YResolution(); y++) {
+  // Scan rows [start, end) along x axis
+  for (int y = start; y < end; y++) {
     first = 1;
     dist = 0;
-    for (x = 0; x < XResolution(); x++) {
-      if (GridValue(x,y) == 0.0) {
+    for (int x = 0; x < grid->XResolution(); x++) {
+      if (grid->GridValue(x, y) == 0.0) {
         dist=0;
         first=0;
-        SetGridValue(x, y, 0);
+        grid->SetGridValue(x, y, 0);
       }
       else if (first == 0) {
         dist++;
         square = dist*dist;
-        SetGridValue(x, y, square);
+        grid->SetGridValue(x, y, square);
       }
     }
       		
     // backward scan
     dist = 0;
     first = 1;
-    for (x = XResolution()-1; x >= 0; x--) {
-      if (GridValue(x,y) == 0.0) {
+    for (int x = grid->XResolution()-1; x >= 0; x--) {
+      if (grid->GridValue(x, y) == 0.0) {
         dist = 0;
         first = 0;
-        SetGridValue(x, y, 0);
+        grid->SetGridValue(x, y, 0);
       }
       else if (first == 0) {
         dist++;
         square = dist*dist;
-        if (square < GridValue(x, y)) {
-          SetGridValue(x, y, square);
+        if (square < grid->GridValue(x, y)) {
+          grid->SetGridValue(x, y, square);
         }
       }
     }
   }
+}
 
-  // Scan along y axis
-  for (x = 0; x < XResolution(); x++) {
+
+
+static void
+SquaredDistanceColumnsBand(int start, int end, void *data)
+{
+  int s;
+  int dist,new_dist;
+  int* oldBuffer;
+  int* newBuffer;
+  R2Grid *grid = (R2Grid *) data;
+
+  // Allocate temporary buffers
+  oldBuffer = new int[grid->YResolution()];
+  assert(oldBuffer);
+  newBuffer = new int[grid->YResolution()];
+  assert(newBuffer);
+
+  // Scan columns [start, end) along y axis
+  for (int x = start; x < end; x++) {
     // Copy grid values
-    for (y = 0; y < YResolution(); y++) 
-      oldBuffer[y] = (int) (GridValue(x, y) + 0.5);
+    for (int y = 0; y < grid->YResolution(); y++) 
+      oldBuffer[y] = (int) (grid->GridValue(x, y) + 0.5);
       		
     // forward scan
     s = 0;
-    for (y = 0; y < YResolution(); y++) {
+    for (int y = 0; y < grid->YResolution(); y++) {
       dist = oldBuffer[y];
       if (dist) {
-        for (t = s; t <= y ; t++) {
+        for (int t = s; t <= y ; t++) {
           new_dist = oldBuffer[t] + (y - t) * (y - t);
           if (new_dist <= dist){
             dist = new_dist;
@@ -1839,18 +2978,18 @@ SquaredDistanceTransform(void)
     }
   
     // backward scan
-    s = YResolution() - 1;
-    for(y = YResolution()-1; y >=0 ; y--) {
+    s = grid->YResolution() - 1;
+    for (int y = grid->YResolution()-1; y >=0 ; y--) {
       dist = newBuffer[y];
       if (dist) {
-        for (t = s; t > y ; t--) {
+        for (int t = s; t > y ; t--) {
           new_dist = oldBuffer[t] + (y - t) * (y - t);
           if (new_dist <= dist){
             dist = new_dist;
             s = t;
           }
         }
-        SetGridValue(x, y, dist);
+        grid->SetGridValue(x, y, dist);
       }
       else { 
         s = y; 
@@ -1865,6 +3004,30 @@ SquaredDistanceTransform(void)
 
 
 
+void R2Grid::
+SquaredDistanceTransform(void)
+{
+  int i;
+
+  // Initalize values (0 if was set, max_value if not)
+  int res = XResolution();
+  if (res < YResolution()) res = YResolution();
+  RNScalar max_value = 2 * (res+1) * (res+1);
+  RNScalar *grid_valuesp = grid_values;
+  for (i = 0; i < grid_size; i++) {
+    if (*grid_valuesp == 0.0) *grid_valuesp = max_value;
+    else if (*grid_valuesp == R2_GRID_UNKNOWN_VALUE) *grid_valuesp = max_value;
+    else *grid_valuesp = 0.0;
+    grid_valuesp++;
+  }
+
+  // Scan along x axis, and then along y axis (in bands of rows or columns on multiple threads)
+  RunBands(YResolution(), 4 * XResolution(), SquaredDistanceRowsBand, this);
+  RunBands(XResolution(), 4 * YResolution(), SquaredDistanceColumnsBand, this);
+}
+
+
+
 void R2Grid::
 Voronoi(R2Grid *squared_distance_grid)
 {
@@ -2529,13 +3692,7 @@ Dot(const R2Grid& grid) const
   assert(grid_resolution[1] == grid.grid_resolution[1]);
 
   // Compute dot product between this and grid
-  RNScalar dot = 0.0;
-  for (int i = 0; i < grid_size; i++) {
-    if (grid_values[i] == R2_GRID_UNKNOWN_VALUE) continue;
-    if (grid.grid_values[i] == R2_GRID_UNKNOWN_VALUE) continue;
-    dot += grid_values[i] * grid.grid_values[i];
-  }
-  return dot;
+  return CompareKernel(grid_values, grid.grid_values, grid_size, R2_GRID_DOT_REDUCTION);
 }
 
 
@@ -2544,13 +3701,7 @@ RNScalar R2Grid::
 L1Distance(const R2Grid& grid) const
 {
   // Compute distance between this and grid
-  RNScalar distance = 0.0;
-  for (int i = 0; i < grid_size; i++) {
-    if (grid_values[i] == R2_GRID_UNKNOWN_VALUE) continue;
-    if (grid.grid_values[i] == R2_GRID_UNKNOWN_VALUE) continue;
-    distance += fabs(grid_values[i] - grid.grid_values[i]);
-  }
-  return distance;
+  return CompareKernel(grid_values, grid.grid_values, grid_size, R2_GRID_L1_DISTANCE_REDUCTION);
 }
 
 
@@ -2559,16 +3710,7 @@ RNScalar R2Grid::
 L2DistanceSquared(const R2Grid& grid) const
 {
   // Compute distance between this and grid
-  RNScalar distance_squared = 0.0;
-  for (int i = 0; i < grid_size; i++) {
-    if (grid_values[i] == R2_GRID_UNKNOWN_VALUE) continue;
-    if (grid.grid_values[i] == R2_GRID_UNKNOWN_VALUE) continue;
-    RNScalar delta = (grid_values[i] - grid.grid_values[i]);
-    distance_squared += delta * delta;
-  }
-
-  // Return result
-  return distance_squared;
+  return CompareKernel(grid_values, grid.grid_values, grid_size, R2_GRID_L2_DISTANCE_SQUARED_REDUCTION);
 }
 
 
@@ -79,9 +79,11 @@ public:
   void Erode(RNScalar grid_distance);
   void Blur(RNScalar grid_sigma = 2);
   void Blur(RNDimension dim, RNScalar grid_sigma);
+  void RecursiveBlur(RNScalar grid_sigma = 2);
+  void RecursiveBlur(RNDimension dim, RNScalar grid_sigma);
   void AddNoise(RNScalar sigma_fraction = 0.05);
   void HarrisCornerFilter(int grid_radius = 3, RNScalar kappa = 0.05);
-  void BilateralFilter(RNLength grid_sigma = 2, RNScalar value_sigma = -1, RNBoolean value_sigma_is_fraction = FALSE);
+  void BilateralFilter(RNLength grid_sigma = 2, RNScalar value_sigma = -1, RNBoolean value_sigma_is_fraction = FALSE, RNBoolean fast = FALSE);
   void AnisotropicDiffusion(RNLength grid_sigma = 2, RNScalar gradient_sigma = -1);
   void PercentileFilter(RNLength grid_radius, RNScalar percentile);
   void MinFilter(RNLength grid_radius);
@@ -234,6 +236,13 @@ const int R2_GRID_REPLACE_OPERATION = 2;
 
 
 
+// Thread functions (neighborhood operations run on up to max_threads threads, 0 for all processors)
+
+int R2GridMaxThreads(void);
+void R2SetGridMaxThreads(int max_threads);
+
+
+
 // Inline functions
 
 inline int R2Grid::
@@ -0,0 +1,269 @@
+/* Source file for GAPS arena (bump) allocator */
+
+
+
+/* Include files */
+
+#include "RNBasics.h"
+#if (RN_OS == RN_WINDOWS)
+#   include <malloc.h>
+#endif
+
+
+
+/* Private variables */
+
+/* Arena memory starts 8 bytes past a 16-byte boundary, and heap memory 
+   allocated by RNArenaNew starts on a 16-byte boundary, so RNArenaDelete 
+   can tell them apart by address alone (without a prefix) */
+#define RN_ARENA_ALIGNMENT 16
+#define RN_ARENA_TAG_OFFSET 8
+
+#if (RN_OS == RN_WINDOWS)
+static __declspec(thread) RNArena *RNcurrent_arena = NULL;
+#else
+static __thread RNArena *RNcurrent_arena = NULL;
+#endif
+
+
+
+/* Private functions */
+
+static void *
+AllocateAligned(size_t size)
+{
+    /* Allocate heap memory starting on an RN_ARENA_ALIGNMENT boundary */
+#if (RN_OS == RN_WINDOWS)
+    return _aligned_malloc(size, RN_ARENA_ALIGNMENT);
+#else
+    void *data = NULL;
+    if (posix_memalign(&data, RN_ARENA_ALIGNMENT, size) != 0) return NULL;
+    return data;
+#endif
+}
+
+
+
+static void
+FreeAligned(void *data)
+{
+    /* Free memory allocated by AllocateAligned */
+#if (RN_OS == RN_WINDOWS)
+    _aligned_free(data);
+#else
+    free(data);
+#endif
+}
+
+
+
+RNArena::
+RNArena(size_t block_size)
+    : blocks(NULL),
+      sorted_blocks(NULL),
+      nblocks(0),
+      nblocks_allocated(0),
+      current(NULL),
+      remaining(0),
+      block_size(block_size),
+      nbytes(0)
+{
+    /* Initialize lists of released memory */
+    for (int i = 0; i < max_free_lists; i++) free_lists[i] = NULL;
+}
+
+
+
+RNArena::
+~RNArena(void)
+{
+    /* Release all blocks */
+    Empty();
+
+    /* Delete table of blocks */
+    if (sorted_blocks) delete [] sorted_blocks;
+}
+
+
+
+void *RNArena::
+Allocate(size_t size)
+{
+    /* Round size up to alignment (so every allocation starts RN_ARENA_TAG_OFFSET past a boundary) */
+    size = (size + RN_ARENA_ALIGNMENT - 1) & ~((size_t) RN_ARENA_ALIGNMENT - 1);
+    const size_t header_size = ((sizeof(Block) + RN_ARENA_ALIGNMENT - 1) & ~((size_t) RN_ARENA_ALIGNMENT - 1)) + RN_ARENA_TAG_OFFSET;
+
+    /* Reuse released memory of same size */
+    size_t list = size / RN_ARENA_ALIGNMENT - 1;
+    if ((size > 0) && (list < max_free_lists) && free_lists[list]) {
+        void *data = free_lists[list];
+        free_lists[list] = *((void **) data);
+        nbytes += size;
+        return data;
+    }
+
+    /* Large requests get their own block, so the current block is not wasted */
+    if (4 * size > block_size) {
+        Block *block = (Block *) AllocateAligned(header_size + size);
+        if (!block) { RNAbort("Unable to allocate %lu bytes from arena", (unsigned long) size); return NULL; }
+        block->size = header_size + size;
+        if (blocks) { block->next = blocks->next; blocks->next = block; }
+        else { block->next = NULL; blocks = block; }
+        InsertBlock(block);
+        nbytes += size;
+        return (char *) block + header_size;
+    }
+
+    /* Start a new block if the current one is full */
+    if (size > remaining) {
+        Block *block = (Block *) AllocateAligned(header_size + block_size);
+        if (!block) { RNAbort("Unable to allocate %lu bytes for arena", (unsigned long) block_size); return NULL; }
+        block->size = header_size + block_size;
+        block->next = blocks;
+        blocks = block;
+        InsertBlock(block);
+        current = (char *) block + header_size;
+        remaining = block_size;
+    }
+
+    /* Bump pointer */
+    void *data = current;
+    current += size;
+    remaining -= size;
+    nbytes += size;
+    return data;
+}
+
+
+
+void RNArena::
+Release(void *data, size_t size)
+{
+    /* Round size up to alignment (as in Allocate) */
+    size = (size + RN_ARENA_ALIGNMENT - 1) & ~((size_t) RN_ARENA_ALIGNMENT - 1);
+
+    /* Insert memory into list for its size (larger sizes are not reused) */
+    size_t list = size / RN_ARENA_ALIGNMENT - 1;
+    if ((size == 0) || (list >= max_free_lists)) return;
+    *((void **) data) = free_lists[list];
+    free_lists[list] = data;
+    nbytes -= size;
+}
+
+
+
+RNBoolean RNArena::
+Contains(const void *data) const
+{
+    /* Binary search for first block starting after data */
+    int low = 0, high = nblocks;
+    while (low < high) {
+        int mid = (low + high) / 2;
+        if ((const char *) sorted_blocks[mid] < (const char *) data) low = mid + 1;
+        else high = mid;
+    }
+
+    /* Check whether data is inside the block before it */
+    if (low == 0) return FALSE;
+    const Block *block = sorted_blocks[low-1];
+    return ((const char *) data < (const char *) block + block->size) ? TRUE : FALSE;
+}
+
+
+
+void RNArena::
+Empty(void)
+{
+    /* Release all blocks at once */
+    while (blocks) {
+        Block *next = blocks->next;
+        FreeAligned(blocks);
+        blocks = next;
+    }
+
+    /* Reset state */
+    for (int i = 0; i < max_free_lists; i++) free_lists[i] = NULL;
+    nblocks = 0;
+    current = NULL;
+    remaining = 0;
+    nbytes = 0;
+}
+
+
+
+void RNArena::
+InsertBlock(Block *block)
+{
+    /* Grow table of blocks */
+    if (nblocks == nblocks_allocated) {
+        nblocks_allocated = (nblocks_allocated > 0) ? 2 * nblocks_allocated : 16;
+        Block **table = new Block * [ nblocks_allocated ];
+        for (int i = 0; i < nblocks; i++) table[i] = sorted_blocks[i];
+        if (sorted_blocks) delete [] sorted_blocks;
+        sorted_blocks = table;
+    }
+
+    /* Insert block in address order (blocks usually come at increasing addresses) */
+    int k = nblocks;
+    while ((k > 0) && ((char *) sorted_blocks[k-1] > (char *) block)) {
+        sorted_blocks[k] = sorted_blocks[k-1];
+        k--;
+    }
+    sorted_blocks[k] = block;
+    nblocks++;
+}
+
+
+
+RNArena *
+RNCurrentArena(void)
+{
+    /* Return arena used by RNArenaNew in this thread (NULL means heap) */
+    return RNcurrent_arena;
+}
+
+
+
+RNArena *
+RNSetCurrentArena(RNArena *arena)
+{
+    /* Set arena used by RNArenaNew in this thread, and return previous one */
+    RNArena *previous = RNcurrent_arena;
+    RNcurrent_arena = arena;
+    return previous;
+}
+
+
+
+void *
+RNArenaNew(size_t size)
+{
+    /* Allocate from current arena (or aligned heap memory, which RNArenaDelete tells apart by address) */
+    RNArena *arena = RNcurrent_arena;
+    void *data = (arena) ? arena->Allocate(size) : AllocateAligned((size > 0) ? size : 1);
+    if (!data) { RNAbort("Unable to allocate %lu bytes", (unsigned long) size); return NULL; }
+    return data;
+}
+
+
+
+void 
+RNArenaDelete(void *data, size_t size)
+{
+    /* Check data */
+    if (!data) return;
+
+    /* Free heap memory */
+    if (((size_t) data & (RN_ARENA_ALIGNMENT - 1)) != RN_ARENA_TAG_OFFSET) {
+        FreeAligned(data);
+        return;
+    }
+
+    /* Let current arena reuse its memory if size is known -- otherwise arena 
+       memory is released in bulk by RNArena::Empty */
+    RNArena *arena = RNcurrent_arena;
+    if (arena && (size > 0) && arena->Contains(data)) arena->Release(data, size);
+}
+
+
+
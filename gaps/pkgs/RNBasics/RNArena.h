@@ -0,0 +1,69 @@
+/* Include file for GAPS arena (bump) allocator */
+
+
+
+/* Class definition */
+
+class RNArena {
+public:
+    /* Constructor/destructor functions */
+    RNArena(size_t block_size = 1 << 20);
+    ~RNArena(void);
+
+    /* Property functions */
+    size_t NBytes(void) const;
+    RNBoolean Contains(const void *data) const;
+
+    /* Allocation functions (released memory of small sizes is reused by later allocations) */
+    void *Allocate(size_t size);
+    void Release(void *data, size_t size);
+    void Empty(void);
+
+private:
+    /* Block header */
+    struct Block { Block *next; size_t size; };
+    void InsertBlock(Block *block);
+    Block *blocks;
+
+    /* Blocks sorted by address (so Contains is a binary search) */
+    Block **sorted_blocks;
+    int nblocks;
+    int nblocks_allocated;
+    char *current;
+    size_t remaining;
+    size_t block_size;
+    size_t nbytes;
+
+    /* Lists of released memory (one per multiple of alignment) */
+    enum { max_free_lists = 16 };
+    void *free_lists[max_free_lists];
+};
+
+
+
+/* Current arena functions (per thread) */
+
+RNArena *RNCurrentArena(void);
+RNArena *RNSetCurrentArena(RNArena *arena);
+
+
+
+/* Allocation functions used by class operator new/delete (memory is 8-byte aligned, 
+   and arena and heap memory are told apart by address, so allocations carry no prefix) */
+
+void *RNArenaNew(size_t size);
+void RNArenaDelete(void *data, size_t size = 0);
+
+
+
+/* Inline functions */
+
+inline size_t RNArena::
+NBytes(void) const
+{
+    /* Return number of bytes allocated from arena */
+    return nbytes;
+}
+
+
+
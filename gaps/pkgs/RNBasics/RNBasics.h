@@ -32,6 +32,7 @@
 /* Memory management include files */
 
 #include "RNBasics/RNMem.h"
+#include "RNBasics/RNArena.h"
 
 
 
@@ -79,6 +80,7 @@
 /* OS utility include files */
 
 #include "RNBasics/RNTime.h"
+#include "RNBasics/RNThread.h"
 
 
 
@@ -0,0 +1,251 @@
+/* Source file for GAPS thread utility functions */
+
+
+
+/* Include files */
+
+#include "RNBasics.h"
+#if (RN_OS != RN_WINDOWS)
+#   include <pthread.h>
+#   include <unistd.h>
+#endif
+
+
+
+/* Private types */
+
+struct RNThreadData {
+    void (*function)(int thread_index, int nthreads, void *data);
+    int thread_index;
+    int nthreads;
+    void *data;
+};
+
+
+
+int 
+RNNumProcessors(void)
+{
+    /* Return number of processors available to this process */
+#if (RN_OS == RN_WINDOWS)
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return (info.dwNumberOfProcessors > 0) ? info.dwNumberOfProcessors : 1;
+#else
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    return (count > 0) ? (int) count : 1;
+#endif
+}
+
+
+
+#if (RN_OS == RN_WINDOWS)
+
+static DWORD WINAPI
+RNThreadMain(LPVOID ptr)
+{
+    /* Call function for one thread */
+    RNThreadData *thread_data = (RNThreadData *) ptr;
+    (*thread_data->function)(thread_data->thread_index, thread_data->nthreads, thread_data->data);
+    return 0;
+}
+
+
+
+static void
+RNRunNewThreads(RNThreadData *thread_data, int nthreads)
+{
+    /* Start threads (the calling thread runs thread 0) */
+    HANDLE *threads = new HANDLE [ nthreads ];
+    int nstarted = 0;
+    for (int i = 1; i < nthreads; i++) {
+        HANDLE thread = CreateThread(NULL, 0, RNThreadMain, &thread_data[i], 0, NULL);
+        if (thread) threads[nstarted++] = thread;
+        else RNThreadMain(&thread_data[i]);
+    }
+
+    /* Run thread 0 in calling thread */
+    RNThreadMain(&thread_data[0]);
+
+    /* Wait for threads to finish (at most MAXIMUM_WAIT_OBJECTS at a time) */
+    for (int i = 0; i < nstarted; i += MAXIMUM_WAIT_OBJECTS) {
+        int n = (nstarted - i < MAXIMUM_WAIT_OBJECTS) ? nstarted - i : MAXIMUM_WAIT_OBJECTS;
+        WaitForMultipleObjects(n, &threads[i], TRUE, INFINITE);
+    }
+
+    /* Close thread handles */
+    for (int i = 0; i < nstarted; i++) CloseHandle(threads[i]);
+    delete [] threads;
+}
+
+#else
+
+static void *
+RNThreadMain(void *ptr)
+{
+    /* Call function for one thread */
+    RNThreadData *thread_data = (RNThreadData *) ptr;
+    (*thread_data->function)(thread_data->thread_index, thread_data->nthreads, thread_data->data);
+    return NULL;
+}
+
+
+
+static void
+RNRunNewThreads(RNThreadData *thread_data, int nthreads)
+{
+    /* Start threads (the calling thread runs thread 0) */
+    pthread_t *threads = new pthread_t [ nthreads ];
+    RNBoolean *started = new RNBoolean [ nthreads ];
+    started[0] = FALSE;
+    for (int i = 1; i < nthreads; i++) {
+        started[i] = (pthread_create(&threads[i], NULL, RNThreadMain, &thread_data[i]) == 0) ? TRUE : FALSE;
+    }
+
+    /* Run thread 0, and any threads that could not be started, in calling thread */
+    for (int i = 0; i < nthreads; i++) {
+        if (!started[i]) RNThreadMain(&thread_data[i]);
+    }
+
+    /* Wait for threads to finish */
+    for (int i = 1; i < nthreads; i++) {
+        if (started[i]) pthread_join(threads[i], NULL);
+    }
+
+    /* Delete thread data */
+    delete [] threads;
+    delete [] started;
+}
+
+
+
+/* Pool of worker threads, kept for the life of the process and reused by
+   RNRunThreads.  Worker w runs thread_index w+1 of each call with more than
+   w+1 threads.  Only one call uses the pool at a time -- calls made while it
+   is busy (from other threads, or from inside a thread function) start their
+   own threads instead. */
+
+struct RNThreadWorker {
+    int worker_index;
+    unsigned int generation;
+};
+
+static pthread_mutex_t rn_pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t rn_pool_start = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t rn_pool_done = PTHREAD_COND_INITIALIZER;
+static RNBoolean rn_pool_busy = FALSE;
+static int rn_pool_nworkers = 0;
+static unsigned int rn_pool_generation = 0;
+static RNThreadData *rn_pool_thread_data = NULL;
+static int rn_pool_nparticipants = 0;
+static int rn_pool_nremaining = 0;
+
+
+
+static void *
+RNThreadWorkerMain(void *ptr)
+{
+    /* Run thread functions of pool calls forever */
+    RNThreadWorker *worker = (RNThreadWorker *) ptr;
+    pthread_mutex_lock(&rn_pool_mutex);
+    while (TRUE) {
+        /* Wait for next call */
+        while (worker->generation == rn_pool_generation) pthread_cond_wait(&rn_pool_start, &rn_pool_mutex);
+        worker->generation = rn_pool_generation;
+        if (worker->worker_index >= rn_pool_nparticipants) continue;
+
+        /* Run thread function of this worker */
+        RNThreadData *thread_data = &rn_pool_thread_data[worker->worker_index + 1];
+        pthread_mutex_unlock(&rn_pool_mutex);
+        RNThreadMain(thread_data);
+        pthread_mutex_lock(&rn_pool_mutex);
+
+        /* Signal calling thread if this is the last worker to finish */
+        if (--rn_pool_nremaining == 0) pthread_cond_signal(&rn_pool_done);
+    }
+    return NULL;
+}
+
+
+
+static int
+RNRunPoolThreads(RNThreadData *thread_data, int nthreads)
+{
+    /* Claim pool (or return 0 if it is busy) */
+    pthread_mutex_lock(&rn_pool_mutex);
+    if (rn_pool_busy) { pthread_mutex_unlock(&rn_pool_mutex); return 0; }
+    rn_pool_busy = TRUE;
+
+    /* Start more workers if needed (they wait for the next generation) */
+    while (rn_pool_nworkers < nthreads - 1) {
+        RNThreadWorker *worker = new RNThreadWorker;
+        worker->worker_index = rn_pool_nworkers;
+        worker->generation = rn_pool_generation;
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, RNThreadWorkerMain, worker) != 0) { delete worker; break; }
+        pthread_detach(thread);
+        rn_pool_nworkers++;
+    }
+
+    /* Start call on workers */
+    rn_pool_thread_data = thread_data;
+    rn_pool_nparticipants = (rn_pool_nworkers < nthreads - 1) ? rn_pool_nworkers : nthreads - 1;
+    rn_pool_nremaining = rn_pool_nparticipants;
+    rn_pool_generation++;
+    int nparticipants = rn_pool_nparticipants;
+    pthread_cond_broadcast(&rn_pool_start);
+    pthread_mutex_unlock(&rn_pool_mutex);
+
+    /* Run thread 0, and any threads without a worker, in calling thread */
+    RNThreadMain(&thread_data[0]);
+    for (int i = nparticipants + 1; i < nthreads; i++) RNThreadMain(&thread_data[i]);
+
+    /* Wait for workers to finish, and release pool */
+    pthread_mutex_lock(&rn_pool_mutex);
+    while (rn_pool_nremaining > 0) pthread_cond_wait(&rn_pool_done, &rn_pool_mutex);
+    rn_pool_thread_data = NULL;
+    rn_pool_busy = FALSE;
+    pthread_mutex_unlock(&rn_pool_mutex);
+
+    /* Return success */
+    return 1;
+}
+
+#endif
+
+
+
+int 
+RNRunThreads(int nthreads, void (*function)(int thread_index, int nthreads, void *data), void *data)
+{
+    /* Call function(thread_index, nthreads, data) for each thread_index in [0, nthreads) 
+       concurrently, and return when all calls have finished */
+    if (nthreads <= 0) nthreads = RNNumProcessors();
+    if (nthreads == 1) { (*function)(0, 1, data); return 1; }
+
+    /* Fill thread data */
+    RNThreadData *thread_data = new RNThreadData [ nthreads ];
+    for (int i = 0; i < nthreads; i++) {
+        thread_data[i].function = function;
+        thread_data[i].thread_index = i;
+        thread_data[i].nthreads = nthreads;
+        thread_data[i].data = data;
+    }
+
+#if (RN_OS == RN_WINDOWS)
+    /* Run threads created for this call */
+    RNRunNewThreads(thread_data, nthreads);
+#else
+    /* Run threads of pool (or threads created for this call if pool is busy) */
+    if (!RNRunPoolThreads(thread_data, nthreads)) RNRunNewThreads(thread_data, nthreads);
+#endif
+
+    /* Delete thread data */
+    delete [] thread_data;
+
+    /* Return success */
+    return 1;
+}
+
+
+
@@ -0,0 +1,26 @@
+/* Include file for GAPS thread utility functions */
+
+
+
+/* Public functions (RNRunThreads reuses a pool of worker threads with pthreads,
+   and creates threads for each call on Windows) */
+
+int RNNumProcessors(void);
+int RNRunThreads(int nthreads, void (*function)(int thread_index, int nthreads, void *data), void *data);
+void RNThreadRange(int count, int thread_index, int nthreads, int& start, int& end);
+
+
+
+/* Inline functions */
+
+inline void 
+RNThreadRange(int count, int thread_index, int nthreads, int& start, int& end)
+{
+    /* Compute range [start, end) of count items processed by thread_index out of nthreads */
+    assert((thread_index >= 0) && (thread_index < nthreads));
+    start = (int) (((long long) count * thread_index) / nthreads);
+    end = (int) (((long long) count * (thread_index + 1)) / nthreads);
+}
+
+
+
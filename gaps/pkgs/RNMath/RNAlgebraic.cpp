@@ -2131,6 +2131,158 @@ PartialDerivative(double const* const* x, int variable) const
 
 
 
+RNScalar RNAlgebraic::
+EvaluateWithGradient(const RNScalar *x, RNScalar *gradient, const int *variable_to_index) const
+{
+  // Adds the partial derivative for each variable v to gradient[variable_to_index[v]]
+  // (or gradient[v] if there is no index) and returns the value of the algebraic.
+  // Operand values are recorded in a forward pass, so that the reverse pass 
+  // visits each node once, rather than once per variable as PartialDerivative does
+
+  // Check for polynomial
+  if (operation == RN_ZERO_OPERATION) return 0;
+  if (operation == RN_POLYNOMIAL_OPERATION) return polynomial->EvaluateWithGradient(x, gradient, variable_to_index);
+
+  // Allocate operand values (on stack for small expressions)
+  RNScalar buffer[64];
+  int nvalues = NOperandValues();
+  RNScalar *values = (nvalues <= 64) ? buffer : new RNScalar [ nvalues ];
+
+  // Forward pass
+  int index = 0;
+  RNScalar value = EvaluateOperandValues(x, values, index);
+
+  // Reverse pass
+  index = 0;
+  AccumulateGradient(x, 1.0, values, index, gradient, variable_to_index);
+
+  // Delete operand values
+  if (values != buffer) delete [] values;
+
+  // Return value
+  return value;
+}
+
+
+
+int RNAlgebraic::
+NOperandValues(void) const
+{
+  // Return number of operand values recorded by EvaluateOperandValues
+  switch(operation) {
+  case RN_ZERO_OPERATION: 
+  case RN_POLYNOMIAL_OPERATION: 
+    return 0;
+
+  default:
+    return 2 + operands[0]->NOperandValues() + operands[1]->NOperandValues();
+  }
+}
+
+
+
+RNScalar RNAlgebraic::
+EvaluateOperandValues(const RNScalar *x, RNScalar *values, int& index) const
+{
+  // Record values of both operands of every operation in prefix order and return value
+  switch(operation) {
+  case RN_ZERO_OPERATION:
+    return 0;
+  
+  case RN_POLYNOMIAL_OPERATION: 
+    return polynomial->Evaluate(x);
+
+  default: {
+    int k = index;
+    index += 2;
+    RNScalar v0 = values[k] = operands[0]->EvaluateOperandValues(x, values, index);
+    RNScalar v1 = values[k+1] = operands[1]->EvaluateOperandValues(x, values, index);
+    switch (operation) {
+    case RN_ADD_OPERATION: return v0 + v1;
+    case RN_SUBTRACT_OPERATION: return v0 - v1;
+    case RN_MULTIPLY_OPERATION: return v0 * v1;
+    case RN_DIVIDE_OPERATION: return (RNIsZero(v1, RN_SMALL_EPSILON)) ? RN_INFINITY : v0 / v1;
+    case RN_POW_OPERATION: return (v0 == 0) ? 0 : ((v1 == 0) ? 1 : pow(v0, v1));
+    } }
+  }
+
+  // Should never get here
+  RNAbort("Invalid algebraic operation: %d", operation);
+  return 0.0;
+}
+
+
+
+void RNAlgebraic::
+AccumulateGradient(const RNScalar *x, RNScalar adjoint, const RNScalar *values, int& index,
+  RNScalar *gradient, const int *variable_to_index) const
+{
+  // Propagate adjoint (derivative of root with respect to this node) to operands
+  switch(operation) {
+  case RN_ZERO_OPERATION: 
+    return;
+
+  case RN_POLYNOMIAL_OPERATION:
+    polynomial->EvaluateWithGradient(x, gradient, variable_to_index, adjoint);
+    return;
+  }
+
+  // Get operand values recorded in forward pass
+  RNScalar v0 = values[index];
+  RNScalar v1 = values[index+1];
+  index += 2;
+
+  // Compute adjoints of operands
+  RNScalar adjoint0 = 0, adjoint1 = 0;
+  switch(operation) {
+  case RN_ADD_OPERATION: 
+    adjoint0 = adjoint;
+    adjoint1 = adjoint;
+    break;
+
+  case RN_SUBTRACT_OPERATION: 
+    adjoint0 = adjoint;
+    adjoint1 = -adjoint;
+    break;
+
+  case RN_MULTIPLY_OPERATION: 
+    // Product rule
+    adjoint0 = adjoint * v1;
+    adjoint1 = adjoint * v0;
+    break;
+
+  case RN_DIVIDE_OPERATION: {
+    // Quotient rule
+    RNScalar v1_squared = v1 * v1;
+    if (RNIsZero(v1_squared, RN_SMALL_EPSILON)) { adjoint0 = adjoint1 = RN_INFINITY; break; }
+    adjoint0 = adjoint * v1 / v1_squared;
+    adjoint1 = -adjoint * v0 / v1_squared;
+    break; }
+
+  case RN_POW_OPERATION: 
+    // Power rule
+    if (operands[1]->IsConstant()) {
+      adjoint0 = adjoint * v1 * pow(v0, v1-1.0);
+    }
+    else if (!RNIsZero(v0, RN_SMALL_EPSILON)) {
+      RNScalar value = pow(v0, v1);
+      adjoint0 = adjoint * value * v1 / v0;
+      adjoint1 = adjoint * value * log(v0);
+    }
+    break;
+
+  default:
+    RNAbort("Invalid algebraic operation: %d", operation);
+    return;
+  }
+
+  // Propagate to operands (in same order as forward pass)
+  operands[0]->AccumulateGradient(x, adjoint0, values, index, gradient, variable_to_index);
+  operands[1]->AccumulateGradient(x, adjoint1, values, index, gradient, variable_to_index);
+}
+
+
+
 void RNAlgebraic::
 Print(FILE *fp, int indent) const
 {
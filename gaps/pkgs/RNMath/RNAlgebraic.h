@@ -112,6 +112,9 @@ public:
   // Partial derivative functions
   RNScalar PartialDerivative(const RNScalar *x, int variable) const;
 
+  // Gradient functions (value and all partial derivatives in one forward and one reverse pass)
+  RNScalar EvaluateWithGradient(const RNScalar *x, RNScalar *gradient, const int *variable_to_index = NULL) const;
+
   // Print functions
   void Print(FILE *fp = stdout, int indent = 0) const;
 
@@ -131,6 +134,12 @@ public:
   RNScalar Evaluate(double const* const* x) const;
   RNScalar PartialDerivative(double const* const* x, int variable) const;
 
+  // Internal functions (for reverse-mode gradient evaluation)
+  int NOperandValues(void) const;
+  RNScalar EvaluateOperandValues(const RNScalar *x, RNScalar *values, int& index) const;
+  void AccumulateGradient(const RNScalar *x, RNScalar adjoint, const RNScalar *values, int& index,
+    RNScalar *gradient, const int *variable_to_index) const;
+
   // Internal functions (for counting unique variables)
   void UpdateVariableRange(int& min_v, int& max_v) const;
   void UpdateVariableIndex(int max_variables, int& variable_count, 
@@ -141,6 +150,10 @@ public:
   // Internal functions (for sanity checking)
   RNBoolean IsValid(void) const;
 
+  // Internal functions (for allocating from RNCurrentArena)
+  void *operator new(size_t size);
+  void operator delete(void *data, size_t size);
+
 private:
   int operation;
   RNAlgebraic *operands[2];
@@ -168,6 +181,24 @@ private:
 // Inline functions
 ////////////////////////////////////////////////////////////////////////
 
+inline void *RNAlgebraic::
+operator new(size_t size)
+{
+  // Allocate from current arena (or heap)
+  return RNArenaNew(size);
+}
+
+
+
+inline void RNAlgebraic::
+operator delete(void *data, size_t size)
+{
+  // Release memory (to current arena for reuse if allocated from it)
+  RNArenaDelete(data, size);
+}
+
+
+
 inline int RNAlgebraic::
 NPartialDerivatives(void) const
 {
@@ -26,6 +26,10 @@ public:
   // Evaluation functions
   RNScalar EvaluateResidual(const RNScalar *x) const;
 
+  // Internal functions (for allocating from RNCurrentArena)
+  void *operator new(size_t size);
+  void operator delete(void *data, size_t size);
+
 private:
   friend class RNSystemOfEquations;
   RNSystemOfEquations *system;
@@ -62,6 +66,24 @@ SystemIndex(void) const
 
 
 
+inline void *RNEquation::
+operator new(size_t size)
+{
+  // Allocate from current arena (or heap)
+  return RNArenaNew(size);
+}
+
+
+
+inline void RNEquation::
+operator delete(void *data, size_t size)
+{
+  // Release memory (to current arena for reuse if allocated from it)
+  RNArenaDelete(data, size);
+}
+
+
+
 inline RNScalar RNEquation::
 EvaluateResidual(const RNScalar *x) const
 {
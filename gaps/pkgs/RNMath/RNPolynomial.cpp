@@ -14,27 +14,25 @@
 // Utility function
 ////////////////////////////////////////////////////////////////////////
 
-#if 0
 static int
-RNComparePolynomialTerms(const RNPolynomialTerm *term1, const RNPolynomialTerm *term1)
+RNComparePolynomialTerms(const RNPolynomialTerm *term1, int n2, const int *v2, const RNScalar *e2)
 {
   // Check number of variables
-  if (term1->NVariables() < term2->NVariables()) return -1;
-  else if (term1->NVariables() > term2->NVariables()) return 1;
+  if (term1->NVariables() < n2) return -1;
+  else if (term1->NVariables() > n2) return 1;
 
   // Compare variables and exponents 
-  for (int i = 0; i < term1->NVariables(); i++) {
+  for (int i = 0; i < n2; i++) {
     // This assumes variables are sorted
-    if (term1->Variable(i) < term2->Variable(i)) return -1;
-    else if (term1->Variable(i) > term2->Variable(i)) return 1;
-    if (term1->Exponent(i) < term2->Exponent(i)) return -1;
-    else if (term1->Exponent(i) > term2->Exponent(i)) return 1;
+    if (term1->Variable(i) < v2[i]) return -1;
+    else if (term1->Variable(i) > v2[i]) return 1;
+    if (term1->Exponent(i) < e2[i]) return -1;
+    else if (term1->Exponent(i) > e2[i]) return 1;
   }
 
   // Terms have the same variables and exponents
   return 0;
 }
-#endif
 
 
 
@@ -44,7 +42,9 @@ RNComparePolynomialTerms(const RNPolynomialTerm *term1, const RNPolynomialTerm *
 
 RNPolynomial::
 RNPolynomial(void)
-  : terms()
+  : terms(NULL),
+    nterms(0),
+    nterms_allocated(0)
 {
 }
 
@@ -52,15 +52,14 @@ RNPolynomial(void)
 
 RNPolynomial::
 RNPolynomial(const RNPolynomial& polynomial)
-  :terms()
+  : terms(NULL),
+    nterms(0),
+    nterms_allocated(0)
 {
   // Copy polynomial terms
-  terms.Resize(polynomial.NTerms());
+  ReserveTerms(polynomial.NTerms());
   for (int i = 0; i < polynomial.NTerms(); i++) {
-    RNPolynomialTerm *polynomial_term = polynomial.Term(i);
-    RNPolynomialTerm *term = new RNPolynomialTerm(*polynomial_term);
-    terms.Insert(term); 
-    term->polynomial = this; 
+    InsertTerm(nterms, *(polynomial.Term(i)));
   }
 }
 
@@ -68,7 +67,9 @@ RNPolynomial(const RNPolynomial& polynomial)
 
 RNPolynomial::
 RNPolynomial(RNScalar c, int v, RNScalar e)
-  : terms()
+  : terms(NULL),
+    nterms(0),
+    nterms_allocated(0)
 {
   // Add term
   AddTerm(c, v, e, TRUE);
@@ -79,7 +80,9 @@ RNPolynomial(RNScalar c, int v, RNScalar e)
 RNPolynomial::
 RNPolynomial(RNScalar c, int nv, const int *v, const RNScalar *e, 
     RNBoolean already_sorted)
-  : terms()
+  : terms(NULL),
+    nterms(0),
+    nterms_allocated(0)
 {
   // Add term
   AddTerm(c, nv, v, e, already_sorted);
@@ -92,6 +95,9 @@ RNPolynomial::
 {
   // Delete terms
   Empty();
+
+  // Delete term storage
+  if (terms) delete [] terms;
 }
 
 
@@ -227,14 +233,14 @@ HasVariable(int variable) const
 void RNPolynomial::
 Empty(void)
 {
-  // Delete all terms
+  // Empty all terms (keeping storage for terms)
   for (int i = 0; i < NTerms(); i++) {
     RNPolynomialTerm *term = Term(i);
-    delete term;
+    term->Empty();
   }
 
-  // Empty array of terms
-  terms.Empty();
+  // Reset number of terms
+  nterms = 0;
 }
 
 
@@ -371,16 +377,16 @@ Multiply(const RNPolynomial& polynomial)
 RNPolynomial& RNPolynomial::
 operator=(const RNPolynomial& polynomial)
 {
+  // Check for self assignment
+  if (this == &polynomial) return *this;
+
   // Empty this polynomial
   Empty();
 
   // Copy polynomial terms
-  terms.Resize(polynomial.NTerms());
+  ReserveTerms(polynomial.NTerms());
   for (int i = 0; i < polynomial.NTerms(); i++) {
-    RNPolynomialTerm *polynomial_term = polynomial.Term(i);
-    RNPolynomialTerm *term = new RNPolynomialTerm(*polynomial_term);
-    terms.Insert(term); 
-    term->polynomial = this; 
+    InsertTerm(nterms, *(polynomial.Term(i)));
   }
 
   // Return this
@@ -402,56 +408,112 @@ AddTerm(RNScalar c, int n, const int *v, const RNScalar *e,
   // Check if term is constant (handle separately for efficiency)
   if (n == 0) {
     // Add constant term
-    if (NTerms() > 0) {
-      // Check for existing constant term
+    if ((NTerms() > 0) && Term(0)->IsConstant()) {
+      // Add constant to existing constant term
       RNPolynomialTerm *match = Term(0);
-      if (match->IsConstant()) {
-        // Add constant to existing constant term
-        match->c += c;
-        if (match->c == 0.0) {
-          // Remove unneeded term
-          terms.Remove(match);
-          delete match;
-        }
-      }
-      else {
-        // Create new constant term (put first in list)
-        RNPolynomialTerm *term = new RNPolynomialTerm(c, 0, NULL, NULL, TRUE, TRUE);
-        terms.InsertHead(term);
-        term->polynomial = this; 
+      match->c += c;
+      if (match->c == 0.0) {
+        // Remove unneeded term
+        RemoveTerm(0);
       }
     }
     else {
-      // Create new constant term 
-      RNPolynomialTerm *term = new RNPolynomialTerm(c, 0, NULL, NULL, TRUE, TRUE);
-      terms.InsertHead(term);
-      term->polynomial = this; 
+      // Create new constant term (put first in list)
+      InsertTerm(0, RNPolynomialTerm(c, 0, NULL, NULL, TRUE, TRUE));
     }
   }
   else {
-    // Add variable term
-    RNPolynomialTerm *term = new RNPolynomialTerm(c, n, v, e, already_sorted, already_unique);
-    RNPolynomialTerm *match = FindTermWithSameVariables(term);
-    if (match) { 
+    // Add variable term (built on the stack, its variables are usually stored inline)
+    RNPolynomialTerm term(c, n, v, e, already_sorted, already_unique);
+    RNBoolean found = FALSE;
+    int k = FindTermIndex(term.n, term.v, term.e, found);
+    if (found) { 
       // Update existing term
+      RNPolynomialTerm *match = Term(k);
       match->c += c;
-      delete term; 
       if (match->c == 0.0) {
         // Remove unneeded term
-        terms.Remove(match);
-        delete match;
+        RemoveTerm(k);
       }
     }
     else { 
-      // Insert new term
-      terms.Insert(term);
-      term->polynomial = this; 
+      // Insert new term (in sorted position)
+      InsertTerm(k, term);
     }
   }
 }
 
 
 
+int RNPolynomial::
+FindTermIndex(int n, const int *v, const RNScalar *e, RNBoolean& found) const
+{
+  // Check last term first (terms are often added in sorted order)
+  found = FALSE;
+  if (nterms == 0) return 0;
+  int compare = RNComparePolynomialTerms(&terms[nterms-1], n, v, e);
+  if (compare < 0) return nterms;
+  if (compare == 0) { found = TRUE; return nterms-1; }
+
+  // Binary search for first term not less than query (sorted variables and exponents)
+  int low = 0, high = nterms-1;
+  while (low < high) {
+    int mid = (low + high) / 2;
+    compare = RNComparePolynomialTerms(&terms[mid], n, v, e);
+    if (compare < 0) low = mid + 1;
+    else high = mid;
+  }
+
+  // Return index of matching term or of position where it would be inserted
+  if (RNComparePolynomialTerms(&terms[low], n, v, e) == 0) found = TRUE;
+  return low;
+}
+
+
+
+void RNPolynomial::
+ReserveTerms(int nterms_requested)
+{
+  // Move terms into one array with room for nterms_requested
+  if (nterms_requested <= nterms_allocated) return;
+  RNPolynomialTerm *buffer = new RNPolynomialTerm [ nterms_requested ];
+  for (int i = 0; i < nterms; i++) {
+    buffer[i] = terms[i];
+    buffer[i].polynomial = this;
+  }
+  if (terms) delete [] terms;
+  terms = buffer;
+  nterms_allocated = nterms_requested;
+}
+
+
+
+void RNPolynomial::
+InsertTerm(int k, const RNPolynomialTerm& term)
+{
+  // Insert copy of term at position k (shifting later terms up)
+  assert((k >= 0) && (k <= nterms));
+  if (nterms == nterms_allocated) ReserveTerms((nterms_allocated > 1) ? nterms_allocated + nterms_allocated / 2 : 2);
+  for (int i = nterms; i > k; i--) terms[i] = terms[i-1];
+  terms[k] = term;
+  terms[k].polynomial = this;
+  nterms++;
+}
+
+
+
+void RNPolynomial::
+RemoveTerm(int k)
+{
+  // Remove term at position k (shifting later terms down)
+  assert((k >= 0) && (k < nterms));
+  for (int i = k; i < nterms-1; i++) terms[i] = terms[i+1];
+  terms[nterms-1].Empty();
+  nterms--;
+}
+
+
+
 RNScalar RNPolynomial::
 Evaluate(const RNScalar *x) const
 {
@@ -508,6 +570,20 @@ PartialDerivative(double const* const* x, int variable) const
 
 
 
+RNScalar RNPolynomial::
+EvaluateWithGradient(const RNScalar *x, RNScalar *gradient, const int *variable_to_index, RNScalar scale) const
+{
+  // Add scale times partial derivatives to gradient and return sum of terms
+  RNScalar sum = 0;
+  for (int i = 0; i < NTerms(); i++) {
+    RNPolynomialTerm *term = Term(i);
+    sum += term->EvaluateWithGradient(x, gradient, variable_to_index, scale);
+  }
+  return sum;
+}
+
+
+
 void RNPolynomial::
 Print(FILE *fp) const
 {
@@ -526,27 +602,10 @@ Print(FILE *fp) const
 RNPolynomialTerm *RNPolynomial::
 FindTermWithSameVariables(const RNPolynomialTerm *query) const
 {
-  // Check if any terms
-  if (NTerms() == 0) return NULL;
-
-  // Check if query has variables
-  if (query->IsConstant()) {
-    // Check for constant term (must be first)
-    RNPolynomialTerm *term = Term(0);
-    if (term->IsConstant()) return term;
-    else return NULL;
-  }
-  else {
-    // Find term with matching variables
-    for (int i = 0; i < NTerms(); i++) {
-      RNPolynomialTerm *term = Term(i);
-      assert((i == 0) || (!term->IsConstant()));
-      if (term->HasVariables(query->NVariables(), query->Variables(), query->Exponents())) return term;
-    }
-  }
-
-  // Did not find matching term
-  return NULL;
+  // Binary search for term with matching variables
+  RNBoolean found = FALSE;
+  int k = FindTermIndex(query->NVariables(), query->Variables(), query->Exponents(), found);
+  return (found) ? Term(k) : NULL;
 }
   
 
@@ -554,24 +613,10 @@ FindTermWithSameVariables(const RNPolynomialTerm *query) const
 RNPolynomialTerm *RNPolynomial::
 FindTermWithVariables(int n, int *v, RNScalar *e) const
 {
-  // Check if query has variables
-  if (n == 0) {
-    // Check for constant term (must be first)
-    RNPolynomialTerm *term = Term(0);
-    if (term->IsConstant()) return term;
-    else return NULL;
-  }
-  else {
-    // Find matching term
-    for (int i = 0; i < NTerms(); i++) {
-      RNPolynomialTerm *term = Term(i);
-      assert((i == 0) || (!term->IsConstant()));
-      if (term->HasVariables(n, v, e)) return term;
-    }
-  }
-
-  // Did not find matching term
-  return NULL;
+  // Binary search for term with matching variables (v must be sorted)
+  RNBoolean found = FALSE;
+  int k = FindTermIndex(n, v, e, found);
+  return (found) ? Term(k) : NULL;
 }
   
 
@@ -614,29 +659,16 @@ UpdateVariableIndex(int max_variables, int& variable_count,
 RNPolynomialTerm::
 RNPolynomialTerm(RNScalar _c, int _n, const int *_v, const RNScalar *_e, 
   RNBoolean already_sorted, RNBoolean already_unique)
-  : n(0),
-    c(_c)
+  : polynomial(NULL),
+    n(0),
+    c(_c),
+    v(inline_v),
+    e(inline_e)
 {
   // Check number of variables
-  if (_n == 0) {
-#ifndef RN_POLYNOMIAL_TERM_STATIC_MEMORY
-    v = NULL;
-    e = NULL;
-#endif
-  }
-  else {
+  if (_n > 0) {
     // Copy term info
-    n = 0;
-#ifndef RN_POLYNOMIAL_TERM_STATIC_MEMORY
-    v = new int [ _n ];
-    e = new RNScalar [ _n ];
-#else
-    // Check number of variables
-    if (_n > max_variables) {
-      fprintf(stderr, "RNPolynomialTerm max variables exceeded\n");
-      return;
-    }
-#endif
+    ReserveVariables(_n);
     for (int i = 0; i < _n; i++) {
       if (_e[i] != 0.0) {
         assert(n < _n);
@@ -703,25 +735,17 @@ RNPolynomialTerm(RNScalar _c, int _n, const int *_v, const RNScalar *_e,
 
 RNPolynomialTerm::
 RNPolynomialTerm(const RNPolynomialTerm& term)
-  : n(term.n),
-    c(term.c)
+  : polynomial(NULL),
+    n(term.n),
+    c(term.c),
+    v(inline_v),
+    e(inline_e)
 {
   // Copy stuff from term
-  if (n == 0) {
-#ifndef RN_POLYNOMIAL_TERM_STATIC_MEMORY
-    v = NULL;
-    e = NULL;
-#endif
-  }
-  else {
-#ifndef RN_POLYNOMIAL_TERM_STATIC_MEMORY
-    v = new int [ n ];
-    e = new RNScalar [ n ];
-#endif
-    for (int i = 0; i < n; i++) {
-      v[i] = term.v[i];
-      e[i] = term.e[i];
-    }
+  ReserveVariables(n);
+  for (int i = 0; i < n; i++) {
+    v[i] = term.v[i];
+    e[i] = term.e[i];
   }
 }
 
@@ -731,10 +755,28 @@ RNPolynomialTerm::
 ~RNPolynomialTerm(void)
 {
   // Delete stuff
-#ifndef RN_POLYNOMIAL_TERM_STATIC_MEMORY
-  if (v) delete [] v;
-  if (e) delete [] e;
-#endif
+  ReserveVariables(0);
+}
+
+
+
+RNPolynomialTerm& RNPolynomialTerm::
+operator=(const RNPolynomialTerm& term)
+{
+  // Check for self assignment
+  if (this == &term) return *this;
+
+  // Copy stuff from term
+  ReserveVariables(term.n);
+  n = term.n;
+  c = term.c;
+  for (int i = 0; i < n; i++) {
+    v[i] = term.v[i];
+    e[i] = term.e[i];
+  }
+
+  // Return this
+  return *this;
 }
 
 
@@ -755,10 +797,7 @@ void RNPolynomialTerm::
 Empty(void)
 {
   // Delete stuff
-#ifndef RN_POLYNOMIAL_TERM_STATIC_MEMORY
-  if (v) delete [] v;
-  if (e) delete [] e;
-#endif
+  ReserveVariables(0);
   c = 0;
   n = 0;
 }
@@ -922,6 +961,38 @@ PartialDerivative(double const* const* x, int variable) const
 
 
 
+RNScalar RNPolynomialTerm::
+EvaluateWithGradient(const RNScalar *x, RNScalar *gradient, const int *variable_to_index, RNScalar scale) const
+{
+  // Add scale times partial derivative for each variable to gradient
+  // (at index variable_to_index[v], or v if there is no index)
+  for (int j = 0; j < NVariables(); j++) {
+    RNScalar result = scale * c;
+    for (int i = 0; i < NVariables(); i++) {
+      int k = Variable(i);
+      if (i == j) {
+        if (e[i] == 1.0) result *= 1.0;
+        else if (e[i] == 2.0) result *= 2.0 * x[k];
+        else if ((e[i] < 1.0) && RNIsZero(x[k])) result *= RN_INFINITY;
+        else result *= e[i] * pow(x[k], e[i] - 1.0);
+      }
+      else {
+        if (e[i] == 1.0) result *= x[k];
+        else if (e[i] == 2.0) result *= x[k] * x[k];
+        else if ((e[i] < 0) && RNIsZero(x[k])) result *= RN_INFINITY;
+        else result *= pow(x[k], e[i]);
+      }
+    }
+    int index = (variable_to_index) ? variable_to_index[Variable(j)] : Variable(j);
+    gradient[index] += result;
+  }
+
+  // Return value of term
+  return Evaluate(x);
+}
+
+
+
 void RNPolynomialTerm::
 Print(FILE *fp) const
 {
@@ -954,6 +1025,25 @@ HasVariables(int query_n, const int *query_v, const RNScalar *query_e) const
 
 
 
+void RNPolynomialTerm::
+ReserveVariables(int nvariables)
+{
+  // Point v and e at storage for nvariables (inline if they fit, contents are not kept)
+  // Larger arrays come from the current arena (or heap), like the term arrays
+  if (v != inline_v) {
+    RNArenaDelete(v);
+    RNArenaDelete(e);
+    v = inline_v;
+    e = inline_e;
+  }
+  if (nvariables > max_inline_variables) {
+    v = (int *) RNArenaNew(nvariables * sizeof(int));
+    e = (RNScalar *) RNArenaNew(nvariables * sizeof(RNScalar));
+  }
+}
+
+
+
 void RNPolynomialTerm::
 UpdateVariableRange(int& min_v, int& max_v) const
 {
@@ -6,7 +6,102 @@
 // Declarations
 ////////////////////////////////////////////////////////////////////////
 
-class RNPolynomialTerm;
+class RNPolynomial;
+
+
+
+////////////////////////////////////////////////////////////////////////
+// Polynomial term
+////////////////////////////////////////////////////////////////////////
+
+class RNPolynomialTerm {
+public:
+  // Constructor/destructor
+  RNPolynomialTerm(RNScalar c = 0.0, int nv = 0, const int *v = NULL, const RNScalar *e = NULL, 
+    RNBoolean already_sorted = FALSE, RNBoolean already_unique = FALSE);
+  RNPolynomialTerm(const RNPolynomialTerm& term);
+  ~RNPolynomialTerm(void);
+
+  // Assignment operator (copies everything but the polynomial)
+  RNPolynomialTerm& operator=(const RNPolynomialTerm& term);
+
+  // Property functions
+  RNBoolean IsZero(void) const;
+  RNBoolean IsOne(void) const;
+  RNBoolean IsConstant(void) const;
+  RNBoolean IsLinear(void) const;
+  RNBoolean IsQuadratic(void) const;
+  RNBoolean HasVariable(int v) const;
+  RNScalar Degree(void) const;
+
+  // Access functions
+  int NVariables(void) const;
+  int Variable(int k) const;
+  RNScalar Coefficient(void) const;
+  RNScalar Exponent(int k) const;
+  const int *Variables(void) const;
+  const RNScalar *Exponents(void) const;
+  RNPolynomial *Polynomial(void) const;
+
+  // Manipulation functions
+  void Empty(void);
+  void Negate(void);
+  void Multiply(RNScalar factor);
+  void Divide(RNScalar factor);
+  void SetCoefficient(RNScalar c);
+  void SetVariable(int k, int v);
+  void SetExponent(int k, RNScalar e);
+
+  // Evaluation functions
+  RNScalar Evaluate(const RNScalar *x) const;
+
+  // Partial derivative functions
+  int NPartialDerivatives(void) const;
+  RNScalar PartialDerivative(const RNScalar *x, int variable) const;
+
+  // Gradient functions
+  RNScalar EvaluateWithGradient(const RNScalar *x, RNScalar *gradient, 
+    const int *variable_to_index = NULL, RNScalar scale = 1.0) const;
+
+  // Print functions
+  void Print(FILE *fp = stdout) const;
+
+public:
+  // More internal functions (for CERES)
+  RNScalar Evaluate(double const* const* x) const;
+  RNScalar PartialDerivative(double const* const* x, int variable) const;
+
+  // Internal functions (for finding similar terms)
+  RNBoolean HasSameVariables(const RNPolynomialTerm *query) const;
+  RNBoolean HasVariables(int n, const int *v, const RNScalar *e) const;
+
+  // Internal functions (for counting unique variables)
+  void UpdateVariableRange(int& min_v, int& max_v) const;
+  void UpdateVariableIndex(int max_variables, int& variable_count, 
+    int *variable_marks, int current_mark, 
+    int *index_to_variable = NULL, int *variable_to_index = NULL,
+    RNBoolean remap_variables = FALSE) const;
+
+public:
+  // Internal functions (for allocating term arrays from RNCurrentArena)
+  void *operator new[](size_t size);
+  void operator delete[](void *data, size_t size);
+
+private:
+  // Internal functions (for allocating variables and exponents)
+  void ReserveVariables(int nvariables);
+
+private:
+  friend class RNPolynomial;
+  RNPolynomial *polynomial;
+  int n;
+  RNScalar c;
+  int *v;
+  RNScalar *e;
+  static const int max_inline_variables = 2;
+  int inline_v[max_inline_variables];
+  RNScalar inline_e[max_inline_variables];
+};
 
 
 
@@ -36,7 +131,10 @@ public:
   RNBoolean HasVariable(int v) const;
   RNScalar Degree(void) const;
 
-  // Access functions
+  // Access functions (terms are kept sorted by number of variables, then by variables and 
+  // exponents, so the constant term is first -- terms are stored in one array, so pointers 
+  // returned by Term() are invalidated whenever terms are added or removed, and changing 
+  // the variables or exponents of a term with SetVariable or SetExponent breaks the order)
   int NTerms(void) const;
   RNPolynomialTerm *Term(int k) const;
 
@@ -87,6 +185,10 @@ public:
   // Partial derivative functions
   RNScalar PartialDerivative(const RNScalar *x, int variable) const;
 
+  // Gradient functions
+  RNScalar EvaluateWithGradient(const RNScalar *x, RNScalar *gradient, 
+    const int *variable_to_index = NULL, RNScalar scale = 1.0) const;
+
   // Print functions
   void Print(FILE *fp = stdout) const;
 
@@ -106,91 +208,21 @@ public:
     int *index_to_variable = NULL, int *variable_to_index = NULL,
     RNBoolean remap_variables = FALSE) const;
 
-private:
-  RNArray<RNPolynomialTerm *> terms;
-};
+  // Internal functions (for allocating from RNCurrentArena)
+  void *operator new(size_t size);
+  void operator delete(void *data, size_t size);
 
-
-
-////////////////////////////////////////////////////////////////////////
-// Polynomial term
-////////////////////////////////////////////////////////////////////////
-
-class RNPolynomialTerm {
-public:
-  // Constructor/destructor
-  RNPolynomialTerm(RNScalar c = 0.0, int nv = 0, const int *v = NULL, const RNScalar *e = NULL, 
-    RNBoolean already_sorted = FALSE, RNBoolean already_unique = FALSE);
-  RNPolynomialTerm(const RNPolynomialTerm& term);
-  ~RNPolynomialTerm(void);
-
-  // Property functions
-  RNBoolean IsZero(void) const;
-  RNBoolean IsOne(void) const;
-  RNBoolean IsConstant(void) const;
-  RNBoolean IsLinear(void) const;
-  RNBoolean IsQuadratic(void) const;
-  RNBoolean HasVariable(int v) const;
-  RNScalar Degree(void) const;
-
-  // Access functions
-  int NVariables(void) const;
-  int Variable(int k) const;
-  RNScalar Coefficient(void) const;
-  RNScalar Exponent(int k) const;
-  const int *Variables(void) const;
-  const RNScalar *Exponents(void) const;
-  RNPolynomial *Polynomial(void) const;
-
-  // Manipulation functions
-  void Empty(void);
-  void Negate(void);
-  void Multiply(RNScalar factor);
-  void Divide(RNScalar factor);
-  void SetCoefficient(RNScalar c);
-  void SetVariable(int k, int v);
-  void SetExponent(int k, RNScalar e);
-
-  // Evaluation functions
-  RNScalar Evaluate(const RNScalar *x) const;
-
-  // Partial derivative functions
-  int NPartialDerivatives(void) const;
-  RNScalar PartialDerivative(const RNScalar *x, int variable) const;
-
-  // Print functions
-  void Print(FILE *fp = stdout) const;
-
-public:
-  // More internal functions (for CERES)
-  RNScalar Evaluate(double const* const* x) const;
-  RNScalar PartialDerivative(double const* const* x, int variable) const;
-
-  // Internal functions (for finding similar terms)
-  RNBoolean HasSameVariables(const RNPolynomialTerm *query) const;
-  RNBoolean HasVariables(int n, const int *v, const RNScalar *e) const;
-
-  // Internal functions (for counting unique variables)
-  void UpdateVariableRange(int& min_v, int& max_v) const;
-  void UpdateVariableIndex(int max_variables, int& variable_count, 
-    int *variable_marks, int current_mark, 
-    int *index_to_variable = NULL, int *variable_to_index = NULL,
-    RNBoolean remap_variables = FALSE) const;
+private:
+  // Internal functions (for storing terms contiguously, in sorted order)
+  int FindTermIndex(int n, const int *v, const RNScalar *e, RNBoolean& found) const;
+  void ReserveTerms(int nterms);
+  void InsertTerm(int k, const RNPolynomialTerm& term);
+  void RemoveTerm(int k);
 
 private:
-  friend class RNPolynomial;
-  RNPolynomial *polynomial;
-  int n;
-  RNScalar c;
-// #define RN_POLYNOMIAL_TERM_STATIC_MEMORY
-#ifdef RN_POLYNOMIAL_TERM_STATIC_MEMORY
-  static const int max_variables = 4;
-  int v[max_variables];
-  RNScalar e[max_variables];
-#else
-  int *v;
-  RNScalar *e;
-#endif
+  RNPolynomialTerm *terms;
+  int nterms;
+  int nterms_allocated;
 };
 
 
@@ -335,10 +367,46 @@ HasSameVariables(const RNPolynomialTerm *query) const
 
 
 
+inline void *RNPolynomialTerm::
+operator new[](size_t size)
+{
+  // Allocate term array from current arena (or heap)
+  return RNArenaNew(size);
+}
+
+
+
+inline void RNPolynomialTerm::
+operator delete[](void *data, size_t size)
+{
+  // Release term array (to current arena for reuse if allocated from it)
+  RNArenaDelete(data, size);
+}
+
+
+
 ////////////////////////////////////////////////////////////////////////
 // Inline functions for polynomial
 ////////////////////////////////////////////////////////////////////////
 
+inline void *RNPolynomial::
+operator new(size_t size)
+{
+  // Allocate from current arena (or heap)
+  return RNArenaNew(size);
+}
+
+
+
+inline void RNPolynomial::
+operator delete(void *data, size_t size)
+{
+  // Release memory (to current arena for reuse if allocated from it)
+  RNArenaDelete(data, size);
+}
+
+
+
 inline RNBoolean RNPolynomial::
 IsPolynomial(void) const
 {
@@ -361,7 +429,7 @@ inline int RNPolynomial::
 NTerms(void) const
 {
   // Return number of terms
-  return terms.NEntries();
+  return nterms;
 }
 
 
@@ -378,8 +446,9 @@ NPartialDerivatives(void) const
 inline RNPolynomialTerm *RNPolynomial::
 Term(int k) const
 {
-  // Return kth term
-  return terms.Kth(k);
+  // Return kth term (pointer is valid until terms are added or removed)
+  assert((k >= 0) && (k < nterms));
+  return &terms[k];
 }
 
 
@@ -10,6 +10,61 @@
 
 
 
+////////////////////////////////////////////////////////////////////////
+// Equation family data
+////////////////////////////////////////////////////////////////////////
+
+// Number of instances evaluated together (the values of each tape variable
+// and stack entry are stored contiguously for all instances of a batch)
+#define RN_FAMILY_BATCH_SIZE 64
+
+
+
+struct RNEquationFamily {
+  RNAlgebraic *expression;
+  int nvariables;
+  int nparameters;
+  int *codes;
+  RNScalar *constants;
+  int *tape_slots;
+  int ntape_slots;
+  int *offsets;
+  int ninstructions;
+  int max_depth;
+  int first_instance;
+  int ninstances;
+  int ninstances_allocated;
+  int *instance_variables;
+  RNScalar *instance_parameters;
+  RNScalar *instance_weights;
+};
+
+
+
+////////////////////////////////////////////////////////////////////////
+// Parallel evaluation data
+////////////////////////////////////////////////////////////////////////
+
+// Results of one evaluation split into blocks of equations, one per thread 
+// (thread 0 writes normal equations into the caller's arrays, other threads
+// into their own, which are then added in thread order)
+struct RNSystemEvaluation {
+  const RNSystemOfEquations *system;
+  const RNScalar *x;
+  int start, end;
+  RNScalar *y;
+  RNScalar *sums;
+  RNScalar **JTJ;
+  RNScalar **JTr;
+  int **marks;
+  int **triplet_rows;
+  int **triplet_columns;
+  RNScalar **triplet_values;
+  int *ntriplets;
+};
+
+
+
 ////////////////////////////////////////////////////////////////////////
 // Functions
 ////////////////////////////////////////////////////////////////////////
@@ -19,7 +74,36 @@ RNSystemOfEquations(int nvariables)
   : lower_bounds(NULL),
     upper_bounds(NULL),
     nvariables(nvariables),
-    equations()
+    max_iterations(0),
+    niterations(0),
+    max_threads(1),
+    grid_xres(0),
+    grid_yres(0),
+    equations(),
+    nlinear_equations(0),
+    nlinear_equations_allocated(0),
+    nlinear_terms_allocated(0),
+    linear_equation_starts(NULL),
+    linear_variables(NULL),
+    linear_coefficients(NULL),
+    linear_constants(NULL),
+    families(),
+    nfamily_instances(0),
+    arenas(),
+    normal_matrix_starts(NULL),
+    normal_matrix_rows(NULL),
+    normal_thread_JTJ(NULL),
+    normal_thread_JTr(NULL),
+    normal_thread_marks(NULL),
+    normal_nthreads(0),
+    tape_code_starts(NULL),
+    tape_codes(NULL),
+    tape_constant_starts(NULL),
+    tape_constants(NULL),
+    tape_variable_starts(NULL),
+    tape_variables(NULL),
+    tape_max_instructions(0),
+    tape_max_depth(0)
 {
   // Allocate memory for variable counting
   index_to_variable = new int [ nvariables ];
@@ -36,7 +120,36 @@ RNSystemOfEquations(const RNSystemOfEquations& system)
   : lower_bounds(NULL),
     upper_bounds(NULL),
     nvariables(system.nvariables),
-    equations()
+    max_iterations(system.max_iterations),
+    niterations(0),
+    max_threads(system.max_threads),
+    grid_xres(system.grid_xres),
+    grid_yres(system.grid_yres),
+    equations(),
+    nlinear_equations(0),
+    nlinear_equations_allocated(0),
+    nlinear_terms_allocated(0),
+    linear_equation_starts(NULL),
+    linear_variables(NULL),
+    linear_coefficients(NULL),
+    linear_constants(NULL),
+    families(),
+    nfamily_instances(0),
+    arenas(),
+    normal_matrix_starts(NULL),
+    normal_matrix_rows(NULL),
+    normal_thread_JTJ(NULL),
+    normal_thread_JTr(NULL),
+    normal_thread_marks(NULL),
+    normal_nthreads(0),
+    tape_code_starts(NULL),
+    tape_codes(NULL),
+    tape_constant_starts(NULL),
+    tape_constants(NULL),
+    tape_variable_starts(NULL),
+    tape_variables(NULL),
+    tape_max_instructions(0),
+    tape_max_depth(0)
 {
   // Allocate memory for variable counting
   index_to_variable = new int [ nvariables ];
@@ -46,12 +159,31 @@ RNSystemOfEquations(const RNSystemOfEquations& system)
   current_mark = 1;
 
   // Copy equations
-  equations.Resize(system.NEquations());
-  for (int i = 0; i < system.NEquations(); i++) {
+  equations.Resize(system.NExpressionEquations());
+  for (int i = 0; i < system.NExpressionEquations(); i++) {
     RNEquation *equation = system.Equation(i);
     InsertEquation(new RNEquation(*equation));
   }
 
+  // Copy linear equations
+  ReserveLinearEquations(system.NLinearEquations(), 
+    (system.NLinearEquations() > 0) ? system.linear_equation_starts[system.NLinearEquations()] : 0);
+  for (int i = 0; i < system.NLinearEquations(); i++) {
+    InsertLinearEquation(system.LinearEquationNTerms(i), system.LinearEquationVariables(i),
+      system.LinearEquationCoefficients(i), system.LinearEquationConstant(i));
+  }
+
+  // Copy equation families
+  for (int f = 0; f < system.NEquationFamilies(); f++) {
+    RNEquationFamily *family = system.families.Kth(f);
+    InsertEquationFamily(new RNAlgebraic(*(family->expression)), family->nvariables, family->nparameters);
+    ReserveEquationFamilyInstances(f, family->ninstances);
+    for (int i = 0; i < family->ninstances; i++) {
+      InsertEquationFamilyInstance(f, &family->instance_variables[i*family->nvariables],
+        &family->instance_parameters[i*family->nparameters], family->instance_weights[i]);
+    }
+  }
+
   // Copy lower bounds
   if (system.lower_bounds) {
     lower_bounds = new RNScalar [ nvariables ];
@@ -79,12 +211,8 @@ RNSystemOfEquations::
   if (variable_to_index) delete [] variable_to_index;
   if (variable_marks) delete [] variable_marks;
 
-  // Delete all equations
-  while (NEquations() > 0) {
-    RNEquation *equation = equations.Tail();
-    RemoveEquation(equation);
-    delete equation;
-  }
+  // Delete all equations (and arenas)
+  Empty();
 
   // Delete all bounds
   if (lower_bounds) delete [] lower_bounds;
@@ -98,11 +226,16 @@ NPartialDerivatives(void) const
 {
   // Return number of partial derivatives
   int count = 0;
-  for (int i = 0; i < NEquations(); i++) {
+  for (int i = 0; i < NExpressionEquations(); i++) {
     RNEquation *equation = Equation(i);
     equation->UpdateVariableIndex(nvariables, count, variable_marks, current_mark);
     ((RNSystemOfEquations *) this)->current_mark++;
   }
+  for (int f = 0; f < NEquationFamilies(); f++) {
+    RNEquationFamily *family = families.Kth(f);
+    count += family->ninstances * family->nvariables;
+  }
+  if (nlinear_equations > 0) count += linear_equation_starts[nlinear_equations];
   return count;
 }
 
@@ -111,12 +244,18 @@ NPartialDerivatives(void) const
 RNBoolean RNSystemOfEquations::
 IsLinear(void) const
 {
-  // Check whether all equations are linear
-  for (int i = 0; i < NEquations(); i++) {
+  // Check whether all equations are linear (linear equations trivially are)
+  for (int i = 0; i < NExpressionEquations(); i++) {
     RNEquation *equation = Equation(i);
     if (!equation->IsLinear()) return FALSE;
   }
 
+  // Check whether all equation families are linear
+  for (int f = 0; f < NEquationFamilies(); f++) {
+    RNEquationFamily *family = families.Kth(f);
+    if (!family->expression->IsLinear()) return FALSE;
+  }
+
   // Passed all tests
   return TRUE;
 }
@@ -126,12 +265,18 @@ IsLinear(void) const
 RNBoolean RNSystemOfEquations::
 IsQuadratic(void) const
 {
-  // Check whether all equations are quadratic
-  for (int i = 0; i < NEquations(); i++) {
+  // Check whether all equations are quadratic (linear equations trivially are)
+  for (int i = 0; i < NExpressionEquations(); i++) {
     RNEquation *equation = Equation(i);
     if (!equation->IsQuadratic()) return FALSE;
   }
 
+  // Check whether all equation families are quadratic
+  for (int f = 0; f < NEquationFamilies(); f++) {
+    RNEquationFamily *family = families.Kth(f);
+    if (!family->expression->IsQuadratic()) return FALSE;
+  }
+
   // Passed all tests
   return TRUE;
 }
@@ -141,12 +286,18 @@ IsQuadratic(void) const
 RNBoolean RNSystemOfEquations::
 IsPolynomial(void) const
 {
-  // Check whether all equations are polynomial
-  for (int i = 0; i < NEquations(); i++) {
+  // Check whether all equations are polynomial (linear equations trivially are)
+  for (int i = 0; i < NExpressionEquations(); i++) {
     RNEquation *equation = Equation(i);
     if (!equation->IsPolynomial()) return FALSE;
   }
 
+  // Check whether all equation families are polynomial
+  for (int f = 0; f < NEquationFamilies(); f++) {
+    RNEquationFamily *family = families.Kth(f);
+    if (!family->expression->IsPolynomial()) return FALSE;
+  }
+
   // Passed all tests
   return TRUE;
 }
@@ -156,12 +307,18 @@ IsPolynomial(void) const
 RNBoolean RNSystemOfEquations::
 IsAlgebraic(void) const
 {
-  // Check whether all equations are algebraic
-  for (int i = 0; i < NEquations(); i++) {
+  // Check whether all equations are algebraic (linear equations trivially are)
+  for (int i = 0; i < NExpressionEquations(); i++) {
     RNEquation *equation = Equation(i);
     if (!equation->IsAlgebraic()) return FALSE;
   }
 
+  // Check whether all equation families are algebraic
+  for (int f = 0; f < NEquationFamilies(); f++) {
+    RNEquationFamily *family = families.Kth(f);
+    if (!family->expression->IsAlgebraic()) return FALSE;
+  }
+
   // Passed all tests
   return TRUE;
 }
@@ -172,11 +329,26 @@ RNBoolean RNSystemOfEquations::
 HasVariable(int v) const
 {
   // Check whether any equation has variable v
-  for (int i = 0; i < NEquations(); i++) {
+  for (int i = 0; i < NExpressionEquations(); i++) {
     RNEquation *equation = Equation(i);
     if (equation->HasVariable(v)) return TRUE;
   }
 
+  // Check whether any instance of an equation family has variable v
+  for (int f = 0; f < NEquationFamilies(); f++) {
+    RNEquationFamily *family = families.Kth(f);
+    for (int i = 0; i < family->ninstances * family->nvariables; i++) {
+      if (family->instance_variables[i] == v) return TRUE;
+    }
+  }
+
+  // Check whether any linear equation has variable v
+  if (nlinear_equations > 0) {
+    for (int i = 0; i < linear_equation_starts[nlinear_equations]; i++) {
+      if (linear_variables[i] == v) return TRUE;
+    }
+  }
+
   // No equation has variable v
   return FALSE;
 }
@@ -248,6 +420,10 @@ InsertEquation(RNEquation *equation)
   assert(equation->system_index == -1);
   // assert(!equations.FindEntry(equation));
 
+  // Invalidate normal matrix pattern and tape
+  InvalidateNormalMatrixPattern();
+  Unfreeze();
+
   // Insert equation
   equation->system = this;
   equation->system_index = equations.NEntries();
@@ -264,6 +440,10 @@ RemoveEquation(RNEquation *equation)
   assert(equation->system_index >= 0);
   // assert(equations.FindEntry(equation));
 
+  // Invalidate normal matrix pattern and tape
+  InvalidateNormalMatrixPattern();
+  Unfreeze();
+
   // Remove equation
   RNArrayEntry *entry = equations.KthEntry(equation->system_index);
   assert(entry && (equations.EntryContents(entry) == equation));
@@ -277,6 +457,266 @@ RemoveEquation(RNEquation *equation)
 
 
 
+void RNSystemOfEquations::
+Empty(void)
+{
+  // Delete all equations
+  while (NExpressionEquations() > 0) {
+    RNEquation *equation = equations.Tail();
+    RemoveEquation(equation);
+    delete equation;
+  }
+
+  // Delete all linear equations
+  if (linear_equation_starts) delete [] linear_equation_starts;
+  if (linear_variables) delete [] linear_variables;
+  if (linear_coefficients) delete [] linear_coefficients;
+  if (linear_constants) delete [] linear_constants;
+  linear_equation_starts = NULL;
+  linear_variables = NULL;
+  linear_coefficients = NULL;
+  linear_constants = NULL;
+  nlinear_equations = 0;
+  nlinear_equations_allocated = 0;
+  nlinear_terms_allocated = 0;
+
+  // Delete all equation families
+  for (int f = 0; f < NEquationFamilies(); f++) {
+    RNEquationFamily *family = families.Kth(f);
+    delete family->expression;
+    delete [] family->codes;
+    delete [] family->constants;
+    delete [] family->tape_slots;
+    delete [] family->offsets;
+    if (family->instance_variables) delete [] family->instance_variables;
+    if (family->instance_parameters) delete [] family->instance_parameters;
+    if (family->instance_weights) delete [] family->instance_weights;
+    delete family;
+  }
+  families.Empty();
+  nfamily_instances = 0;
+
+  // Delete normal matrix pattern and tape
+  InvalidateNormalMatrixPattern();
+  Unfreeze();
+
+  // Release arenas (after all destructors have run, since they may touch arena memory)
+  for (int i = 0; i < arenas.NEntries(); i++) {
+    RNArena *arena = arenas.Kth(i);
+    if (RNCurrentArena() == arena) RNSetCurrentArena(NULL);
+    delete arena;
+  }
+  arenas.Empty();
+}
+
+
+
+RNArena *RNSystemOfEquations::
+CreateArena(void)
+{
+  // Create arena owned by this system (not thread-safe -- call serially)
+  RNArena *arena = new RNArena();
+  arenas.Insert(arena);
+  return arena;
+}
+
+
+
+void RNSystemOfEquations::
+ReserveLinearEquations(int nequations, int nterms)
+{
+  // Grow storage for linear equation rows
+  if (nequations > nlinear_equations_allocated) {
+    int *starts = new int [ nequations + 1 ];
+    RNScalar *constants = new RNScalar [ nequations ];
+    for (int i = 0; i < nlinear_equations; i++) constants[i] = linear_constants[i];
+    for (int i = 0; i <= nlinear_equations; i++) starts[i] = (linear_equation_starts) ? linear_equation_starts[i] : 0;
+    if (linear_equation_starts) delete [] linear_equation_starts;
+    if (linear_constants) delete [] linear_constants;
+    linear_equation_starts = starts;
+    linear_constants = constants;
+    nlinear_equations_allocated = nequations;
+  }
+
+  // Grow storage for linear equation terms
+  if (nterms > nlinear_terms_allocated) {
+    int nterms_used = (linear_equation_starts) ? linear_equation_starts[nlinear_equations] : 0;
+    int *variables = new int [ nterms ];
+    RNScalar *coefficients = new RNScalar [ nterms ];
+    for (int i = 0; i < nterms_used; i++) variables[i] = linear_variables[i];
+    for (int i = 0; i < nterms_used; i++) coefficients[i] = linear_coefficients[i];
+    if (linear_variables) delete [] linear_variables;
+    if (linear_coefficients) delete [] linear_coefficients;
+    linear_variables = variables;
+    linear_coefficients = coefficients;
+    nlinear_terms_allocated = nterms;
+  }
+}
+
+
+
+static int
+CopyLinearTerms(int nvariables, int nterms, const int *variables, const RNScalar *coefficients,
+  int *row_variables, RNScalar *row_coefficients)
+{
+  // Copy terms into row, merging terms with the same variable and dropping zero terms
+  int count = 0;
+  for (int i = 0; i < nterms; i++) {
+    // Just checking
+    assert((variables[i] >= 0) && (variables[i] < nvariables));
+
+    // Check for term with same variable
+    int j = 0;
+    while ((j < count) && (row_variables[j] != variables[i])) j++;
+    if (j < count) {
+      row_coefficients[j] += coefficients[i];
+    }
+    else {
+      row_variables[count] = variables[i];
+      row_coefficients[count] = coefficients[i];
+      count++;
+    }
+  }
+
+  // Remove zero terms
+  int nonzero_count = 0;
+  for (int i = 0; i < count; i++) {
+    if (row_coefficients[i] == 0) continue;
+    row_variables[nonzero_count] = row_variables[i];
+    row_coefficients[nonzero_count] = row_coefficients[i];
+    nonzero_count++;
+  }
+
+  // Return number of terms in row
+  return nonzero_count;
+}
+
+
+
+void RNSystemOfEquations::
+InsertLinearEquation(int nterms, const int *variables, const RNScalar *coefficients, RNScalar constant)
+{
+  // Insert equation sum_i(coefficients[i] * x[variables[i]]) + constant
+  // Terms with the same variable are merged, and zero terms are dropped
+
+  // Make sure there is room for another row
+  if (!linear_equation_starts) ReserveLinearEquations(1024, 0);
+  int start = linear_equation_starts[nlinear_equations];
+  if (nlinear_equations + 1 > nlinear_equations_allocated) {
+    ReserveLinearEquations(2 * nlinear_equations_allocated, nlinear_terms_allocated);
+  }
+  if (start + nterms > nlinear_terms_allocated) {
+    int n = (nlinear_terms_allocated > 0) ? 2 * nlinear_terms_allocated : 1024;
+    while (n < start + nterms) n *= 2;
+    ReserveLinearEquations(nlinear_equations_allocated, n);
+  }
+
+  // Copy terms into row
+  int nonzero_count = CopyLinearTerms(nvariables, nterms, variables, coefficients, 
+    &linear_variables[start], &linear_coefficients[start]);
+
+  // Check if equation is constant
+  if (nonzero_count == 0) return;
+
+  // Invalidate normal matrix pattern
+  if (normal_matrix_starts) InvalidateNormalMatrixPattern();
+
+  // Insert row
+  linear_constants[nlinear_equations] = constant;
+  linear_equation_starts[nlinear_equations+1] = start + nonzero_count;
+  nlinear_equations++;
+}
+
+
+
+int RNSystemOfEquations::
+InsertLinearEquations(int nequations, int nterms)
+{
+  // Append nequations rows of nterms zero terms each (filled later with SetLinearEquation)
+  int first = nlinear_equations;
+  if (nequations <= 0) return first;
+  int start = (linear_equation_starts) ? linear_equation_starts[first] : 0;
+  ReserveLinearEquations(first + nequations, start + nequations * nterms);
+  for (int k = 0; k < nequations; k++) {
+    linear_constants[first+k] = 0;
+    linear_equation_starts[first+k+1] = start + (k+1) * nterms;
+  }
+  for (int i = start; i < start + nequations * nterms; i++) {
+    linear_variables[i] = 0;
+    linear_coefficients[i] = 0;
+  }
+  nlinear_equations += nequations;
+
+  // Invalidate normal matrix pattern
+  if (normal_matrix_starts) InvalidateNormalMatrixPattern();
+
+  // Return index of first row
+  return first;
+}
+
+
+
+void RNSystemOfEquations::
+SetLinearEquation(int k, int nterms, const int *variables, const RNScalar *coefficients, RNScalar constant)
+{
+  // Set kth row to sum_i(coefficients[i] * x[variables[i]]) + constant
+  // (merged and zero terms leave zeros at the end of the row, removed by CompactLinearEquations)
+  assert((k >= 0) && (k < nlinear_equations));
+  int start = linear_equation_starts[k];
+  int end = linear_equation_starts[k+1];
+  assert(nterms <= end - start);
+
+  // Copy terms into row
+  int count = CopyLinearTerms(nvariables, nterms, variables, coefficients, 
+    &linear_variables[start], &linear_coefficients[start]);
+  for (int i = start + count; i < end; i++) {
+    linear_variables[i] = 0;
+    linear_coefficients[i] = 0;
+  }
+
+  // Set constant
+  linear_constants[k] = constant;
+}
+
+
+
+void RNSystemOfEquations::
+CompactLinearEquations(void)
+{
+  // Check linear equations
+  if (!linear_equation_starts) return;
+
+  // Remove zero terms, and then rows without terms (in place, keeping order)
+  int nequations = 0;
+  int nterms = 0;
+  int start = linear_equation_starts[0];
+  for (int k = 0; k < nlinear_equations; k++) {
+    int end = linear_equation_starts[k+1];
+    int count = 0;
+    for (int i = start; i < end; i++) {
+      if (linear_coefficients[i] == 0) continue;
+      linear_variables[nterms+count] = linear_variables[i];
+      linear_coefficients[nterms+count] = linear_coefficients[i];
+      count++;
+    }
+    start = end;
+    if (count == 0) continue;
+    linear_constants[nequations] = linear_constants[k];
+    linear_equation_starts[nequations+1] = nterms + count;
+    nterms += count;
+    nequations++;
+  }
+
+  // Check if anything was removed
+  if ((nequations == nlinear_equations) && (nterms == start)) return;
+  nlinear_equations = nequations;
+
+  // Invalidate normal matrix pattern
+  if (normal_matrix_starts) InvalidateNormalMatrixPattern();
+}
+
+
+
 void RNSystemOfEquations::
 SetLowerBound(int variable, RNScalar bound)
 {
@@ -307,7 +747,7 @@ SetUpperBound(int variable, RNScalar bound)
   if (!upper_bounds) {
     upper_bounds = new RNScalar [ nvariables ];
     for (int i = 0; i < nvariables; i++) {
-      upper_bounds[i] = -FLT_MAX;
+      upper_bounds[i] = FLT_MAX;
     }
   }
 
@@ -317,14 +757,61 @@ SetUpperBound(int variable, RNScalar bound)
 
 
 
+int RNSystemOfEquations::
+NThreads(void) const
+{
+  // Return number of threads to use for evaluation
+  int nthreads = (max_threads > 0) ? max_threads : RNNumProcessors();
+  if (nthreads > NEquations()) nthreads = NEquations();
+  if (nthreads < 1) nthreads = 1;
+  return nthreads;
+}
+
+
+
+static void
+EvaluateResidualsThread(int thread_index, int nthreads, void *data)
+{
+  // Evaluate residuals for this thread's block of equations
+  RNSystemEvaluation *evaluation = (RNSystemEvaluation *) data;
+  int start, end;
+  RNThreadRange(evaluation->end - evaluation->start, thread_index, nthreads, start, end);
+  start += evaluation->start;
+  end += evaluation->start;
+  evaluation->sums[thread_index] = evaluation->system->EvaluateResidualRange(evaluation->x, evaluation->y, start, end);
+}
+
+
+
+static RNScalar
+EvaluateResidualsInParallel(const RNSystemOfEquations *system, const RNScalar *x, RNScalar *y, int nthreads)
+{
+  // Evaluate blocks of equations in separate threads
+  RNSystemEvaluation evaluation;
+  evaluation.system = system;
+  evaluation.x = x;
+  evaluation.start = 0;
+  evaluation.end = system->NEquations();
+  evaluation.y = y;
+  evaluation.sums = new RNScalar [ nthreads ];
+  RNRunThreads(nthreads, EvaluateResidualsThread, &evaluation);
+
+  // Add sums of squared residuals in thread order
+  RNScalar sum = 0;
+  for (int t = 0; t < nthreads; t++) sum += evaluation.sums[t];
+  delete [] evaluation.sums;
+  return sum;
+}
+
+
+
 void RNSystemOfEquations::
 EvaluateResiduals(const RNScalar *x, RNScalar *y) const
 {
-  // Evaluate equations
-  for (int i = 0; i < NEquations(); i++) {
-    RNEquation *equation = Equation(i);
-    y[i] = equation->Evaluate(x);
-  }
+  // Evaluate all equations (in blocks, one per thread)
+  int nthreads = NThreads();
+  if (nthreads == 1) EvaluateResidualRange(x, y, 0, NEquations());
+  else EvaluateResidualsInParallel(this, x, y, nthreads);
 }
 
 
@@ -336,20 +823,58 @@ SumOfSquaredResiduals(const RNScalar *x) const
   if (NVariables() == 0) return 0.0;
   if (NEquations() == 0) return 0.0;
   
-  // Allocate residuals
-  RNScalar *y = new RNScalar [ NEquations() ];
-  
-  // Compute residuals
-  EvaluateResiduals(x, y);
+  // Sum squared residuals of equations (without storing residuals)
+  int nthreads = NThreads();
+  if (nthreads == 1) return EvaluateResidualRange(x, NULL, 0, NEquations());
+  else return EvaluateResidualsInParallel(this, x, NULL, nthreads);
+}
 
-  // Sum squared residuals
+
+
+RNScalar RNSystemOfEquations::
+EvaluateResidualRange(const RNScalar *x, RNScalar *y, int start, int end) const
+{
+  // Evaluate equations with indices in [start, end), store residuals in y 
+  // (if not NULL, indexed by equation), and return their sum of squared residuals
+  if ((end < 0) || (end > NEquations())) end = NEquations();
+  if (start < 0) start = 0;
   RNScalar sum = 0;
-  for (int i = 0; i < NEquations(); i++) {
-    sum += y[i] * y[i];
+
+  // Evaluate expression equations
+  int expression_end = (end < NExpressionEquations()) ? end : NExpressionEquations();
+  if (tape_code_starts) {
+    RNScalar *stack = new RNScalar [ tape_max_depth ];
+    for (int i = start; i < expression_end; i++) {
+      RNScalar residual = EvaluateTapeEquation(i, x, stack);
+      if (y) y[i] = residual;
+      sum += residual * residual;
+    }
+    delete [] stack;
+  }
+  else {
+    for (int i = start; i < expression_end; i++) {
+      RNScalar residual = Equation(i)->Evaluate(x);
+      if (y) y[i] = residual;
+      sum += residual * residual;
+    }
   }
 
-  // Free residuals
-  delete [] y;
+  // Evaluate instances of equation families
+  if (end > NExpressionEquations()) {
+    int family_start = (start > NExpressionEquations()) ? start - NExpressionEquations() : 0;
+    RNScalar *yfamily = (y) ? &y[NExpressionEquations()] : NULL;
+    sum += EvaluateEquationFamilies(x, yfamily, NULL, NULL, family_start, end - NExpressionEquations());
+  }
+
+  // Evaluate linear equations
+  int linear_offset = NExpressionEquations() + nfamily_instances;
+  int linear_start = (start > linear_offset) ? start - linear_offset : 0;
+  int linear_end = end - linear_offset;
+  for (int k = linear_start; k < linear_end; k++) {
+    RNScalar residual = EvaluateLinearEquation(k, x);
+    if (y) y[linear_offset + k] = residual;
+    sum += residual * residual;
+  }
 
   // Return sum of squared residuals
   return sum;
@@ -357,82 +882,1623 @@ SumOfSquaredResiduals(const RNScalar *x) const
 
 
 
-void RNSystemOfEquations::
-PrintEquations(FILE *fp) const
+////////////////////////////////////////////////////////////////////////
+// Tape functions
+////////////////////////////////////////////////////////////////////////
+
+// Tape instructions (each pushes one value on a stack; binary operations
+// pop their two operands first).  A polynomial is stored as its number of 
+// terms followed by each term's number of variables and variable indices
+// (local to the equation) in the codes, and its coefficient and exponents
+// in the constants.
+enum {
+  RN_TAPE_ZERO,
+  RN_TAPE_POLYNOMIAL,
+  RN_TAPE_ADD,
+  RN_TAPE_SUBTRACT,
+  RN_TAPE_MULTIPLY,
+  RN_TAPE_DIVIDE,
+  RN_TAPE_POW,
+  RN_TAPE_POW_CONSTANT_EXPONENT
+};
+
+
+
+struct TapeBuffer {
+  int *codes;
+  int ncodes, ncodes_allocated;
+  RNScalar *constants;
+  int nconstants, nconstants_allocated;
+  int *variables;
+  int nvariables, nvariables_allocated;
+  int *variable_marks;
+  int *variable_to_index;
+  int current_mark;
+  int variables_start;
+};
+
+
+
+static void
+ReserveTape(TapeBuffer& tape, int ncodes, int nconstants, int nvariables)
 {
-  // Check file
-  if (!fp) fp = stdout;
-  
-  // Print equation
-  fprintf(fp, "fp, %d %d %d\n", NEquations(), NVariables(), NPartialDerivatives());
-  for (int i = 0; i < NEquations(); i++) {
-    RNEquation *equation = Equation(i);
-    equation->Print(fp);
+  // Make room for more codes, constants, and variables (doubling sizes)
+  if (tape.ncodes + ncodes > tape.ncodes_allocated) {
+    int nallocated = 2 * (tape.ncodes + ncodes);
+    int *codes = new int [ nallocated ];
+    for (int i = 0; i < tape.ncodes; i++) codes[i] = tape.codes[i];
+    if (tape.codes) delete [] tape.codes;
+    tape.codes = codes;
+    tape.ncodes_allocated = nallocated;
+  }
+  if (tape.nconstants + nconstants > tape.nconstants_allocated) {
+    int nallocated = 2 * (tape.nconstants + nconstants);
+    RNScalar *constants = new RNScalar [ nallocated ];
+    for (int i = 0; i < tape.nconstants; i++) constants[i] = tape.constants[i];
+    if (tape.constants) delete [] tape.constants;
+    tape.constants = constants;
+    tape.nconstants_allocated = nallocated;
+  }
+  if (tape.nvariables + nvariables > tape.nvariables_allocated) {
+    int nallocated = 2 * (tape.nvariables + nvariables);
+    int *variables = new int [ nallocated ];
+    for (int i = 0; i < tape.nvariables; i++) variables[i] = tape.variables[i];
+    if (tape.variables) delete [] tape.variables;
+    tape.variables = variables;
+    tape.nvariables_allocated = nallocated;
   }
 }
 
 
 
-void RNSystemOfEquations::
-PrintValues(const RNScalar *x, FILE *fp) const
+static void
+LowerExpression(const RNAlgebraic *expression, TapeBuffer& tape, 
+  int& ninstructions, int& depth, int& max_depth)
 {
-  // Check file
-  if (!fp) fp = stdout;
-  
-  // Print values
-  fprintf(fp, "Values: %d\n", NVariables());
-  for (int i = 0; i < NVariables(); i++) {
-    fprintf(fp, "  %12d %12.6f ", i, x[i]);
-    if ((i > 0) && ((i % 6) == 0)) fprintf(fp, "\n");
+  // Append instructions for expression to tape in postfix order
+  switch (expression->Operation()) {
+  case RN_ZERO_OPERATION: 
+    ReserveTape(tape, 1, 0, 0);
+    tape.codes[tape.ncodes++] = RN_TAPE_ZERO;
+    break;
+
+  case RN_POLYNOMIAL_OPERATION: {
+    // Make room for polynomial
+    const RNPolynomial *polynomial = expression->Polynomial();
+    int nterm_variables = 0;
+    for (int i = 0; i < polynomial->NTerms(); i++) nterm_variables += polynomial->Term(i)->NVariables();
+    ReserveTape(tape, 2 + polynomial->NTerms() + nterm_variables, polynomial->NTerms() + nterm_variables, nterm_variables);
+
+    // Append polynomial
+    tape.codes[tape.ncodes++] = RN_TAPE_POLYNOMIAL;
+    tape.codes[tape.ncodes++] = polynomial->NTerms();
+    for (int i = 0; i < polynomial->NTerms(); i++) {
+      RNPolynomialTerm *term = polynomial->Term(i);
+      tape.codes[tape.ncodes++] = term->NVariables();
+      tape.constants[tape.nconstants++] = term->Coefficient();
+      for (int j = 0; j < term->NVariables(); j++) {
+        // Append variable to equation's variables, if first occurrence
+        int v = term->Variable(j);
+        if (tape.variable_marks[v] != tape.current_mark) {
+          tape.variable_marks[v] = tape.current_mark;
+          tape.variable_to_index[v] = tape.nvariables - tape.variables_start;
+          tape.variables[tape.nvariables++] = v;
+        }
+
+        // Append variable index (local to equation) and exponent
+        tape.codes[tape.ncodes++] = tape.variable_to_index[v];
+        tape.constants[tape.nconstants++] = term->Exponent(j);
+      }
+    }
+    break; }
+
+  default: {
+    // Append operands
+    LowerExpression(expression->Operand(0), tape, ninstructions, depth, max_depth);
+    LowerExpression(expression->Operand(1), tape, ninstructions, depth, max_depth);
+
+    // Append operation
+    int code = RN_TAPE_ZERO;
+    switch (expression->Operation()) {
+    case RN_ADD_OPERATION: code = RN_TAPE_ADD; break;
+    case RN_SUBTRACT_OPERATION: code = RN_TAPE_SUBTRACT; break;
+    case RN_MULTIPLY_OPERATION: code = RN_TAPE_MULTIPLY; break;
+    case RN_DIVIDE_OPERATION: code = RN_TAPE_DIVIDE; break;
+    case RN_POW_OPERATION: code = (expression->Operand(1)->IsConstant()) ? RN_TAPE_POW_CONSTANT_EXPONENT : RN_TAPE_POW; break;
+    default: RNAbort("Invalid algebraic operation: %d", expression->Operation()); break;
+    }
+    ReserveTape(tape, 1, 0, 0);
+    tape.codes[tape.ncodes++] = code;
+    depth -= 2;
+    break; }
   }
-  fprintf(fp, "\n");
+
+  // Update counts for pushed value
+  ninstructions++;
+  depth++;
+  if (depth > max_depth) max_depth = depth;
 }
 
 
 
-void RNSystemOfEquations::
-PrintResiduals(const RNScalar *x, FILE *fp) const
+static inline RNScalar
+EvaluateTapeTerm(const int *codes, const RNScalar *constants, const int *variables, const RNScalar *x)
 {
-  // Check file
-  if (!fp) fp = stdout;
-  
-  // Print residuals
-  double sum = 0;
-  double *y = new double [ NEquations() ];
-  EvaluateResiduals(x, y);
-  fprintf(fp, "Residuals: %d\n", NEquations());
-  for (int i = 0; i < NEquations(); i++) {
-    fprintf(fp, "  %12d %12.6f\n", i, y[i]);
-    sum += y[i]*y[i];
+  // Evaluate the term (as in RNPolynomialTerm::Evaluate)
+  RNScalar result = constants[0];
+  for (int i = 1; i <= codes[0]; i++) {
+    RNScalar xk = x[variables[codes[i]]];
+    RNScalar e = constants[i];
+    if (e == 1.0) result *= xk;
+    else if (e == 2.0) result *= xk * xk;
+    else if ((e < 0) && RNIsZero(xk)) result *= RN_INFINITY;
+    else result *= pow(xk, e);
+  }
+  return result;
+}
+
+
+
+static inline void
+AccumulateTapeTermGradient(const int *codes, const RNScalar *constants, const int *variables, 
+  const RNScalar *x, RNScalar scale, RNScalar *gradient)
+{
+  // Add scale times partial derivatives (as in RNPolynomialTerm::EvaluateWithGradient)
+  for (int j = 1; j <= codes[0]; j++) {
+    RNScalar result = scale * constants[0];
+    for (int i = 1; i <= codes[0]; i++) {
+      RNScalar xk = x[variables[codes[i]]];
+      RNScalar e = constants[i];
+      if (i == j) {
+        if (e == 1.0) result *= 1.0;
+        else if (e == 2.0) result *= 2.0 * xk;
+        else if ((e < 1.0) && RNIsZero(xk)) result *= RN_INFINITY;
+        else result *= e * pow(xk, e - 1.0);
+      }
+      else {
+        if (e == 1.0) result *= xk;
+        else if (e == 2.0) result *= xk * xk;
+        else if ((e < 0) && RNIsZero(xk)) result *= RN_INFINITY;
+        else result *= pow(xk, e);
+      }
+    }
+    gradient[codes[j]] += result;
+  }
+}
+
+
+
+static inline RNScalar
+EvaluateTapeOperation(int code, RNScalar v0, RNScalar v1)
+{
+  // Return result of binary operation (as in RNAlgebraic::Evaluate)
+  switch (code) {
+  case RN_TAPE_ADD: return v0 + v1;
+  case RN_TAPE_SUBTRACT: return v0 - v1;
+  case RN_TAPE_MULTIPLY: return v0 * v1;
+  case RN_TAPE_DIVIDE: return (RNIsZero(v1, RN_SMALL_EPSILON)) ? RN_INFINITY : v0 / v1;
+  default: return (v0 == 0) ? 0 : ((v1 == 0) ? 1 : pow(v0, v1));
   }
-  fprintf(fp, "%g\n", sum);
-  delete [] y;
 }
 
 
 
 void RNSystemOfEquations::
-PrintPartialDerivatives(const RNScalar *x, FILE *fp) const
+Freeze(void)
 {
-  // Check file
-  if (!fp) fp = stdout;
-  
-  // Print partial derivatives
-  for (int j = 0; j < NEquations(); j++) {
-    RNEquation *equation = Equation(j);
-    for (int i = 0; i < NVariables(); i++) 
-      fprintf(fp, "(%d %d : %g)  ", j, i, equation->PartialDerivative(x, i));
-    fprintf(fp, "\n");
+  // Check if already frozen
+  if (tape_code_starts) return;
+  int nexpressions = NExpressionEquations();
+
+  // Allocate offsets
+  tape_code_starts = new int [ nexpressions + 1 ];
+  tape_constant_starts = new int [ nexpressions + 1 ];
+  tape_variable_starts = new int [ nexpressions + 1 ];
+
+  // Allocate tape (grows as equations are appended)
+  TapeBuffer tape = { NULL, 0, 0, NULL, 0, 0, NULL, 0, 0, variable_marks, variable_to_index, 0, 0 };
+  ReserveTape(tape, 8 * nexpressions + 1, 4 * nexpressions + 1, 2 * nexpressions + 1);
+
+  // Append instructions, constants, and variables of each equation
+  tape_max_instructions = 1;
+  tape_max_depth = 1;
+  for (int i = 0; i < nexpressions; i++) {
+    RNEquation *equation = Equation(i);
+    tape_code_starts[i] = tape.ncodes;
+    tape_constant_starts[i] = tape.nconstants;
+    tape_variable_starts[i] = tape.nvariables;
+
+    // Append instructions and variables (in same order as UpdateVariableIndex)
+    int ninstructions = 0, depth = 0;
+    tape.current_mark = current_mark++;
+    tape.variables_start = tape.nvariables;
+    LowerExpression(equation, tape, ninstructions, depth, tape_max_depth);
+    if (ninstructions > tape_max_instructions) tape_max_instructions = ninstructions;
   }
+
+  // Remember tape
+  tape_code_starts[nexpressions] = tape.ncodes;
+  tape_constant_starts[nexpressions] = tape.nconstants;
+  tape_variable_starts[nexpressions] = tape.nvariables;
+  tape_codes = tape.codes;
+  tape_constants = tape.constants;
+  tape_variables = tape.variables;
 }
 
 
 
 void RNSystemOfEquations::
-Print(FILE *fp) const
+Unfreeze(void)
 {
-  // Print equations
-  PrintEquations(fp);
+  // Delete tape
+  if (tape_code_starts) delete [] tape_code_starts;
+  if (tape_codes) delete [] tape_codes;
+  if (tape_constant_starts) delete [] tape_constant_starts;
+  if (tape_constants) delete [] tape_constants;
+  if (tape_variable_starts) delete [] tape_variable_starts;
+  if (tape_variables) delete [] tape_variables;
+  tape_code_starts = NULL;
+  tape_codes = NULL;
+  tape_constant_starts = NULL;
+  tape_constants = NULL;
+  tape_variable_starts = NULL;
+  tape_variables = NULL;
+  tape_max_instructions = 0;
+  tape_max_depth = 0;
+}
+
+
+
+RNScalar RNSystemOfEquations::
+EvaluateTapeEquation(int k, const RNScalar *x, RNScalar *stack) const
+{
+  // Get instructions of kth expression equation
+  const int *codes = &tape_codes[tape_code_starts[k]];
+  const int *end = &tape_codes[tape_code_starts[k+1]];
+  const RNScalar *constants = &tape_constants[tape_constant_starts[k]];
+  const int *variables = &tape_variables[tape_variable_starts[k]];
+
+  // Execute instructions (stack has tape_max_depth entries)
+  int depth = 0;
+  while (codes < end) {
+    int code = *(codes++);
+    if (code == RN_TAPE_ZERO) {
+      stack[depth++] = 0;
+    }
+    else if (code == RN_TAPE_POLYNOMIAL) {
+      int nterms = *(codes++);
+      RNScalar sum = 0;
+      for (int i = 0; i < nterms; i++) {
+        sum += EvaluateTapeTerm(codes, constants, variables, x);
+        constants += codes[0] + 1;
+        codes += codes[0] + 1;
+      }
+      stack[depth++] = sum;
+    }
+    else {
+      depth--;
+      stack[depth-1] = EvaluateTapeOperation(code, stack[depth-1], stack[depth]);
+    }
+  }
+
+  // Return value
+  assert(depth == 1);
+  return stack[0];
+}
+
+
+
+RNScalar RNSystemOfEquations::
+EvaluateTapeEquationWithGradient(int k, const RNScalar *x, RNScalar *gradient, RNScalar *values, int *offsets) const
+{
+  // Adds partial derivatives of kth expression equation to gradient (indexed by position 
+  // in its tape variables) and returns its value.  The forward pass records the operand 
+  // values and tape offsets of every instruction in values and offsets (2*tape_max_instructions
+  // entries each), and the reverse pass propagates adjoints through them, using 
+  // values[2*tape_max_instructions ...] (tape_max_depth entries) as a stack
+  const int *codes = &tape_codes[tape_code_starts[k]];
+  const int *end = &tape_codes[tape_code_starts[k+1]];
+  const RNScalar *constants = &tape_constants[tape_constant_starts[k]];
+  const int *variables = &tape_variables[tape_variable_starts[k]];
+  RNScalar *stack = &values[2*tape_max_instructions];
+
+  // Forward pass
+  int ninstructions = 0, depth = 0;
+  const int *c = codes;
+  const RNScalar *e = constants;
+  while (c < end) {
+    offsets[2*ninstructions] = c - codes;
+    offsets[2*ninstructions+1] = e - constants;
+    int code = *(c++);
+    if (code == RN_TAPE_ZERO) {
+      stack[depth++] = 0;
+    }
+    else if (code == RN_TAPE_POLYNOMIAL) {
+      int nterms = *(c++);
+      RNScalar sum = 0;
+      for (int i = 0; i < nterms; i++) {
+        sum += EvaluateTapeTerm(c, e, variables, x);
+        e += c[0] + 1;
+        c += c[0] + 1;
+      }
+      stack[depth++] = sum;
+    }
+    else {
+      depth--;
+      RNScalar v0 = values[2*ninstructions] = stack[depth-1];
+      RNScalar v1 = values[2*ninstructions+1] = stack[depth];
+      stack[depth-1] = EvaluateTapeOperation(code, v0, v1);
+    }
+    ninstructions++;
+  }
+
+  // Remember value
+  assert(depth == 1);
+  RNScalar value = stack[0];
+
+  // Reverse pass (adjoints of second operands are on top of stack, 
+  // since their instructions are visited first)
+  depth = 0;
+  stack[depth++] = 1.0;
+  for (int j = ninstructions-1; j >= 0; j--) {
+    RNScalar adjoint = stack[--depth];
+    c = &codes[offsets[2*j]];
+    e = &constants[offsets[2*j+1]];
+    int code = *(c++);
+    if (code == RN_TAPE_ZERO) {
+      continue;
+    }
+    else if (code == RN_TAPE_POLYNOMIAL) {
+      int nterms = *(c++);
+      for (int i = 0; i < nterms; i++) {
+        AccumulateTapeTermGradient(c, e, variables, x, adjoint, gradient);
+        e += c[0] + 1;
+        c += c[0] + 1;
+      }
+    }
+    else {
+      RNScalar v0 = values[2*j];
+      RNScalar v1 = values[2*j+1];
+      RNScalar adjoint0 = 0, adjoint1 = 0;
+      if (code == RN_TAPE_ADD) {
+        adjoint0 = adjoint;
+        adjoint1 = adjoint;
+      }
+      else if (code == RN_TAPE_SUBTRACT) {
+        adjoint0 = adjoint;
+        adjoint1 = -adjoint;
+      }
+      else if (code == RN_TAPE_MULTIPLY) {
+        adjoint0 = adjoint * v1;
+        adjoint1 = adjoint * v0;
+      }
+      else if (code == RN_TAPE_DIVIDE) {
+        RNScalar v1_squared = v1 * v1;
+        if (RNIsZero(v1_squared, RN_SMALL_EPSILON)) adjoint0 = adjoint1 = RN_INFINITY;
+        else { adjoint0 = adjoint * v1 / v1_squared; adjoint1 = -adjoint * v0 / v1_squared; }
+      }
+      else if (code == RN_TAPE_POW_CONSTANT_EXPONENT) {
+        adjoint0 = adjoint * v1 * pow(v0, v1-1.0);
+      }
+      else if (!RNIsZero(v0, RN_SMALL_EPSILON)) {
+        RNScalar power = pow(v0, v1);
+        adjoint0 = adjoint * power * v1 / v0;
+        adjoint1 = adjoint * power * log(v0);
+      }
+      stack[depth++] = adjoint0;
+      stack[depth++] = adjoint1;
+    }
+  }
+
+  // Return value
+  return value;
+}
+
+
+
+static int
+CompareInts(const void *data1, const void *data2)
+{
+  // Compare integers (for qsort)
+  int i1 = *((const int *) data1);
+  int i2 = *((const int *) data2);
+  if (i1 < i2) return -1;
+  else if (i1 > i2) return 1;
+  else return 0;
+}
+
+
+
+static void
+AccumulateNormalEquations(const int *starts, const int *rows, RNScalar *JTJ, RNScalar *JTr,
+  int count, const int *variables, const RNScalar *gradient, RNScalar residual)
+{
+  // Add contribution of one equation (row of J) to upper triangle of J^T*J and to J^T*r
+  for (int a = 0; a < count; a++) {
+    RNScalar ga = gradient[a];
+    if (ga == 0) continue;
+    int va = variables[a];
+    JTr[va] += ga * residual;
+    for (int b = 0; b < count; b++) {
+      RNScalar gb = gradient[b];
+      if (gb == 0) continue;
+      int vb = variables[b];
+      if (va > vb) continue;
+
+      // Binary search for row va in column vb
+      int lo = starts[vb];
+      int hi = starts[vb+1] - 1;
+      while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (rows[mid] < va) lo = mid + 1;
+        else hi = mid;
+      }
+
+      // Add product of partial derivatives
+      assert(rows[lo] == va);
+      JTJ[lo] += ga * gb;
+    }
+  }
+}
+
+
+
+void RNSystemOfEquations::
+InvalidateNormalMatrixPattern(void)
+{
+  // Delete sparsity pattern of normal matrix
+  if (normal_matrix_starts) delete [] normal_matrix_starts;
+  if (normal_matrix_rows) delete [] normal_matrix_rows;
+  normal_matrix_starts = NULL;
+  normal_matrix_rows = NULL;
+
+  // Delete buffers for normal equations of threads (sized for the pattern)
+  UpdateNormalThreadBuffers(0);
+}
+
+
+
+void RNSystemOfEquations::
+UpdateNormalThreadBuffers(int nthreads)
+{
+  // Check if buffers are up to date
+  if (nthreads == normal_nthreads) return;
+
+  // Delete previous buffers
+  for (int t = 0; t < normal_nthreads; t++) {
+    if (normal_thread_JTJ[t]) delete [] normal_thread_JTJ[t];
+    if (normal_thread_JTr[t]) delete [] normal_thread_JTr[t];
+    delete [] normal_thread_marks[t];
+  }
+  if (normal_thread_JTJ) delete [] normal_thread_JTJ;
+  if (normal_thread_JTr) delete [] normal_thread_JTr;
+  if (normal_thread_marks) delete [] normal_thread_marks;
+  normal_thread_JTJ = NULL;
+  normal_thread_JTr = NULL;
+  normal_thread_marks = NULL;
+  normal_nthreads = 0;
+  if (nthreads <= 0) return;
+
+  // Allocate scratch arrays for every thread, and J^T*J and J^T*r for all threads but the first
+  int nnz = normal_matrix_starts[nvariables];
+  normal_thread_JTJ = new RNScalar * [ nthreads ];
+  normal_thread_JTr = new RNScalar * [ nthreads ];
+  normal_thread_marks = new int * [ nthreads ];
+  for (int t = 0; t < nthreads; t++) {
+    normal_thread_JTJ[t] = (t > 0) ? new RNScalar [ nnz ] : NULL;
+    normal_thread_JTr[t] = (t > 0) ? new RNScalar [ nvariables ] : NULL;
+    normal_thread_marks[t] = new int [ 3*nvariables ];
+  }
+  normal_nthreads = nthreads;
+}
+
+
+
+void RNSystemOfEquations::
+UpdateNormalMatrixPattern(void)
+{
+  // Check if pattern is up to date
+  if (normal_matrix_starts) return;
+
+  // Count variables in each equation (rows of J)
+  int m = NEquations();
+  int *jrow_starts = new int [ m + 1 ];
+  jrow_starts[0] = 0;
+  for (int i = 0; i < NExpressionEquations(); i++) {
+    RNEquation *equation = Equation(i);
+    int count = 0;
+    equation->UpdateVariableIndex(nvariables, count, variable_marks, current_mark++);
+    jrow_starts[i+1] = jrow_starts[i] + count;
+  }
+  for (int k = 0; k < nfamily_instances; k++) {
+    int i = NExpressionEquations() + k;
+    jrow_starts[i+1] = jrow_starts[i] + EquationFamilyInstanceNVariables(k);
+  }
+  for (int k = 0; k < nlinear_equations; k++) {
+    int i = NExpressionEquations() + nfamily_instances + k;
+    jrow_starts[i+1] = jrow_starts[i] + LinearEquationNTerms(k);
+  }
+
+  // Fill variables in each equation
+  int jnnz = jrow_starts[m];
+  int *jrow_variables = new int [ jnnz ];
+  for (int i = 0; i < NExpressionEquations(); i++) {
+    RNEquation *equation = Equation(i);
+    int count = 0;
+    equation->UpdateVariableIndex(nvariables, count, variable_marks, current_mark++, index_to_variable);
+    for (int j = 0; j < count; j++) jrow_variables[jrow_starts[i]+j] = index_to_variable[j];
+  }
+  for (int k = 0; k < nfamily_instances; k++) {
+    int i = NExpressionEquations() + k;
+    const int *variables = EquationFamilyInstanceVariables(k);
+    for (int j = 0; j < EquationFamilyInstanceNVariables(k); j++) jrow_variables[jrow_starts[i]+j] = variables[j];
+  }
+  for (int k = 0; k < nlinear_equations; k++) {
+    int i = NExpressionEquations() + nfamily_instances + k;
+    const int *variables = LinearEquationVariables(k);
+    for (int j = 0; j < LinearEquationNTerms(k); j++) jrow_variables[jrow_starts[i]+j] = variables[j];
+  }
+
+  // Build transpose (equations containing each variable)
+  int *jcol_starts = new int [ nvariables + 1 ];
+  int *jcol_equations = new int [ jnnz ];
+  for (int v = 0; v <= nvariables; v++) jcol_starts[v] = 0;
+  for (int j = 0; j < jnnz; j++) jcol_starts[jrow_variables[j]+1]++;
+  for (int v = 0; v < nvariables; v++) jcol_starts[v+1] += jcol_starts[v];
+  int *jcol_counts = new int [ nvariables ];
+  for (int v = 0; v < nvariables; v++) jcol_counts[v] = jcol_starts[v];
+  for (int i = 0; i < m; i++) {
+    for (int j = jrow_starts[i]; j < jrow_starts[i+1]; j++) {
+      jcol_equations[jcol_counts[jrow_variables[j]]++] = i;
+    }
+  }
+
+  // Count entries of upper triangle in each column of J^T*J
+  int *marks = new int [ nvariables ];
+  for (int v = 0; v < nvariables; v++) marks[v] = -1;
+  normal_matrix_starts = new int [ nvariables + 1 ];
+  normal_matrix_starts[0] = 0;
+  for (int c = 0; c < nvariables; c++) {
+    int count = 0;
+    for (int j = jcol_starts[c]; j < jcol_starts[c+1]; j++) {
+      int i = jcol_equations[j];
+      for (int k = jrow_starts[i]; k < jrow_starts[i+1]; k++) {
+        int r = jrow_variables[k];
+        if ((r > c) || (marks[r] == c)) continue;
+        marks[r] = c;
+        count++;
+      }
+    }
+    normal_matrix_starts[c+1] = normal_matrix_starts[c] + count;
+  }
+
+  // Fill sorted row indices of upper triangle in each column of J^T*J
+  for (int v = 0; v < nvariables; v++) marks[v] = -1;
+  normal_matrix_rows = new int [ normal_matrix_starts[nvariables] ];
+  for (int c = 0; c < nvariables; c++) {
+    int count = normal_matrix_starts[c];
+    for (int j = jcol_starts[c]; j < jcol_starts[c+1]; j++) {
+      int i = jcol_equations[j];
+      for (int k = jrow_starts[i]; k < jrow_starts[i+1]; k++) {
+        int r = jrow_variables[k];
+        if ((r > c) || (marks[r] == c)) continue;
+        marks[r] = c;
+        normal_matrix_rows[count++] = r;
+      }
+    }
+    assert(count == normal_matrix_starts[c+1]);
+    int ncolumn_entries = normal_matrix_starts[c+1] - normal_matrix_starts[c];
+    qsort(&normal_matrix_rows[normal_matrix_starts[c]], ncolumn_entries, sizeof(int), CompareInts);
+  }
+
+  // Delete temporary data
+  delete [] jrow_starts;
+  delete [] jrow_variables;
+  delete [] jcol_starts;
+  delete [] jcol_equations;
+  delete [] jcol_counts;
+  delete [] marks;
+}
+
+
+
+int RNSystemOfEquations::
+NormalMatrixNNonzeros(void) const
+{
+  // Return number of entries in upper triangle of J^T*J
+  ((RNSystemOfEquations *) this)->UpdateNormalMatrixPattern();
+  return normal_matrix_starts[nvariables];
+}
+
+
+
+const int *RNSystemOfEquations::
+NormalMatrixColumnStarts(void) const
+{
+  // Return column starts of upper triangle of J^T*J (nvariables+1 entries)
+  ((RNSystemOfEquations *) this)->UpdateNormalMatrixPattern();
+  return normal_matrix_starts;
+}
+
+
+
+const int *RNSystemOfEquations::
+NormalMatrixRowIndices(void) const
+{
+  // Return sorted row indices of upper triangle of J^T*J
+  ((RNSystemOfEquations *) this)->UpdateNormalMatrixPattern();
+  return normal_matrix_rows;
+}
+
+
+
+static void
+EvaluateNormalEquationsThread(int thread_index, int nthreads, void *data)
+{
+  // Accumulate normal equations for this thread's block of equations
+  RNSystemEvaluation *evaluation = (RNSystemEvaluation *) data;
+  const RNSystemOfEquations *system = evaluation->system;
+  int start, end;
+  RNThreadRange(evaluation->end - evaluation->start, thread_index, nthreads, start, end);
+  start += evaluation->start;
+  end += evaluation->start;
+
+  // Accumulate with scratch arrays of this thread
+  int n = system->NVariables();
+  int *marks = evaluation->marks[thread_index];
+  for (int i = 0; i < n; i++) marks[i] = 0;
+  int mark = 1;
+  system->AccumulateNormalEquationRange(evaluation->x, evaluation->JTJ[thread_index], evaluation->JTr[thread_index],
+    start, end, marks, mark, &marks[n], &marks[2*n]);
+}
+
+
+
+int RNSystemOfEquations::
+EvaluateNormalEquations(const RNScalar *x, RNScalar *JTJ, RNScalar *JTr, int start, int end) const
+{
+  // Accumulate upper triangle of J^T*J (in pattern of NormalMatrixRowIndices)
+  // and J^T*r, with J and r evaluated at x, without forming J
+  // Only equations with indices in [start, end) contribute (end < 0 means all)
+  ((RNSystemOfEquations *) this)->UpdateNormalMatrixPattern();
+  int nnz = normal_matrix_starts[nvariables];
+  if ((end < 0) || (end > NEquations())) end = NEquations();
+  if (start < 0) start = 0;
+
+  // Initialize results
+  for (int i = 0; i < nnz; i++) JTJ[i] = 0;
+  for (int i = 0; i < nvariables; i++) JTr[i] = 0;
+
+  // Accumulate serially (with scratch arrays of system)
+  int nthreads = NThreads();
+  if ((nthreads == 1) || (end - start < nthreads)) {
+    RNSystemOfEquations *tmp = (RNSystemOfEquations *) this;
+    AccumulateNormalEquationRange(x, JTJ, JTr, start, end, 
+      tmp->variable_marks, tmp->current_mark, tmp->index_to_variable, tmp->variable_to_index);
+    return 1;
+  }
+
+  // Get buffers of threads (kept by system between calls)
+  ((RNSystemOfEquations *) this)->UpdateNormalThreadBuffers(nthreads);
+  normal_thread_JTJ[0] = JTJ;
+  normal_thread_JTr[0] = JTr;
+  for (int t = 1; t < nthreads; t++) {
+    for (int i = 0; i < nnz; i++) normal_thread_JTJ[t][i] = 0;
+    for (int i = 0; i < nvariables; i++) normal_thread_JTr[t][i] = 0;
+  }
+
+  // Accumulate blocks of equations in separate threads
+  RNSystemEvaluation evaluation;
+  evaluation.system = this;
+  evaluation.x = x;
+  evaluation.start = start;
+  evaluation.end = end;
+  evaluation.JTJ = normal_thread_JTJ;
+  evaluation.JTr = normal_thread_JTr;
+  evaluation.marks = normal_thread_marks;
+  RNRunThreads(nthreads, EvaluateNormalEquationsThread, &evaluation);
+
+  // Add results of other threads in thread order
+  for (int t = 1; t < nthreads; t++) {
+    for (int i = 0; i < nnz; i++) JTJ[i] += normal_thread_JTJ[t][i];
+    for (int i = 0; i < nvariables; i++) JTr[i] += normal_thread_JTr[t][i];
+  }
+  normal_thread_JTJ[0] = NULL;
+  normal_thread_JTr[0] = NULL;
+
+  // Return success
+  return 1;
+}
+
+
+
+void RNSystemOfEquations::
+AccumulateNormalEquationRange(const RNScalar *x, RNScalar *JTJ, RNScalar *JTr, int start, int end,
+  int *marks, int& mark, int *index_to_variable, int *variable_to_index) const
+{
+  // Add contributions of equations with indices in [start, end) to J^T*J and J^T*r
+  const int *starts = normal_matrix_starts;
+  const int *rows = normal_matrix_rows;
+
+  // Allocate temporary data
+  RNScalar *gradient = new RNScalar [ nvariables ];
+  RNScalar *tape_values = (tape_code_starts) ? new RNScalar [ 2*tape_max_instructions + tape_max_depth ] : NULL;
+  int *tape_offsets = (tape_code_starts) ? new int [ 2*tape_max_instructions ] : NULL;
+
+  // Accumulate expression equations
+  int expression_end = (end < NExpressionEquations()) ? end : NExpressionEquations();
+  for (int i = start; i < expression_end; i++) {
+    if (tape_code_starts) {
+      int count = tape_variable_starts[i+1] - tape_variable_starts[i];
+      if (count == 0) continue;
+      for (int j = 0; j < count; j++) gradient[j] = 0;
+      RNScalar residual = EvaluateTapeEquationWithGradient(i, x, gradient, tape_values, tape_offsets);
+      AccumulateNormalEquations(starts, rows, JTJ, JTr, count, &tape_variables[tape_variable_starts[i]], gradient, residual);
+      continue;
+    }
+    RNEquation *equation = Equation(i);
+    int count = 0;
+    equation->UpdateVariableIndex(nvariables, count, marks, mark++, index_to_variable, variable_to_index);
+    if (count == 0) continue;
+    for (int j = 0; j < count; j++) gradient[j] = 0;
+    RNScalar residual = equation->EvaluateWithGradient(x, gradient, variable_to_index);
+    AccumulateNormalEquations(starts, rows, JTJ, JTr, count, index_to_variable, gradient, residual);
+  }
+
+  // Accumulate instances of equation families
+  if (end > NExpressionEquations()) {
+    int family_start = (start > NExpressionEquations()) ? start - NExpressionEquations() : 0;
+    EvaluateEquationFamilies(x, NULL, JTJ, JTr, family_start, end - NExpressionEquations());
+  }
+
+  // Accumulate linear equations
+  int linear_offset = NExpressionEquations() + nfamily_instances;
+  int linear_start = (start > linear_offset) ? start - linear_offset : 0;
+  int linear_end = end - linear_offset;
+  for (int k = linear_start; k < linear_end; k++) {
+    RNScalar residual = EvaluateLinearEquation(k, x);
+    AccumulateNormalEquations(starts, rows, JTJ, JTr, LinearEquationNTerms(k), 
+      LinearEquationVariables(k), LinearEquationCoefficients(k), residual);
+  }
+
+  // Delete temporary data
+  if (tape_values) delete [] tape_values;
+  if (tape_offsets) delete [] tape_offsets;
+  delete [] gradient;
+}
+
+
+
+static void
+EvaluateJacobianThread(int thread_index, int nthreads, void *data)
+{
+  // Fill triplets of J for this thread's block of equations into buffers of this thread
+  RNSystemEvaluation *evaluation = (RNSystemEvaluation *) data;
+  const RNSystemOfEquations *system = evaluation->system;
+  int start, end;
+  RNThreadRange(evaluation->end - evaluation->start, thread_index, nthreads, start, end);
+  start += evaluation->start;
+  end += evaluation->start;
+
+  // Count triplets
+  int n = system->NVariables();
+  int *marks = new int [ 3*n ];
+  for (int i = 0; i < n; i++) marks[i] = 0;
+  int mark = 1;
+  int count = system->EvaluateJacobianRange(NULL, start, end, NULL, NULL, NULL, marks, mark, &marks[n], &marks[2*n]);
+
+  // Fill triplets
+  evaluation->triplet_rows[thread_index] = new int [ count ];
+  evaluation->triplet_columns[thread_index] = new int [ count ];
+  evaluation->triplet_values[thread_index] = new RNScalar [ count ];
+  evaluation->ntriplets[thread_index] = system->EvaluateJacobianRange(evaluation->x, start, end, 
+    evaluation->triplet_rows[thread_index], evaluation->triplet_columns[thread_index], evaluation->triplet_values[thread_index], 
+    marks, mark, &marks[n], &marks[2*n]);
+  delete [] marks;
+}
+
+
+
+int RNSystemOfEquations::
+EvaluateJacobian(const RNScalar *x, int *rows, int *columns, RNScalar *values) const
+{
+  // Fill NPartialDerivatives() triplets (row, column, value) of J evaluated at x, ordered by equation
+  int nthreads = NThreads();
+  if (nthreads == 1) {
+    RNSystemOfEquations *tmp = (RNSystemOfEquations *) this;
+    EvaluateJacobianRange(x, 0, NEquations(), rows, columns, values, 
+      tmp->variable_marks, tmp->current_mark, tmp->index_to_variable, tmp->variable_to_index);
+    return 1;
+  }
+
+  // Fill triplets for blocks of equations in separate buffers
+  RNSystemEvaluation evaluation;
+  evaluation.system = this;
+  evaluation.x = x;
+  evaluation.start = 0;
+  evaluation.end = NEquations();
+  evaluation.triplet_rows = new int * [ nthreads ];
+  evaluation.triplet_columns = new int * [ nthreads ];
+  evaluation.triplet_values = new RNScalar * [ nthreads ];
+  evaluation.ntriplets = new int [ nthreads ];
+  RNRunThreads(nthreads, EvaluateJacobianThread, &evaluation);
+
+  // Merge buffers in thread order (so triplets are ordered by equation)
+  int count = 0;
+  for (int t = 0; t < nthreads; t++) {
+    for (int k = 0; k < evaluation.ntriplets[t]; k++) {
+      rows[count] = evaluation.triplet_rows[t][k];
+      columns[count] = evaluation.triplet_columns[t][k];
+      values[count] = evaluation.triplet_values[t][k];
+      count++;
+    }
+    delete [] evaluation.triplet_rows[t];
+    delete [] evaluation.triplet_columns[t];
+    delete [] evaluation.triplet_values[t];
+  }
+  delete [] evaluation.triplet_rows;
+  delete [] evaluation.triplet_columns;
+  delete [] evaluation.triplet_values;
+  delete [] evaluation.ntriplets;
+
+  // Return success
+  return 1;
+}
+
+
+
+int RNSystemOfEquations::
+EvaluateJacobianRange(const RNScalar *x, int start, int end, int *rows, int *columns, RNScalar *values,
+  int *marks, int& mark, int *index_to_variable, int *variable_to_index) const
+{
+  // Fill triplets of J for equations with indices in [start, end), and return how many
+  // (only count them if rows is NULL)
+  int count = 0;
+
+  // Fill triplets for expression equations
+  RNScalar *gradient = (rows) ? new RNScalar [ nvariables ] : NULL;
+  int expression_end = (end < NExpressionEquations()) ? end : NExpressionEquations();
+  for (int i = start; i < expression_end; i++) {
+    RNEquation *equation = Equation(i);
+    int nv = 0;
+    equation->UpdateVariableIndex(nvariables, nv, marks, mark++, index_to_variable, variable_to_index);
+    if (!rows) { count += nv; continue; }
+    for (int j = 0; j < nv; j++) gradient[j] = 0;
+    equation->EvaluateWithGradient(x, gradient, variable_to_index);
+    for (int j = 0; j < nv; j++) {
+      rows[count] = i;
+      columns[count] = index_to_variable[j];
+      values[count] = gradient[j];
+      count++;
+    }
+  }
+  if (gradient) delete [] gradient;
+
+  // Fill triplets for instances of equation families
+  int family_start = (start > NExpressionEquations()) ? start - NExpressionEquations() : 0;
+  int family_end = (end - NExpressionEquations() < nfamily_instances) ? end - NExpressionEquations() : nfamily_instances;
+  if (family_start < family_end) {
+    // Allocate temporary data once for all instances in range (sized for largest family)
+    int max_nvariables = 1;
+    for (int f = 0; f < NEquationFamilies(); f++) {
+      RNEquationFamily *family = families.Kth(f);
+      if (family->nvariables > max_nvariables) max_nvariables = family->nvariables;
+    }
+    RNScalar *buffer = (rows) ? new RNScalar [ 2*max_nvariables + EquationFamilyInstanceScratchSize() ] : NULL;
+    RNScalar *scratch = (buffer) ? &buffer[2*max_nvariables] : NULL;
+
+    // Fill triplets for each instance
+    for (int k = family_start; k < family_end; k++) {
+      int i = NExpressionEquations() + k;
+      int nv = EquationFamilyInstanceNVariables(k);
+      if (!rows) { count += nv; continue; }
+      const int *variables = EquationFamilyInstanceVariables(k);
+      for (int j = 0; j < nv; j++) { buffer[j] = x[variables[j]]; buffer[nv+j] = 0; }
+      EvaluateEquationFamilyInstance(k, buffer, &buffer[nv], scratch);
+      for (int j = 0; j < nv; j++) {
+        rows[count] = i;
+        columns[count] = variables[j];
+        values[count] = buffer[nv+j];
+        count++;
+      }
+    }
+
+    // Delete temporary data
+    if (buffer) delete [] buffer;
+  }
+
+  // Fill triplets for linear equations
+  int linear_offset = NExpressionEquations() + nfamily_instances;
+  int linear_start = (start > linear_offset) ? start - linear_offset : 0;
+  int linear_end = end - linear_offset;
+  for (int k = linear_start; k < linear_end; k++) {
+    int nv = LinearEquationNTerms(k);
+    if (!rows) { count += nv; continue; }
+    const int *variables = LinearEquationVariables(k);
+    const RNScalar *coefficients = LinearEquationCoefficients(k);
+    for (int j = 0; j < nv; j++) {
+      rows[count] = linear_offset + k;
+      columns[count] = variables[j];
+      values[count] = coefficients[j];
+      count++;
+    }
+  }
+
+  // Return number of triplets
+  return count;
+}
+
+
+
+void RNSystemOfEquations::
+PrintEquations(FILE *fp) const
+{
+  // Check file
+  if (!fp) fp = stdout;
+  
+  // Print equation
+  fprintf(fp, "fp, %d %d %d\n", NEquations(), NVariables(), NPartialDerivatives());
+  for (int i = 0; i < NExpressionEquations(); i++) {
+    RNEquation *equation = Equation(i);
+    equation->Print(fp);
+  }
+
+  // Print instances of equation families
+  for (int f = 0; f < NEquationFamilies(); f++) {
+    RNEquationFamily *family = families.Kth(f);
+    fprintf(fp, "Family %d: ", f);
+    family->expression->Print(fp);
+    for (int i = 0; i < family->ninstances; i++) {
+      fprintf(fp, "  %g (", family->instance_weights[i]);
+      for (int j = 0; j < family->nvariables; j++) fprintf(fp, " %d", family->instance_variables[i*family->nvariables+j]);
+      fprintf(fp, " ) (");
+      for (int j = 0; j < family->nparameters; j++) fprintf(fp, " %g", family->instance_parameters[i*family->nparameters+j]);
+      fprintf(fp, " )\n");
+    }
+  }
+
+  // Print linear equations
+  for (int i = 0; i < nlinear_equations; i++) {
+    const int *variables = LinearEquationVariables(i);
+    const RNScalar *coefficients = LinearEquationCoefficients(i);
+    fprintf(fp, "{ ");
+    for (int j = 0; j < LinearEquationNTerms(i); j++) {
+      fprintf(fp, "  %g (%d^1) ", coefficients[j], variables[j]);
+    }
+    fprintf(fp, "  %g }\n", LinearEquationConstant(i));
+  }
+}
+
+
+
+void RNSystemOfEquations::
+PrintValues(const RNScalar *x, FILE *fp) const
+{
+  // Check file
+  if (!fp) fp = stdout;
+  
+  // Print values
+  fprintf(fp, "Values: %d\n", NVariables());
+  for (int i = 0; i < NVariables(); i++) {
+    fprintf(fp, "  %12d %12.6f ", i, x[i]);
+    if ((i > 0) && ((i % 6) == 0)) fprintf(fp, "\n");
+  }
+  fprintf(fp, "\n");
+}
+
+
+
+void RNSystemOfEquations::
+PrintResiduals(const RNScalar *x, FILE *fp) const
+{
+  // Check file
+  if (!fp) fp = stdout;
+  
+  // Print residuals
+  double sum = 0;
+  double *y = new double [ NEquations() ];
+  EvaluateResiduals(x, y);
+  fprintf(fp, "Residuals: %d\n", NEquations());
+  for (int i = 0; i < NEquations(); i++) {
+    fprintf(fp, "  %12d %12.6f\n", i, y[i]);
+    sum += y[i]*y[i];
+  }
+  fprintf(fp, "%g\n", sum);
+  delete [] y;
+}
+
+
+
+void RNSystemOfEquations::
+PrintPartialDerivatives(const RNScalar *x, FILE *fp) const
+{
+  // Check file
+  if (!fp) fp = stdout;
+  
+  // Print partial derivatives
+  for (int j = 0; j < NExpressionEquations(); j++) {
+    RNEquation *equation = Equation(j);
+    for (int i = 0; i < NVariables(); i++) 
+      fprintf(fp, "(%d %d : %g)  ", j, i, equation->PartialDerivative(x, i));
+    fprintf(fp, "\n");
+  }
+
+  // Print partial derivatives of instances of equation families
+  int max_nvariables = 1;
+  for (int f = 0; f < NEquationFamilies(); f++) {
+    RNEquationFamily *family = families.Kth(f);
+    if (family->nvariables > max_nvariables) max_nvariables = family->nvariables;
+  }
+  RNScalar *values = new RNScalar [ 2 * max_nvariables + EquationFamilyInstanceScratchSize() ];
+  RNScalar *gradient = &values[max_nvariables];
+  RNScalar *scratch = &values[2 * max_nvariables];
+  for (int j = 0; j < nfamily_instances; j++) {
+    const int *variables = EquationFamilyInstanceVariables(j);
+    for (int i = 0; i < EquationFamilyInstanceNVariables(j); i++) { values[i] = x[variables[i]]; gradient[i] = 0; }
+    EvaluateEquationFamilyInstance(j, values, gradient, scratch);
+    for (int i = 0; i < EquationFamilyInstanceNVariables(j); i++) 
+      fprintf(fp, "(%d %d : %g)  ", NExpressionEquations() + j, variables[i], gradient[i]);
+    fprintf(fp, "\n");
+  }
+  delete [] values;
+
+  // Print partial derivatives of linear equations
+  for (int j = 0; j < nlinear_equations; j++) {
+    const int *variables = LinearEquationVariables(j);
+    const RNScalar *coefficients = LinearEquationCoefficients(j);
+    for (int i = 0; i < LinearEquationNTerms(j); i++) 
+      fprintf(fp, "(%d %d : %g)  ", NExpressionEquations() + nfamily_instances + j, variables[i], coefficients[i]);
+    fprintf(fp, "\n");
+  }
+}
+
+
+
+void RNSystemOfEquations::
+Print(FILE *fp) const
+{
+  // Print equations
+  PrintEquations(fp);
+}
+
+
+
+////////////////////////////////////////////////////////////////////////
+// Equation family functions
+////////////////////////////////////////////////////////////////////////
+
+static inline void
+MultiplyFamilyPower(RNScalar *result, const RNScalar *x, RNScalar e, int n)
+{
+  // Multiply result by x^e for a batch of instances (as in EvaluateTapeTerm)
+  if (e == 1.0) {
+    for (int b = 0; b < n; b++) result[b] *= x[b];
+  }
+  else if (e == 2.0) {
+    for (int b = 0; b < n; b++) result[b] *= x[b] * x[b];
+  }
+  else {
+    for (int b = 0; b < n; b++) {
+      if ((e < 0) && RNIsZero(x[b])) result[b] *= RN_INFINITY;
+      else result[b] *= pow(x[b], e);
+    }
+  }
+}
+
+
+
+static inline void
+MultiplyFamilyPowerDerivative(RNScalar *result, const RNScalar *x, RNScalar e, int n)
+{
+  // Multiply result by derivative of x^e for a batch of instances (as in AccumulateTapeTermGradient)
+  if (e == 1.0) {
+    return;
+  }
+  else if (e == 2.0) {
+    for (int b = 0; b < n; b++) result[b] *= 2.0 * x[b];
+  }
+  else {
+    for (int b = 0; b < n; b++) {
+      if ((e < 1.0) && RNIsZero(x[b])) result[b] *= RN_INFINITY;
+      else result[b] *= e * pow(x[b], e - 1.0);
+    }
+  }
+}
+
+
+
+static inline void
+EvaluateFamilyTerm(const int *codes, const RNScalar *constants, const RNScalar *values, int n, RNScalar *result)
+{
+  // Evaluate term for a batch of instances
+  for (int b = 0; b < n; b++) result[b] = constants[0];
+  for (int i = 1; i <= codes[0]; i++) {
+    MultiplyFamilyPower(result, &values[codes[i]*RN_FAMILY_BATCH_SIZE], constants[i], n);
+  }
+}
+
+
+
+static inline void
+AccumulateFamilyTermGradient(const int *codes, const RNScalar *constants, const RNScalar *values, 
+  const RNScalar *adjoint, int n, RNScalar *gradients, RNScalar *result)
+{
+  // Add adjoint times partial derivatives of term for a batch of instances
+  for (int j = 1; j <= codes[0]; j++) {
+    for (int b = 0; b < n; b++) result[b] = adjoint[b] * constants[0];
+    for (int i = 1; i <= codes[0]; i++) {
+      const RNScalar *x = &values[codes[i]*RN_FAMILY_BATCH_SIZE];
+      if (i == j) MultiplyFamilyPowerDerivative(result, x, constants[i], n);
+      else MultiplyFamilyPower(result, x, constants[i], n);
+    }
+    RNScalar *gradient = &gradients[codes[j]*RN_FAMILY_BATCH_SIZE];
+    for (int b = 0; b < n; b++) gradient[b] += result[b];
+  }
+}
+
+
+
+static inline void
+EvaluateFamilyOperation(int code, int n, RNScalar *v0, const RNScalar *v1)
+{
+  // Replace v0 with result of binary operation for a batch of instances
+  switch (code) {
+  case RN_TAPE_ADD: 
+    for (int b = 0; b < n; b++) v0[b] += v1[b]; 
+    break;
+
+  case RN_TAPE_SUBTRACT: 
+    for (int b = 0; b < n; b++) v0[b] -= v1[b]; 
+    break;
+
+  case RN_TAPE_MULTIPLY: 
+    for (int b = 0; b < n; b++) v0[b] *= v1[b]; 
+    break;
+
+  default: 
+    for (int b = 0; b < n; b++) v0[b] = EvaluateTapeOperation(code, v0[b], v1[b]);
+    break;
+  }
+}
+
+
+
+static void
+EvaluateFamilyBatch(const RNEquationFamily *family, int n, const RNScalar *values, 
+  RNScalar *residuals, RNScalar *gradients, RNScalar *scratch)
+{
+  // Evaluate the family's expression for n instances, given values of its tape variables 
+  // (values[s*RN_FAMILY_BATCH_SIZE+b] is tape variable s of instance b).  If gradients 
+  // is not NULL, fill it with partial derivatives with respect to tape variables (same layout).
+  // Scratch has (max_depth + 2*ninstructions + 1)*RN_FAMILY_BATCH_SIZE entries
+  const int B = RN_FAMILY_BATCH_SIZE;
+  RNScalar *stack = scratch;
+  RNScalar *operands = &scratch[family->max_depth*B];
+  RNScalar *term = &operands[2*family->ninstructions*B];
+
+  // Forward pass (same instructions for all instances, so inner loops run over instances)
+  int depth = 0;
+  for (int j = 0; j < family->ninstructions; j++) {
+    const int *c = &family->codes[family->offsets[2*j]];
+    const RNScalar *e = &family->constants[family->offsets[2*j+1]];
+    int code = *(c++);
+    if (code == RN_TAPE_ZERO) {
+      RNScalar *s = &stack[(depth++)*B];
+      for (int b = 0; b < n; b++) s[b] = 0;
+    }
+    else if (code == RN_TAPE_POLYNOMIAL) {
+      int nterms = *(c++);
+      RNScalar *s = &stack[(depth++)*B];
+      for (int b = 0; b < n; b++) s[b] = 0;
+      for (int i = 0; i < nterms; i++) {
+        EvaluateFamilyTerm(c, e, values, n, term);
+        for (int b = 0; b < n; b++) s[b] += term[b];
+        e += c[0] + 1;
+        c += c[0] + 1;
+      }
+    }
+    else {
+      depth--;
+      RNScalar *s0 = &stack[(depth-1)*B];
+      RNScalar *s1 = &stack[depth*B];
+      if (gradients) {
+        RNScalar *v0 = &operands[2*j*B];
+        RNScalar *v1 = &operands[(2*j+1)*B];
+        for (int b = 0; b < n; b++) { v0[b] = s0[b]; v1[b] = s1[b]; }
+      }
+      EvaluateFamilyOperation(code, n, s0, s1);
+    }
+  }
+
+  // Copy values
+  assert(depth == 1);
+  for (int b = 0; b < n; b++) residuals[b] = stack[b];
+  if (!gradients) return;
+
+  // Reverse pass (as in EvaluateTapeEquationWithGradient, with a stack of adjoints per instance)
+  for (int i = 0; i < family->ntape_slots*B; i++) gradients[i] = 0;
+  for (int b = 0; b < n; b++) stack[b] = 1.0;
+  depth = 1;
+  for (int j = family->ninstructions-1; j >= 0; j--) {
+    RNScalar *adjoint = &stack[(--depth)*B];
+    const int *c = &family->codes[family->offsets[2*j]];
+    const RNScalar *e = &family->constants[family->offsets[2*j+1]];
+    int code = *(c++);
+    if (code == RN_TAPE_ZERO) {
+      continue;
+    }
+    else if (code == RN_TAPE_POLYNOMIAL) {
+      int nterms = *(c++);
+      for (int i = 0; i < nterms; i++) {
+        AccumulateFamilyTermGradient(c, e, values, adjoint, n, gradients, term);
+        e += c[0] + 1;
+        c += c[0] + 1;
+      }
+    }
+    else {
+      // Adjoint of first operand replaces adjoint of result
+      const RNScalar *v0 = &operands[2*j*B];
+      const RNScalar *v1 = &operands[(2*j+1)*B];
+      RNScalar *adjoint1 = &stack[(depth+1)*B];
+      for (int b = 0; b < n; b++) {
+        RNScalar a = adjoint[b], adjoint0 = 0;
+        adjoint1[b] = 0;
+        if (code == RN_TAPE_ADD) {
+          adjoint0 = a;
+          adjoint1[b] = a;
+        }
+        else if (code == RN_TAPE_SUBTRACT) {
+          adjoint0 = a;
+          adjoint1[b] = -a;
+        }
+        else if (code == RN_TAPE_MULTIPLY) {
+          adjoint0 = a * v1[b];
+          adjoint1[b] = a * v0[b];
+        }
+        else if (code == RN_TAPE_DIVIDE) {
+          RNScalar v1_squared = v1[b] * v1[b];
+          if (RNIsZero(v1_squared, RN_SMALL_EPSILON)) adjoint0 = adjoint1[b] = RN_INFINITY;
+          else { adjoint0 = a * v1[b] / v1_squared; adjoint1[b] = -a * v0[b] / v1_squared; }
+        }
+        else if (code == RN_TAPE_POW_CONSTANT_EXPONENT) {
+          adjoint0 = a * v1[b] * pow(v0[b], v1[b]-1.0);
+        }
+        else if (!RNIsZero(v0[b], RN_SMALL_EPSILON)) {
+          RNScalar power = pow(v0[b], v1[b]);
+          adjoint0 = a * power * v1[b] / v0[b];
+          adjoint1[b] = a * power * log(v0[b]);
+        }
+        adjoint[b] = adjoint0;
+      }
+      depth += 2;
+    }
+  }
+}
+
+
+
+int RNSystemOfEquations::
+InsertEquationFamily(RNAlgebraic *expression, int nvariables, int nparameters)
+{
+  // Insert a family of equations weight * expression(variables, parameters), with instances 
+  // inserted later, and return its index (the family takes ownership of expression)
+  int nslots = nvariables + nparameters;
+
+  // Check expression
+  int min_v = 0, max_v = -1;
+  expression->UpdateVariableRange(min_v, max_v);
+  if ((nvariables <= 0) || (nparameters < 0) || (min_v < 0) || (max_v >= nslots)) {
+    fprintf(stderr, "Equation family has variable outside %d variables and %d parameters\n", nvariables, nparameters);
+    delete expression;
+    return -1;
+  }
+
+  // Lower expression into tape (tape variables are template variables and parameters, in order of occurrence)
+  int *slot_marks = new int [ nslots ];
+  int *slot_to_index = new int [ nslots ];
+  for (int i = 0; i < nslots; i++) slot_marks[i] = 0;
+  TapeBuffer tape = { NULL, 0, 0, NULL, 0, 0, NULL, 0, 0, slot_marks, slot_to_index, 1, 0 };
+  ReserveTape(tape, 16, 8, nslots);
+  int ninstructions = 0, depth = 0, max_depth = 0;
+  LowerExpression(expression, tape, ninstructions, depth, max_depth);
+  delete [] slot_marks;
+  delete [] slot_to_index;
+
+  // Record offsets of instructions (shared by all instances)
+  int *offsets = new int [ 2*ninstructions ];
+  const int *c = tape.codes;
+  const RNScalar *e = tape.constants;
+  for (int j = 0; j < ninstructions; j++) {
+    offsets[2*j] = c - tape.codes;
+    offsets[2*j+1] = e - tape.constants;
+    if (*(c++) != RN_TAPE_POLYNOMIAL) continue;
+    int nterms = *(c++);
+    for (int i = 0; i < nterms; i++) {
+      e += c[0] + 1;
+      c += c[0] + 1;
+    }
+  }
+
+  // Create family
+  RNEquationFamily *family = new RNEquationFamily;
+  family->expression = expression;
+  family->nvariables = nvariables;
+  family->nparameters = nparameters;
+  family->codes = tape.codes;
+  family->constants = tape.constants;
+  family->tape_slots = tape.variables;
+  family->ntape_slots = tape.nvariables;
+  family->offsets = offsets;
+  family->ninstructions = ninstructions;
+  family->max_depth = max_depth;
+  family->first_instance = nfamily_instances;
+  family->ninstances = 0;
+  family->ninstances_allocated = 0;
+  family->instance_variables = NULL;
+  family->instance_parameters = NULL;
+  family->instance_weights = NULL;
+
+  // Insert family
+  families.Insert(family);
+
+  // Return index of family
+  return families.NEntries() - 1;
+}
+
+
+
+void RNSystemOfEquations::
+ReserveEquationFamilyInstances(int f, int ninstances)
+{
+  // Grow storage for instances of family
+  RNEquationFamily *family = families.Kth(f);
+  if (ninstances <= family->ninstances_allocated) return;
+  int *variables = new int [ ninstances * family->nvariables ];
+  RNScalar *parameters = new RNScalar [ ninstances * family->nparameters + 1 ];
+  RNScalar *weights = new RNScalar [ ninstances ];
+  for (int i = 0; i < family->ninstances * family->nvariables; i++) variables[i] = family->instance_variables[i];
+  for (int i = 0; i < family->ninstances * family->nparameters; i++) parameters[i] = family->instance_parameters[i];
+  for (int i = 0; i < family->ninstances; i++) weights[i] = family->instance_weights[i];
+  if (family->instance_variables) delete [] family->instance_variables;
+  if (family->instance_parameters) delete [] family->instance_parameters;
+  if (family->instance_weights) delete [] family->instance_weights;
+  family->instance_variables = variables;
+  family->instance_parameters = parameters;
+  family->instance_weights = weights;
+  family->ninstances_allocated = ninstances;
+}
+
+
+
+void RNSystemOfEquations::
+InsertEquationFamilyInstance(int f, const int *variables, const RNScalar *parameters, RNScalar weight)
+{
+  // Insert equation weight * expression(x[variables[0]], ..., parameters[0], ...) of family f
+  // (the variables of an instance must be distinct)
+  RNEquationFamily *family = families.Kth(f);
+
+  // Check if equation is zero
+  if (weight == 0) return;
+
+  // Just checking
+  for (int j = 0; j < family->nvariables; j++) {
+    assert((variables[j] >= 0) && (variables[j] < nvariables));
+    for (int k = 0; k < j; k++) assert(variables[j] != variables[k]);
+  }
+
+  // Make sure there is room for another instance
+  if (family->ninstances + 1 > family->ninstances_allocated) {
+    int n = (family->ninstances_allocated > 0) ? 2 * family->ninstances_allocated : 1024;
+    ReserveEquationFamilyInstances(f, n);
+  }
+
+  // Invalidate normal matrix pattern
+  if (normal_matrix_starts) InvalidateNormalMatrixPattern();
+
+  // Insert instance
+  int i = family->ninstances;
+  for (int j = 0; j < family->nvariables; j++) family->instance_variables[i*family->nvariables+j] = variables[j];
+  for (int j = 0; j < family->nparameters; j++) family->instance_parameters[i*family->nparameters+j] = parameters[j];
+  family->instance_weights[i] = weight;
+  family->ninstances++;
+  nfamily_instances++;
+
+  // Shift first instances of later families
+  for (int g = f + 1; g < NEquationFamilies(); g++) {
+    families.Kth(g)->first_instance++;
+  }
+}
+
+
+
+RNEquationFamily *RNSystemOfEquations::
+EquationFamilyOfInstance(int& k) const
+{
+  // Return family of kth instance (over all families), and replace k with index within family
+  assert((k >= 0) && (k < nfamily_instances));
+
+  // Binary search for last family whose first instance is not after k
+  int low = 0, high = NEquationFamilies() - 1;
+  while (low < high) {
+    int mid = (low + high + 1) / 2;
+    if (families.Kth(mid)->first_instance <= k) low = mid;
+    else high = mid - 1;
+  }
+
+  // Check family
+  RNEquationFamily *family = families.Kth(low);
+  k -= family->first_instance;
+  if ((k < 0) || (k >= family->ninstances)) {
+    RNAbort("Invalid equation family instance");
+    return NULL;
+  }
+
+  // Return family
+  return family;
+}
+
+
+
+int RNSystemOfEquations::
+EquationFamilyInstanceNVariables(int k) const
+{
+  // Return number of variables of kth instance (over all families)
+  RNEquationFamily *family = EquationFamilyOfInstance(k);
+  return family->nvariables;
+}
+
+
+
+const int *RNSystemOfEquations::
+EquationFamilyInstanceVariables(int k) const
+{
+  // Return variables of kth instance (over all families)
+  RNEquationFamily *family = EquationFamilyOfInstance(k);
+  return &family->instance_variables[k*family->nvariables];
+}
+
+
+
+int RNSystemOfEquations::
+EquationFamilyInstanceScratchSize(void) const
+{
+  // Return number of scratch values used to evaluate an instance of any family
+  int size = 1;
+  for (int f = 0; f < NEquationFamilies(); f++) {
+    RNEquationFamily *family = families.Kth(f);
+    int family_size = (2*family->ntape_slots + family->max_depth + 2*family->ninstructions + 1) * RN_FAMILY_BATCH_SIZE;
+    if (family_size > size) size = family_size;
+  }
+  return size;
+}
+
+
+
+RNScalar RNSystemOfEquations::
+EvaluateEquationFamilyInstance(int k, const RNScalar *values, RNScalar *gradient, RNScalar *scratch) const
+{
+  // Return residual of kth instance (over all families), given values of its variables,
+  // and add its partial derivatives to gradient (if not NULL, indexed like values)
+  RNEquationFamily *family = EquationFamilyOfInstance(k);
+  const int B = RN_FAMILY_BATCH_SIZE;
+
+  // Allocate temporary data (unless provided by caller)
+  RNScalar *buffer = (scratch) ? scratch : new RNScalar [ EquationFamilyInstanceScratchSize() ];
+  RNScalar *slot_values = buffer;
+  RNScalar *slot_gradients = (gradient) ? &buffer[family->ntape_slots * B] : NULL;
+  RNScalar *tape_scratch = &buffer[2 * family->ntape_slots * B];
+
+  // Gather values of tape variables
+  for (int s = 0; s < family->ntape_slots; s++) {
+    int slot = family->tape_slots[s];
+    if (slot < family->nvariables) slot_values[s*B] = values[slot];
+    else slot_values[s*B] = family->instance_parameters[k*family->nparameters + slot - family->nvariables];
+  }
+
+  // Evaluate residual and partial derivatives
+  RNScalar residual;
+  RNScalar weight = family->instance_weights[k];
+  EvaluateFamilyBatch(family, 1, slot_values, &residual, slot_gradients, tape_scratch);
+  if (gradient) {
+    for (int s = 0; s < family->ntape_slots; s++) {
+      int slot = family->tape_slots[s];
+      if (slot < family->nvariables) gradient[slot] += weight * slot_gradients[s*B];
+    }
+  }
+
+  // Delete temporary data
+  if (!scratch) delete [] buffer;
+
+  // Return weighted residual
+  return weight * residual;
+}
+
+
+
+RNScalar RNSystemOfEquations::
+EvaluateEquationFamilies(const RNScalar *x, RNScalar *y, RNScalar *JTJ, RNScalar *JTr, int start, int end) const
+{
+  // Evaluate instances (over all families) with indices in [start, end) (end < 0 means all),
+  // store their residuals in y (if not NULL, indexed by instance), add their contributions 
+  // to normal equations (if JTJ is not NULL), and return their sum of squared residuals
+  if ((end < 0) || (end > nfamily_instances)) end = nfamily_instances;
+  if (start < 0) start = 0;
+  if (start >= end) return 0;
+  const int B = RN_FAMILY_BATCH_SIZE;
+
+  // Allocate temporary data (sized for largest family)
+  int max_slots = 1, max_scratch = 1, max_nvariables = 1;
+  for (int f = 0; f < NEquationFamilies(); f++) {
+    RNEquationFamily *family = families.Kth(f);
+    int nscratch = family->max_depth + 2*family->ninstructions + 1;
+    if (family->ntape_slots > max_slots) max_slots = family->ntape_slots;
+    if (nscratch > max_scratch) max_scratch = nscratch;
+    if (family->nvariables > max_nvariables) max_nvariables = family->nvariables;
+  }
+  RNScalar *values = new RNScalar [ max_slots * B ];
+  RNScalar *gradients = (JTJ) ? new RNScalar [ max_slots * B ] : NULL;
+  RNScalar *gradient = (JTJ) ? new RNScalar [ max_nvariables ] : NULL;
+  RNScalar *scratch = new RNScalar [ max_scratch * B ];
+  RNScalar residuals[RN_FAMILY_BATCH_SIZE];
+
+  // Evaluate instances of each family in batches
+  RNScalar sum = 0;
+  int first = 0;
+  for (int f = 0; f < NEquationFamilies(); f++) {
+    RNEquationFamily *family = families.Kth(f);
+    int nv = family->nvariables;
+    int np = family->nparameters;
+    int family_start = (start > first) ? start - first : 0;
+    int family_end = (end - first < family->ninstances) ? end - first : family->ninstances;
+    for (int i0 = family_start; i0 < family_end; i0 += B) {
+      int n = (family_end - i0 < B) ? family_end - i0 : B;
+
+      // Gather values of tape variables
+      for (int s = 0; s < family->ntape_slots; s++) {
+        int slot = family->tape_slots[s];
+        RNScalar *v = &values[s*B];
+        if (slot < nv) {
+          const int *variables = &family->instance_variables[i0*nv + slot];
+          for (int b = 0; b < n; b++) v[b] = x[variables[b*nv]];
+        }
+        else {
+          const RNScalar *parameters = &family->instance_parameters[i0*np + slot - nv];
+          for (int b = 0; b < n; b++) v[b] = parameters[b*np];
+        }
+      }
+
+      // Evaluate batch
+      EvaluateFamilyBatch(family, n, values, residuals, gradients, scratch);
+
+      // Weight and store results
+      for (int b = 0; b < n; b++) {
+        int i = i0 + b;
+        RNScalar weight = family->instance_weights[i];
+        RNScalar residual = weight * residuals[b];
+        sum += residual * residual;
+        if (y) y[first + i] = residual;
+        if (JTJ) {
+          for (int j = 0; j < nv; j++) gradient[j] = 0;
+          for (int s = 0; s < family->ntape_slots; s++) {
+            int slot = family->tape_slots[s];
+            if (slot < nv) gradient[slot] = weight * gradients[s*B + b];
+          }
+          AccumulateNormalEquations(normal_matrix_starts, normal_matrix_rows, JTJ, JTr, 
+            nv, &family->instance_variables[i*nv], gradient, residual);
+        }
+      }
+    }
+    first += family->ninstances;
+  }
+
+  // Delete temporary data
+  delete [] values;
+  if (gradients) delete [] gradients;
+  if (gradient) delete [] gradient;
+  delete [] scratch;
+
+  // Return sum of squared residuals
+  return sum;
 }
 
 
@@ -15,6 +15,9 @@
 // Class definition
 ////////////////////////////////////////////////////////////////////////
 
+struct RNEquationFamily;
+class RNCSparseCholesky;
+
 class RNSystemOfEquations {
 public:
   // Constructor/destructor
@@ -25,6 +28,11 @@ public:
   // Property functions
   int NVariables(void) const;
   int NEquations(void) const;
+  int NExpressionEquations(void) const;
+  int NLinearEquations(void) const;
+  int NLinearTerms(void) const;
+  int NEquationFamilies(void) const;
+  int NEquationFamilyInstances(void) const;
   int NPartialDerivatives(void) const;
   RNBoolean IsLinear(void) const;
   RNBoolean IsQuadratic(void) const;
@@ -42,6 +50,44 @@ public:
   void InsertEquation(RNAlgebraic *algebraic);
   void InsertEquation(RNEquation *equation);
   void RemoveEquation(RNEquation *equation);
+  void Empty(void);
+
+  // Linear equation functions (stored compactly, one row per equation)
+  int LinearEquationNTerms(int k) const;
+  const int *LinearEquationVariables(int k) const;
+  const RNScalar *LinearEquationCoefficients(int k) const;
+  RNScalar LinearEquationConstant(int k) const;
+  RNScalar EvaluateLinearEquation(int k, const RNScalar *x) const;
+  void InsertLinearEquation(int nterms, const int *variables, const RNScalar *coefficients, RNScalar constant = 0);
+  void ReserveLinearEquations(int nequations, int nterms);
+
+  // Linear equation slot functions (InsertLinearEquations appends nequations empty rows with room 
+  // for nterms terms each and returns the index of the first, SetLinearEquation fills one of them,
+  // so separate threads can fill disjoint rows, and CompactLinearEquations then removes zero terms 
+  // and rows left empty -- rows must not be inserted or compacted while others are being filled)
+  int InsertLinearEquations(int nequations, int nterms);
+  void SetLinearEquation(int k, int nterms, const int *variables, const RNScalar *coefficients, RNScalar constant = 0);
+  void CompactLinearEquations(void);
+
+  // Equation family functions (many equations sharing one expression over template variables 
+  // 0..nvariables-1 and parameters nvariables..nvariables+nparameters-1, stored as one 
+  // instruction tape plus a table of variables, parameters, and weight per instance --
+  // evaluating an instance uses EquationFamilyInstanceScratchSize() scratch values,
+  // which are allocated per call if scratch is NULL)
+  int InsertEquationFamily(RNAlgebraic *expression, int nvariables, int nparameters = 0);
+  void InsertEquationFamilyInstance(int family, const int *variables, const RNScalar *parameters = NULL, RNScalar weight = 1);
+  void ReserveEquationFamilyInstances(int family, int ninstances);
+  int EquationFamilyInstanceNVariables(int k) const;
+  const int *EquationFamilyInstanceVariables(int k) const;
+  int EquationFamilyInstanceScratchSize(void) const;
+  RNScalar EvaluateEquationFamilyInstance(int k, const RNScalar *values, RNScalar *gradient = NULL, 
+    RNScalar *scratch = NULL) const;
+
+  // Arena functions (expressions allocated while an arena created here is current, via 
+  // RNSetCurrentArena, are released in bulk when the system is emptied or deleted --
+  // arenas are not thread-safe, so create one per constructing thread, serially)
+  RNArena *CreateArena(void);
+  int NArenas(void) const;
 
   // Variable constraints
   void SetLowerBound(int variable, RNScalar bound);
@@ -53,8 +99,40 @@ public:
   void EvaluateResiduals(const RNScalar *x, RNScalar *y) const;
   RNScalar SumOfSquaredResiduals(const RNScalar *x) const;
 
+  // Compilation functions (lower expression equations into a flat instruction tape,
+  // which evaluation functions use until an equation is inserted or removed --
+  // equations must not be modified while the system is frozen)
+  void Freeze(void);
+  void Unfreeze(void);
+  RNBoolean IsFrozen(void) const;
+
+  // Normal equation functions (upper triangle of J^T*J in compressed column form, and J^T*r --
+  // multithreaded evaluation keeps one buffer per extra thread until the pattern changes)
+  int NormalMatrixNNonzeros(void) const;
+  const int *NormalMatrixColumnStarts(void) const;
+  const int *NormalMatrixRowIndices(void) const;
+  int EvaluateNormalEquations(const RNScalar *x, RNScalar *JTJ, RNScalar *JTr, int start = 0, int end = -1) const;
+
+  // Jacobian functions (NPartialDerivatives() triplets of J, ordered by equation)
+  int EvaluateJacobian(const RNScalar *x, int *rows, int *columns, RNScalar *values) const;
+
+  // Thread functions (evaluation functions split equations into one block per thread,
+  // and sums are deterministic for a given number of threads -- 0 means all processors)
+  int MaxThreads(void) const;
+  void SetMaxThreads(int max_threads);
+
+  // Grid functions (variables are pixels of an xres*yres grid in row-major order,
+  // which enables nested-dissection ordering in the CSparse solvers -- 0 means not a grid)
+  int GridXResolution(void) const;
+  int GridYResolution(void) const;
+  void SetGridResolution(int xres, int yres);
+
   // Optimization functions
-  int Minimize(RNScalar *x, int solver = 0, RNScalar tolerance = RN_EPSILON) const;
+  int MaxIterations(void) const;
+  void SetMaxIterations(int max_iterations);
+  int NIterations(void) const;
+  int Minimize(RNScalar *x, int solver = 0, RNScalar tolerance = RN_EPSILON,
+    RNCSparseCholesky *cholesky = NULL) const;
 
   // Print functions
   void PrintEquations(FILE *fp = stdout) const;
@@ -67,6 +145,28 @@ public:
   // Do not use these
   void InsertEquation(RNPolynomial *polynomial, RNScalar residual_threshold);
   void InsertEquation(RNAlgebraic *algebraic, RNScalar residual_threshold);
+  void SetNIterations(int niterations);
+
+public:
+  // Internal functions (for evaluating blocks of equations in separate threads -- 
+  // marks, index_to_variable, and variable_to_index are scratch arrays of nvariables entries)
+  RNScalar EvaluateResidualRange(const RNScalar *x, RNScalar *y, int start, int end) const;
+  void AccumulateNormalEquationRange(const RNScalar *x, RNScalar *JTJ, RNScalar *JTr, int start, int end,
+    int *marks, int& mark, int *index_to_variable, int *variable_to_index) const;
+  int EvaluateJacobianRange(const RNScalar *x, int start, int end, int *rows, int *columns, RNScalar *values,
+    int *marks, int& mark, int *index_to_variable, int *variable_to_index) const;
+  int NThreads(void) const;
+
+private:
+  // Internal functions
+  void UpdateNormalMatrixPattern(void);
+  void InvalidateNormalMatrixPattern(void);
+  void UpdateNormalThreadBuffers(int nthreads);
+  RNScalar EvaluateTapeEquation(int k, const RNScalar *x, RNScalar *stack) const;
+  RNScalar EvaluateTapeEquationWithGradient(int k, const RNScalar *x, RNScalar *gradient, RNScalar *values, int *offsets) const;
+  RNEquationFamily *EquationFamilyOfInstance(int& k) const;
+  RNScalar EvaluateEquationFamilies(const RNScalar *x, RNScalar *y, RNScalar *JTJ = NULL, RNScalar *JTr = NULL, 
+    int start = 0, int end = -1) const;
   
 public:
   int *index_to_variable;
@@ -80,7 +180,36 @@ public:
 
 private:
   int nvariables;
+  int max_iterations;
+  int niterations;
+  int max_threads;
+  int grid_xres;
+  int grid_yres;
   RNArray<RNEquation *> equations;
+  int nlinear_equations;
+  int nlinear_equations_allocated;
+  int nlinear_terms_allocated;
+  int *linear_equation_starts;
+  int *linear_variables;
+  RNScalar *linear_coefficients;
+  RNScalar *linear_constants;
+  RNArray<RNEquationFamily *> families;
+  int nfamily_instances;
+  RNArray<RNArena *> arenas;
+  int *normal_matrix_starts;
+  int *normal_matrix_rows;
+  RNScalar **normal_thread_JTJ;
+  RNScalar **normal_thread_JTr;
+  int **normal_thread_marks;
+  int normal_nthreads;
+  int *tape_code_starts;
+  int *tape_codes;
+  int *tape_constant_starts;
+  RNScalar *tape_constants;
+  int *tape_variable_starts;
+  int *tape_variables;
+  int tape_max_instructions;
+  int tape_max_depth;
 };
 
 
@@ -101,27 +230,228 @@ NVariables(void) const
 inline int RNSystemOfEquations::
 NEquations(void) const
 {
-  // Return number of equations
+  // Return number of equations (expression equations first, then 
+  // instances of equation families, then linear equations)
+  return equations.NEntries() + nfamily_instances + nlinear_equations;
+}
+
+
+
+inline int RNSystemOfEquations::
+NExpressionEquations(void) const
+{
+  // Return number of equations stored as expressions
   return equations.NEntries();
 }
 
 
 
+inline int RNSystemOfEquations::
+NLinearEquations(void) const
+{
+  // Return number of equations stored as compact linear rows
+  return nlinear_equations;
+}
+
+
+
+inline int RNSystemOfEquations::
+NLinearTerms(void) const
+{
+  // Return number of terms in all compact linear rows
+  return (linear_equation_starts) ? linear_equation_starts[nlinear_equations] : 0;
+}
+
+
+
+inline int RNSystemOfEquations::
+NEquationFamilies(void) const
+{
+  // Return number of equation families
+  return families.NEntries();
+}
+
+
+
+inline int RNSystemOfEquations::
+NEquationFamilyInstances(void) const
+{
+  // Return number of equations instantiated from all equation families
+  return nfamily_instances;
+}
+
+
+
+inline int RNSystemOfEquations::
+NArenas(void) const
+{
+  // Return number of arenas owned by system
+  return arenas.NEntries();
+}
+
+
+
 inline RNEquation *RNSystemOfEquations::
 Equation(int k) const
 {
-  // Return Kth equation
+  // Return Kth expression equation
   return equations.Kth(k);
 }
 
 
 
+inline int RNSystemOfEquations::
+LinearEquationNTerms(int k) const
+{
+  // Return number of terms in kth linear equation
+  assert((k >= 0) && (k < nlinear_equations));
+  return linear_equation_starts[k+1] - linear_equation_starts[k];
+}
+
+
+
+inline const int *RNSystemOfEquations::
+LinearEquationVariables(int k) const
+{
+  // Return variables of kth linear equation
+  assert((k >= 0) && (k < nlinear_equations));
+  return &linear_variables[linear_equation_starts[k]];
+}
+
+
+
+inline const RNScalar *RNSystemOfEquations::
+LinearEquationCoefficients(int k) const
+{
+  // Return coefficients of kth linear equation
+  assert((k >= 0) && (k < nlinear_equations));
+  return &linear_coefficients[linear_equation_starts[k]];
+}
+
+
+
+inline RNScalar RNSystemOfEquations::
+LinearEquationConstant(int k) const
+{
+  // Return constant term of kth linear equation
+  assert((k >= 0) && (k < nlinear_equations));
+  return linear_constants[k];
+}
+
+
+
+inline RNScalar RNSystemOfEquations::
+EvaluateLinearEquation(int k, const RNScalar *x) const
+{
+  // Return residual of kth linear equation
+  assert((k >= 0) && (k < nlinear_equations));
+  RNScalar sum = linear_constants[k];
+  for (int i = linear_equation_starts[k]; i < linear_equation_starts[k+1]; i++) {
+    sum += linear_coefficients[i] * x[linear_variables[i]];
+  }
+  return sum;
+}
+
+
+
+inline int RNSystemOfEquations::
+MaxIterations(void) const
+{
+  // Return maximum number of solver iterations (0 means solver default)
+  return max_iterations;
+}
+
+
+
+inline void RNSystemOfEquations::
+SetMaxIterations(int max_iterations)
+{
+  // Set maximum number of solver iterations (0 means solver default)
+  this->max_iterations = max_iterations;
+}
+
+
+
+inline RNBoolean RNSystemOfEquations::
+IsFrozen(void) const
+{
+  // Return whether expression equations have been lowered into a tape
+  return (tape_code_starts) ? TRUE : FALSE;
+}
+
+
+
+inline int RNSystemOfEquations::
+MaxThreads(void) const
+{
+  // Return maximum number of threads used for evaluation
+  return max_threads;
+}
+
+
+
+inline void RNSystemOfEquations::
+SetMaxThreads(int max_threads)
+{
+  // Set maximum number of threads used for evaluation
+  this->max_threads = max_threads;
+}
+
+
+
+inline int RNSystemOfEquations::
+GridXResolution(void) const
+{
+  // Return number of grid columns (0 if variables are not a grid)
+  return grid_xres;
+}
+
+
+
+inline int RNSystemOfEquations::
+GridYResolution(void) const
+{
+  // Return number of grid rows (0 if variables are not a grid)
+  return grid_yres;
+}
+
+
+
+inline void RNSystemOfEquations::
+SetGridResolution(int xres, int yres)
+{
+  // Set grid dimensions of variables
+  this->grid_xres = xres;
+  this->grid_yres = yres;
+}
+
+
+
+inline int RNSystemOfEquations::
+NIterations(void) const
+{
+  // Return number of iterations taken by last call to Minimize (damped steps for the CSparse
+  // solvers, conjugate gradient iterations for the PCG solvers, 0 for the other solvers)
+  return niterations;
+}
+
+
+
+inline void RNSystemOfEquations::
+SetNIterations(int niterations)
+{
+  // Set number of iterations taken by last call to Minimize
+  this->niterations = niterations;
+}
+
+
+
 inline RNScalar RNSystemOfEquations::
 LowerBound(int variable) const
 {
-  // Return lower bound on variable (or FLT_MAX if there is none)
+  // Return lower bound on variable (or -FLT_MAX if there is none)
   assert((variable >= 0) && (variable < nvariables));
-  if (!lower_bounds) return FLT_MAX;
+  if (!lower_bounds) return -FLT_MAX;
   return lower_bounds[variable];
 }
 
@@ -165,9 +495,19 @@ enum {
   RN_MINPACK_SOLVER,
   RN_SPLM_SOLVER,
   RN_CSPARSE_SOLVER,
+  RN_PCG_SOLVER,
+  RN_CSPARSE_SUPERNODAL_SOLVER,
+  RN_MIXED_PCG_SOLVER,
   RN_NUM_SOLVERS
 };
 
+// Note: the PCG solvers (RN_PCG_SOLVER and RN_MIXED_PCG_SOLVER) take a single
+// linearized step: they solve the normal equations at the input x once, so 
+// nonlinear equations are only approximated (call Minimize again to iterate).
+// They also ignore lower and upper bounds on the variables.  Convergence is
+// measured against the right-hand side of the linearized system at x = 0, 
+// so the tolerance means the same thing for cold and warm starts.
+
 
 
 ////////////////////////////////////////////////////////////////////////
@@ -217,16 +557,28 @@ public:
   virtual bool Evaluate(double const* const* x, double* residual, double** jacobian) const 
   {
     // Evaluate residual
-    if (residual != NULL) {
+    if ((residual != NULL) && (jacobian == NULL)) {
       residual[0] = equation->Evaluate(x);
     }
 
-    // Evaluate Jacobian, if asked for.
+    // Evaluate residual and Jacobian, if asked for.
     if (jacobian != NULL) {
+      // Gather variables (they are remapped to parameter block indices)
+      RNScalar *values = new RNScalar [ 2*nvariables ];
+      RNScalar *gradient = &values[nvariables];
       for (int v = 0; v < nvariables; v++) {
-        jacobian[v][0] = equation->PartialDerivative(x, v);
+        values[v] = x[v][0];
+        gradient[v] = 0;
       }
 
+      // Evaluate residual and gradient in one pass
+      RNScalar value = equation->EvaluateWithGradient(values, gradient);
+      if (residual != NULL) residual[0] = value;
+      for (int v = 0; v < nvariables; v++) {
+        if (jacobian[v] != NULL) jacobian[v][0] = gradient[v];
+      }
+      delete [] values;
+
 #if 0
       // Check versus numerical partial derivative
       for (int v = 0; v < nvariables; v++) {
@@ -253,6 +605,92 @@ public:
 
 
 
+class CeresFamilyCostFunction : public ceres::CostFunction {
+private:
+  const RNSystemOfEquations *system;
+  int k;
+  int nvariables;
+public:
+  CeresFamilyCostFunction(const RNSystemOfEquations *system, int k) 
+    : system(system), k(k), nvariables(system->EquationFamilyInstanceNVariables(k))
+  {
+    set_num_residuals(1);
+    for (int i = 0; i < nvariables; i++) {
+      mutable_parameter_block_sizes()->push_back(1);
+    }
+  };
+
+  virtual bool Evaluate(double const* const* x, double* residual, double** jacobian) const 
+  {
+    // Allocate temporary data on stack (unless family is too large)
+    RNScalar stack_buffer[4096];
+    int size = 2*nvariables + system->EquationFamilyInstanceScratchSize();
+    RNScalar *values = (size <= 4096) ? stack_buffer : new RNScalar [ size ];
+    RNScalar *gradient = &values[nvariables];
+    RNScalar *scratch = &values[2*nvariables];
+
+    // Gather variables of kth equation family instance
+    for (int v = 0; v < nvariables; v++) {
+      values[v] = x[v][0];
+      gradient[v] = 0;
+    }
+
+    // Evaluate residual and Jacobian, if asked for
+    RNScalar value = system->EvaluateEquationFamilyInstance(k, values, (jacobian) ? gradient : NULL, scratch);
+    if (residual != NULL) residual[0] = value;
+    if (jacobian != NULL) {
+      for (int v = 0; v < nvariables; v++) {
+        if (jacobian[v] != NULL) jacobian[v][0] = gradient[v];
+      }
+    }
+
+    // Delete temporary data
+    if (values != stack_buffer) delete [] values;
+
+    // Return success
+    return true;
+  }
+};
+
+
+
+class CeresLinearCostFunction : public ceres::CostFunction {
+private:
+  int nterms;
+  const RNScalar *coefficients;
+  RNScalar constant;
+public:
+  CeresLinearCostFunction(int nterms, const RNScalar *coefficients, RNScalar constant) 
+    : nterms(nterms), coefficients(coefficients), constant(constant)
+  {
+    set_num_residuals(1);
+    for (int i = 0; i < nterms; i++) {
+      mutable_parameter_block_sizes()->push_back(1);
+    }
+  };
+
+  virtual bool Evaluate(double const* const* x, double* residual, double** jacobian) const 
+  {
+    // Evaluate residual
+    if (residual != NULL) {
+      residual[0] = constant;
+      for (int v = 0; v < nterms; v++) residual[0] += coefficients[v] * x[v][0];
+    }
+
+    // Evaluate Jacobian, if asked for.
+    if (jacobian != NULL) {
+      for (int v = 0; v < nterms; v++) {
+        if (jacobian[v]) jacobian[v][0] = coefficients[v];
+      }
+    }
+
+    // Return success
+    return true;
+  }
+};
+
+
+
 static int 
 MinimizeCERES(const RNSystemOfEquations *system, RNScalar *io, RNScalar tolerance)
 {
@@ -272,7 +710,7 @@ MinimizeCERES(const RNSystemOfEquations *system, RNScalar *io, RNScalar toleranc
   for (int i = 0; i < n; i++) x[i] = io[i];
 
   // Create ceres residual blocks
-  for (int i = 0; i < system_copy.NEquations(); i++) {
+  for (int i = 0; i < system_copy.NExpressionEquations(); i++) {
     RNEquation *equation = system_copy.Equation(i);
 
     // Remap variables
@@ -302,6 +740,26 @@ MinimizeCERES(const RNSystemOfEquations *system, RNScalar *io, RNScalar toleranc
     problem->AddResidualBlock(cost_function, loss_function, variable_ptr);
   }
 
+  // Create ceres residual blocks for instances of equation families
+  for (int i = 0; i < system->NEquationFamilyInstances(); i++) {
+    const int *variables = system->EquationFamilyInstanceVariables(i);
+    std::vector<double *> variable_ptr;
+    for (int j = 0; j < system->EquationFamilyInstanceNVariables(i); j++) variable_ptr.push_back(&x[variables[j]]);
+    ceres::CostFunction *cost_function = new CeresFamilyCostFunction(system, i);
+    problem->AddResidualBlock(cost_function, NULL, variable_ptr);
+  }
+
+  // Create ceres residual blocks for linear equations
+  for (int i = 0; i < system->NLinearEquations(); i++) {
+    int nterms = system->LinearEquationNTerms(i);
+    const int *variables = system->LinearEquationVariables(i);
+    std::vector<double *> variable_ptr;
+    for (int j = 0; j < nterms; j++) variable_ptr.push_back(&x[variables[j]]);
+    ceres::CostFunction *cost_function = new CeresLinearCostFunction(nterms, 
+      system->LinearEquationCoefficients(i), system->LinearEquationConstant(i));
+    problem->AddResidualBlock(cost_function, NULL, variable_ptr);
+  }
+
   // Set lower bounds
   if (system->lower_bounds) {
     for (int i = 0; i < n; i++) {
@@ -313,15 +771,16 @@ MinimizeCERES(const RNSystemOfEquations *system, RNScalar *io, RNScalar toleranc
   // Set upper bounds
   if (system->upper_bounds) {
     for (int i = 0; i < n; i++) {
-      if (system->upper_bounds[i] == -FLT_MAX) continue;
+      if (system->upper_bounds[i] == FLT_MAX) continue;
       problem->SetParameterUpperBound(&x[i], 0, system->upper_bounds[i]);
     }
   }
   
   // Run the solver
   // options->max_num_iterations = 128;
-  options->num_threads = 12;
-  options->num_linear_solver_threads = 12; 
+  if (system->MaxIterations() > 0) options->max_num_iterations = system->MaxIterations();
+  options->num_threads = system->NThreads();
+  options->num_linear_solver_threads = system->NThreads(); 
   // options->check_gradients = true;
   // options->gradient_check_relative_precision = 1E-1;
   // options->numeric_derivative_relative_step_size = 1E-3;
@@ -419,35 +878,23 @@ SPLMJacobian(double *x, struct splm_ccsm *jac, int n, int m, void *data)
   splm_stm sm;
   splm_stm_allocval(&sm, m, n, jac->nnz);
 
-#if 0
+  // Evaluate triplets (in parallel blocks of equations, if system has multiple threads)
+  int *rows = new int [ jac->nnz ];
+  int *columns = new int [ jac->nnz ];
+  RNScalar *values = new RNScalar [ jac->nnz ];
+  system->EvaluateJacobian(x, rows, columns, values);
+
   // Fill triplets
   int ntriplets = 0;
-  for (int i = 0; i < system->NEquations(); i++) {
-    RNEquation *equation = system->Equation(i);
-    for (int v = 0; v < n; v++) {
-      if (equation->HasVariable(v)) {
-        RNScalar d = equation->PartialDerivative(x, v);
-        splm_stm_nonzeroval(&sm, i, v, d);
-        ntriplets++;
-      }
-    }
+  for (int k = 0; k < jac->nnz; k++) {
+    splm_stm_nonzeroval(&sm, rows[k], columns[k], values[k]);
+    ntriplets++;
   }
-#else
-  int ntriplets = 0;
-  for (int i = 0; i < system->NEquations(); i++) {
-    RNEquation *equation = system->Equation(i);
-    int count = 0;
-    equation->UpdateVariableIndex(system->NVariables(), count, 
-      system->variable_marks, system->current_mark++, 
-      system->index_to_variable);
-    for (int j = 0; j < count; j++) {
-      int v = system->index_to_variable[j];
-      RNScalar d = equation->PartialDerivative(x, v);
-      splm_stm_nonzeroval(&sm, i, v, d);
-      ntriplets++;
-    }
-  }      
-#endif
+
+  // Delete evaluated triplets
+  delete [] rows;
+  delete [] columns;
+  delete [] values;
 
   // Just checking
   if (ntriplets != jac->nnz) {
@@ -576,36 +1023,29 @@ MinpackJacobian(void *data, int m, int n, const double *x, double *jacobian, int
   assert(n == system->NVariables());
   assert(ldjacobian == m);
 
-#if 0
-  // Evaluate jacobian
-  for (int i = 0; i < system->NEquations(); i++) {
-    RNEquation *equation = system->Equation(i);
-    for (int v = 0; v < n; v++) {
-      RNScalar d = equation->PartialDerivative(x, v);
-      jacobian[v*ldjacobian+i] += term->PartialDerivative(x, v);
-    }
-  }
-#else
   // Initialize jacobian
   for (int i = 0; i < system->NEquations(); i++) {
     for (int v = 0; v < n; v++) {
       jacobian[v*ldjacobian+i] = 0;
     }
   }
-  // Evaluate jacobian
-  for (int i = 0; i < system->NEquations(); i++) {
-    RNEquation *equation = system->Equation(i);
-    int count = 0;
-    equation->UpdateVariableIndex(system->NVariables(), count, 
-      system->variable_marks, system->current_mark++, 
-      system->index_to_variable);
-    for (int j = 0; j < count; j++) {
-      int v = system->index_to_variable[j];
-      RNScalar d = equation->PartialDerivative(x, v);
-      jacobian[v*ldjacobian+i] = d;
-    }
-  }  
-#endif    
+
+  // Evaluate triplets (in parallel blocks of equations, if system has multiple threads)
+  int nnz = system->NPartialDerivatives();
+  int *rows = new int [ nnz ];
+  int *columns = new int [ nnz ];
+  RNScalar *values = new RNScalar [ nnz ];
+  system->EvaluateJacobian(x, rows, columns, values);
+
+  // Fill jacobian
+  for (int k = 0; k < nnz; k++) {
+    jacobian[columns[k]*ldjacobian+rows[k]] = values[k];
+  }
+
+  // Delete triplets
+  delete [] rows;
+  delete [] columns;
+  delete [] values;
 
   // Return success
   return 1;
@@ -720,95 +1160,495 @@ MinimizeMINPACK(const RNSystemOfEquations *system, RNScalar *io, RNScalar tolera
 
 #include "CSparse/CSparse.h"
 
+class RNCSparseCholesky {
+public:
+  // Constructor/destructor
+  RNCSparseCholesky(void);
+  ~RNCSparseCholesky(void);
+
+  // Property functions
+  int NSymbolicAnalyses(void) const;
+  int NNumericFactorizations(void) const;
+  RNBoolean IsSupernodal(void) const;
+  int NThreads(void) const;
+
+  // Factorization options (supernodal factorization uses blocked dense kernels
+  // and factors independent subtrees of the elimination tree on nthreads threads)
+  void SetSupernodal(RNBoolean supernodal, int nthreads = 1);
+
+  // Ordering options (nested dissection is used for matrices with xres*yres columns 
+  // coupling nearby pixels of a grid in row-major order, AMD otherwise -- 0 means AMD always,
+  // cached analyses are keyed on the grid dimensions, so changing them flushes nothing)
+  void SetGridOrdering(int xres, int yres);
+
+  // Solve A*x = b for symmetric positive definite A (upper triangle is used),
+  // b is overwritten with x, symbolic analysis is reused when pattern of A was seen before
+  int Solve(const cs *A, double *b);
+
+  // Release all cached symbolic analyses
+  void Empty(void);
+
+public:
+  // Internal functions
+  int FindSymbolic(const cs *A) const;
+  int ComputeSymbolic(const cs *A);
+
+private:
+  static const int max_cache_entries = 4;
+  css *symbolics[max_cache_entries];
+  int *pattern_p[max_cache_entries];
+  int *pattern_i[max_cache_entries];
+  int pattern_n[max_cache_entries];
+  int pattern_nnz[max_cache_entries];
+  int pattern_xres[max_cache_entries];
+  int pattern_yres[max_cache_entries];
+  unsigned int last_used[max_cache_entries];
+  unsigned int clock;
+  int nsymbolic_analyses;
+  int nnumeric_factorizations;
+  RNBoolean supernodal;
+  int nthreads;
+  int grid_xres;
+  int grid_yres;
+};
+
+
+
+inline RNCSparseCholesky::
+RNCSparseCholesky(void)
+  : clock(0),
+    nsymbolic_analyses(0),
+    nnumeric_factorizations(0),
+    supernodal(FALSE),
+    nthreads(1),
+    grid_xres(0),
+    grid_yres(0)
+{
+  // Initialize cache entries
+  for (int k = 0; k < max_cache_entries; k++) {
+    symbolics[k] = NULL;
+    pattern_p[k] = NULL;
+    pattern_i[k] = NULL;
+    pattern_n[k] = 0;
+    pattern_nnz[k] = 0;
+    pattern_xres[k] = 0;
+    pattern_yres[k] = 0;
+    last_used[k] = 0;
+  }
+}
+
+
+
+inline RNCSparseCholesky::
+~RNCSparseCholesky(void)
+{
+  // Delete cache entries
+  Empty();
+}
+
+
+
+inline int RNCSparseCholesky::
+NSymbolicAnalyses(void) const
+{
+  // Return number of symbolic analyses computed (cache misses)
+  return nsymbolic_analyses;
+}
+
+
+
+inline int RNCSparseCholesky::
+NNumericFactorizations(void) const
+{
+  // Return number of numeric factorizations computed
+  return nnumeric_factorizations;
+}
+
+
+
+inline RNBoolean RNCSparseCholesky::
+IsSupernodal(void) const
+{
+  // Return whether numeric factorizations are supernodal
+  return supernodal;
+}
+
+
+
+inline int RNCSparseCholesky::
+NThreads(void) const
+{
+  // Return number of threads used by supernodal factorizations
+  return nthreads;
+}
+
+
+
+inline void RNCSparseCholesky::
+SetSupernodal(RNBoolean supernodal, int nthreads)
+{
+  // Set factorization options
+  this->supernodal = supernodal;
+  this->nthreads = (nthreads > 0) ? nthreads : 1;
+}
+
+
+
+inline void RNCSparseCholesky::
+SetGridOrdering(int xres, int yres)
+{
+  // Set grid dimensions (used to find and compute symbolic analyses)
+  grid_xres = xres;
+  grid_yres = yres;
+}
+
+
+
+inline void RNCSparseCholesky::
+Empty(void)
+{
+  // Delete cache entries
+  for (int k = 0; k < max_cache_entries; k++) {
+    if (symbolics[k]) cs_sfree(symbolics[k]);
+    if (pattern_p[k]) delete [] pattern_p[k];
+    if (pattern_i[k]) delete [] pattern_i[k];
+    symbolics[k] = NULL;
+    pattern_p[k] = NULL;
+    pattern_i[k] = NULL;
+    pattern_n[k] = 0;
+    pattern_nnz[k] = 0;
+    pattern_xres[k] = 0;
+    pattern_yres[k] = 0;
+    last_used[k] = 0;
+  }
+}
+
+
+
+inline int RNCSparseCholesky::
+FindSymbolic(const cs *A) const
+{
+  // Search for cache entry with same sparsity pattern and ordering
+  int nnz = A->p[A->n];
+  for (int k = 0; k < max_cache_entries; k++) {
+    if (!symbolics[k]) continue;
+    if (pattern_xres[k] != grid_xres) continue;
+    if (pattern_yres[k] != grid_yres) continue;
+    if (pattern_n[k] != A->n) continue;
+    if (pattern_nnz[k] != nnz) continue;
+    if (memcmp(pattern_p[k], A->p, (A->n+1)*sizeof(int))) continue;
+    if (memcmp(pattern_i[k], A->i, nnz*sizeof(int))) continue;
+    return k;
+  }
+
+  // Not found
+  return -1;
+}
+
+
+
+inline int RNCSparseCholesky::
+ComputeSymbolic(const cs *A)
+{
+  // Compute ordering and symbolic analysis
+  css *S = NULL;
+  if ((grid_xres > 0) && (grid_yres > 0) && (grid_xres * grid_yres == A->n)) {
+    // Find largest row or column distance between pixels coupled by A
+    int w = 1;
+    for (int j = 0; j < A->n; j++) {
+      for (int k = A->p[j]; k < A->p[j+1]; k++) {
+        int i = A->i[k];
+        int dx = abs(i % grid_xres - j % grid_xres);
+        int dy = abs(i / grid_xres - j / grid_xres);
+        if (dx > w) w = dx;
+        if (dy > w) w = dy;
+      }
+    }
+
+    // Use nested dissection with separators of width w
+    int *P = cs_ndgrid(grid_xres, grid_yres, w);
+    if (P) { S = cs_schol_perm(P, A); cs_free(P); }
+  }
+  else {
+    // Use approximate minimum degree
+    S = cs_schol(1, A);
+  }
+  if (!S) return -1;
+  nsymbolic_analyses++;
+
+  // Find least recently used cache entry
+  int k = 0;
+  for (int j = 1; j < max_cache_entries; j++) {
+    if (last_used[j] < last_used[k]) k = j;
+  }
+
+  // Replace cache entry
+  int nnz = A->p[A->n];
+  if (symbolics[k]) cs_sfree(symbolics[k]);
+  if (pattern_p[k]) delete [] pattern_p[k];
+  if (pattern_i[k]) delete [] pattern_i[k];
+  symbolics[k] = S;
+  pattern_n[k] = A->n;
+  pattern_nnz[k] = nnz;
+  pattern_xres[k] = grid_xres;
+  pattern_yres[k] = grid_yres;
+  pattern_p[k] = new int [ A->n + 1 ];
+  pattern_i[k] = new int [ nnz ];
+  memcpy(pattern_p[k], A->p, (A->n+1)*sizeof(int));
+  memcpy(pattern_i[k], A->i, nnz*sizeof(int));
+
+  // Return index of cache entry
+  return k;
+}
+
+
+
+inline int RNCSparseCholesky::
+Solve(const cs *A, double *b)
+{
+  // Check inputs
+  if (!CS_CSC(A) || !b) return 0;
+  int n = A->n;
+
+  // Get symbolic analysis (from cache, if possible)
+  int k = FindSymbolic(A);
+  if (k < 0) k = ComputeSymbolic(A);
+  if (k < 0) return 0;
+  last_used[k] = ++clock;
+  css *S = symbolics[k];
+
+  // Compute numeric factorization
+  csn *N = (supernodal) ? cs_chol_super(A, S, nthreads) : cs_chol(A, S);
+  if (!N) return 0;
+  nnumeric_factorizations++;
+
+  // Solve with factorization
+  double *x = new double [ n ];
+  cs_ipvec(S->pinv, b, x, n);   // x = P*b
+  cs_lsolve(N->L, x);           // x = L\x
+  cs_ltsolve(N->L, x);          // x = L'\x
+  cs_pvec(S->pinv, x, b, n);    // b = P'*x
+
+  // Delete stuff
+  delete [] x;
+  cs_nfree(N);
+
+  // Return success
+  return 1;
+}
+
+
+
 static int 
-MinimizeCSPARSE(const RNSystemOfEquations *system, RNScalar *io, RNScalar tolerance)
+SolveNormalEquationsCSPARSE(const RNSystemOfEquations *system, const RNScalar *JTJ, RNScalar *b,
+  RNCSparseCholesky *cholesky)
 {
+  // Solve JTJ * x = b, where JTJ holds values of the upper triangle of a symmetric matrix 
+  // in the pattern of system->NormalMatrixRowIndices(), and b is overwritten with x
+  // (the symbolic analysis is looked up in and added to the cholesky cache)
+
+  // Use nested-dissection ordering if variables are a grid
+  cholesky->SetGridOrdering(system->GridXResolution(), system->GridYResolution());
+
+  // Setup matrix header for upper triangle of J^T*J (no copy)
+  cs A;
+  A.nzmax = system->NormalMatrixNNonzeros();
+  A.m = system->NVariables();
+  A.n = system->NVariables();
+  A.p = (int *) system->NormalMatrixColumnStarts();
+  A.i = (int *) system->NormalMatrixRowIndices();
+  A.x = (double *) JTJ;
+  A.nz = -1;
+
+  // Solve linear system
+  return cholesky->Solve(&A, b);
+}
+
+
+
+static RNBoolean
+ProjectOntoBounds(const RNSystemOfEquations *system, RNScalar *x)
+{
+  // Clamp x to the variable bounds, and return whether any variable was clamped
+  RNBoolean clamped = FALSE;
+  for (int i = 0; i < system->NVariables(); i++) {
+    if (system->lower_bounds && (x[i] < system->lower_bounds[i])) { x[i] = system->lower_bounds[i]; clamped = TRUE; }
+    if (system->upper_bounds && (x[i] > system->upper_bounds[i])) { x[i] = system->upper_bounds[i]; clamped = TRUE; }
+  }
+  return clamped;
+}
+
+
+
+static int 
+MinimizeCSPARSE(const RNSystemOfEquations *system, RNScalar *io, RNScalar tolerance, 
+  RNCSparseCholesky *cholesky = NULL)
+{
+  // Minimizes the sum of squared residuals with damped Gauss-Newton (Levenberg-Marquardt)
+  // iterations, each solving (J^T*J + lambda*diag(J^T*J)) * dx = -J^T*r by sparse Cholesky
+  // (reusing the symbolic analysis) and projecting x+dx onto the variable bounds.  
+  // Variables held at a bound by the gradient are fixed for the iteration (projected Newton).
+  // Iterations stop when the relative decrease of the sum of squared residuals falls
+  // below tolerance.  Linear systems are solved with one step from x = 0 (independent
+  // of io), and iterate only if that step violates the bounds.
+
+  // Use a cache of symbolic factorizations for this call only if none is provided
+  RNCSparseCholesky local_cholesky;
+  if (!cholesky) cholesky = &local_cholesky;
+
   // Get convenient variables
   const int n = system->NVariables();
-  const int mm = system->NEquations();
-  const int max_nz = system->NPartialDerivatives();
+  int max_iterations = (system->MaxIterations() > 0) ? system->MaxIterations() : 100;
+  RNBoolean linear = system->IsLinear();
+  const RNScalar min_lambda = 1E-6;
+  const RNScalar max_lambda = 1E10;
 
-  // Allocate matrix
-  cs *a = cs_spalloc (0, n, max_nz, 1, 1);
-  if (!a) {
-    fprintf(stderr, "Unable to allocate cs matrix: %d %d\n", n, max_nz);
-    return 0;
-  }
-    
-  // Allocate B vector
-  double *b = new double [ mm ];
-  for (int i = 0; i < mm; i++) b[i] = 0;
+  // Get sparsity pattern of upper triangle of J^T*J
+  int nnz = system->NormalMatrixNNonzeros();
+  if (nnz == 0) return 0;
+  const int *starts = system->NormalMatrixColumnStarts();
+  const int *rows = system->NormalMatrixRowIndices();
 
-  // Allocate X vector
+  // Allocate temporary data
+  double *values = new double [ nnz ];
+  double *diagonal = new double [ n ];
+  double *b = new double [ n ];
   double *x = new double [ n ];
-  for (int i = 0; i < n; i++) x[i] = 0;
-
-  // Allocate temporary data for rows
-  double *lhs = new double [ n ];
-  for (int i = 0; i < n; i++) lhs[i] = 0;
+  double *step = new double [ n ];
+  RNBoolean *fixed = new RNBoolean [ n ];
+
+  // Initialize x 
+  if (linear) { for (int i = 0; i < n; i++) x[i] = 0; }
+  else { for (int i = 0; i < n; i++) x[i] = io[i]; ProjectOntoBounds(system, x); }
+  RNScalar ssr = system->SumOfSquaredResiduals(x);
+
+  // Iterate
+  int status = 1;
+  int iteration = 0;
+  RNScalar lambda = 0;
+  RNBoolean solved = FALSE;
+  RNBoolean converged = FALSE;
+  while (!converged && (iteration < max_iterations)) {
+    // Accumulate J^T*J and J^T*r at x
+    if (!system->EvaluateNormalEquations(x, values, b)) {
+      fprintf(stderr, "Unable to compute normal equations\n");
+      status = 0;
+      break;
+    }
 
-  // Fill matrix
-  int m = 0;
-  for (int i = 0; i < system->NEquations(); i++) {
-    RNEquation *equation = system->Equation(i);
+    // Fix variables at bounds where the gradient points outward
+    for (int i = 0; i < n; i++) {
+      fixed[i] = FALSE;
+      if (system->lower_bounds && (x[i] <= system->lower_bounds[i]) && (b[i] > 0)) fixed[i] = TRUE;
+      if (system->upper_bounds && (x[i] >= system->upper_bounds[i]) && (b[i] < 0)) fixed[i] = TRUE;
+      if (fixed[i]) b[i] = 0;
+    }
 
-    // Initialize constant term
-    double rhs = -equation->Evaluate(x);
+    // Remove couplings of fixed variables from J^T*J
+    for (int c = 0; c < n; c++) {
+      for (int k = starts[c]; k < starts[c+1]; k++) {
+        if ((rows[k] != c) && (fixed[rows[k]] || fixed[c])) values[k] = 0;
+      }
+    }
 
-    // Mark variables in equation
-    int nz = 0;
-    int variable_count = 0;
-    RNSystemOfEquations *tmp = (RNSystemOfEquations *) system;
-    equation->UpdateVariableIndex(n, variable_count, tmp->variable_marks, tmp->current_mark++, tmp->index_to_variable);
-    for (int j = 0; j < variable_count; j++) {
-      int v = tmp->index_to_variable[j];
-      lhs[v] = equation->PartialDerivative(x, v);
-      if (lhs[v] != 0) nz++;
+    // Remember diagonal of J^T*J (last entry of each sorted column)
+    for (int c = 0; c < n; c++) {
+      int k = starts[c+1] - 1;
+      diagonal[c] = ((k >= starts[c]) && (rows[k] == c)) ? values[k] : 0;
     }
 
-    // Add data to matrix if there are nonzero entries 
-    if (nz > 0) {
-      assert(m < mm);
-      for (int j = 0; j < variable_count; j++) {
-        int v = tmp->index_to_variable[j];
-        if (lhs[v] == 0) continue;
-        cs_entry(a, m, v, lhs[v]);
+    // Search for damping that decreases the sum of squared residuals
+    RNBoolean accepted = FALSE;
+    while (!accepted && (lambda <= max_lambda)) {
+      // Damp diagonal
+      for (int c = 0; c < n; c++) {
+        int k = starts[c+1] - 1;
+        if ((k >= starts[c]) && (rows[k] == c)) values[k] = diagonal[c] * (1 + lambda);
+      }
+
+      // Solve (J^T*J + lambda*diag(J^T*J)) * step = -J^T*r
+      for (int i = 0; i < n; i++) step[i] = -b[i];
+      if (!SolveNormalEquationsCSPARSE(system, values, step, cholesky)) {
+        lambda = (lambda < min_lambda) ? min_lambda : 10 * lambda;
+        continue;
+      }
+      solved = TRUE;
+
+      // Take projected step
+      for (int i = 0; i < n; i++) step[i] += x[i];
+      RNBoolean clamped = ProjectOntoBounds(system, step);
+
+      // Linear systems are solved exactly by the first step, unless it hits bounds
+      if (linear && (iteration == 0)) {
+        for (int i = 0; i < n; i++) x[i] = step[i];
+        ssr = system->SumOfSquaredResiduals(x);
+        converged = !clamped && (lambda == 0);
+        accepted = TRUE;
+        break;
+      }
+
+      // Accept step if it decreases sum of squared residuals
+      RNScalar step_ssr = system->SumOfSquaredResiduals(step);
+      if (step_ssr <= ssr) {
+        for (int i = 0; i < n; i++) x[i] = step[i];
+        converged = (ssr - step_ssr <= tolerance * ssr);
+        ssr = step_ssr;
+        lambda = (lambda > min_lambda) ? 0.1 * lambda : 0;
+        accepted = TRUE;
+      }
+      else {
+        lambda = (lambda < min_lambda) ? min_lambda : 10 * lambda;
       }
-      b[m] = rhs;
-      m++;
     }
+
+    // Check if no step decreased the sum of squared residuals
+    if (!accepted) {
+      if (!solved) { fprintf(stderr, "Error in CSPARSE solver\n"); status = 0; }
+      break;
+    }
+
+    // Count iteration
+    iteration++;
   }
 
-  // Just checking
-  assert(a->m == m);
-  assert(a->n == n);
-  assert(a->n == system->NVariables());
-  assert(a->m <= system->NEquations());
-  assert(a->nz <= system->NPartialDerivatives());
-
-  // Setup aT * a * x = aT * b        
-  cs *A = cs_compress(a);
-  assert(A);
-  cs *AT = cs_transpose (A, 1);
-  assert(AT);
-  cs *ATA = cs_multiply (AT, A);
-  assert(ATA);
-  cs_gaxpy(AT, b, x);
+  // Copy solution into result
+  if (status) { for (int i = 0; i < n; i++) io[i] = x[i]; }
 
-  // Solve linear system
-  // int status = cs_lusol (1, ATA, x, RN_EPSILON);
-  int status = cs_cholsol (1, ATA, x);
-  if (status == 0) fprintf(stderr, "Error in CSPARSE solver\n");
-  else { for (int i = 0; i < n; i++) io[i] = x[i]; }
+  // Remember number of iterations
+  ((RNSystemOfEquations *) system)->SetNIterations(iteration);
 
   // Delete stuff
-  cs_spfree(A);
-  cs_spfree(AT);
-  cs_spfree(ATA);
-  cs_spfree(a);
+  delete [] values;
+  delete [] diagonal;
   delete [] b;
   delete [] x;
-  delete [] lhs;
+  delete [] step;
+  delete [] fixed;
+
+  // Return status
+  return status;
+}
+
+
+
+static int 
+MinimizeCSPARSESupernodal(const RNSystemOfEquations *system, RNScalar *io, RNScalar tolerance,
+  RNCSparseCholesky *cholesky = NULL)
+{
+  // Use a cache of symbolic factorizations for this call only if none is provided
+  RNCSparseCholesky local_cholesky;
+  if (!cholesky) cholesky = &local_cholesky;
+
+  // Remember factorization options of the cache (it may be shared with the simplicial solver)
+  RNBoolean previous_supernodal = cholesky->IsSupernodal();
+  int previous_nthreads = cholesky->NThreads();
+
+  // Minimize with supernodal factorizations on the system's threads
+  cholesky->SetSupernodal(TRUE, system->NThreads());
+  int status = MinimizeCSPARSE(system, io, tolerance, cholesky);
+
+  // Restore factorization options of the cache
+  cholesky->SetSupernodal(previous_supernodal, previous_nthreads);
 
   // Return status
   return status;
@@ -817,7 +1657,8 @@ MinimizeCSPARSE(const RNSystemOfEquations *system, RNScalar *io, RNScalar tolera
 #else
 
 static int 
-MinimizeCSPARSE(const RNSystemOfEquations *system, RNScalar *io, RNScalar tolerance)
+MinimizeCSPARSE(const RNSystemOfEquations *system, RNScalar *io, RNScalar tolerance,
+  RNCSparseCholesky *cholesky = NULL)
 {
   // Print error message
   fprintf(stderr, "Cannot minimize equation: CSparse solver disabled during compile.\n");
@@ -825,19 +1666,365 @@ MinimizeCSPARSE(const RNSystemOfEquations *system, RNScalar *io, RNScalar tolera
   return 0;
 }
 
+
+
+static int 
+MinimizeCSPARSESupernodal(const RNSystemOfEquations *system, RNScalar *io, RNScalar tolerance,
+  RNCSparseCholesky *cholesky = NULL)
+{
+  // Same error as simplicial CSparse solver
+  return MinimizeCSPARSE(system, io, tolerance);
+}
+
 #endif
 
 
 
+////////////////////////////////////////////////////////////////////////
+// PCG Stuff
+////////////////////////////////////////////////////////////////////////
+
+static void
+MultiplyNormalMatrix(int n, const int *starts, const int *rows, const RNScalar *values, 
+  const RNScalar *x, RNScalar *y)
+{
+  // Compute y = A*x for symmetric A stored as upper triangle in compressed columns
+  for (int i = 0; i < n; i++) y[i] = 0;
+  for (int c = 0; c < n; c++) {
+    for (int k = starts[c]; k < starts[c+1]; k++) {
+      int r = rows[k];
+      y[r] += values[k] * x[c];
+      if (r != c) y[c] += values[k] * x[r];
+    }
+  }
+}
+
+
+
+static void
+MultiplyNormalMatrix(int n, const int *starts, const int *rows, const RNScalar32 *values, 
+  const RNScalar *x, RNScalar *y)
+{
+  // Compute y = A*x for single-precision A, accumulating in double precision (same storage as above)
+  for (int i = 0; i < n; i++) y[i] = 0;
+  for (int c = 0; c < n; c++) {
+    for (int k = starts[c]; k < starts[c+1]; k++) {
+      int r = rows[k];
+      y[r] += values[k] * x[c];
+      if (r != c) y[c] += values[k] * x[r];
+    }
+  }
+}
+
+
+
+static void
+MultiplyNormalMatrix(int n, const int *starts, const int *rows, const RNScalar32 *values, 
+  const RNScalar32 *x, RNScalar32 *y)
+{
+  // Compute y = A*x in single precision (same storage as above)
+  for (int i = 0; i < n; i++) y[i] = 0;
+  for (int c = 0; c < n; c++) {
+    RNScalar32 xc = x[c];
+    RNScalar32 yc = 0;
+    for (int k = starts[c]; k < starts[c+1]; k++) {
+      int r = rows[k];
+      y[r] += values[k] * xc;
+      if (r != c) yc += values[k] * x[r];
+    }
+    y[c] += yc;
+  }
+}
+
+
+
+static int 
+MinimizePCG(const RNSystemOfEquations *system, RNScalar *io, RNScalar tolerance)
+{
+  // Solves the normal equations linearized at io with Jacobi-preconditioned 
+  // conjugate gradients, starting from io and stopping when the residual
+  // of the normal equations is below tolerance times the norm of their 
+  // right-hand side b = J^T*J*io - J^T*r (i.e., -J^T*r at x = 0).  Does a
+  // single linearization and ignores bounds
+
+  // Get convenient variables
+  const int n = system->NVariables();
+  int max_iterations = (system->MaxIterations() > 0) ? system->MaxIterations() : n;
+  
+  // Get sparsity pattern of upper triangle of J^T*J
+  int nnz = system->NormalMatrixNNonzeros();
+  if (nnz == 0) return 0;
+  const int *starts = system->NormalMatrixColumnStarts();
+  const int *rows = system->NormalMatrixRowIndices();
+
+  // Allocate temporary data
+  RNScalar *values = new RNScalar [ nnz ];
+  RNScalar *r = new RNScalar [ n ];
+  RNScalar *z = new RNScalar [ n ];
+  RNScalar *p = new RNScalar [ n ];
+  RNScalar *q = new RNScalar [ n ];
+  RNScalar *d = new RNScalar [ n ];
+  RNScalar *x = new RNScalar [ n ];
+
+  // Accumulate J^T*J and J^T*r at io
+  if (!system->EvaluateNormalEquations(io, values, r)) {
+    fprintf(stderr, "Unable to compute normal equations\n");
+    delete [] values;
+    delete [] r;
+    delete [] z;
+    delete [] p;
+    delete [] q;
+    delete [] d;
+    delete [] x;
+    return 0;
+  }
+
+  // Compute Jacobi preconditioner (diagonal is last entry of each sorted column)
+  for (int c = 0; c < n; c++) {
+    int k = starts[c+1] - 1;
+    d[c] = ((k >= starts[c]) && (rows[k] == c) && (values[k] > 0)) ? 1.0 / values[k] : 1.0;
+  }
+
+  // Compute squared norm of right-hand side at x = 0 (reference for convergence)
+  RNScalar bb = 0;
+  MultiplyNormalMatrix(n, starts, rows, values, io, q);
+  for (int i = 0; i < n; i++) bb += (q[i] - r[i]) * (q[i] - r[i]);
+
+  // Initialize step x = 0 and residual r = -J^T*r
+  RNScalar rz = 0, rr0 = 0;
+  for (int i = 0; i < n; i++) {
+    x[i] = 0;
+    r[i] = -r[i];
+    z[i] = d[i] * r[i];
+    p[i] = z[i];
+    rz += r[i] * z[i];
+    rr0 += r[i] * r[i];
+  }
+
+  // Iterate
+  int iteration = 0;
+  RNScalar rr = rr0;
+  RNScalar threshold = tolerance * tolerance * bb;
+  while ((iteration < max_iterations) && (rr > threshold) && (rr > 0)) {
+    // Compute step length
+    MultiplyNormalMatrix(n, starts, rows, values, p, q);
+    RNScalar pq = 0;
+    for (int i = 0; i < n; i++) pq += p[i] * q[i];
+    if (pq <= 0) break;
+    RNScalar alpha = rz / pq;
+
+    // Update solution and residual
+    rr = 0;
+    for (int i = 0; i < n; i++) {
+      x[i] += alpha * p[i];
+      r[i] -= alpha * q[i];
+      rr += r[i] * r[i];
+    }
+
+    // Update search direction
+    RNScalar rz_new = 0;
+    for (int i = 0; i < n; i++) {
+      z[i] = d[i] * r[i];
+      rz_new += r[i] * z[i];
+    }
+    RNScalar beta = rz_new / rz;
+    for (int i = 0; i < n; i++) p[i] = z[i] + beta * p[i];
+    rz = rz_new;
+    iteration++;
+  }
+
+  // Copy solution into result
+  for (int i = 0; i < n; i++) io[i] += x[i];
+
+  // Remember number of iterations
+  ((RNSystemOfEquations *) system)->SetNIterations(iteration);
+
+  // Delete temporary data
+  delete [] values;
+  delete [] r;
+  delete [] z;
+  delete [] p;
+  delete [] q;
+  delete [] d;
+  delete [] x;
+
+  // Return success
+  return 1;
+}
+
+
+
+static int 
+MinimizeMixedPCG(const RNSystemOfEquations *system, RNScalar *io, RNScalar tolerance)
+{
+  // Solves the same normal equations as MinimizePCG to the same tolerance, but the 
+  // conjugate gradient iterations read a single-precision copy of J^T*J and keep 
+  // search directions in single precision (dot products and the solution are 
+  // accumulated in double precision).  Rounding errors of the single-precision
+  // solves are removed by iterative refinement: after each inner solve, the 
+  // residual is recomputed in double precision (from the single-precision matrix,
+  // since the double-precision one is deleted once copied), and the inner solve 
+  // is restarted on the remaining residual until it meets the tolerance
+
+  // Get convenient variables
+  const int n = system->NVariables();
+  int max_iterations = (system->MaxIterations() > 0) ? system->MaxIterations() : n;
+  const RNScalar inner_tolerance = 1E-3;
+  const int max_refinements = 8;
+  
+  // Get sparsity pattern of upper triangle of J^T*J
+  int nnz = system->NormalMatrixNNonzeros();
+  if (nnz == 0) return 0;
+  const int *starts = system->NormalMatrixColumnStarts();
+  const int *rows = system->NormalMatrixRowIndices();
+
+  // Allocate temporary data
+  RNScalar *values = new RNScalar [ nnz ];
+  RNScalar32 *values32 = new RNScalar32 [ nnz ];
+  RNScalar *b = new RNScalar [ n ];
+  RNScalar *r = new RNScalar [ n ];
+  RNScalar *x = new RNScalar [ n ];
+  RNScalar32 *r32 = new RNScalar32 [ n ];
+  RNScalar32 *p = new RNScalar32 [ n ];
+  RNScalar32 *q = new RNScalar32 [ n ];
+  RNScalar32 *d = new RNScalar32 [ n ];
+
+  // Accumulate J^T*J and J^T*r at io
+  if (!system->EvaluateNormalEquations(io, values, b)) {
+    fprintf(stderr, "Unable to compute normal equations\n");
+    delete [] values;
+    delete [] values32;
+    delete [] b;
+    delete [] r;
+    delete [] x;
+    delete [] r32;
+    delete [] p;
+    delete [] q;
+    delete [] d;
+    return 0;
+  }
+
+  // Make single-precision copy of J^T*J
+  for (int k = 0; k < nnz; k++) values32[k] = (RNScalar32) values[k];
+
+  // Compute Jacobi preconditioner (diagonal is last entry of each sorted column)
+  for (int c = 0; c < n; c++) {
+    int k = starts[c+1] - 1;
+    d[c] = ((k >= starts[c]) && (rows[k] == c) && (values[k] > 0)) ? (RNScalar32) (1.0 / values[k]) : 1.0F;
+  }
+
+  // Compute squared norm of right-hand side at x = 0 (reference for convergence)
+  RNScalar bb = 0;
+  MultiplyNormalMatrix(n, starts, rows, values, io, r);
+  for (int i = 0; i < n; i++) bb += (r[i] - b[i]) * (r[i] - b[i]);
+
+  // Delete double-precision J^T*J (only the single-precision copy is used below)
+  delete [] values;
+  values = NULL;
+
+  // Initialize step x = 0 and residual r = b = -J^T*r
+  RNScalar rr0 = 0;
+  for (int i = 0; i < n; i++) {
+    x[i] = 0;
+    b[i] = -b[i];
+    r[i] = b[i];
+    rr0 += r[i] * r[i];
+  }
+
+  // Refine solution
+  int iteration = 0;
+  RNScalar rr = rr0;
+  RNScalar threshold = tolerance * tolerance * bb;
+  for (int refinement = 0; refinement < max_refinements; refinement++) {
+    // Check convergence of double-precision residual
+    if ((iteration >= max_iterations) || (rr <= threshold) || (rr <= 0)) break;
+
+    // Initialize single-precision solve of A*dx = r from dx = 0
+    RNScalar rz = 0;
+    for (int i = 0; i < n; i++) {
+      r32[i] = (RNScalar32) r[i];
+      p[i] = d[i] * r32[i];
+      rz += (RNScalar) r32[i] * p[i];
+    }
+
+    // Iterate until residual is reduced by inner tolerance (or overall threshold)
+    RNScalar inner_rr = rr;
+    RNScalar inner_threshold = inner_tolerance * inner_tolerance * rr;
+    if (inner_threshold < threshold) inner_threshold = threshold;
+    while ((iteration < max_iterations) && (inner_rr > inner_threshold) && (inner_rr > 0)) {
+      // Compute step length
+      MultiplyNormalMatrix(n, starts, rows, values32, p, q);
+      RNScalar pq = 0;
+      for (int i = 0; i < n; i++) pq += (RNScalar) p[i] * q[i];
+      if (pq <= 0) break;
+      RNScalar alpha = rz / pq;
+
+      // Update solution and residual
+      inner_rr = 0;
+      for (int i = 0; i < n; i++) {
+        x[i] += alpha * p[i];
+        r32[i] -= (RNScalar32) (alpha * q[i]);
+        inner_rr += (RNScalar) r32[i] * r32[i];
+      }
+
+      // Update search direction
+      RNScalar rz_new = 0;
+      for (int i = 0; i < n; i++) rz_new += (RNScalar) r32[i] * d[i] * r32[i];
+      RNScalar32 beta = (RNScalar32) (rz_new / rz);
+      for (int i = 0; i < n; i++) p[i] = d[i] * r32[i] + beta * p[i];
+      rz = rz_new;
+      iteration++;
+    }
+
+    // Recompute residual r = b - A*x in double precision
+    MultiplyNormalMatrix(n, starts, rows, values32, x, r);
+    RNScalar rr_new = 0;
+    for (int i = 0; i < n; i++) {
+      r[i] = b[i] - r[i];
+      rr_new += r[i] * r[i];
+    }
+
+    // Stop if refinement no longer reduces residual
+    if (rr_new >= rr) break;
+    rr = rr_new;
+  }
+
+  // Copy solution into result
+  for (int i = 0; i < n; i++) io[i] += x[i];
+
+  // Remember number of iterations
+  ((RNSystemOfEquations *) system)->SetNIterations(iteration);
+
+  // Delete temporary data
+  delete [] values32;
+  delete [] b;
+  delete [] r;
+  delete [] x;
+  delete [] r32;
+  delete [] p;
+  delete [] q;
+  delete [] d;
+
+  // Return success
+  return 1;
+}
+
+
 
 inline int RNSystemOfEquations::
-Minimize(RNScalar *x, int solver, RNScalar tolerance) const
+Minimize(RNScalar *x, int solver, RNScalar tolerance, RNCSparseCholesky *cholesky) const
 {
+  // Reset statistics
+  ((RNSystemOfEquations *) this)->SetNIterations(0);
+
   // Check solver
   if (solver == RN_SPLM_SOLVER) return MinimizeSPLM(this, x, tolerance);
   else if (solver == RN_MINPACK_SOLVER) return MinimizeMINPACK(this, x, tolerance);
   else if (solver == RN_CERES_SOLVER) return MinimizeCERES(this, x, tolerance);
-  else if (solver == RN_CSPARSE_SOLVER) return MinimizeCSPARSE(this, x, tolerance);
+  else if (solver == RN_CSPARSE_SOLVER) return MinimizeCSPARSE(this, x, tolerance, cholesky);
+  else if (solver == RN_PCG_SOLVER) return MinimizePCG(this, x, tolerance);
+  else if (solver == RN_CSPARSE_SUPERNODAL_SOLVER) return MinimizeCSPARSESupernodal(this, x, tolerance, cholesky);
+  else if (solver == RN_MIXED_PCG_SOLVER) return MinimizeMixedPCG(this, x, tolerance);
   fprintf(stderr, "System of equation solver not recognized: %d\n", solver);
   return 0;
 }